@@ -20,13 +20,22 @@
 ***/
 
 #include <stdbool.h>
+#include <stddef.h>
+
+// Defaults for bloomfilter_init's zero arguments. 10 bits a key is about 1% false positives.
+#define BLOOM_DEFAULT_MAXKEYS 65536
+#define BLOOM_DEFAULT_BITS_PER_KEY 10
 
 typedef struct bloomfilter_options_t bloomfilter_options_t;
 
-bloomfilter_options_t *bloomfilter_init(unsigned long fieldsize, unsigned long (*hashfcn)(unsigned long, const void *, size_t),
-    unsigned int bits_in_hash_return, char **errptr);
+bloomfilter_options_t *bloomfilter_init(unsigned long maxkeys, unsigned int bits_per_key, unsigned int hashes, char **errptr);
 int bloomfilter_add(bloomfilter_options_t *options, const void *key, size_t klen);
 bool bloomfilter_exists(bloomfilter_options_t *options, const void *key, size_t klen);
+void bloomfilter_clear(bloomfilter_options_t *options);
+unsigned long bloomfilter_maxkeys(bloomfilter_options_t *options);
+unsigned long bloomfilter_keys(bloomfilter_options_t *options);
+int bloomfilter_save(bloomfilter_options_t *options, const char *path, char **errptr);
+bloomfilter_options_t *bloomfilter_load(const char *path, char **errptr);
 void bloomfilter_destroy(bloomfilter_options_t *options);
 
 #endif
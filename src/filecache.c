@@ -21,12 +21,13 @@
 #endif
 
 #include <unistd.h>
+#include <pthread.h>
 #include <dirent.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
-#include <sys/file.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <curl/curl.h>
 
@@ -55,34 +56,64 @@
 // Entries for stat and file cache are in the ldb cache; fc: designates filecache entries
 static const char * filecache_prefix = "fc:";
 
+// Room for filecache_prefix plus a path
+#define FILECACHE_KEY_MAX (PATH_MAX + 8)
+
+/* Paths filecache_delete has removed since the last cleanup, mapped to the cache file it
+ * unlinked, or to NULL when the cache file lives on under another path (pdata_move).
+ * Between full sweeps, cleanup only rechecks these. Past FILECACHE_DIRTY_MAX we drop the set
+ * and the next cleanup is a full sweep.
+ */
+#define FILECACHE_DIRTY_MAX 65536
+static pthread_mutex_t dirty_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *dirty_paths = NULL; // owns keys and values
+static bool dirty_overflow = false;
+
 // Name of forensic haven directory
 static const char * forensic_haven_dir = "forensic-haven";
 
 typedef int fd_t;
 
+struct filecache_fill;
+struct quota_hold;
+struct file_lock;
+
 // Session data
 struct filecache_sdata {
-    fd_t fd; // LOCK_SH for write/truncation; LOCK_EX during PUT
+    fd_t fd; // its lock is shared for write/truncation; exclusive during PUT
+    struct file_lock *lock; // the cache file's; see file_lock_get
     bool readable;
     bool writable;
     bool modified;
+    bool writer; // counted in lock's writers; see file_lock_writer_add
     int error_code;
+    struct filecache_fill *fill; // set while a ranged GET may still be filling fd's file
+    struct quota_hold *hold; // keeps the path from eviction while a quota is set
 };
 
 // @TODO Where to find ETAG_MAX?
 #define ETAG_MAX 256
 
-// Persistent data stored in leveldb
+// Hex SHA-256
+#define FILECACHE_HASH_LEN 64
+
+// Persistent data stored in the metadata store
 struct filecache_pdata {
     char filename[PATH_MAX];
     char etag[ETAG_MAX + 1];
     time_t last_server_update;
+    // Entries written before these were added are shorter; they read back with them empty
+    char hash[FILECACHE_HASH_LEN + 1]; // of the last contents known to match the server's; "" if unknown
+    char hash_etag[ETAG_MAX + 1]; // the server's etag for those contents
 };
 
+// Length of a filecache_pdata entry from before hash and hash_etag
+#define FILECACHE_PDATA_V1_SIZE offsetof(struct filecache_pdata, hash)
+
 // GError mechanisms
 static G_DEFINE_QUARK(FC, filecache)
 static G_DEFINE_QUARK(SYS, system)
-static G_DEFINE_QUARK(LDB, leveldb)
+static G_DEFINE_QUARK(KVS, kvstore)
 static G_DEFINE_QUARK(CURL, curl)
 
 void filecache_init(char *cache_path, GError **gerr) {
@@ -105,6 +136,13 @@ void filecache_init(char *cache_path, GError **gerr) {
         }
     }
 
+    // For dedup; see dedup_link
+    snprintf(path, PATH_MAX, "%s/objects", cache_path);
+    if (mkdir(path, 0770) == -1 && errno != EEXIST) {
+        g_set_error (gerr, system_quark(), errno, "filecache_init: Path %s could not be created.", path);
+        return;
+    }
+
     snprintf(path, PATH_MAX, "%s/%s", cache_path, forensic_haven_dir);
     if (mkdir(path, 0770) == -1) {
         if (errno != EEXIST || inject_error(filecache_error_init3)) {
@@ -115,13 +153,17 @@ void filecache_init(char *cache_path, GError **gerr) {
     return;
 }
 
-// Allocates a new string.
-static char *path2key(const char *path) {
-    char *key = NULL;
+// Builds the key into the caller's buffer of FILECACHE_KEY_MAX bytes. Returns NULL if it doesn't fit.
+static char *path2key(const char *path, char *key, size_t keylen) {
+    int len;
 
     BUMP(filecache_path2key);
 
-    asprintf(&key, "%s%s", filecache_prefix, path);
+    len = snprintf(key, keylen, "%s%s", filecache_prefix, path);
+    if (len < 0 || (size_t)len >= keylen) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "path2key: key for path %s is too long", path);
+        return NULL;
+    }
     return key;
 }
 
@@ -188,8 +230,8 @@ static void new_cache_file(const char *cache_path, char *cache_file_path, fd_t *
 // adds an entry to the ldb cache
 static void filecache_pdata_set(filecache_t *cache, const char *path,
         const struct filecache_pdata *pdata, GError **gerr) {
-    leveldb_writeoptions_t *options;
     char *ldberr = NULL;
+    char keybuf[FILECACHE_KEY_MAX];
     char *key;
 
     BUMP(filecache_pdata_set);
@@ -202,16 +244,16 @@ static void filecache_pdata_set(filecache_t *cache, const char *path,
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "filecache_pdata_set: path=%s ; cachefile=%s", path, pdata->filename);
 
-    key = path2key(path);
-    options = leveldb_writeoptions_create();
-    leveldb_put(cache, options, key, strlen(key) + 1, (const char *) pdata, sizeof(struct filecache_pdata), &ldberr);
-    leveldb_writeoptions_destroy(options);
-
-    free(key);
+    key = path2key(path, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error(gerr, filecache_quark(), ENAMETOOLONG, "filecache_pdata_set: path too long: %s", path);
+        return;
+    }
+    kvstore_put(cache, key, strlen(key) + 1, (const char *) pdata, sizeof(struct filecache_pdata), &ldberr);
 
     // ldb error will cause file to go to forensic haven.
     if (ldberr != NULL || inject_error(filecache_error_setldb)) {
-        g_set_error(gerr, leveldb_quark(), E_FC_LDBERR, "filecache_pdata_set: leveldb_put error %s", ldberr ? ldberr : "inject-error");
+        g_set_error(gerr, kvstore_quark(), E_FC_LDBERR, "filecache_pdata_set: kvstore_put error %s", ldberr ? ldberr : "inject-error");
         free(ldberr);
         return;
     }
@@ -265,8 +307,8 @@ finish:
 // get an entry from the ldb cache
 static struct filecache_pdata *filecache_pdata_get(filecache_t *cache, const char *path, GError **gerr) {
     struct filecache_pdata *pdata = NULL;
+    char keybuf[FILECACHE_KEY_MAX];
     char *key;
-    leveldb_readoptions_t *options;
     size_t vallen;
     char *ldberr = NULL;
 
@@ -274,16 +316,16 @@ static struct filecache_pdata *filecache_pdata_get(filecache_t *cache, const cha
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "Entered filecache_pdata_get: path=%s", path);
 
-    key = path2key(path);
+    key = path2key(path, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error(gerr, filecache_quark(), ENAMETOOLONG, "filecache_pdata_get: path too long: %s", path);
+        return NULL;
+    }
 
-    options = leveldb_readoptions_create();
-    leveldb_readoptions_set_fill_cache(options, false);
-    pdata = (struct filecache_pdata *) leveldb_get(cache, options, key, strlen(key) + 1, &vallen, &ldberr);
-    leveldb_readoptions_destroy(options);
-    free(key);
+    pdata = (struct filecache_pdata *) kvstore_get(cache, key, strlen(key) + 1, &vallen, &ldberr);
 
     if (ldberr != NULL || inject_error(filecache_error_getldb)) {
-        g_set_error(gerr, leveldb_quark(), E_FC_LDBERR, "filecache_pdata_get: leveldb_get error %s", ldberr ? ldberr : "inject-error");
+        g_set_error(gerr, kvstore_quark(), E_FC_LDBERR, "filecache_pdata_get: kvstore_get error %s", ldberr ? ldberr : "inject-error");
         free(ldberr);
         free(pdata);
         return NULL;
@@ -294,8 +336,16 @@ static struct filecache_pdata *filecache_pdata_get(filecache_t *cache, const cha
         return NULL;
     }
 
+    if (vallen == FILECACHE_PDATA_V1_SIZE) {
+        struct filecache_pdata *old = pdata;
+        pdata = calloc(1, sizeof(struct filecache_pdata));
+        memcpy(pdata, old, FILECACHE_PDATA_V1_SIZE);
+        free(old);
+        vallen = sizeof(struct filecache_pdata);
+    }
+
     if (vallen != sizeof(struct filecache_pdata) || inject_error(filecache_error_getvallen)) {
-        g_set_error(gerr, leveldb_quark(), E_FC_LDBERR, "Length %lu is not expected length %lu.", vallen, sizeof(struct filecache_pdata));
+        g_set_error(gerr, kvstore_quark(), E_FC_LDBERR, "Length %lu is not expected length %lu.", vallen, sizeof(struct filecache_pdata));
         free(pdata);
         return NULL;
     }
@@ -349,6 +399,601 @@ static size_t write_response_to_fd(void *ptr, size_t size, size_t nmemb, void *u
     return real_size;
 }
 
+/* Cache file locks. Writes and truncations hold a cache file's lock shared, and a PUT holds it
+ * exclusive so the file can't change under the upload. Everything that touches cache files is
+ * in this process, so rather than a pair of flock calls around every write, each cache file
+ * has an in-process rwlock. They are keyed by inode, so all the fds on a file share one, and
+ * live while some handle or PUT has a reference. They also count the writable handles, for
+ * get_fresh_fd to leave their file in place; see file_lock_writer_add.
+ */
+struct file_lock {
+    dev_t dev;
+    ino_t ino;
+    pthread_rwlock_t rwlock;
+    unsigned refs; // under file_locks_mutex
+    unsigned writers; // under file_locks_mutex
+};
+
+static pthread_mutex_t file_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *file_locks = NULL; // set of locks, by inode
+
+static guint file_lock_hash(gconstpointer ptr) {
+    const struct file_lock *lock = ptr;
+    return (guint) (lock->ino ^ (lock->dev << 16));
+}
+
+static gboolean file_lock_equal(gconstpointer a, gconstpointer b) {
+    const struct file_lock *la = a;
+    const struct file_lock *lb = b;
+    return la->ino == lb->ino && la->dev == lb->dev;
+}
+
+// A reference to the lock for fd's cache file; release with file_lock_put
+static struct file_lock *file_lock_get(int fd, GError **gerr) {
+    struct file_lock probe;
+    struct file_lock *lock;
+    struct stat st;
+
+    if (fstat(fd, &st)) {
+        g_set_error(gerr, system_quark(), errno, "file_lock_get: fstat failed on fd %d", fd);
+        return NULL;
+    }
+    probe.dev = st.st_dev;
+    probe.ino = st.st_ino;
+
+    pthread_mutex_lock(&file_locks_mutex);
+    if (file_locks == NULL) file_locks = g_hash_table_new_full(file_lock_hash, file_lock_equal, NULL, free);
+    lock = g_hash_table_lookup(file_locks, &probe);
+    if (lock == NULL) {
+        pthread_rwlockattr_t attr;
+
+        lock = calloc(1, sizeof(struct file_lock));
+        lock->dev = st.st_dev;
+        lock->ino = st.st_ino;
+        // Otherwise a steady stream of writes could hold off a PUT indefinitely
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&lock->rwlock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        g_hash_table_add(file_locks, lock);
+    }
+    ++lock->refs;
+    pthread_mutex_unlock(&file_locks_mutex);
+    return lock;
+}
+
+static void file_lock_put(struct file_lock *lock) {
+    if (lock == NULL) return;
+
+    pthread_mutex_lock(&file_locks_mutex);
+    if (--lock->refs == 0) {
+        pthread_rwlock_destroy(&lock->rwlock);
+        g_hash_table_remove(file_locks, lock);
+    }
+    pthread_mutex_unlock(&file_locks_mutex);
+}
+
+/* Count a writable handle on fd's file. A read-only open or background refresh which GETs a new
+ * copy won't swap out a file with writers, whose writes would go on to a file nothing names; but
+ * it may have done so between the handle's open and now. In that case this returns false without
+ * counting, and fd is stale.
+ */
+static bool file_lock_writer_add(struct file_lock *lock, int fd) {
+    struct stat st;
+    bool linked;
+
+    pthread_mutex_lock(&file_locks_mutex);
+    linked = (fstat(fd, &st) == 0 && st.st_nlink > 0);
+    if (linked) ++lock->writers;
+    pthread_mutex_unlock(&file_locks_mutex);
+    return linked;
+}
+
+static void file_lock_writer_remove(struct file_lock *lock) {
+    pthread_mutex_lock(&file_locks_mutex);
+    --lock->writers;
+    pthread_mutex_unlock(&file_locks_mutex);
+}
+
+// Whether filename has writable handles; wants file_locks_mutex held
+static bool file_lock_writing(const char *filename) {
+    struct file_lock probe;
+    struct file_lock *lock;
+    struct stat st;
+
+    if (file_locks == NULL || stat(filename, &st)) return false;
+    probe.dev = st.st_dev;
+    probe.ino = st.st_ino;
+    lock = g_hash_table_lookup(file_locks, &probe);
+    return (lock != NULL && lock->writers > 0);
+}
+
+/* Content dedup. There is still one cache file per path, but with dedup on, a body GET for a
+ * read-only open is hashed and hard-linked with objects/<hash>: if the object exists, the
+ * path's cache file is swapped for another link to it; if not, the path's file becomes the
+ * object. Identical bodies under many paths then take the disk space of one. Files are only
+ * shared from birth, so a writable open first unshares its cache file (unshare_cache_file),
+ * copying it to a private inode under the same name. Full cleanups drop the objects no cache
+ * file links to any more. The hash also lets put_return_etag skip PUTting contents the server
+ * already had, as of our last look.
+ */
+static bool dedup = false;
+static pthread_mutex_t unshare_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void filecache_dedup_init(bool enable) {
+    dedup = enable;
+}
+
+// Hex SHA-256 of fd's contents into hash, which holds FILECACHE_HASH_LEN + 1
+static bool hash_cache_file(int fd, char *hash) {
+    GChecksum *checksum;
+    char buf[64 * 1024];
+    off_t offset = 0;
+    ssize_t bytes;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    while ((bytes = pread(fd, buf, sizeof(buf), offset)) > 0) {
+        g_checksum_update(checksum, (const guchar *) buf, bytes);
+        offset += bytes;
+    }
+    if (bytes == 0) {
+        strncpy(hash, g_checksum_get_string(checksum), FILECACHE_HASH_LEN);
+        hash[FILECACHE_HASH_LEN] = '\0';
+    }
+    g_checksum_free(checksum);
+    return bytes == 0;
+}
+
+// Share filename's inode with any other cache file holding the same contents
+static void dedup_link(const char *cache_path, const char *filename, const char *hash) {
+    char object[PATH_MAX];
+    char tmpname[PATH_MAX];
+
+    snprintf(object, PATH_MAX, "%s/objects/%s", cache_path, hash);
+    if (link(filename, object) == 0) {
+        BUMP(filecache_dedup_new);
+        return;
+    }
+    if (errno != EEXIST) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "dedup_link: link(%s, %s): %s", filename, object, strerror(errno));
+        return;
+    }
+
+    // The rename swaps the names atomically; the new body's inode goes once its fd closes
+    snprintf(tmpname, PATH_MAX, "%s.dedup", filename);
+    if (link(object, tmpname) || rename(tmpname, filename)) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "dedup_link: sharing %s with %s: %s", filename, object, strerror(errno));
+        unlink(tmpname);
+        return;
+    }
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "dedup_link: %s shares %s", filename, object);
+    BUMP(filecache_dedup_hit);
+}
+
+/* Before an open for writing, give filename an inode of its own if it shares one, copying the
+ * contents unless the open truncates anyway. Under a mutex, so two writers end up on one copy.
+ */
+static void unshare_cache_file(const char *cache_path, const char *filename, bool copy, GError **gerr) {
+    char tmpname[PATH_MAX];
+    char buf[64 * 1024];
+    struct stat st;
+    GError *tmpgerr = NULL;
+    int fd = -1;
+    int src = -1;
+
+    pthread_mutex_lock(&unshare_mutex);
+    if (stat(filename, &st) || st.st_nlink <= 1) goto finish;
+
+    new_cache_file(cache_path, tmpname, &fd, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "unshare_cache_file: ");
+        goto finish;
+    }
+
+    if (copy) {
+        ssize_t bytes;
+
+        src = open(filename, O_RDONLY);
+        if (src < 0) {
+            g_set_error(gerr, system_quark(), errno, "unshare_cache_file: open of %s failed", filename);
+            goto fail;
+        }
+        while ((bytes = read(src, buf, sizeof(buf))) > 0) {
+            if (write(fd, buf, bytes) != bytes) {
+                bytes = -1;
+                break;
+            }
+        }
+        if (bytes < 0) {
+            g_set_error(gerr, system_quark(), errno, "unshare_cache_file: copy of %s failed", filename);
+            goto fail;
+        }
+    }
+
+    if (rename(tmpname, filename)) {
+        g_set_error(gerr, system_quark(), errno, "unshare_cache_file: rename to %s failed", filename);
+        goto fail;
+    }
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "unshare_cache_file: %s has its own copy", filename);
+    BUMP(filecache_dedup_cow);
+    goto finish;
+
+fail:
+    unlink(tmpname);
+
+finish:
+    if (src >= 0) close(src);
+    if (fd >= 0) close(fd);
+    pthread_mutex_unlock(&unshare_mutex);
+}
+
+/* Open an existing cache file, unsharing it first for writing. Always leaves O_TRUNC off; the
+ * caller truncates under the lock.
+ */
+static int open_cache_file(const char *cache_path, const char *filename, int flags, GError **gerr) {
+    if (dedup && ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC))) {
+        GError *tmpgerr = NULL;
+
+        unshare_cache_file(cache_path, filename, !(flags & O_TRUNC), &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_error(gerr, tmpgerr);
+            return -1;
+        }
+    }
+    return open(filename, flags & ~O_TRUNC);
+}
+
+// Unlink the objects which only their own name still links to
+static void dedup_collect(const char *cache_path) {
+    char objects_path[PATH_MAX];
+    char object[PATH_MAX];
+    struct dirent *diriter;
+    DIR *dir;
+    int visited = 0;
+    int unlinked = 0;
+
+    snprintf(objects_path, PATH_MAX, "%s/objects", cache_path);
+    dir = opendir(objects_path);
+    if (dir == NULL) return;
+
+    while ((diriter = readdir(dir)) != NULL) {
+        struct stat st;
+
+        if (diriter->d_name[0] == '.') continue;
+        snprintf(object, PATH_MAX, "%s/%s", objects_path, diriter->d_name);
+        if (stat(object, &st) || !S_ISREG(st.st_mode)) continue;
+        ++visited;
+        if (st.st_nlink == 1 && unlink(object) == 0) {
+            ++unlinked;
+            BUMP(filecache_dedup_gc);
+        }
+    }
+    closedir(dir);
+    log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "dedup_collect: visited %d objects, unlinked %d", visited, unlinked);
+}
+
+/* Cache quota. With a quota set, the paths with cache files are kept in least-recently-used
+ * order along with their sizes: a body GET and a close each move their path to the front.
+ * When the files add up to more than the quota, the eviction thread drops entries from the
+ * back until they are under QUOTA_LOW_WATER percent of it, skipping any path which is open,
+ * in use (last_server_update == 0) or waiting for write-back. An evicted path is fetched
+ * again on its next open. The index lives in memory; the first full cleanup after startup
+ * fills it, oldest first, with what is already on disk. Sizes are per path, so with dedup a
+ * shared file counts once for each path sharing it.
+ */
+#define QUOTA_LOW_WATER 90
+#define QUOTA_IDLE_WAIT 30
+
+struct quota_entry {
+    char *path;
+    off_t size;
+    struct quota_entry *prev; // toward the most recently used
+    struct quota_entry *next;
+};
+
+// Open handles on a path; filecache_open's sdata points at it, so it follows renames
+struct quota_hold {
+    char *path;
+    unsigned count;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // wakes the evictor when over the quota, and opens waiting out an eviction
+    filecache_t *cache;
+    off_t max_bytes; // 0 disables
+    off_t resident;
+    GHashTable *entries; // path -> entry; owns the entries, whose paths are the keys
+    GHashTable *holds; // path -> hold; owns the holds, whose paths are the keys
+    struct quota_entry *head; // most recently used
+    struct quota_entry *tail;
+    const char *evicting; // the path the evictor is deleting, if any
+    pthread_t thread;
+    bool stop;
+} quota = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Defined with write-back and deletion, below
+static bool writeback_pending(filecache_t *cache, const char *path);
+static void filecache_delete_entry(filecache_t *cache, const char *path, bool unlink_cachefile, bool mark_dirty, GError **gerr);
+
+static void quota_entry_free(void *ptr) {
+    struct quota_entry *entry = ptr;
+    free(entry->path);
+    free(entry);
+}
+
+static void quota_hold_free(void *ptr) {
+    struct quota_hold *hold = ptr;
+    free(hold->path);
+    free(hold);
+}
+
+// The list operations want quota.mutex held
+static void quota_unlist(struct quota_entry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else quota.head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else quota.tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void quota_list_head(struct quota_entry *entry) {
+    entry->prev = NULL;
+    entry->next = quota.head;
+    if (quota.head) quota.head->prev = entry;
+    else quota.tail = entry;
+    quota.head = entry;
+}
+
+static void quota_list_tail(struct quota_entry *entry) {
+    entry->next = NULL;
+    entry->prev = quota.tail;
+    if (quota.tail) quota.tail->next = entry;
+    else quota.head = entry;
+    quota.tail = entry;
+}
+
+static void quota_resize(struct quota_entry *entry, off_t size) {
+    quota.resident += size - entry->size;
+    ADJUST(filecache_resident_bytes, size - entry->size);
+    entry->size = size;
+}
+
+static void quota_remove(struct quota_entry *entry) {
+    quota_unlist(entry);
+    quota_resize(entry, 0);
+    ADJUST(filecache_resident_files, -1);
+    g_hash_table_remove(quota.entries, entry->path);
+}
+
+/* Note path's cache file at size bytes. With recent, as most recently used; otherwise a path
+ * new to the index goes to the back and a known one stays where it is.
+ */
+static void quota_account(const char *path, off_t size, bool recent) {
+    struct quota_entry *entry;
+
+    if (quota.max_bytes == 0) return;
+
+    pthread_mutex_lock(&quota.mutex);
+    entry = g_hash_table_lookup(quota.entries, path);
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(struct quota_entry));
+        entry->path = strdup(path);
+        g_hash_table_insert(quota.entries, entry->path, entry);
+        ADJUST(filecache_resident_files, 1);
+        if (recent) quota_list_head(entry);
+        else quota_list_tail(entry);
+    }
+    else if (recent) {
+        quota_unlist(entry);
+        quota_list_head(entry);
+    }
+    quota_resize(entry, size);
+    if (quota.resident > quota.max_bytes) pthread_cond_broadcast(&quota.cond);
+    pthread_mutex_unlock(&quota.mutex);
+}
+
+// path no longer has a cache file
+static void quota_forget(const char *path) {
+    struct quota_entry *entry;
+
+    if (quota.max_bytes == 0) return;
+
+    pthread_mutex_lock(&quota.mutex);
+    entry = g_hash_table_lookup(quota.entries, path);
+    if (entry) quota_remove(entry);
+    pthread_mutex_unlock(&quota.mutex);
+}
+
+// The cache file, and any open handles, have moved from old_path to new_path
+static void quota_move(const char *old_path, const char *new_path) {
+    struct quota_entry *entry;
+    struct quota_hold *hold;
+    off_t size = 0;
+
+    if (quota.max_bytes == 0) return;
+
+    pthread_mutex_lock(&quota.mutex);
+    entry = g_hash_table_lookup(quota.entries, old_path);
+    if (entry) {
+        size = entry->size;
+        quota_remove(entry);
+    }
+    hold = g_hash_table_lookup(quota.holds, old_path);
+    if (hold) {
+        struct quota_hold *other;
+
+        g_hash_table_steal(quota.holds, old_path);
+        free(hold->path);
+        hold->path = strdup(new_path);
+        other = g_hash_table_lookup(quota.holds, new_path);
+        if (other) {
+            // Handles still open on a file the rename replaced; they share the name's protection
+            hold->count += other->count;
+            g_hash_table_remove(quota.holds, new_path);
+        }
+        g_hash_table_insert(quota.holds, hold->path, hold);
+    }
+    pthread_mutex_unlock(&quota.mutex);
+
+    if (entry) quota_account(new_path, size, true);
+}
+
+/* Keep path from eviction until quota_release, waiting out an eviction of it under way.
+ * Returns NULL if there is no quota.
+ */
+static struct quota_hold *quota_hold(const char *path) {
+    struct quota_hold *hold;
+
+    if (quota.max_bytes == 0) return NULL;
+
+    pthread_mutex_lock(&quota.mutex);
+    while (quota.evicting && strcmp(quota.evicting, path) == 0) {
+        pthread_cond_wait(&quota.cond, &quota.mutex);
+    }
+    hold = g_hash_table_lookup(quota.holds, path);
+    if (hold == NULL) {
+        hold = calloc(1, sizeof(struct quota_hold));
+        hold->path = strdup(path);
+        g_hash_table_insert(quota.holds, hold->path, hold);
+    }
+    ++hold->count;
+    pthread_mutex_unlock(&quota.mutex);
+    return hold;
+}
+
+// Let go of a hold; fd, if not -1, is the handle closing, whose path becomes most recently used
+static void quota_release(struct quota_hold *hold, int fd) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (hold == NULL) return;
+
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        pthread_mutex_lock(&quota.mutex);
+        strncpy(path, hold->path, PATH_MAX - 1);
+        path[PATH_MAX - 1] = '\0';
+        pthread_mutex_unlock(&quota.mutex);
+        quota_account(path, st.st_size, true);
+    }
+
+    pthread_mutex_lock(&quota.mutex);
+    if (--hold->count == 0) g_hash_table_remove(quota.holds, hold->path);
+    pthread_mutex_unlock(&quota.mutex);
+}
+
+/* Evict the least recently used path that can go. Call with quota.mutex held; returns with it
+ * held, false if nothing could be evicted.
+ */
+static bool quota_evict_one(void) {
+    struct quota_entry *entry;
+    struct quota_entry *last;
+    struct filecache_pdata *pdata;
+    GError *tmpgerr = NULL;
+    char path[PATH_MAX];
+    off_t size;
+    bool busy;
+
+    // Busy paths go to the front as we pass them; stop once we come round to the first of them
+    last = NULL;
+    for (entry = quota.tail; entry && entry != last; entry = quota.tail) {
+        if (!g_hash_table_contains(quota.holds, entry->path)) break;
+        BUMP(filecache_quota_skip);
+        quota_unlist(entry);
+        quota_list_head(entry);
+        if (last == NULL) last = entry;
+    }
+    if (entry == NULL || entry == last) return false;
+
+    strncpy(path, entry->path, PATH_MAX - 1);
+    path[PATH_MAX - 1] = '\0';
+    size = entry->size;
+    quota_remove(entry);
+    // Opens of path wait from here, so we see the in-use state they left behind
+    quota.evicting = path;
+    pthread_mutex_unlock(&quota.mutex);
+
+    pdata = filecache_pdata_get(quota.cache, path, &tmpgerr);
+    if (tmpgerr) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "quota_evict_one: %s: %s", path, tmpgerr->message);
+        g_clear_error(&tmpgerr);
+    }
+    busy = (pdata == NULL || pdata->last_server_update == 0 || writeback_pending(quota.cache, path));
+    if (!busy) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "quota_evict_one: evicting %s :: %s (%lu bytes)", path, pdata->filename, size);
+        filecache_delete_entry(quota.cache, path, true, true, &tmpgerr);
+        if (tmpgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "quota_evict_one: %s: %s", path, tmpgerr->message);
+            g_clear_error(&tmpgerr);
+        }
+        BUMP(filecache_quota_evict);
+        ADJUST(filecache_quota_evict_bytes, size);
+    }
+    free(pdata);
+
+    pthread_mutex_lock(&quota.mutex);
+    quota.evicting = NULL;
+    pthread_cond_broadcast(&quota.cond);
+    pthread_mutex_unlock(&quota.mutex);
+
+    // In use comes back to the front; gone since we looked stays gone
+    if (busy && pdata) {
+        BUMP(filecache_quota_skip);
+        quota_account(path, size, true);
+    }
+
+    pthread_mutex_lock(&quota.mutex);
+    return true;
+}
+
+static void *quota_worker(__unused void *ptr) {
+    off_t low_water = quota.max_bytes / 100 * QUOTA_LOW_WATER;
+
+    pthread_mutex_lock(&quota.mutex);
+    while (!quota.stop) {
+        struct timespec wait;
+
+        if (quota.resident > quota.max_bytes) {
+            log_print(LOG_INFO, SECTION_FILECACHE_CLEAN, "quota_worker: %lu bytes resident, over the quota of %lu", quota.resident, quota.max_bytes);
+            // One path at a time; quota_evict_one lets go of the mutex while it deletes
+            while (!quota.stop && quota.resident > low_water && quota_evict_one());
+        }
+
+        // Over the quota with everything busy, we look again once handles have had time to close
+        clock_gettime(CLOCK_REALTIME, &wait);
+        wait.tv_sec += QUOTA_IDLE_WAIT;
+        pthread_cond_timedwait(&quota.cond, &quota.mutex, &wait);
+    }
+    pthread_mutex_unlock(&quota.mutex);
+    return NULL;
+}
+
+// Hold the file cache to max_bytes; 0 for no quota. Call before the FUSE loop.
+void filecache_quota_init(filecache_t *cache, off_t max_bytes) {
+    if (max_bytes <= 0) return;
+
+    quota.cache = cache;
+    quota.entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, quota_entry_free);
+    quota.holds = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, quota_hold_free);
+    quota.max_bytes = max_bytes;
+    if (pthread_create(&quota.thread, NULL, quota_worker, NULL)) {
+        log_print(LOG_ERR, SECTION_FILECACHE_CLEAN, "filecache_quota_init: failed to start the eviction thread; the quota will not be enforced");
+        quota.max_bytes = 0;
+        return;
+    }
+    log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_quota_init: holding the file cache to %lu bytes", max_bytes);
+}
+
+void filecache_quota_stop(void) {
+    if (quota.max_bytes == 0) return;
+
+    pthread_mutex_lock(&quota.mutex);
+    quota.stop = true;
+    pthread_cond_broadcast(&quota.cond);
+    pthread_mutex_unlock(&quota.mutex);
+    pthread_join(quota.thread, NULL);
+}
+
 // Get a file descriptor pointing to the latest full copy of the file.
 static void get_fresh_fd(filecache_t *cache,
         const char *cache_path, const char *path, struct filecache_sdata *sdata,
@@ -358,6 +1003,7 @@ static void get_fresh_fd(filecache_t *cache,
     char etag[ETAG_MAX];
     char response_filename[PATH_MAX] = "\0";
     int response_fd = -1;
+    int ret = 0;
     bool close_response_fd = true;
     struct timespec start_time;
     long response_code = 500; // seed it as bad so we can enter the loop
@@ -396,7 +1042,11 @@ static void get_fresh_fd(filecache_t *cache,
         log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "get_fresh_fd: file is fresh or being truncated: %s::%s", path, pdata->filename);
 
         // Open first with O_TRUNC off to avoid modifying the file without holding the right lock.
-        sdata->fd = open(pdata->filename, flags & ~O_TRUNC);
+        sdata->fd = open_cache_file(cache_path, pdata->filename, flags, &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "get_fresh_fd: ");
+            goto finish;
+        }
         if (sdata->fd < 0 || inject_error(filecache_error_freshopen1)) {
             log_print(LOG_DYNAMIC, SECTION_FILECACHE_OPEN, "get_fresh_fd: < 0, %s with flags %x returns < 0: errno: %d, %s : ENOENT=%d", path, flags, errno, strerror(errno), ENOENT);
             // If the cachefile named in pdata->filename does not exist, or any other error occurs...
@@ -408,10 +1058,17 @@ static void get_fresh_fd(filecache_t *cache,
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "get_fresh_fd: truncating fd %d:%s::%s",
                 sdata->fd, path, pdata->filename);
 
+            // filecache_open keeps the lock for the handle
+            if (sdata->lock == NULL) sdata->lock = file_lock_get(sdata->fd, &tmpgerr);
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "get_fresh_fd: ");
+                goto finish;
+            }
+
             log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "get_fresh_fd: acquiring shared file lock on fd %d",
                 sdata->fd);
-            if (flock(sdata->fd, LOCK_SH) || inject_error(filecache_error_freshflock1)) {
-                g_set_error(gerr, system_quark(), errno, "get_fresh_fd: error acquiring shared file lock");
+            if (inject_error(filecache_error_freshflock1) || (ret = pthread_rwlock_rdlock(&sdata->lock->rwlock))) {
+                g_set_error(gerr, system_quark(), ret, "get_fresh_fd: error acquiring shared file lock");
                 goto finish;
             }
             log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "get_fresh_fd: acquired shared file lock on fd %d", sdata->fd);
@@ -425,22 +1082,22 @@ static void get_fresh_fd(filecache_t *cache,
 
             log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "get_fresh_fd: releasing shared file lock on fd %d",
                 sdata->fd);
-            if (flock(sdata->fd, LOCK_UN) || inject_error(filecache_error_freshflock2)) {
-                // If we didn't get an error from ftruncate, then set gerr here from flock on error;
+            if ((ret = pthread_rwlock_unlock(&sdata->lock->rwlock)) || inject_error(filecache_error_freshflock2)) {
+                // If we didn't get an error from ftruncate, then set gerr here from the unlock on error;
                 // If ftruncate did get an error, it will take precedence and we will ignore this error
                 if (!gerr) {
-                    g_set_error(gerr, system_quark(), errno, "get_fresh_fd: error releasing shared file lock");
+                    g_set_error(gerr, system_quark(), ret, "get_fresh_fd: error releasing shared file lock");
                 }
                 else {
-                    // If we got an error from ftruncate so don't set one for flock, still report
+                    // If we got an error from ftruncate so don't set one for the unlock, still report
                     // that releasing the lock failed.
                     log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "get_fresh_fd: error releasing shared file lock :: %s",
-                        strerror(errno));
+                        strerror(ret));
                 }
                 goto finish;
             }
 
-            // We've fallen through to flock from ftruncate; if ftruncate returns an error, return here
+            // We've fallen through to the unlock from ftruncate; if ftruncate returns an error, return here
             if (gerr) goto finish;
 
             log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "get_fresh_fd: released shared file lock on fd %d", sdata->fd);
@@ -458,7 +1115,9 @@ static void get_fresh_fd(filecache_t *cache,
 
     for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
         CURL *session;
+        struct session_sink_s sink;
         struct curl_slist *slist = NULL;
+        unsigned long request_start;
         bool new_resolve_list;
 
         // Assume all is ok the first round; with each failure, rescramble
@@ -493,8 +1152,8 @@ static void get_fresh_fd(filecache_t *cache,
 
         // Set an ETag header capture path.
         etag[0] = '\0';
-        curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, capture_etag);
-        curl_easy_setopt(session, CURLOPT_WRITEHEADER, etag);
+        sink.header = capture_etag;
+        sink.header_data = etag;
 
         // Create a new temp file in case cURL needs to write to one.
         new_cache_file(cache_path, response_filename, &response_fd, &tmpgerr);
@@ -506,13 +1165,12 @@ static void get_fresh_fd(filecache_t *cache,
         }
 
         // Give cURL the fd and callback for handling the response body.
-        curl_easy_setopt(session, CURLOPT_WRITEDATA, &response_fd);
-        curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, write_response_to_fd);
+        sink.write = write_response_to_fd;
+        sink.write_data = &response_fd;
 
-        res = curl_easy_perform(session);
-        if(res == CURLE_OK) {
-            curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
-        }
+        request_start = stats_clock();
+        res = session_perform_hedged(session, STATS_LAT_GET, &sink, &response_code);
+        LATENCY(STATS_LAT_GET, request_start);
 
         log_filesystem_nodes("get_fresh_fd", res, response_code, idx, path);
     }
@@ -553,7 +1211,11 @@ static void get_fresh_fd(filecache_t *cache,
             goto finish;
         }
 
-        sdata->fd = open(pdata->filename, flags);
+        sdata->fd = open_cache_file(cache_path, pdata->filename, flags, &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "get_fresh_fd: open for 304: ");
+            goto finish;
+        }
 
         if (sdata->fd < 0 || inject_error(filecache_error_freshopen2)) {
             // If the cachefile named in pdata->filename does not exist ...
@@ -581,6 +1243,7 @@ static void get_fresh_fd(filecache_t *cache,
         char old_filename[PATH_MAX];
         const char *sz;
         bool unlink_old = false;
+        bool guard = false;
 
         if (pdata == NULL) {
             *pdatap = calloc(1, sizeof(struct filecache_pdata));
@@ -604,12 +1267,38 @@ static void get_fresh_fd(filecache_t *cache,
         pdata->last_server_update = time(NULL);
         strncpy(pdata->filename, response_filename, PATH_MAX);
 
+        pdata->hash[0] = '\0';
+        if (dedup && hash_cache_file(response_fd, pdata->hash)) {
+            strncpy(pdata->hash_etag, pdata->etag, ETAG_MAX + 1);
+            // A writer would change the contents under everyone sharing them
+            if ((flags & O_ACCMODE) == O_RDONLY) dedup_link(cache_path, response_filename, pdata->hash);
+        }
+
         sdata->fd = response_fd;
 
+        // Read-only opens, and so prefetch and background refreshes, leave a file being written where
+        // it is. The mutex holds off writers counting themselves until the old file is gone.
+        if (unlink_old && (flags & O_ACCMODE) == O_RDONLY) {
+            guard = true;
+            pthread_mutex_lock(&file_locks_mutex);
+            if (file_lock_writing(old_filename)) {
+                pthread_mutex_unlock(&file_locks_mutex);
+                log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "get_fresh_fd: 200: %s is open for writing; leaving it on %s", path, old_filename);
+                // This open reads the new copy, which goes once it closes
+                unlink(response_filename);
+                close_response_fd = false;
+                goto finish;
+            }
+        }
+
         log_print(LOG_DYNAMIC, SECTION_FILECACHE_OPEN, "get_fresh_fd: Updating file cache on 200 for %s : %s : timestamp: %lu.", path, pdata->filename, pdata->last_server_update);
         filecache_pdata_set(cache, path, pdata, &tmpgerr);
         if (tmpgerr) {
+            if (guard) pthread_mutex_unlock(&file_locks_mutex);
+            // The handle's quota hold is filecache_open's to release
+            struct quota_hold *hold = sdata->hold;
             memset(sdata, 0, sizeof(struct filecache_sdata));
+            sdata->hold = hold;
             g_propagate_prefixed_error(gerr, tmpgerr, "get_fresh_fd on 200: ");
             goto finish;
         }
@@ -621,6 +1310,7 @@ static void get_fresh_fd(filecache_t *cache,
         // deleted once no more file descriptors reference it.
         if (unlink_old) {
             unlink(old_filename);
+            if (guard) pthread_mutex_unlock(&file_locks_mutex);
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "get_fresh_fd: 200: unlink old filename %s", old_filename);
         }
 
@@ -629,6 +1319,8 @@ static void get_fresh_fd(filecache_t *cache,
             goto finish;
         }
 
+        quota_account(path, st.st_size, true);
+
         /* Get the time into now.
          * Subtract seconds since start_time and multiply by 1000 to get ms.
          * Subtract nanoseconds since start_time and divide by a million to get ms.
@@ -766,6 +1458,55 @@ finish:
     }
 }
 
+/* Kernel page cache. With it on, an open keeps the pages the kernel has cached for the file
+ * (keep_cache) only if it reads the same cache file as the path's previous open. New contents
+ * from the server always arrive in a new cache file, whether through get_fresh_fd, a ranged
+ * fill or a background revalidation, so a changed file drops its pages on its next open. Local
+ * writes go through the page cache and need nothing; after a rename, or once the table fills
+ * up and is cleared, we have merely lost track and the file is read from us again.
+ */
+#define KERNEL_CACHE_MAX 65536
+
+static bool kernel_cache = false;
+static pthread_mutex_t kernel_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *kernel_cache_files = NULL; // path -> cache file its last open read; owns keys and values
+
+void filecache_kernel_cache_init(bool enable) {
+    kernel_cache = enable;
+    if (enable && kernel_cache_files == NULL) {
+        kernel_cache_files = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+    }
+}
+
+static bool kernel_cache_keep(const char *path, const char *filename) {
+    const char *last;
+    bool keep;
+
+    pthread_mutex_lock(&kernel_cache_mutex);
+    last = g_hash_table_lookup(kernel_cache_files, path);
+    keep = (last != NULL && strcmp(last, filename) == 0);
+    if (!keep) {
+        if (g_hash_table_size(kernel_cache_files) >= KERNEL_CACHE_MAX) {
+            g_hash_table_remove_all(kernel_cache_files);
+        }
+        g_hash_table_replace(kernel_cache_files, strdup(path), strdup(filename));
+    }
+    pthread_mutex_unlock(&kernel_cache_mutex);
+
+    if (keep) BUMP(filecache_kernel_keep);
+    else BUMP(filecache_kernel_drop);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "kernel_cache_keep: %s: %s pages for %s", path, keep ? "keeping" : "dropping", filename);
+    return keep;
+}
+
+// Defined with prefetch and ranged GETs, below
+static bool revalidate_due(const struct filecache_pdata *pdata, int flags);
+static bool revalidate_in_background(const struct filecache_pdata *pdata, const char *path);
+static bool ranged_open(filecache_t *cache, const char *cache_path, const char *path,
+        struct filecache_sdata *sdata, struct filecache_pdata **pdatap, int flags, GError **gerr);
+static const char *ranged_filename(const struct filecache_sdata *sdata);
+
 // top-level open call
 void filecache_open(char *cache_path, filecache_t *cache, const char *path, struct fuse_file_info *info, bool grace, GError **gerr) {
     struct filecache_pdata *pdata = NULL;
@@ -774,6 +1515,8 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
     const int max_retries = 2;
     int flags = info->flags;
     bool use_local_copy = false;
+    bool created = false;
+    bool revalidate;
 
     BUMP(filecache_open);
 
@@ -793,6 +1536,9 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
         goto fail;
     }
 
+    // Before anything looks at the cache entry, so eviction can't take it from under us
+    sdata->hold = quota_hold(path);
+
     for (int retries = 0; retries < max_retries; retries++) {
         // If open is called twice, both times with O_CREAT, fuse does not pass O_CREAT
         // the second time. (Unlike on a linux file system, where the second time open
@@ -818,13 +1564,38 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
                 g_propagate_prefixed_error(gerr, tmpgerr, "filecache_open: ");
                 goto fail;
             }
+            created = true;
             break;
         }
 
-        // Get a file descriptor pointing to a guaranteed-fresh file.
-        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_open: calling get_fresh_fd on %s", path);
-        get_fresh_fd(cache, cache_path, path, sdata, &pdata, flags, use_local_copy, &tmpgerr);
+        // Queued only once the local copy is open, so its refresh can't unlink it from under us first
+        revalidate = !use_local_copy && revalidate_due(pdata, flags);
+        if (revalidate) {
+            log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_open: calling get_fresh_fd on %s to revalidate", path);
+            get_fresh_fd(cache, cache_path, path, sdata, &pdata, flags, true, &tmpgerr);
+            if (tmpgerr == NULL && !revalidate_in_background(pdata, path)) {
+                // No room in the queue; revalidate now instead
+                close(sdata->fd);
+                sdata->fd = -1;
+                revalidate = false;
+            }
+        }
+
+        // Large files open once their first chunk is in; otherwise get a file descriptor pointing to a guaranteed-fresh file.
+        if (!revalidate && (use_local_copy || !ranged_open(cache, cache_path, path, sdata, &pdata, flags, &tmpgerr))) {
+            log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_open: calling get_fresh_fd on %s", path);
+            get_fresh_fd(cache, cache_path, path, sdata, &pdata, flags, use_local_copy, &tmpgerr);
+        }
         if (tmpgerr) {
+            // A refresh replaced the cache file pdata named before we opened it; pdata has the new one
+            if (tmpgerr->domain == system_quark() && tmpgerr->code == ENOENT && retries + 1 < max_retries) {
+                log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN,
+                    "filecache_open: Retry on replaced cache file for path %s. Error: %s", path, tmpgerr->message);
+                g_clear_error(&tmpgerr);
+                free(pdata);
+                pdata = NULL;
+                continue;
+            }
             // If we got a network error (curl_quark is a marker) and we are using grace, try again but use the local copy
             if (tmpgerr->domain == curl_quark() && grace) {
                 log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN,
@@ -837,6 +1608,31 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
             goto fail;
         }
 
+        if (sdata->fd >= 0 && (flags & O_ACCMODE) != O_RDONLY) {
+            if (sdata->lock == NULL) sdata->lock = file_lock_get(sdata->fd, &tmpgerr);
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "filecache_open: ");
+                close(sdata->fd);
+                goto fail;
+            }
+            sdata->writer = file_lock_writer_add(sdata->lock, sdata->fd);
+            if (!sdata->writer) {
+                // A refresh swapped in a new copy after get_fresh_fd opened the old one
+                log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "filecache_open: %s was replaced while opening", path);
+                close(sdata->fd);
+                sdata->fd = -1;
+                file_lock_put(sdata->lock);
+                sdata->lock = NULL;
+                free(pdata);
+                pdata = NULL;
+                if (retries + 1 == max_retries) {
+                    g_set_error(gerr, system_quark(), EAGAIN, "filecache_open: %s was replaced while opening", path);
+                    goto fail;
+                }
+                continue;
+            }
+        }
+
         // If we've reached here, it's successful, and we don't want to retry.
         break;
     }
@@ -856,7 +1652,24 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN,
             "filecache_open: Setting fd to session data structure with fd %d for %s :: (no pdata).", sdata->fd, path);
         }
+
+        if (sdata->lock == NULL) {
+            sdata->lock = file_lock_get(sdata->fd, &tmpgerr);
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "filecache_open: ");
+                close(sdata->fd);
+                goto fail;
+            }
+        }
+        // Nothing can have replaced a file we created
+        if (created) sdata->writer = file_lock_writer_add(sdata->lock, sdata->fd);
         info->fh = (uint64_t) sdata;
+
+        // New and truncated files have nothing worth keeping
+        if (kernel_cache && !created && !(flags & O_TRUNC)) {
+            const char *filename = sdata->fill ? ranged_filename(sdata) : (pdata ? pdata->filename : NULL);
+            info->keep_cache = (filename != NULL && kernel_cache_keep(path, filename));
+        }
         goto finish;
     }
 
@@ -864,12 +1677,926 @@ fail:
     log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_open: No valid fd set for path %s. Setting fh structure to NULL.", path);
     info->fh = (uint64_t) NULL;
 
+    if (sdata) {
+        file_lock_put(sdata->lock);
+        quota_release(sdata->hold, -1);
+    }
     free(sdata);
 
 finish:
     free(pdata);
 }
 
+/* Prefetch of small files when a directory is refreshed (filecache_prefetch_directory).
+ * A few worker threads GET the directory's small files into the file cache through
+ * get_fresh_fd, so the opens which typically follow a listing find a fresh copy rather
+ * than making their own synchronous GET. Work queued for a directory is dropped once
+ * nothing has touched the directory (filecache_prefetch_touch) for PREFETCH_IDLE_TIMEOUT.
+ * The same workers carry out stale-while-revalidate refreshes for filecache_open; those
+ * jobs have no directory and are never dropped.
+ */
+#define PREFETCH_QUEUE_MAX 4096
+#define PREFETCH_IDLE_TIMEOUT 5
+
+struct prefetch_job_s {
+    char *path;
+    char *dir; // NULL for a revalidation
+};
+
+struct prefetch_dir_s {
+    time_t last_access;
+    unsigned pending; // jobs queued or running for this directory
+};
+
+static struct {
+    pthread_mutex_t mutex; // protects everything below once the workers start
+    pthread_cond_t cond;
+    GQueue *queue;
+    GHashTable *queued; // paths queued or being fetched; keys are owned by the jobs
+    GHashTable *dirs; // dir -> prefetch_dir_s; owns keys and values
+    filecache_t *cache;
+    char *cache_path;
+    off_t max_size; // 0 disables prefetch on readdir
+    time_t revalidate_window; // 0 disables stale-while-revalidate
+    int nthreads;
+    pthread_t *threads;
+    bool stop;
+} prefetch = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void prefetch_file(const char *path) {
+    struct filecache_sdata sdata;
+    struct filecache_pdata *pdata;
+    GError *tmpgerr = NULL;
+
+    // Don't add to the load on a cluster we are already backing off from
+    if (use_saint_mode()) {
+        BUMP(filecache_prefetch_cancel);
+        return;
+    }
+
+    pdata = filecache_pdata_get(prefetch.cache, path, NULL);
+    // An open would not go to the server for these either; see get_fresh_fd
+    if (pdata && (pdata->last_server_update == 0 || (time(NULL) - pdata->last_server_update) <= REFRESH_INTERVAL)) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "prefetch_file: already fresh: %s", path);
+        free(pdata);
+        return;
+    }
+
+    memset(&sdata, 0, sizeof(struct filecache_sdata));
+    sdata.fd = -1;
+    get_fresh_fd(prefetch.cache, prefetch.cache_path, path, &sdata, &pdata, O_RDONLY, false, &tmpgerr);
+    if (tmpgerr) {
+        // Not our error to report; the open, if it comes, will try again
+        log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "prefetch_file: %s: %s", path, tmpgerr->message);
+        g_clear_error(&tmpgerr);
+    }
+    else {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "prefetch_file: fetched %s", path);
+        BUMP(filecache_prefetch_done);
+        if (sdata.fd >= 0) close(sdata.fd);
+    }
+    free(pdata);
+}
+
+static void *prefetch_worker(__unused void *ptr) {
+    pthread_mutex_lock(&prefetch.mutex);
+    while (!prefetch.stop) {
+        struct prefetch_job_s *job;
+        struct prefetch_dir_s *dir;
+        bool cancel;
+
+        job = g_queue_pop_head(prefetch.queue);
+        if (job == NULL) {
+            pthread_cond_wait(&prefetch.cond, &prefetch.mutex);
+            continue;
+        }
+        // Stays put while pending is non-zero
+        dir = job->dir ? g_hash_table_lookup(prefetch.dirs, job->dir) : NULL;
+        cancel = dir && (time(NULL) - dir->last_access > PREFETCH_IDLE_TIMEOUT);
+        pthread_mutex_unlock(&prefetch.mutex);
+
+        if (cancel) {
+            log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "prefetch_worker: %s idle; dropping %s", job->dir, job->path);
+            BUMP(filecache_prefetch_cancel);
+        }
+        else {
+            prefetch_file(job->path);
+        }
+
+        pthread_mutex_lock(&prefetch.mutex);
+        g_hash_table_remove(prefetch.queued, job->path);
+        if (dir && --dir->pending == 0) {
+            g_hash_table_remove(prefetch.dirs, job->dir);
+        }
+        free(job->path);
+        free(job->dir);
+        free(job);
+    }
+    pthread_mutex_unlock(&prefetch.mutex);
+    return NULL;
+}
+
+/* Start nthreads background workers. They prefetch files of up to max_size bytes after a readdir,
+ * and revalidate cache files which filecache_open served up to revalidate_window seconds past
+ * REFRESH_INTERVAL. A zero max_size or revalidate_window turns that half off; with both off, or
+ * no threads, nothing starts. Call once, after the cache is open and before the FUSE loop.
+ */
+void filecache_prefetch_init(filecache_t *cache, const char *cache_path, int nthreads, off_t max_size, time_t revalidate_window) {
+    if (nthreads <= 0 || (max_size <= 0 && revalidate_window <= 0)) return;
+
+    prefetch.cache = cache;
+    prefetch.cache_path = strdup(cache_path);
+    prefetch.max_size = max_size > 0 ? max_size : 0;
+    prefetch.revalidate_window = revalidate_window > 0 ? revalidate_window : 0;
+    prefetch.queue = g_queue_new();
+    prefetch.queued = g_hash_table_new(g_str_hash, g_str_equal);
+    prefetch.dirs = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+    prefetch.threads = calloc(nthreads, sizeof(pthread_t));
+
+    for (int idx = 0; idx < nthreads; idx++) {
+        if (pthread_create(&prefetch.threads[idx], NULL, prefetch_worker, NULL)) {
+            log_print(LOG_ERR, SECTION_FILECACHE_OPEN, "filecache_prefetch_init: pthread_create failed; running %d workers", idx);
+            break;
+        }
+        ++prefetch.nthreads;
+    }
+    log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "filecache_prefetch_init: %d workers; files up to %lu bytes; revalidate window %lu",
+        prefetch.nthreads, prefetch.max_size, prefetch.revalidate_window);
+}
+
+void filecache_prefetch_stop(void) {
+    struct prefetch_job_s *job;
+
+    if (prefetch.nthreads == 0) return;
+
+    pthread_mutex_lock(&prefetch.mutex);
+    prefetch.stop = true;
+    pthread_cond_broadcast(&prefetch.cond);
+    pthread_mutex_unlock(&prefetch.mutex);
+
+    for (int idx = 0; idx < prefetch.nthreads; idx++) {
+        pthread_join(prefetch.threads[idx], NULL);
+    }
+    prefetch.nthreads = 0;
+
+    while ((job = g_queue_pop_head(prefetch.queue))) {
+        free(job->path);
+        free(job->dir);
+        free(job);
+    }
+    g_queue_free(prefetch.queue);
+    g_hash_table_destroy(prefetch.queued);
+    g_hash_table_destroy(prefetch.dirs);
+    free(prefetch.threads);
+    free(prefetch.cache_path);
+}
+
+// dirpath is NULL for a revalidation. Returns true if the path is queued or already in hand.
+static bool prefetch_enqueue(const char *dirpath, const char *path) {
+    struct prefetch_job_s *job;
+    struct prefetch_dir_s *dir;
+
+    pthread_mutex_lock(&prefetch.mutex);
+    if (g_hash_table_contains(prefetch.queued, path)) {
+        pthread_mutex_unlock(&prefetch.mutex);
+        return true;
+    }
+    if (prefetch.stop || g_queue_get_length(prefetch.queue) >= PREFETCH_QUEUE_MAX) {
+        pthread_mutex_unlock(&prefetch.mutex);
+        return false;
+    }
+
+    if (dirpath) {
+        dir = g_hash_table_lookup(prefetch.dirs, dirpath);
+        if (dir == NULL) {
+            dir = calloc(1, sizeof(struct prefetch_dir_s));
+            g_hash_table_replace(prefetch.dirs, strdup(dirpath), dir);
+        }
+        dir->last_access = time(NULL);
+        ++dir->pending;
+    }
+
+    job = malloc(sizeof(struct prefetch_job_s));
+    job->path = strdup(path);
+    job->dir = dirpath ? strdup(dirpath) : NULL;
+    g_hash_table_add(prefetch.queued, job->path);
+    g_queue_push_tail(prefetch.queue, job);
+    if (dirpath) BUMP(filecache_prefetch_queued);
+
+    pthread_cond_signal(&prefetch.cond);
+    pthread_mutex_unlock(&prefetch.mutex);
+    return true;
+}
+
+static void prefetch_enumerate_callback(const char *path_prefix, const char *filename, void *user) {
+    filecache_t *cache = user;
+    struct stat_cache_value *value;
+    char path[PATH_MAX];
+
+    if (filename[0] == '\0') return;
+
+    // The root enumerates with a path_prefix of "/"
+    if (snprintf(path, PATH_MAX, "%s/%s", strcmp(path_prefix, "/") ? path_prefix : "", filename) >= PATH_MAX) return;
+
+    value = stat_cache_value_get(cache, path, true, NULL);
+    if (value == NULL) return;
+
+    if (S_ISREG(value->st.st_mode) && value->st.st_size > 0 && value->st.st_size <= prefetch.max_size) {
+        prefetch_enqueue(path_prefix, path);
+    }
+    free(value);
+}
+
+// Queue the small files of a directory just refreshed from the server
+void filecache_prefetch_directory(filecache_t *cache, const char *path) {
+    if (prefetch.nthreads == 0 || prefetch.max_size == 0) return;
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_prefetch_directory: %s", path);
+    stat_cache_enumerate(cache, path, prefetch_enumerate_callback, cache, true);
+}
+
+// Note activity on path, keeping queued prefetches for it (as a directory) or its parent alive
+void filecache_prefetch_touch(const char *path) {
+    struct prefetch_dir_s *dir;
+    char parent[PATH_MAX];
+    char *slash;
+
+    if (prefetch.nthreads == 0 || prefetch.max_size == 0) return;
+
+    strncpy(parent, path, PATH_MAX - 1);
+    parent[PATH_MAX - 1] = '\0';
+    slash = strrchr(parent, '/');
+    if (slash == NULL) return;
+    if (slash == parent) slash[1] = '\0'; // child of the root
+    else slash[0] = '\0';
+
+    pthread_mutex_lock(&prefetch.mutex);
+    if (g_hash_table_size(prefetch.dirs) > 0) {
+        if ((dir = g_hash_table_lookup(prefetch.dirs, path))) dir->last_access = time(NULL);
+        if ((dir = g_hash_table_lookup(prefetch.dirs, parent))) dir->last_access = time(NULL);
+    }
+    pthread_mutex_unlock(&prefetch.mutex);
+}
+
+/* Stale-while-revalidate: a read-only open of a cache file that has aged past REFRESH_INTERVAL,
+ * but by no more than the revalidate window, is served from the cache file straight away while
+ * a worker does the If-None-Match GET. A 304 just restamps pdata; a 200 swaps in the new cache
+ * file for later opens, while this open keeps reading the old one. filecache_open opens that
+ * before queueing the GET (revalidate_in_background), which could otherwise unlink it first.
+ */
+static bool revalidate_due(const struct filecache_pdata *pdata, int flags) {
+    time_t age;
+
+    if (prefetch.nthreads == 0 || prefetch.revalidate_window == 0) return false;
+    if (pdata == NULL || pdata->last_server_update == 0) return false;
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_TRUNC | O_CREAT))) return false;
+
+    age = time(NULL) - pdata->last_server_update;
+    return (age > REFRESH_INTERVAL && age <= REFRESH_INTERVAL + prefetch.revalidate_window);
+}
+
+// Returns false if the queue is full, leaving the revalidation to the open
+static bool revalidate_in_background(const struct filecache_pdata *pdata, const char *path) {
+    time_t age = time(NULL) - pdata->last_server_update;
+
+    if (!prefetch_enqueue(NULL, path)) return false;
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "revalidate_in_background: serving %s (age %lu) while revalidating", path, age);
+    BUMP(filecache_revalidate);
+    return true;
+}
+
+/* Ranged GETs for large files. A read-only open which has to go to the server for a file of
+ * at least range_min_size bytes GETs only the first FILECACHE_RANGE_CHUNK and returns. A
+ * detached worker, one of at most FILECACHE_RANGE_FILLS_MAX, fetches the remaining chunks into the same sparse cache file with If-Match
+ * Range requests, keeping a bitmap of the chunks present; filecache_read waits only for the
+ * chunks it covers, and has the worker fetch those next. Other opens of the path share the
+ * fill while it runs. pdata names the cache file only once every chunk has arrived, so
+ * writers, PUTs, cleanup and prefetch never see a partial file, and a fill cut short by a
+ * restart just leaves an orphan for cleanup to remove. filecache_ranged_get_stop cuts the fills
+ * short that way at unmount, and waits for their workers, which use the caches.
+ */
+#define FILECACHE_RANGE_CHUNK (1024 * 1024)
+// Opens past this many fills at once make a full GET instead
+#define FILECACHE_RANGE_FILLS_MAX 16
+
+struct filecache_fill {
+    pthread_mutex_t mutex; // protects bitmap, missing, want and failed
+    pthread_cond_t cond; // broadcast as each chunk lands, and on failure
+    char *path;
+    char filename[PATH_MAX];
+    char etag[ETAG_MAX + 1];
+    char old_filename[PATH_MAX]; // pdata's cache file when the fill started; empty if none
+    filecache_t *cache;
+    fd_t fd; // the worker's; each open has its own
+    off_t size;
+    long nchunks;
+    long missing;
+    unsigned char *bitmap; // one bit per chunk
+    long want; // a chunk some read is waiting on; -1 for none
+    time_t started;
+    bool failed;
+    unsigned refs; // the worker plus each open; under fills_mutex
+};
+
+static off_t range_min_size = 0; // 0 disables ranged GETs
+static pthread_mutex_t fills_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *fills = NULL; // path -> fill while its worker runs; keys belong to the fills
+static pthread_cond_t fills_done = PTHREAD_COND_INITIALIZER; // broadcast as each worker finishes
+static int fills_running = 0; // workers, and opens about to start one; under fills_mutex
+static bool fills_stop = false;
+
+// Ranged GETs apply to files of min_size bytes and up; 0 turns them off. Call before the FUSE loop.
+void filecache_ranged_get_init(off_t min_size) {
+    range_min_size = min_size > 0 ? min_size : 0;
+    if (range_min_size > 0 && fills == NULL) {
+        fills = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "filecache_ranged_get_init: files from %lu bytes", range_min_size);
+}
+
+// Stop the fills under way and wait for their workers. Call before the caches close.
+void filecache_ranged_get_stop(void) {
+    pthread_mutex_lock(&fills_mutex);
+    __atomic_store_n(&fills_stop, true, __ATOMIC_RELAXED);
+    if (fills_running > 0) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "filecache_ranged_get_stop: waiting for %d fills", fills_running);
+    }
+    while (fills_running > 0) {
+        pthread_cond_wait(&fills_done, &fills_mutex);
+    }
+    pthread_mutex_unlock(&fills_mutex);
+}
+
+// A place for a fill's worker; false if there are enough already, or we're stopping
+static bool fill_slot_take(void) {
+    bool taken = false;
+
+    pthread_mutex_lock(&fills_mutex);
+    if (!fills_stop && fills_running < FILECACHE_RANGE_FILLS_MAX) {
+        ++fills_running;
+        taken = true;
+    }
+    pthread_mutex_unlock(&fills_mutex);
+    return taken;
+}
+
+static void fill_slot_release(void) {
+    pthread_mutex_lock(&fills_mutex);
+    --fills_running;
+    pthread_cond_broadcast(&fills_done);
+    pthread_mutex_unlock(&fills_mutex);
+}
+
+static bool chunk_present(const struct filecache_fill *fill, long chunk) {
+    return fill->bitmap[chunk / 8] & (1 << (chunk % 8));
+}
+
+static void fill_unref(struct filecache_fill *fill) {
+    bool last;
+
+    pthread_mutex_lock(&fills_mutex);
+    last = (--fill->refs == 0);
+    pthread_mutex_unlock(&fills_mutex);
+
+    if (!last) return;
+
+    close(fill->fd);
+    pthread_mutex_destroy(&fill->mutex);
+    pthread_cond_destroy(&fill->cond);
+    free(fill->bitmap);
+    free(fill->path);
+    free(fill);
+}
+
+struct range_response {
+    char etag[ETAG_MAX];
+    off_t total; // from Content-Range; -1 if there was none
+};
+
+// Picks the total length out of "Content-Range: bytes 0-1048575/104857600"; passes the rest to capture_etag
+static size_t capture_range_headers(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    size_t real_size = size * nmemb;
+    struct range_response *response = (struct range_response *) userdata;
+    const char *header = (const char *) ptr;
+    static const char content_range[] = "Content-Range:";
+
+    if (real_size >= sizeof(content_range) && strncasecmp(header, content_range, sizeof(content_range) - 1) == 0) {
+        const char *slash = memchr(header, '/', real_size);
+        if (slash && slash + 1 < header + real_size && isdigit(slash[1])) {
+            response->total = strtoll(slash + 1, NULL, 10);
+        }
+        return real_size;
+    }
+    return capture_etag(ptr, size, nmemb, response->etag);
+}
+
+struct range_sink {
+    fd_t fd;
+    off_t offset; // where the next byte of the body goes
+    off_t limit; // one past the last byte asked for; 0 for no limit
+    const bool *cancel; // abandons the transfer once set; NULL for never
+};
+
+static size_t write_response_at(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    size_t real_size = size * nmemb;
+    struct range_sink *sink = (struct range_sink *) userdata;
+
+    if (sink->cancel && __atomic_load_n(sink->cancel, __ATOMIC_RELAXED))
+        return 0;
+    // A server ignoring the Range would otherwise write all over the chunks already in place
+    if (sink->limit && sink->offset + (off_t) real_size > sink->limit)
+        return 0;
+    if (pwrite(sink->fd, ptr, real_size, sink->offset) != (ssize_t) real_size)
+        return 0;
+    sink->offset += real_size;
+    return real_size;
+}
+
+// GET bytes start through end of path into sink, trying each node in turn as get_fresh_fd does
+static CURLcode range_get(const char *path, struct range_sink *sink, off_t start, off_t end,
+        const char *if_none_match, const char *if_match, struct range_response *response, long *response_code) {
+    CURLcode res = CURLE_OK;
+    char range[64];
+
+    BUMP(filecache_range_get);
+
+    snprintf(range, sizeof(range), "%lld-%lld", (long long) start, (long long) end);
+    *response_code = 500; // seed it as bad so we can enter the loop
+
+    for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || *response_code >= 500); idx++) {
+        CURL *session;
+        struct session_sink_s hedge_sink;
+        struct curl_slist *slist = NULL;
+        unsigned long request_start;
+        char *header = NULL;
+        bool new_resolve_list = (idx > 0);
+
+        if (new_resolve_list) set_dynamic_logging();
+
+        session = session_request_init(path, NULL, false, new_resolve_list);
+        if (!session) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "range_get: Failed session_request_init on GET %s", path);
+            return CURLE_FAILED_INIT;
+        }
+
+        if (if_none_match) {
+            asprintf(&header, "If-None-Match: %s", if_none_match);
+            slist = curl_slist_append(slist, header);
+            free(header);
+        }
+        if (if_match) {
+            // Don't mix chunks of two versions of the file
+            asprintf(&header, "If-Match: %s", if_match);
+            slist = curl_slist_append(slist, header);
+            free(header);
+        }
+        slist = enhanced_logging(slist, LOG_DYNAMIC, SECTION_FILECACHE_OPEN, "range_get: %s %s", path, range);
+        if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
+
+        curl_easy_setopt(session, CURLOPT_RANGE, range);
+
+        response->etag[0] = '\0';
+        response->total = -1;
+        hedge_sink.header = capture_range_headers;
+        hedge_sink.header_data = response;
+
+        sink->offset = start;
+        hedge_sink.write = write_response_at;
+        hedge_sink.write_data = sink;
+
+        request_start = stats_clock();
+        res = session_perform_hedged(session, STATS_LAT_GET, &hedge_sink, response_code);
+        LATENCY(STATS_LAT_GET, request_start);
+
+        log_filesystem_nodes("range_get", res, *response_code, idx, path);
+
+        if (slist) curl_slist_free_all(slist);
+    }
+
+    return res;
+}
+
+// Point pdata at the finished file, unless someone has written or fetched another copy meanwhile
+static void fill_install(struct filecache_fill *fill) {
+    struct filecache_pdata *pdata;
+    GError *tmpgerr = NULL;
+    bool install;
+    bool guard;
+
+    pdata = filecache_pdata_get(fill->cache, fill->path, &tmpgerr);
+    if (tmpgerr) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "fill_install: %s: %s", fill->path, tmpgerr->message);
+        g_clear_error(&tmpgerr);
+        install = false;
+    }
+    else if (pdata == NULL) {
+        // If there was an entry when we started, or the stat cache has lost track of the path, the
+        // file has since been deleted or moved
+        struct stat_cache_value *value = NULL;
+        if (fill->old_filename[0] == '\0') value = stat_cache_value_get(fill->cache, fill->path, true, NULL);
+        install = (value != NULL);
+        free(value);
+    }
+    else {
+        install = (pdata->last_server_update != 0 && strcmp(pdata->filename, fill->old_filename) == 0);
+    }
+
+    // As in get_fresh_fd, a file being written stays where it is
+    guard = (install && fill->old_filename[0] != '\0');
+    if (guard) {
+        pthread_mutex_lock(&file_locks_mutex);
+        if (file_lock_writing(fill->old_filename)) {
+            log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "fill_install: %s is open for writing; leaving it on %s", fill->path, fill->old_filename);
+            install = false;
+        }
+    }
+
+    if (install) {
+        struct filecache_pdata new_pdata;
+
+        memset(&new_pdata, 0, sizeof(struct filecache_pdata));
+        strncpy(new_pdata.filename, fill->filename, PATH_MAX);
+        strncpy(new_pdata.etag, fill->etag, ETAG_MAX);
+        // The first chunk's GET is when the contents were current
+        new_pdata.last_server_update = fill->started;
+
+        log_print(LOG_DYNAMIC, SECTION_FILECACHE_OPEN, "fill_install: Updating file cache for %s : %s : timestamp: %lu.", fill->path, new_pdata.filename, new_pdata.last_server_update);
+        filecache_pdata_set(fill->cache, fill->path, &new_pdata, &tmpgerr);
+        if (tmpgerr) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "fill_install: %s: %s", fill->path, tmpgerr->message);
+            g_clear_error(&tmpgerr);
+            install = false;
+        }
+        else if (fill->old_filename[0] != '\0') {
+            unlink(fill->old_filename);
+        }
+    }
+    if (guard) pthread_mutex_unlock(&file_locks_mutex);
+    if (install) quota_account(fill->path, fill->size, true);
+
+    // Opens still reading it keep it alive
+    if (!install) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "fill_install: superseded; dropping %s", fill->filename);
+        unlink(fill->filename);
+    }
+
+    free(pdata);
+}
+
+static void *fill_worker(void *ptr) {
+    struct filecache_fill *fill = (struct filecache_fill *) ptr;
+    long next = 1; // chunk 0 came with the open
+    bool ok = true;
+
+    while (true) {
+        struct range_response response;
+        struct range_sink sink;
+        long response_code;
+        long chunk;
+        off_t start;
+        off_t end;
+        CURLcode res;
+
+        if (__atomic_load_n(&fills_stop, __ATOMIC_RELAXED)) {
+            log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "fill_worker: stopping; %s is incomplete", fill->path);
+            ok = false;
+            break;
+        }
+
+        pthread_mutex_lock(&fill->mutex);
+        if (fill->missing == 0) {
+            pthread_mutex_unlock(&fill->mutex);
+            break;
+        }
+        // A waiting read goes first; otherwise carry on in order, wrapping round past anything it skipped
+        chunk = fill->want;
+        if (chunk < 0 || chunk_present(fill, chunk)) {
+            for (chunk = next % fill->nchunks; chunk_present(fill, chunk); chunk = (chunk + 1) % fill->nchunks);
+        }
+        pthread_mutex_unlock(&fill->mutex);
+
+        start = (off_t) chunk * FILECACHE_RANGE_CHUNK;
+        end = start + FILECACHE_RANGE_CHUNK - 1;
+        if (end >= fill->size) end = fill->size - 1;
+        sink.fd = fill->fd;
+        sink.limit = end + 1;
+        sink.cancel = &fills_stop;
+
+        res = range_get(fill->path, &sink, start, end, NULL, fill->etag, &response, &response_code);
+        if (res != CURLE_OK || response_code != 206 || sink.offset != end + 1 || inject_error(filecache_error_rangechunk)) {
+            // 412 means the file changed on the server; the next open starts over
+            if ((res != CURLE_OK || response_code >= 500) && !__atomic_load_n(&fills_stop, __ATOMIC_RELAXED)) set_saint_mode();
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "fill_worker: chunk %ld of %s failed: %s; HTTP %ld",
+                chunk, fill->path, curl_easy_strerror(res), response_code);
+            ok = false;
+            break;
+        }
+
+        pthread_mutex_lock(&fill->mutex);
+        fill->bitmap[chunk / 8] |= (1 << (chunk % 8));
+        --fill->missing;
+        if (fill->want == chunk) fill->want = -1;
+        pthread_cond_broadcast(&fill->cond);
+        pthread_mutex_unlock(&fill->mutex);
+
+        next = chunk + 1;
+    }
+
+    if (ok) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "fill_worker: %s complete in %ld chunks", fill->path, fill->nchunks);
+        fill_install(fill);
+    }
+    else {
+        BUMP(filecache_range_fail);
+        pthread_mutex_lock(&fill->mutex);
+        fill->failed = true;
+        pthread_cond_broadcast(&fill->cond);
+        pthread_mutex_unlock(&fill->mutex);
+        unlink(fill->filename);
+    }
+
+    // A later fill of the same path may have taken our place
+    pthread_mutex_lock(&fills_mutex);
+    if (g_hash_table_lookup(fills, fill->path) == fill) {
+        g_hash_table_remove(fills, fill->path);
+    }
+    pthread_mutex_unlock(&fills_mutex);
+
+    // Done with the caches; what's left only touches the fill
+    fill_slot_release();
+    fill_unref(fill);
+    return NULL;
+}
+
+// Wait for the chunks covering size bytes at offset. Returns false if the fill failed first.
+static bool fill_wait(struct filecache_fill *fill, off_t offset, size_t size) {
+    long first;
+    long last;
+    bool ok = true;
+
+    if (size == 0 || offset >= fill->size) return true;
+
+    first = offset / FILECACHE_RANGE_CHUNK;
+    last = offset + (off_t) size - 1;
+    if (last >= fill->size) last = fill->size - 1;
+    last /= FILECACHE_RANGE_CHUNK;
+
+    pthread_mutex_lock(&fill->mutex);
+    for (long chunk = first; chunk <= last && fill->missing > 0; chunk++) {
+        if (chunk_present(fill, chunk)) continue;
+        BUMP(filecache_range_wait);
+        while (!chunk_present(fill, chunk) && !fill->failed) {
+            fill->want = chunk;
+            pthread_cond_wait(&fill->cond, &fill->mutex);
+        }
+        if (!chunk_present(fill, chunk)) {
+            ok = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fill->mutex);
+
+    return ok;
+}
+
+// The cache file a ranged open reads while its fill is under way
+static const char *ranged_filename(const struct filecache_sdata *sdata) {
+    return sdata->fill->filename;
+}
+
+// Join the fill under way for path, if there is one
+static bool ranged_attach(const char *path, struct filecache_sdata *sdata) {
+    struct filecache_fill *fill;
+    bool attached = false;
+
+    pthread_mutex_lock(&fills_mutex);
+    fill = g_hash_table_lookup(fills, path);
+    if (fill && !fill->failed) {
+        fd_t fd = open(fill->filename, O_RDONLY);
+        if (fd >= 0) {
+            sdata->fd = fd;
+            sdata->fill = fill;
+            ++fill->refs;
+            attached = true;
+        }
+    }
+    pthread_mutex_unlock(&fills_mutex);
+
+    if (attached) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "ranged_attach: sharing the fill of %s", path);
+        BUMP(filecache_range_open);
+    }
+    return attached;
+}
+
+/* Open a large file after GETting just its first chunk; see above. Returns true if it has set
+ * either sdata->fd or gerr. False leaves the open to get_fresh_fd, which will find pdata freshly
+ * stamped if the server answered 304, and otherwise makes its usual GET.
+ */
+static bool ranged_open(filecache_t *cache, const char *cache_path, const char *path,
+        struct filecache_sdata *sdata, struct filecache_pdata **pdatap, int flags, GError **gerr) {
+    struct filecache_pdata *pdata = *pdatap;
+    struct filecache_fill *fill = NULL;
+    struct stat_cache_value *value;
+    struct range_response response;
+    struct range_sink sink;
+    char filename[PATH_MAX] = "\0";
+    fd_t fd = -1;
+    fd_t reader_fd;
+    long response_code;
+    CURLcode res;
+    off_t size;
+    pthread_t thread;
+    pthread_attr_t attr;
+    GError *tmpgerr = NULL;
+    bool handled = false;
+    bool slot = false;
+
+    if (range_min_size == 0) return false;
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_TRUNC | O_CREAT))) return false;
+    // get_fresh_fd opens these without going to the server
+    if (pdata && (pdata->last_server_update == 0 || (time(NULL) - pdata->last_server_update) <= REFRESH_INTERVAL)) return false;
+
+    if (ranged_attach(path, sdata)) return true;
+
+    value = stat_cache_value_get(cache, path, true, NULL);
+    if (value == NULL) return false;
+    size = value->st.st_size;
+    free(value);
+    if (size < range_min_size) return false;
+
+    // Held from before the first chunk, so there is a worker for the rest
+    if (!fill_slot_take()) {
+        log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "ranged_open: %d fills under way; a full GET of %s", FILECACHE_RANGE_FILLS_MAX, path);
+        return false;
+    }
+    slot = true;
+
+    new_cache_file(cache_path, filename, &fd, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "ranged_open: ");
+        handled = true;
+        goto finish;
+    }
+
+    sink.fd = fd;
+    sink.limit = 0; // a 200 brings the whole file
+    sink.cancel = NULL;
+    res = range_get(path, &sink, 0, FILECACHE_RANGE_CHUNK - 1, pdata ? pdata->etag : NULL, NULL, &response, &response_code);
+    if (res != CURLE_OK || response_code >= 500 || inject_error(filecache_error_rangecurl)) {
+        set_saint_mode();
+        g_set_error(gerr, curl_quark(), E_FC_CURLERR, "ranged_open: curl_easy_perform is not CURLE_OK or 500: %s",
+            curl_easy_strerror(res));
+        handled = true;
+        goto finish;
+    }
+
+    if (response_code == 304 && pdata) {
+        // Mark the cache item as revalidated at the current time, for get_fresh_fd to open.
+        pdata->last_server_update = time(NULL);
+        log_print(LOG_DYNAMIC, SECTION_FILECACHE_OPEN, "ranged_open: Updating file cache on 304 for %s : %s : timestamp: %lu.", path, pdata->filename, pdata->last_server_update);
+        filecache_pdata_set(cache, path, pdata, &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "ranged_open on 304: ");
+            handled = true;
+        }
+        BUMP(filecache_get_304_count);
+        goto finish;
+    }
+
+    // The whole file, either because the server ignored the Range or it has shrunk to one chunk
+    if (response_code == 200 || (response_code == 206 && response.total == sink.offset)) {
+        char old_filename[PATH_MAX] = "\0";
+
+        if (pdata == NULL) {
+            *pdatap = calloc(1, sizeof(struct filecache_pdata));
+            pdata = *pdatap;
+            if (pdata == NULL) {
+                g_set_error(gerr, system_quark(), errno, "ranged_open: ");
+                handled = true;
+                goto finish;
+            }
+        }
+        else {
+            strncpy(old_filename, pdata->filename, PATH_MAX);
+            // As in get_fresh_fd, a file being written stays where it is
+            pthread_mutex_lock(&file_locks_mutex);
+            if (file_lock_writing(old_filename)) {
+                pthread_mutex_unlock(&file_locks_mutex);
+                log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "ranged_open: %s is open for writing; leaving it on %s", path, old_filename);
+                // This open reads the new copy, which goes once it closes
+                unlink(filename);
+                filename[0] = '\0';
+                sdata->fd = fd;
+                fd = -1;
+                handled = true;
+                goto finish;
+            }
+        }
+
+        strncpy(pdata->etag, response.etag, ETAG_MAX);
+        pdata->etag[ETAG_MAX] = '\0';
+        pdata->last_server_update = time(NULL);
+        strncpy(pdata->filename, filename, PATH_MAX);
+
+        log_print(LOG_DYNAMIC, SECTION_FILECACHE_OPEN, "ranged_open: Updating file cache on %ld for %s : %s : timestamp: %lu.", response_code, path, pdata->filename, pdata->last_server_update);
+        filecache_pdata_set(cache, path, pdata, &tmpgerr);
+        if (tmpgerr) {
+            if (old_filename[0] != '\0') pthread_mutex_unlock(&file_locks_mutex);
+            g_propagate_prefixed_error(gerr, tmpgerr, "ranged_open on 200: ");
+            handled = true;
+            goto finish;
+        }
+
+        if (old_filename[0] != '\0') {
+            unlink(old_filename);
+            pthread_mutex_unlock(&file_locks_mutex);
+        }
+
+        sdata->fd = fd;
+        fd = -1;
+        filename[0] = '\0';
+        handled = true;
+        goto finish;
+    }
+
+    // Anything else (404, or a 206 we can't continue from) is get_fresh_fd's to deal with
+    if (response_code != 206 || response.total <= sink.offset || sink.offset != FILECACHE_RANGE_CHUNK || response.etag[0] == '\0') {
+        log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "ranged_open: %s: HTTP %ld with %ld of %lld bytes; falling back to a full GET",
+            path, response_code, (long) sink.offset, (long long) response.total);
+        goto finish;
+    }
+
+    // The rest of the file fills in around the first chunk
+    if (ftruncate(fd, response.total) < 0 || (reader_fd = open(filename, O_RDONLY)) < 0) {
+        g_set_error(gerr, system_quark(), errno, "ranged_open: preparing %s failed", filename);
+        handled = true;
+        goto finish;
+    }
+
+    fill = calloc(1, sizeof(struct filecache_fill));
+    pthread_mutex_init(&fill->mutex, NULL);
+    pthread_cond_init(&fill->cond, NULL);
+    fill->path = strdup(path);
+    strncpy(fill->filename, filename, PATH_MAX);
+    strncpy(fill->etag, response.etag, ETAG_MAX);
+    if (pdata) strncpy(fill->old_filename, pdata->filename, PATH_MAX);
+    fill->cache = cache;
+    fill->fd = fd;
+    fill->size = response.total;
+    fill->nchunks = (response.total + FILECACHE_RANGE_CHUNK - 1) / FILECACHE_RANGE_CHUNK;
+    fill->bitmap = calloc((fill->nchunks + 7) / 8, 1);
+    fill->bitmap[0] = 1;
+    fill->missing = fill->nchunks - 1;
+    fill->want = -1;
+    fill->started = time(NULL);
+    fill->refs = 2; // the worker and this open
+
+    // Registered before the worker starts, so its removal can't come first
+    pthread_mutex_lock(&fills_mutex);
+    g_hash_table_replace(fills, fill->path, fill);
+    pthread_mutex_unlock(&fills_mutex);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, fill_worker, fill)) {
+        log_print(LOG_ERR, SECTION_FILECACHE_OPEN, "ranged_open: pthread_create failed; falling back to a full GET of %s", path);
+        // An open may have attached in the meantime
+        pthread_mutex_lock(&fill->mutex);
+        fill->failed = true;
+        pthread_cond_broadcast(&fill->cond);
+        pthread_mutex_unlock(&fill->mutex);
+        pthread_mutex_lock(&fills_mutex);
+        if (g_hash_table_lookup(fills, fill->path) == fill) g_hash_table_remove(fills, fill->path);
+        pthread_mutex_unlock(&fills_mutex);
+        fill_unref(fill);
+        fill_unref(fill);
+        fd = -1; // closed with the fill
+        close(reader_fd);
+        pthread_attr_destroy(&attr);
+        goto finish;
+    }
+    pthread_attr_destroy(&attr);
+    slot = false; // the worker's now
+
+    log_print(LOG_DYNAMIC, SECTION_FILECACHE_OPEN, "ranged_open: %s: filling %ld chunks of %lld bytes into %s",
+        path, fill->nchunks, (long long) fill->size, fill->filename);
+    BUMP(filecache_range_open);
+
+    sdata->fd = reader_fd;
+    sdata->fill = fill;
+    fd = -1;
+    filename[0] = '\0';
+    handled = true;
+
+finish:
+    if (slot) fill_slot_release();
+    if (fd >= 0) close(fd);
+    if (filename[0] != '\0') unlink(filename);
+    return handled;
+}
+
 // top-level read call
 ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_t offset, GError **gerr) {
     struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
@@ -884,6 +2611,11 @@ ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_
 
     log_print(LOG_DYNAMIC, SECTION_FILECACHE_IO, "filecache_read: fd=%d", sdata->fd);
 
+    if (sdata->fill && !fill_wait(sdata->fill, offset, size)) {
+        g_set_error(gerr, system_quark(), EIO, "filecache_read: ranged GET of the file failed");
+        return -1;
+    }
+
     bytes_read = pread(sdata->fd, buf, size, offset);
     if (bytes_read < 0 || inject_error(filecache_error_readread)) {
         g_set_error(gerr, system_quark(), errno, "filecache_read: pread failed: ");
@@ -896,6 +2628,39 @@ ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_
     return bytes_read;
 }
 
+/* Like filecache_read, but rather than copying the data hands back a buffer naming the cache
+ * file's fd, so libfuse can splice it straight to the kernel. libfuse frees *bufp.
+ */
+void filecache_read_buf(struct fuse_file_info *info, struct fuse_bufvec **bufp, size_t size, off_t offset, GError **gerr) {
+    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    struct fuse_bufvec *bufv;
+
+    BUMP(filecache_read);
+
+    if (sdata == NULL || inject_error(filecache_error_readsdata)) {
+        g_set_error(gerr, filecache_quark(), E_FC_SDATANULL, "filecache_read_buf: sdata is NULL");
+        return;
+    }
+
+    log_print(LOG_DYNAMIC, SECTION_FILECACHE_IO, "filecache_read_buf: fd=%d", sdata->fd);
+
+    if (sdata->fill && !fill_wait(sdata->fill, offset, size)) {
+        g_set_error(gerr, system_quark(), EIO, "filecache_read_buf: ranged GET of the file failed");
+        return;
+    }
+
+    bufv = malloc(sizeof(struct fuse_bufvec));
+    if (bufv == NULL) {
+        g_set_error(gerr, system_quark(), ENOMEM, "filecache_read_buf: Failed to malloc bufvec");
+        return;
+    }
+    *bufv = FUSE_BUFVEC_INIT(size);
+    bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[0].fd = sdata->fd;
+    bufv->buf[0].pos = offset;
+    *bufp = bufv;
+}
+
 static void set_error(struct filecache_sdata *sdata, int error_code) {
     if (sdata->error_code == 0) {
         sdata->error_code = error_code;
@@ -906,10 +2671,13 @@ static void set_error(struct filecache_sdata *sdata, int error_code) {
     }
 }
 
-// top-level write call
-ssize_t filecache_write(struct fuse_file_info *info, const char *buf, size_t size, off_t offset, GError **gerr) {
+// Write from a FUSE buffer, which may be a pipe the kernel spliced the data into
+ssize_t filecache_write_buf(struct fuse_file_info *info, struct fuse_bufvec *buf, off_t offset, GError **gerr) {
     struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
     ssize_t bytes_written;
+    int ret = 0;
 
     BUMP(filecache_write);
 
@@ -927,15 +2695,23 @@ ssize_t filecache_write(struct fuse_file_info *info, const char *buf, size_t siz
 
     // Don't write to a file while it is being PUT
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: acquiring shared file lock on fd %d", sdata->fd);
-    if (flock(sdata->fd, LOCK_SH) || inject_error(filecache_error_writeflock1)) {
-        g_set_error(gerr, system_quark(), errno, "filecache_write: error acquiring shared file lock");
+    if (inject_error(filecache_error_writeflock1) || (ret = pthread_rwlock_rdlock(&sdata->lock->rwlock))) {
+        g_set_error(gerr, system_quark(), ret, "filecache_write: error acquiring shared file lock");
         return -1;
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: acquired shared file lock on fd %d", sdata->fd);
 
-    bytes_written = pwrite(sdata->fd, buf, size, offset);
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = sdata->fd;
+    dst.buf[0].pos = offset;
+    bytes_written = fuse_buf_copy(&dst, buf, 0);
+    // fuse_buf_copy returns -errno
+    if (bytes_written < 0) {
+        errno = -bytes_written;
+        bytes_written = -1;
+    }
 
-    // If pwrite fails, file goes to forensic haven
+    // If the write fails, file goes to forensic haven
     if (bytes_written < 0 || inject_error(filecache_error_writewrite)) {
         set_error(sdata, errno);
         g_set_error(gerr, system_quark(), errno, "filecache_write: pwrite failed");
@@ -946,8 +2722,8 @@ ssize_t filecache_write(struct fuse_file_info *info, const char *buf, size_t siz
     }
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: releasing shared file lock on fd %d", sdata->fd);
-    if (flock(sdata->fd, LOCK_UN) || inject_error(filecache_error_writeflock2)) {
-        g_set_error(gerr, system_quark(), errno, "filecache_write: error releasing shared file lock");
+    if ((ret = pthread_rwlock_unlock(&sdata->lock->rwlock)) || inject_error(filecache_error_writeflock2)) {
+        g_set_error(gerr, system_quark(), ret, "filecache_write: error releasing shared file lock");
         // Since we've already written (or not), just fall through and return bytes_written
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: released shared file lock on fd %d", sdata->fd);
@@ -968,6 +2744,8 @@ void filecache_close(struct fuse_file_info *info, GError **gerr) {
 
     log_print(LOG_DYNAMIC, SECTION_FILECACHE_FILE, "filecache_close: fd (%d).", sdata->fd);
 
+    quota_release(sdata->hold, sdata->fd);
+
     if (sdata->fd < 0 || inject_error(filecache_error_closefd))  {
         g_set_error(gerr, system_quark(), EBADF, "filecache_close got bad file descriptor");
     }
@@ -980,6 +2758,10 @@ void filecache_close(struct fuse_file_info *info, GError **gerr) {
         }
     }
 
+    if (sdata->fill) fill_unref(sdata->fill);
+    if (sdata->writer) file_lock_writer_remove(sdata->lock);
+    file_lock_put(sdata->lock);
+
     free(sdata);
 
     return;
@@ -987,7 +2769,13 @@ void filecache_close(struct fuse_file_info *info, GError **gerr) {
 
 /* PUT's from fd to URI */
 /* Our modification to include etag support on put */
-static void put_return_etag(const char *path, int fd, char *etag, GError **gerr) {
+/* Leaves the new etag, and with dedup on the contents' hash, in pdata */
+static void put_return_etag(const char *path, int fd, struct filecache_pdata *pdata, GError **gerr) {
+    char *etag = pdata->etag;
+    char hash[FILECACHE_HASH_LEN + 1] = "";
+    struct file_lock *lock;
+    GError *tmpgerr = NULL;
+    int ret = 0;
     struct stat st;
     struct timespec start_time;
     long response_code = 500; // seed it as bad so we can enter the loop
@@ -1008,9 +2796,16 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "enter: put_return_etag(,%s,%d,,)", path, fd);
 
+    lock = file_lock_get(fd, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "put_return_etag: ");
+        return;
+    }
+
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "put_return_etag: acquiring exclusive file lock on fd %d", fd);
-    if (flock(fd, LOCK_EX) || inject_error(filecache_error_etagflock1)) {
-        g_set_error(gerr, system_quark(), errno, "put_return_etag: error acquiring exclusive file lock");
+    if (inject_error(filecache_error_etagflock1) || (ret = pthread_rwlock_wrlock(&lock->rwlock))) {
+        g_set_error(gerr, system_quark(), ret, "put_return_etag: error acquiring exclusive file lock");
+        file_lock_put(lock);
         return;
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "put_return_etag: acquired exclusive file lock on fd %d", fd);
@@ -1024,12 +2819,21 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "put_return_etag: file size %d", st.st_size);
 
+    // Writing a file back the way it was, e.g. a copy from another path with the same contents
+    if (dedup && hash_cache_file(fd, hash) && strcmp(hash, pdata->hash) == 0) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "put_return_etag: server already has these contents for %s", path);
+        BUMP(filecache_put_skip);
+        strncpy(etag, pdata->hash_etag, ETAG_MAX + 1);
+        goto finish;
+    }
+
     // If we're in saint mode, skip the PUT altogether
     for (int idx = 0;
          idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500);
          idx++) {
         CURL *session;
         struct curl_slist *slist = NULL;
+        unsigned long request_start;
         FILE *fp;
         bool new_resolve_list;
 
@@ -1067,7 +2871,9 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
         curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, capture_etag);
         curl_easy_setopt(session, CURLOPT_WRITEHEADER, etag);
 
-        res = curl_easy_perform(session);
+        request_start = stats_clock();
+        res = session_perform(session);
+        LATENCY(STATS_LAT_PUT, request_start);
 
         fclose(fp);
         if(res == CURLE_OK) {
@@ -1116,112 +2922,568 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
         clock_gettime(CLOCK_MONOTONIC, &now);
         elapsed_time = ((now.tv_sec - start_time.tv_sec) * 1000) + ((now.tv_nsec - start_time.tv_nsec) / (1000 * 1000));
 
-        if (st.st_size > XLG) {
-            TIMING(filecache_put_xlg_timing, elapsed_time);
-            BUMP(filecache_put_xlg_count);
-            latency = FETCH(filecache_put_xlg_timing);
-            count = FETCH(filecache_put_xlg_count);
-            sz = "XLG";
-            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &lptime,
-                "large-puts", &lpcount, 1,
-                "large-put-latency", &lplatency, elapsed_time);
+        if (st.st_size > XLG) {
+            TIMING(filecache_put_xlg_timing, elapsed_time);
+            BUMP(filecache_put_xlg_count);
+            latency = FETCH(filecache_put_xlg_timing);
+            count = FETCH(filecache_put_xlg_count);
+            sz = "XLG";
+            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &lptime,
+                "large-puts", &lpcount, 1,
+                "large-put-latency", &lplatency, elapsed_time);
+        }
+        else if (st.st_size > LG) {
+            TIMING(filecache_put_lg_timing, elapsed_time);
+            BUMP(filecache_put_lg_count);
+            latency = FETCH(filecache_put_lg_timing);
+            count = FETCH(filecache_put_lg_count);
+            sz = "LG";
+            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &lptime,
+                "large-puts", &lpcount, 1,
+                "large-put-latency", &lplatency, elapsed_time);
+         }
+        else if (st.st_size > MED) {
+            TIMING(filecache_put_med_timing, elapsed_time);
+            BUMP(filecache_put_med_count);
+            latency = FETCH(filecache_put_med_timing);
+            count = FETCH(filecache_put_med_count);
+            sz = "MED";
+            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &lptime,
+                "large-puts", &lpcount, 1,
+                "large-put-latency", &lplatency, elapsed_time);
+        }
+        else if (st.st_size > SM) {
+            TIMING(filecache_put_sm_timing, elapsed_time);
+            BUMP(filecache_put_sm_count);
+            latency = FETCH(filecache_put_sm_timing);
+            count = FETCH(filecache_put_sm_count);
+            sz = "SM";
+            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &sptime,
+                "small-puts", &spcount, 1,
+                "small-put-latency", &splatency, elapsed_time);
+        }
+        else if (st.st_size > XSM) {
+            TIMING(filecache_put_xsm_timing, elapsed_time);
+            BUMP(filecache_put_xsm_count);
+            latency = FETCH(filecache_put_xsm_timing);
+            count = FETCH(filecache_put_xsm_count);
+            sz = "XSM";
+            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &sptime,
+                "small-puts", &spcount, 1,
+                "small-put-latency", &splatency, elapsed_time);
+        }
+        else {
+            TIMING(filecache_put_xxsm_timing, elapsed_time);
+            BUMP(filecache_put_xxsm_count);
+            latency = FETCH(filecache_put_xxsm_timing);
+            count = FETCH(filecache_put_xxsm_count);
+            sz = "XXSM";
+            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &sptime,
+                "small-puts", &spcount, 1,
+                "small-put-latency", &splatency, elapsed_time);
+        }
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "put_return_etag: PUT on size %s (%lu) for %s -- Current:Average latency %lu :: %lu",
+            sz, st.st_size, path, elapsed_time, (latency / count));
+
+        /* The aggregate_log_print_server routine is expecting a cumulative count and latency, but by
+         * passing NULL for time, we ensure that aggregate prints this message and resets to 0, so
+         * there's no need to keep a static variable for count and latency.
+         */
+        if (st.st_size >= LG && elapsed_time > large_time_allotment) {
+            unsigned long exceeded_count = 0;
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "put_return_etag: large (%lu) PUT for %s exceeded time allotment %lu with %lu",
+                st.st_size, path, large_time_allotment, elapsed_time);
+            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", NULL, "exceeded-time-large-PUT-count",
+                &exceeded_count, 1, "exceeded-time-large-PUT-latency", &elapsed_time, 0);
+        }
+        else if (st.st_size < LG && elapsed_time > small_time_allotment) {
+            unsigned long exceeded_count = 0;
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "put_return_etag: small (%lu) PUT for %s exceeded time allotment %lu with %lu",
+                st.st_size, path, small_time_allotment, elapsed_time);
+            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", NULL, "exceeded-time-small-PUT-count",
+                &exceeded_count, 1, "exceeded-time-small-PUT-latency", &elapsed_time, 0);
+        }
+    }
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "PUT returns etag: %s", etag);
+
+    strncpy(pdata->hash, hash, FILECACHE_HASH_LEN + 1);
+    strncpy(pdata->hash_etag, etag, ETAG_MAX + 1);
+
+finish:
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "put_return_etag: releasing exclusive file lock on fd %d", fd);
+    if ((ret = pthread_rwlock_unlock(&lock->rwlock)) || inject_error(filecache_error_etagflock2)) {
+        g_set_error(gerr, system_quark(), ret, "put_return_etag: error releasing exclusive file lock");
+    }
+    else {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "put_return_etag: released exclusive file lock on fd %d", fd);
+    }
+    file_lock_put(lock);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "exit: put_return_etag");
+
+    return;
+}
+
+/* Write-back. With workers running, a close (dav_flush, dav_release) no longer PUTs the file
+ * itself. filecache_sync records the path under writeback_prefix in the store, leaves pdata
+ * marked in-use (last_server_update 0, so nothing replaces the local copy with the server's)
+ * and returns. A worker PUTs the path once it has sat writeback.delay seconds; closes in the
+ * meantime just push that back, so a file rewritten several times in a row goes up once.
+ * The records survive a restart, and filecache_writeback_init requeues them. fsync and
+ * renames PUT synchronously (filecache_writeback_flush); unlinks drop the record.
+ * cURL failures are retried with backoff up to WRITEBACK_MAX_ATTEMPTS; any other failure, or
+ * running out of attempts, sends the file to the forensic haven as a failed release would.
+ * A failure puts the worker's thread in saint mode, in which its requests fail without going
+ * to the server, so no backoff is shorter than that lasts.
+ */
+#define WRITEBACK_MAX_ATTEMPTS 8
+#define WRITEBACK_MAX_BACKOFF 300
+
+static const char * writeback_prefix = "wb:";
+
+// Persisted for each queued path
+struct writeback_record {
+    time_t queued;
+};
+
+struct writeback_item {
+    char *path; // also the key in writeback.items
+    time_t due;
+    unsigned long gen; // changes each time the path is requeued
+    int attempts;
+    bool uploading;
+    bool parked; // failed while stopping; left for the next start
+};
+
+static struct {
+    pthread_mutex_t mutex; // protects everything below once the workers start
+    pthread_cond_t cond; // new work, or stopping
+    pthread_cond_t done; // an upload finished
+    GHashTable *items; // path -> writeback_item; owns the items
+    unsigned long gen;
+    filecache_t *cache;
+    char *cache_path;
+    time_t delay;
+    int nthreads;
+    pthread_t *threads;
+    bool stop;
+} writeback = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+static char *writeback_key(const char *path, char *key, size_t keylen) {
+    int len = snprintf(key, keylen, "%s%s", writeback_prefix, path);
+    if (len < 0 || (size_t)len >= keylen) return NULL;
+    return key;
+}
+
+static void writeback_item_free(void *ptr) {
+    struct writeback_item *item = ptr;
+    free(item->path);
+    free(item);
+}
+
+// Is a write-back record on disk for path? Cleanup must not take the cache files of these.
+static bool writeback_pending(filecache_t *cache, const char *path) {
+    char keybuf[FILECACHE_KEY_MAX];
+    char *ldberr = NULL;
+    char *value;
+    size_t vallen;
+
+    if (writeback_key(path, keybuf, sizeof(keybuf)) == NULL) return false;
+    value = kvstore_get(cache, keybuf, strlen(keybuf) + 1, &vallen, &ldberr);
+    if (ldberr != NULL) {
+        // Err on the side of keeping the file
+        free(ldberr);
+        return true;
+    }
+    free(value);
+    return value != NULL;
+}
+
+// Call with writeback.mutex held
+static void writeback_record_delete(const char *path) {
+    char keybuf[FILECACHE_KEY_MAX];
+    char *ldberr = NULL;
+
+    if (writeback_key(path, keybuf, sizeof(keybuf)) == NULL) return;
+    kvstore_delete(writeback.cache, keybuf, strlen(keybuf) + 1, &ldberr);
+    if (ldberr != NULL) {
+        // Worst case, the next start PUTs the file again
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "writeback_record_delete: kvstore_delete on %s: %s", path, ldberr);
+        free(ldberr);
+    }
+}
+
+// Queue path for upload, or push back the upload already queued
+static void writeback_enqueue(filecache_t *cache, const char *path, GError **gerr) {
+    struct writeback_item *item;
+    struct writeback_record record;
+    char keybuf[FILECACHE_KEY_MAX];
+    char *ldberr = NULL;
+
+    if (writeback_key(path, keybuf, sizeof(keybuf)) == NULL) {
+        g_set_error(gerr, filecache_quark(), ENAMETOOLONG, "writeback_enqueue: path too long: %s", path);
+        return;
+    }
+
+    record.queued = time(NULL);
+
+    pthread_mutex_lock(&writeback.mutex);
+    kvstore_put(cache, keybuf, strlen(keybuf) + 1, (const char *) &record, sizeof(struct writeback_record), &ldberr);
+    if (ldberr != NULL || inject_error(filecache_error_wbldb)) {
+        pthread_mutex_unlock(&writeback.mutex);
+        g_set_error(gerr, kvstore_quark(), E_FC_LDBERR, "writeback_enqueue: kvstore_put error %s", ldberr ? ldberr : "inject-error");
+        free(ldberr);
+        return;
+    }
+
+    item = g_hash_table_lookup(writeback.items, path);
+    if (item) {
+        BUMP(filecache_writeback_coalesced);
+    }
+    else {
+        item = calloc(1, sizeof(struct writeback_item));
+        item->path = strdup(path);
+        g_hash_table_replace(writeback.items, item->path, item);
+    }
+    item->due = record.queued + writeback.delay;
+    item->gen = ++writeback.gen;
+    item->attempts = 0;
+    BUMP(filecache_writeback_queued);
+    pthread_cond_signal(&writeback.cond);
+    pthread_mutex_unlock(&writeback.mutex);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "writeback_enqueue: %s due in %lu", path, writeback.delay);
+}
+
+/* PUT path's current cache file, leaving pdata as put_return_etag left it in uploaded.
+ * Returns false, without error, if the path has left the cache since it was queued.
+ */
+static bool writeback_put(const char *path, struct filecache_pdata *uploaded, off_t *size, GError **gerr) {
+    struct filecache_pdata *pdata;
+    struct stat st;
+    GError *tmpgerr = NULL;
+    int fd;
+
+    *size = 0;
+
+    pdata = filecache_pdata_get(writeback.cache, path, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "writeback_put: ");
+        return false;
+    }
+    if (pdata == NULL) {
+        log_print(LOG_INFO, SECTION_FILECACHE_COMM, "writeback_put: %s is no longer cached", path);
+        return false;
+    }
+    *uploaded = *pdata;
+    free(pdata);
+
+    fd = open(uploaded->filename, O_RDONLY);
+    if (fd < 0) {
+        g_set_error(gerr, system_quark(), errno, "writeback_put: open of %s failed", uploaded->filename);
+        return false;
+    }
+    if (fstat(fd, &st) == 0) *size = st.st_size;
+
+    put_return_etag(path, fd, uploaded, &tmpgerr);
+    close(fd);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "writeback_put: ");
+        return false;
+    }
+    return true;
+}
+
+/* Upload item's path and settle the outcome. Call with writeback.mutex held and the item not
+ * uploading; returns with the mutex held, though it drops it for the PUT. On failure, gerr
+ * says why; the item is then either requeued or gone to the forensic haven.
+ */
+static void writeback_run(struct writeback_item *item, bool may_retry, GError **gerr) {
+    char path[PATH_MAX];
+    struct filecache_pdata uploaded;
+    unsigned long gen = item->gen;
+    GError *tmpgerr = NULL;
+    off_t size;
+    bool put;
+    bool haven = false;
+
+    item->uploading = true;
+    strncpy(path, item->path, PATH_MAX - 1);
+    path[PATH_MAX - 1] = '\0';
+    pthread_mutex_unlock(&writeback.mutex);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "writeback_run: PUT %s (attempt %d)", path, item->attempts + 1);
+    put = writeback_put(path, &uploaded, &size, &tmpgerr);
+
+    pthread_mutex_lock(&writeback.mutex);
+    // Only a requeue can change the item while it uploads; removal waits on uploading
+    item->uploading = false;
+    if (!tmpgerr) {
+        if (put) BUMP(filecache_writeback_put);
+        if (item->gen == gen) {
+            struct filecache_pdata *pdata = NULL;
+
+            // Under the mutex, so a requeue can't slip in between and be marked as uploaded
+            if (put) pdata = filecache_pdata_get(writeback.cache, path, NULL);
+            if (pdata && strcmp(pdata->filename, uploaded.filename) == 0) {
+                strncpy(pdata->etag, uploaded.etag, ETAG_MAX + 1);
+                strncpy(pdata->hash, uploaded.hash, FILECACHE_HASH_LEN + 1);
+                strncpy(pdata->hash_etag, uploaded.hash_etag, ETAG_MAX + 1);
+                pdata->last_server_update = time(NULL);
+                filecache_pdata_set(writeback.cache, path, pdata, NULL);
+            }
+            free(pdata);
+            writeback_record_delete(path);
+            g_hash_table_remove(writeback.items, path);
+        }
+        // else, written again while we were uploading; the item stays queued for the new contents
+    }
+    // put_return_etag sets saint mode on network errors and 5xx; a 4xx won't go any better next time
+    else if (tmpgerr->code == E_FC_CURLERR && use_saint_mode() && ++item->attempts < WRITEBACK_MAX_ATTEMPTS) {
+        time_t backoff = writeback.delay << item->attempts;
+        if (backoff <= 0 || backoff > WRITEBACK_MAX_BACKOFF) backoff = WRITEBACK_MAX_BACKOFF;
+        // use_saint_mode still holds at saint_mode_duration seconds
+        if (backoff <= saint_mode_duration) backoff = saint_mode_duration + 1;
+        BUMP(filecache_writeback_retry);
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "writeback_run: PUT of %s failed; retrying in %lu: %s", path, backoff, tmpgerr->message);
+        item->due = time(NULL) + backoff;
+        if (!may_retry) item->parked = true;
+    }
+    else {
+        BUMP(filecache_writeback_fail);
+        log_print(LOG_ERR, SECTION_FILECACHE_COMM, "writeback_run: giving up on %s: %s", path, tmpgerr->message);
+        writeback_record_delete(path);
+        g_hash_table_remove(writeback.items, path);
+        haven = true;
+    }
+    pthread_cond_broadcast(&writeback.done);
+
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "writeback_run: ");
+    }
+
+    if (haven) {
+        GError *subgerr = NULL;
+
+        // As dav_release does on a failed PUT
+        pthread_mutex_unlock(&writeback.mutex);
+        filecache_forensic_haven(writeback.cache_path, writeback.cache, path, size, &subgerr);
+        if (subgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "writeback_run: forensic haven failed on %s: %s", path, subgerr->message);
+            g_clear_error(&subgerr);
+        }
+        filecache_delete(writeback.cache, path, true, &subgerr);
+        if (subgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "writeback_run: filecache_delete failed on %s: %s", path, subgerr->message);
+            g_clear_error(&subgerr);
+        }
+        stat_cache_delete(writeback.cache, path, &subgerr);
+        if (subgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "writeback_run: stat_cache_delete failed on %s: %s", path, subgerr->message);
+            g_clear_error(&subgerr);
+        }
+        pthread_mutex_lock(&writeback.mutex);
+    }
+}
+
+// The item due soonest, or NULL; *next is when the earliest one not yet due comes due
+static struct writeback_item *writeback_pick(time_t now, time_t *next) {
+    struct writeback_item *picked = NULL;
+    GHashTableIter iter;
+    gpointer value;
+
+    *next = 0;
+    g_hash_table_iter_init(&iter, writeback.items);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct writeback_item *item = value;
+        if (item->uploading || item->parked) continue;
+        // When stopping, don't wait out the delay
+        if (item->due <= now || writeback.stop) {
+            if (picked == NULL || item->due < picked->due) picked = item;
         }
-        else if (st.st_size > LG) {
-            TIMING(filecache_put_lg_timing, elapsed_time);
-            BUMP(filecache_put_lg_count);
-            latency = FETCH(filecache_put_lg_timing);
-            count = FETCH(filecache_put_lg_count);
-            sz = "LG";
-            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &lptime,
-                "large-puts", &lpcount, 1,
-                "large-put-latency", &lplatency, elapsed_time);
-         }
-        else if (st.st_size > MED) {
-            TIMING(filecache_put_med_timing, elapsed_time);
-            BUMP(filecache_put_med_count);
-            latency = FETCH(filecache_put_med_timing);
-            count = FETCH(filecache_put_med_count);
-            sz = "MED";
-            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &lptime,
-                "large-puts", &lpcount, 1,
-                "large-put-latency", &lplatency, elapsed_time);
+        else if (*next == 0 || item->due < *next) {
+            *next = item->due;
         }
-        else if (st.st_size > SM) {
-            TIMING(filecache_put_sm_timing, elapsed_time);
-            BUMP(filecache_put_sm_count);
-            latency = FETCH(filecache_put_sm_timing);
-            count = FETCH(filecache_put_sm_count);
-            sz = "SM";
-            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &sptime,
-                "small-puts", &spcount, 1,
-                "small-put-latency", &splatency, elapsed_time);
+    }
+    return picked;
+}
+
+static void *writeback_worker(__unused void *ptr) {
+    pthread_mutex_lock(&writeback.mutex);
+    while (true) {
+        struct writeback_item *item;
+        time_t next;
+
+        item = writeback_pick(time(NULL), &next);
+        if (item) {
+            GError *tmpgerr = NULL;
+            writeback_run(item, !writeback.stop, &tmpgerr);
+            // writeback_run has logged it
+            g_clear_error(&tmpgerr);
+            continue;
         }
-        else if (st.st_size > XSM) {
-            TIMING(filecache_put_xsm_timing, elapsed_time);
-            BUMP(filecache_put_xsm_count);
-            latency = FETCH(filecache_put_xsm_timing);
-            count = FETCH(filecache_put_xsm_count);
-            sz = "XSM";
-            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &sptime,
-                "small-puts", &spcount, 1,
-                "small-put-latency", &splatency, elapsed_time);
+        if (writeback.stop) break;
+        if (next == 0) {
+            pthread_cond_wait(&writeback.cond, &writeback.mutex);
         }
         else {
-            TIMING(filecache_put_xxsm_timing, elapsed_time);
-            BUMP(filecache_put_xxsm_count);
-            latency = FETCH(filecache_put_xxsm_timing);
-            count = FETCH(filecache_put_xxsm_count);
-            sz = "XXSM";
-            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", &sptime,
-                "small-puts", &spcount, 1,
-                "small-put-latency", &splatency, elapsed_time);
+            struct timespec deadline = { .tv_sec = next, .tv_nsec = 0 };
+            pthread_cond_timedwait(&writeback.cond, &writeback.mutex, &deadline);
         }
-        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "put_return_etag: PUT on size %s (%lu) for %s -- Current:Average latency %lu :: %lu",
-            sz, st.st_size, path, elapsed_time, (latency / count));
+    }
+    pthread_mutex_unlock(&writeback.mutex);
+    return NULL;
+}
 
-        /* The aggregate_log_print_server routine is expecting a cumulative count and latency, but by
-         * passing NULL for time, we ensure that aggregate prints this message and resets to 0, so
-         * there's no need to keep a static variable for count and latency.
-         */
-        if (st.st_size >= LG && elapsed_time > large_time_allotment) {
-            unsigned long exceeded_count = 0;
-            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "put_return_etag: large (%lu) PUT for %s exceeded time allotment %lu with %lu",
-                st.st_size, path, large_time_allotment, elapsed_time);
-            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", NULL, "exceeded-time-large-PUT-count",
-                &exceeded_count, 1, "exceeded-time-large-PUT-latency", &elapsed_time, 0);
+/* Start nthreads upload workers, PUTting closed files delay seconds after their last close,
+ * and requeue the records left by the previous run. With no threads, closes PUT synchronously
+ * as before, but a worker still starts if there are records to finish. Call once, after the
+ * cache is open and before the cleanup thread and the FUSE loop.
+ */
+void filecache_writeback_init(filecache_t *cache, const char *cache_path, int nthreads, time_t delay) {
+    kvstore_iter_t *iter;
+    size_t prefix_len = strlen(writeback_prefix);
+    unsigned requeued = 0;
+
+    writeback.cache = cache;
+    writeback.cache_path = strdup(cache_path);
+    writeback.delay = delay > 0 ? delay : 0;
+    writeback.items = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, writeback_item_free);
+
+    iter = kvstore_iter_create(cache, NULL, false);
+    if (iter == NULL) {
+        // Their records stay in the store for the next start
+        log_print(LOG_ERR, SECTION_FILECACHE_COMM, "filecache_writeback_init: kvstore_iter_create failed; not requeueing the files left queued");
+    }
+    else {
+        for (kvstore_iter_seek(iter, writeback_prefix, prefix_len); kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
+            struct writeback_item *item;
+            size_t klen;
+            const char *iterkey = kvstore_iter_key(iter, &klen);
+
+            if (strncmp(iterkey, writeback_prefix, prefix_len) != 0) break;
+
+            item = calloc(1, sizeof(struct writeback_item));
+            item->path = strdup(iterkey + prefix_len);
+            item->gen = ++writeback.gen;
+            g_hash_table_replace(writeback.items, item->path, item);
+            ++requeued;
         }
-        else if (st.st_size < LG && elapsed_time > small_time_allotment) {
-            unsigned long exceeded_count = 0;
-            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "put_return_etag: small (%lu) PUT for %s exceeded time allotment %lu with %lu",
-                st.st_size, path, small_time_allotment, elapsed_time);
-            aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "put_return_etag", NULL, "exceeded-time-small-PUT-count",
-                &exceeded_count, 1, "exceeded-time-small-PUT-latency", &elapsed_time, 0);
+        kvstore_iter_destroy(iter);
+    }
+
+    if (nthreads <= 0 && requeued > 0) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_writeback_init: write-back is off, but finishing %u queued files", requeued);
+        nthreads = 1;
+    }
+    if (nthreads <= 0) return;
+
+    writeback.threads = calloc(nthreads, sizeof(pthread_t));
+    for (int idx = 0; idx < nthreads; idx++) {
+        if (pthread_create(&writeback.threads[idx], NULL, writeback_worker, NULL)) {
+            log_print(LOG_ERR, SECTION_FILECACHE_COMM, "filecache_writeback_init: pthread_create failed; running %d workers", idx);
+            break;
         }
+        ++writeback.nthreads;
     }
+    log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_writeback_init: %d workers; delay %lu; requeued %u",
+        writeback.nthreads, writeback.delay, requeued);
+}
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "PUT returns etag: %s", etag);
+// Upload whatever is queued, then stop the workers. What fails now stays on disk for the next start.
+void filecache_writeback_stop(void) {
+    if (writeback.nthreads == 0) return;
 
-finish:
+    pthread_mutex_lock(&writeback.mutex);
+    log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_writeback_stop: %u files queued", g_hash_table_size(writeback.items));
+    writeback.stop = true;
+    pthread_cond_broadcast(&writeback.cond);
+    pthread_mutex_unlock(&writeback.mutex);
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "put_return_etag: releasing exclusive file lock on fd %d", fd);
-    if (flock(fd, LOCK_UN) || inject_error(filecache_error_etagflock2)) {
-        g_set_error(gerr, system_quark(), errno, "put_return_etag: error releasing exclusive file lock");
+    for (int idx = 0; idx < writeback.nthreads; idx++) {
+        pthread_join(writeback.threads[idx], NULL);
     }
-    else {
-        log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "put_return_etag: released exclusive file lock on fd %d", fd);
+    writeback.nthreads = 0;
+    free(writeback.threads);
+}
+
+// Wait out any upload of path under way. Call with writeback.mutex held.
+static struct writeback_item *writeback_settle(const char *path) {
+    struct writeback_item *item;
+
+    while ((item = g_hash_table_lookup(writeback.items, path)) && item->uploading) {
+        pthread_cond_wait(&writeback.done, &writeback.mutex);
     }
+    return item;
+}
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "exit: put_return_etag");
+// The path is going away; don't PUT it
+void filecache_writeback_cancel(const char *path) {
+    struct writeback_item *item;
 
-    return;
+    if (writeback.items == NULL) return;
+
+    pthread_mutex_lock(&writeback.mutex);
+    item = writeback_settle(path);
+    if (item) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_writeback_cancel: dropping %s", path);
+        writeback_record_delete(path);
+        g_hash_table_remove(writeback.items, path);
+    }
+    pthread_mutex_unlock(&writeback.mutex);
+}
+
+/* PUT path now if it is queued, along with, for a directory, anything queued beneath it.
+ * The server must have them before an operation on the path, such as a MOVE, goes to it.
+ */
+void filecache_writeback_flush(const char *path, GError **gerr) {
+    GQueue *paths;
+    GHashTableIter iter;
+    gpointer key;
+    char *queued_path;
+    size_t len = strlen(path);
+
+    if (writeback.items == NULL) return;
+
+    paths = g_queue_new();
+    pthread_mutex_lock(&writeback.mutex);
+    g_hash_table_iter_init(&iter, writeback.items);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        const char *queued = key;
+        if (strncmp(queued, path, len) == 0 && (path[len - 1] == '/' || queued[len] == '\0' || queued[len] == '/')) {
+            g_queue_push_tail(paths, strdup(queued));
+        }
+    }
+
+    while ((queued_path = g_queue_pop_head(paths))) {
+        struct writeback_item *item = writeback_settle(queued_path);
+        GError *tmpgerr = NULL;
+
+        free(queued_path);
+        // Gone up while we waited, or an earlier one failed
+        if (item == NULL || (gerr && *gerr)) continue;
+
+        BUMP(filecache_writeback_sync);
+        writeback_run(item, true, &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_writeback_flush: ");
+        }
+    }
+    pthread_mutex_unlock(&writeback.mutex);
+    g_queue_free(paths);
 }
 
 // top-level sync call
-bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info *info, bool do_put, GError **gerr) {
+bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info *info, enum filecache_sync_mode mode, GError **gerr) {
     struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
     struct filecache_pdata *pdata = NULL;
     GError *tmpgerr = NULL;
     bool wrote_data = false;
+    bool do_put = (mode != FILECACHE_SYNC_LOCAL);
+    // Without workers, queueing means PUTting now, as it always did
+    bool defer = (mode == FILECACHE_SYNC_QUEUE && writeback.nthreads > 0);
 
     BUMP(filecache_sync);
 
@@ -1275,8 +3537,33 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync(%s, fd=%d): cachefile=%s", path, sdata->fd, pdata->filename);
 
+    // An earlier close may have left this handle's writes queued; fsync has to see them up
+    if (!sdata->modified && mode == FILECACHE_SYNC_PUT) {
+        filecache_writeback_flush(path, &tmpgerr);
+        if (tmpgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_sync: write-back flush failed on %s", path);
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_sync: ");
+            goto finish;
+        }
+    }
+
     if (sdata->modified) {
-        if (do_put) {
+        if (defer) {
+            writeback_enqueue(cache, path, &tmpgerr);
+            if (tmpgerr) {
+                set_error(sdata, tmpgerr->code);
+                log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_sync: writeback_enqueue failed on %s", path);
+                g_propagate_prefixed_error(gerr, tmpgerr, "filecache_sync: ");
+                goto finish;
+            }
+
+            // Queued, so no longer this handle's to PUT; but until the PUT, the local copy
+            // trumps the server one, and there is no etag to send
+            sdata->modified = false;
+            strncpy(pdata->etag, "", 1);
+            pdata->last_server_update = 0;
+        }
+        else if (do_put) {
             log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync: Seeking fd=%d", sdata->fd);
             // If this lseek fails, file eventually goes to forensic haven.
             if ((lseek(sdata->fd, 0, SEEK_SET) == (off_t)-1) || inject_error(filecache_error_synclseek)) {
@@ -1288,7 +3575,7 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
 
             log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "About to PUT file (%s, fd=%d).", path, sdata->fd);
 
-            put_return_etag(path, sdata->fd, pdata->etag, &tmpgerr);
+            put_return_etag(path, sdata->fd, pdata, &tmpgerr);
 
             // if we fail PUT for any reason, file will eventually go to forensic haven.
             // We err in put_return_etag on:
@@ -1322,6 +3609,9 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
             // If the PUT succeeded, the file isn't locally modified.
             sdata->modified = false;
             pdata->last_server_update = time(NULL);
+
+            // This PUT carried anything an earlier close queued
+            filecache_writeback_cancel(path);
         }
         else {
             // If we don't PUT the file, we don't have an etag, so zero it out
@@ -1358,6 +3648,7 @@ finish:
 // top-level truncate call
 void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr) {
     struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    int ret = 0;
 
     BUMP(filecache_truncate);
 
@@ -1369,8 +3660,8 @@ void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr) {
     log_print(LOG_DYNAMIC, SECTION_FILECACHE_FILE, "filecache_truncate(%d)", sdata->fd);
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_truncate: acquiring shared file lock on fd %d", sdata->fd);
-    if (flock(sdata->fd, LOCK_SH) || inject_error(filecache_error_truncflock1)) {
-        g_set_error(gerr, system_quark(), errno, "filecache_truncate: error acquiring shared file lock");
+    if (inject_error(filecache_error_truncflock1) || (ret = pthread_rwlock_rdlock(&sdata->lock->rwlock))) {
+        g_set_error(gerr, system_quark(), ret, "filecache_truncate: error acquiring shared file lock");
         return;
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_truncate: acquired shared file lock on fd %d", sdata->fd);
@@ -1381,17 +3672,17 @@ void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr) {
     }
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_truncate: releasing shared file lock on fd %d", sdata->fd);
-    if (flock(sdata->fd, LOCK_UN) || inject_error(filecache_error_truncflock2)) {
+    if ((ret = pthread_rwlock_unlock(&sdata->lock->rwlock)) || inject_error(filecache_error_truncflock2)) {
         if (!gerr) {
-            g_set_error(gerr, system_quark(), errno, "filecache_truncate: error releasing shared file lock");
+            g_set_error(gerr, system_quark(), ret, "filecache_truncate: error releasing shared file lock");
         }
         else {
-            log_print(LOG_WARNING, SECTION_FILECACHE_FILE, "filecache_truncate: error releasing shared file lock :: %s", g_strerror(errno));
+            log_print(LOG_WARNING, SECTION_FILECACHE_FILE, "filecache_truncate: error releasing shared file lock :: %s", g_strerror(ret));
         }
         return;
     }
 
-    // If we got an error on ftruncate, we fell through to flock. If we didn't get an error there, we need
+    // If we got an error on ftruncate, we fell through to the unlock. If we didn't get an error there, we need
     // to return before setting sdata modified.
     if (gerr) return;
 
@@ -1419,10 +3710,47 @@ void filecache_set_error(struct fuse_file_info *info, int error_code) {
 }
 
 // deletes entry from ldb cache
-void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefile, GError **gerr) {
+static void filecache_mark_dirty(const char *path, const char *cachefile) {
+    pthread_mutex_lock(&dirty_mutex);
+    if (!dirty_overflow) {
+        if (dirty_paths == NULL) {
+            dirty_paths = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+        }
+        if (g_hash_table_size(dirty_paths) >= FILECACHE_DIRTY_MAX) {
+            log_print(LOG_INFO, SECTION_FILECACHE_CLEAN, "filecache_mark_dirty: dirty set full; next cleanup is a full sweep");
+            g_hash_table_remove_all(dirty_paths);
+            dirty_overflow = true;
+        }
+        else {
+            g_hash_table_replace(dirty_paths, strdup(path), cachefile ? strdup(cachefile) : NULL);
+        }
+    }
+    pthread_mutex_unlock(&dirty_mutex);
+}
+
+// Hands the current dirty set to the caller, who destroys it; NULL if nothing is dirty
+static GHashTable *filecache_take_dirty(bool *overflow) {
+    GHashTable *taken;
+
+    pthread_mutex_lock(&dirty_mutex);
+    taken = dirty_paths;
+    dirty_paths = NULL;
+    *overflow = dirty_overflow;
+    dirty_overflow = false;
+    pthread_mutex_unlock(&dirty_mutex);
+
+    if (taken != NULL && g_hash_table_size(taken) == 0) {
+        g_hash_table_destroy(taken);
+        taken = NULL;
+    }
+    return taken;
+}
+
+// mark_dirty is false when cleanup itself deletes
+static void filecache_delete_entry(filecache_t *cache, const char *path, bool unlink_cachefile, bool mark_dirty, GError **gerr) {
     struct filecache_pdata *pdata;
-    leveldb_writeoptions_t *options;
     GError *tmpgerr = NULL;
+    char keybuf[FILECACHE_KEY_MAX];
     char *key;
     char *ldberr = NULL;
 
@@ -1438,12 +3766,13 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
 
     if (!pdata) return;
 
-    key = path2key(path);
+    filecache_writeback_cancel(path);
+    quota_forget(path);
+
+    // pdata_get already succeeded on this path, so its key fits
+    key = path2key(path, keybuf, sizeof(keybuf));
 
-    options = leveldb_writeoptions_create();
-    leveldb_delete(cache, options, key, strlen(key) + 1, &ldberr);
-    leveldb_writeoptions_destroy(options);
-    free(key);
+    kvstore_delete(cache, key, strlen(key) + 1, &ldberr);
 
     if (unlink_cachefile && pdata) {
         log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "filecache_delete: unlinking %s", pdata->filename);
@@ -1452,8 +3781,12 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
         }
     }
 
+    if (mark_dirty) {
+        filecache_mark_dirty(path, unlink_cachefile ? pdata->filename : NULL);
+    }
+
     if (ldberr != NULL || inject_error(filecache_error_deleteldb)) {
-        g_set_error(gerr, leveldb_quark(), E_FC_LDBERR, "filecache_delete: leveldb_delete: %s", ldberr ? ldberr : "error-inject");
+        g_set_error(gerr, kvstore_quark(), E_FC_LDBERR, "filecache_delete: kvstore_delete: %s", ldberr ? ldberr : "error-inject");
         free(ldberr);
     }
 
@@ -1462,6 +3795,10 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
     return;
 }
 
+void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefile, GError **gerr) {
+    filecache_delete_entry(cache, path, unlink_cachefile, true, gerr);
+}
+
 void filecache_forensic_haven(const char *cache_path, filecache_t *cache, const char *path, off_t fsize, GError **gerr) {
     struct filecache_pdata *pdata = NULL;
     char *bpath = NULL;
@@ -1503,8 +3840,8 @@ void filecache_forensic_haven(const char *cache_path, filecache_t *cache, const
         // If rename fails, put this in the .txt file
         failed_rename = true;
     }
-    free(bpath);
-    // do not pass bname to free; basename() does not return a free'able address
+    // do not pass bname to free; basename() does not return a free'able address.
+    // It points into bpath, which we free at the end, since we need bname again below.
     free(newpath);
     newpath = NULL; // reusing below
 
@@ -1534,6 +3871,7 @@ void filecache_forensic_haven(const char *cache_path, filecache_t *cache, const
 finish:
     if (fd >= 0) close(fd);
     free(buf);
+    free(bpath);
     free(newpath);
     free(pdata);
     log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "filecache_forensic_haven: exiting for %s", path);
@@ -1564,6 +3902,8 @@ void filecache_pdata_move(filecache_t *cache, const char *old_path, const char *
         goto finish;
     }
 
+    quota_move(old_path, new_path);
+
     // We don't want to unlink the cachefile for 'old' since we use it for 'new'
     filecache_delete(cache, old_path, false, &tmpgerr);
     if (tmpgerr) {
@@ -1594,6 +3934,152 @@ static const char *key2path(const char *key) {
     return NULL;
 }
 
+// One entry of pdata_subtree's walk, at the iterator
+static void pdata_subtree_entry(kvstore_batch_t *wb, kvstore_iter_t *iter, const char *path, const char *new_path, GError **gerr) {
+    char keybuf[FILECACHE_KEY_MAX];
+    char newpath[PATH_MAX];
+    const char *iterkey;
+    const char *iterpath;
+    const char *value;
+    size_t klen;
+    size_t vlen;
+
+    iterkey = kvstore_iter_key(iter, &klen);
+    iterpath = key2path(iterkey);
+    value = kvstore_iter_value(iter, &vlen);
+    if (new_path) {
+        int len = snprintf(newpath, sizeof(newpath), "%s%s", new_path, iterpath + strlen(path));
+        if (len < 0 || (size_t)len >= sizeof(newpath) || path2key(newpath, keybuf, sizeof(keybuf)) == NULL) {
+            g_set_error(gerr, filecache_quark(), ENAMETOOLONG, "pdata_subtree_entry: path too long: %s%s", new_path, iterpath + strlen(path));
+            return;
+        }
+        log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "pdata_subtree_entry: %s to %s", iterpath, newpath);
+        kvstore_batch_put(wb, keybuf, strlen(keybuf) + 1, value, vlen);
+        quota_move(iterpath, newpath);
+    }
+    else {
+        const struct filecache_pdata *pdata = (const struct filecache_pdata *) value;
+
+        log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "pdata_subtree_entry: deleting %s", iterpath);
+        filecache_writeback_cancel(iterpath);
+        quota_forget(iterpath);
+        // Cleanup unlinks the cache file once the entry is gone
+        filecache_mark_dirty(iterpath, vlen == sizeof(struct filecache_pdata) ? pdata->filename : NULL);
+    }
+    kvstore_batch_delete(wb, iterkey, klen);
+}
+
+/* Moves the entries at and below path to the same place under new_path, or with new_path
+ * NULL deletes them, in wb. The keys of a subtree are one range, so it's a single scan.
+ */
+static void pdata_subtree(filecache_t *cache, kvstore_batch_t *wb, const char *path, const char *new_path, GError **gerr) {
+    kvstore_iter_t *iter;
+    char prefix[FILECACHE_KEY_MAX];
+    size_t prefix_len;
+    size_t klen;
+    const char *iterkey;
+    GError *tmpgerr = NULL;
+
+    if (strcmp(path, "/") == 0) {
+        g_set_error(gerr, filecache_quark(), EINVAL, "pdata_subtree: not on the root");
+        return;
+    }
+    if (path2key(path, prefix, sizeof(prefix) - 1) == NULL) {
+        g_set_error(gerr, filecache_quark(), ENAMETOOLONG, "pdata_subtree: path too long: %s", path);
+        return;
+    }
+    prefix_len = strlen(prefix);
+
+    iter = kvstore_iter_create(cache, NULL, false);
+    if (iter == NULL) {
+        g_set_error(gerr, filecache_quark(), E_FC_LDBERR, "pdata_subtree: kvstore_iter_create failed");
+        return;
+    }
+
+    // A directory has no entry of its own, but a file does
+    kvstore_iter_seek(iter, prefix, prefix_len + 1);
+    if (kvstore_iter_valid(iter)) {
+        iterkey = kvstore_iter_key(iter, &klen);
+        if (klen == prefix_len + 1 && memcmp(iterkey, prefix, klen) == 0) {
+            pdata_subtree_entry(wb, iter, path, new_path, &tmpgerr);
+            if (tmpgerr) goto finish;
+        }
+    }
+
+    prefix[prefix_len++] = '/';
+    prefix[prefix_len] = '\0';
+    for (kvstore_iter_seek(iter, prefix, prefix_len); kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
+        iterkey = kvstore_iter_key(iter, &klen);
+        if (strncmp(iterkey, prefix, prefix_len) != 0) break;
+        pdata_subtree_entry(wb, iter, path, new_path, &tmpgerr);
+        if (tmpgerr) goto finish;
+    }
+
+finish:
+    kvstore_iter_destroy(iter);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "pdata_subtree: ");
+    }
+}
+
+/* A directory rename's side of the file cache, in wb, the stat cache's batch: whatever was at
+ * new_path goes, and old_path's entries take its place, keeping their cache files.
+ */
+void filecache_move_subtree(filecache_t *cache, kvstore_batch_t *wb, const char *old_path, const char *new_path, GError **gerr) {
+    GError *tmpgerr = NULL;
+
+    BUMP(filecache_subtree);
+
+    pdata_subtree(cache, wb, new_path, NULL, &tmpgerr);
+    if (!tmpgerr) pdata_subtree(cache, wb, old_path, new_path, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "filecache_move_subtree: ");
+    }
+}
+
+/* As filecache_delete, but the entry's delete goes in wb, to be written with the stat cache's
+ * changes. Cleanup unlinks the cache file once the entry is gone, as for a subtree.
+ */
+void filecache_batch_delete(filecache_t *cache, kvstore_batch_t *wb, const char *path, GError **gerr) {
+    struct filecache_pdata *pdata;
+    GError *tmpgerr = NULL;
+    char keybuf[FILECACHE_KEY_MAX];
+    char *key;
+
+    BUMP(filecache_delete);
+
+    log_print(LOG_DYNAMIC, SECTION_FILECACHE_CACHE, "filecache_batch_delete: path (%s).", path);
+
+    pdata = filecache_pdata_get(cache, path, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "filecache_batch_delete: ");
+        return;
+    }
+
+    if (!pdata) return;
+
+    filecache_writeback_cancel(path);
+    quota_forget(path);
+
+    // pdata_get already succeeded on this path, so its key fits
+    key = path2key(path, keybuf, sizeof(keybuf));
+    kvstore_batch_delete(wb, key, strlen(key) + 1);
+    filecache_mark_dirty(path, pdata->filename);
+
+    free(pdata);
+}
+
+void filecache_delete_subtree(filecache_t *cache, kvstore_batch_t *wb, const char *path, GError **gerr) {
+    GError *tmpgerr = NULL;
+
+    BUMP(filecache_subtree);
+
+    pdata_subtree(cache, wb, path, NULL, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "filecache_delete_subtree: ");
+    }
+}
+
 static int cleanup_orphans(const char *cache_path, time_t stamped_time, GError **gerr) {
     struct dirent *diriter;
     DIR *dir;
@@ -1662,10 +4148,81 @@ static int cleanup_orphans(const char *cache_path, time_t stamped_time, GError *
     return ret;
 }
 
-void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, GError **gerr) {
-    leveldb_iterator_t *iter = NULL;
-    leveldb_readoptions_t *options;
+/* Recheck only the paths filecache_delete touched since the last cleanup: finish unlinks that
+ * failed, and drop entries which have since lost their cache file or aged out. Touching live
+ * files and hunting for orphans needs a full sweep.
+ */
+static void filecache_cleanup_dirty(filecache_t *cache, GHashTable *dirty) {
+    GHashTableIter hiter;
+    gpointer key;
+    gpointer value;
+    time_t starttime;
+    // Statistics
+    int dirty_count = 0;
+    int unlinked_files = 0;
+    int pruned_files = 0;
+    int issues = 0;
+
+    starttime = time(NULL);
+
+    g_hash_table_iter_init(&hiter, dirty);
+    while (g_hash_table_iter_next(&hiter, &key, &value)) {
+        const char *path = key;
+        const char *cachefile = value;
+        struct filecache_pdata *pdata;
+        GError *tmpgerr = NULL;
+
+        ++dirty_count;
+        pdata = filecache_pdata_get(cache, path, &tmpgerr);
+        if (tmpgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_cleanup_dirty: %s: %s", path, tmpgerr->message);
+            g_clear_error(&tmpgerr);
+            ++issues;
+            continue;
+        }
+
+        // The cache file filecache_delete meant to unlink, unless the path has since taken it back
+        if (cachefile && (pdata == NULL || strcmp(pdata->filename, cachefile) != 0) && access(cachefile, F_OK) == 0) {
+            log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "filecache_cleanup_dirty: Unlinking leftover %s", cachefile);
+            if (unlink(cachefile)) {
+                log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_cleanup_dirty: failed to unlink %s: %d %s", cachefile, errno, strerror(errno));
+                ++issues;
+            }
+            else {
+                ++unlinked_files;
+            }
+        }
+
+        if (pdata) {
+            if (access(pdata->filename, F_OK)) {
+                filecache_delete_entry(cache, path, true, false, &tmpgerr);
+                ++pruned_files;
+            }
+            else if ((pdata->last_server_update != 0) && (starttime - pdata->last_server_update > AGE_OUT_THRESHOLD)) {
+                filecache_delete_entry(cache, path, true, false, &tmpgerr);
+                ++unlinked_files;
+            }
+            if (tmpgerr) {
+                log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_cleanup_dirty: %s: %s", path, tmpgerr->message);
+                g_clear_error(&tmpgerr);
+                ++issues;
+            }
+            free(pdata);
+        }
+    }
+
+    log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_cleanup_dirty: visited %d dirty paths; unlinked %d, pruned %d, had %d issues",
+        dirty_count, unlinked_files, pruned_files, issues);
+}
+
+/* On the first call after startup, with full, or if the dirty set overflowed, visit every
+ * entry and every cache file. Otherwise only recheck what changed since the last call.
+ */
+void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, bool full, GError **gerr) {
+    kvstore_iter_t *iter = NULL;
     GError *tmpgerr = NULL;
+    GHashTable *dirty;
+    bool overflow;
 
     size_t klen;
     char fname[PATH_MAX];
@@ -1681,24 +4238,38 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "enter: filecache_cleanup(cache %p)", cache);
 
-    options = leveldb_readoptions_create();
-    leveldb_readoptions_set_fill_cache(options, false);
-    iter = leveldb_create_iterator(cache, options);
+    // A full sweep covers everything dirtied before it starts
+    dirty = filecache_take_dirty(&overflow);
+    if (!(first || full || overflow)) {
+        if (dirty) {
+            BUMP(filecache_cleanup_incr);
+            filecache_cleanup_dirty(cache, dirty);
+            g_hash_table_destroy(dirty);
+        }
+        return;
+    }
+    if (dirty) g_hash_table_destroy(dirty);
+
+    iter = kvstore_iter_create(cache, NULL, false);
+    if (iter == NULL) {
+        g_set_error(gerr, filecache_quark(), E_FC_LDBERR, "filecache_cleanup: kvstore_iter_create failed");
+        return;
+    }
 
-    leveldb_iter_seek(iter, filecache_prefix, strlen(filecache_prefix));
+    kvstore_iter_seek(iter, filecache_prefix, strlen(filecache_prefix));
 
     starttime = time(NULL);
 
-    while (leveldb_iter_valid(iter)) {
+    while (kvstore_iter_valid(iter)) {
         const struct filecache_pdata *pdata;
         const char *iterkey;
         const char *path;
         // We need the key to get the path in case we need to remove the entry from the filecache
-        iterkey = leveldb_iter_key(iter, &klen);
+        iterkey = kvstore_iter_key(iter, &klen);
         path = key2path(iterkey);
         // if path is null, we've gone past the filecache entries
         if (path == NULL) break;
-        pdata = (const struct filecache_pdata *)leveldb_iter_value(iter, &klen);
+        pdata = (const struct filecache_pdata *)kvstore_iter_value(iter, &klen);
         log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "filecache_cleanup: Visiting %s :: %s", path, pdata ? pdata->filename : "no pdata");
         if (pdata) {
             ++cached_files;
@@ -1709,7 +4280,7 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
             // If the cache file doesn't exist, delete the entry from the level_db cache
             ret = access(fname, F_OK);
             if (ret) {
-                filecache_delete(cache, path, true, &tmpgerr);
+                filecache_delete_entry(cache, path, true, false, &tmpgerr);
                 if (tmpgerr) {
                     g_propagate_prefixed_error(gerr, tmpgerr, "filecache_cleanup on failed call to access: ");
                     ++issues;
@@ -1719,10 +4290,11 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
                     ++pruned_files;
                 }
             }
-            else if ((first && pdata->last_server_update == 0) ||
+            // A file in use when we went down is stale, unless it was waiting for write-back
+            else if ((first && pdata->last_server_update == 0 && !writeback_pending(cache, path)) ||
                      ((pdata->last_server_update != 0) && (starttime - pdata->last_server_update > AGE_OUT_THRESHOLD))) {
                 log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "filecache_cleanup: Unlinking %s", fname);
-                filecache_delete(cache, path, true, &tmpgerr);
+                filecache_delete_entry(cache, path, true, false, &tmpgerr);
                 if (tmpgerr) {
                     g_propagate_prefixed_error(gerr, tmpgerr, "filecache_cleanup on aged out: ");
                     ++issues;
@@ -1735,21 +4307,26 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
                 }
             }
             else {
+                struct stat st;
+
                 // put a timestamp on the file
                 ret = utime(fname, NULL);
                 if (ret) {
                     log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_cleanup: failed to update timestamp on \"%s\" for \"%s\" from ldb cache: %d - %s", fname, path, errno, strerror(errno));
                 }
+                // Files from before startup join the quota's index as least recently used
+                else if (stat(fname, &st) == 0) {
+                    quota_account(path, st.st_size, false);
+                }
             }
         }
         else {
             log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_cleanup: pulled NULL pdata out of cache for %s", path);
         }
-        leveldb_iter_next(iter);
+        kvstore_iter_next(iter);
     }
 
-    leveldb_iter_destroy(iter);
-    leveldb_readoptions_destroy(options);
+    kvstore_iter_destroy(iter);
 
     // check filestamps on each file in directory. Set back a second to avoid unlikely but
     // possible race where we are updating a file inside the window where we are starting the cache cleanup
@@ -1758,6 +4335,9 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
         g_propagate_prefixed_error(gerr, tmpgerr, "filecache_cleanup: ");
     }
 
+    // After the orphans, whose links may have been all that kept an object
+    dedup_collect(cache_path);
+
 finish:
     log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_cleanup: visited %d cache entries; unlinked %d, pruned %d, had %d issues; cleanup_orphans had %d issues",
         cached_files, unlinked_files, pruned_files, issues, ret);
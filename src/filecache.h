@@ -19,14 +19,14 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 ***/
 
-#include <leveldb/c.h>
 #include <glib.h>
 #include <curl/curl.h>
 #include "fuse.h"
+#include "kvstore.h"
 
 /* Ultimately, it will be a dav_* function returning the value, so set it up for appropriate
  * values here, i.e. errno-like values. If curl errors occur, they are network errors
- * so report them as ENETDOWN. For leveldb, EIO is not a perfect fit,
+ * so report them as ENETDOWN. For the store, EIO is not a perfect fit,
  * but since it might get propagated to all kinds of dav_* function, EIO seems the closest
  * match. The closest approximation to PDATANULL is ENOENT; it means whenever we're trying
  * to do an operation, we don't have the file in the cache, so we can't update, etc.
@@ -38,22 +38,48 @@
 #define E_FC_CURLERR ENETDOWN
 #define E_FC_FILETOOLARGE EFBIG
 
-typedef leveldb_t filecache_t;
+typedef kvstore_t filecache_t;
+
+// What filecache_sync does with a modified file
+enum filecache_sync_mode {
+    FILECACHE_SYNC_LOCAL, // point the file cache at the new contents, without a PUT
+    FILECACHE_SYNC_PUT, // PUT now, along with anything left queued for write-back
+    FILECACHE_SYNC_QUEUE, // hand to the write-back workers if there are any, else PUT now
+};
 
 void filecache_print_stats(void);
 void filecache_init(char *cache_path, GError **gerr);
 void filecache_delete(filecache_t *cache, const char *path, bool unlink, GError **gerr);
 void filecache_open(char *cache_path, filecache_t *cache, const char *path, struct fuse_file_info *info, bool grace, GError **gerr);
 ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_t offset, GError **gerr);
-ssize_t filecache_write(struct fuse_file_info *info, const char *buf, size_t size, off_t offset, GError **gerr);
+void filecache_read_buf(struct fuse_file_info *info, struct fuse_bufvec **bufp, size_t size, off_t offset, GError **gerr);
+ssize_t filecache_write_buf(struct fuse_file_info *info, struct fuse_bufvec *buf, off_t offset, GError **gerr);
 void filecache_close(struct fuse_file_info *info, GError **gerr);
-bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info *info, bool do_put, GError **gerr);
+bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info *info, enum filecache_sync_mode mode, GError **gerr);
 void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr);
 int filecache_fd(struct fuse_file_info *info);
 void filecache_set_error(struct fuse_file_info *info, int error_code);
 void filecache_forensic_haven(const char *cache_path, filecache_t *cache, const char *path, off_t fsize, GError **gerr);
 void filecache_pdata_move(filecache_t *cache, const char *old_path, const char *new_path, GError **gerr);
-void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, GError **gerr);
+// These add to wb, for the caller to write with the stat cache's changes
+void filecache_move_subtree(filecache_t *cache, kvstore_batch_t *wb, const char *old_path, const char *new_path, GError **gerr);
+void filecache_delete_subtree(filecache_t *cache, kvstore_batch_t *wb, const char *path, GError **gerr);
+void filecache_batch_delete(filecache_t *cache, kvstore_batch_t *wb, const char *path, GError **gerr);
+void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, bool full, GError **gerr);
+void filecache_prefetch_init(filecache_t *cache, const char *cache_path, int nthreads, off_t max_size, time_t revalidate_window);
+void filecache_prefetch_stop(void);
+void filecache_prefetch_directory(filecache_t *cache, const char *path);
+void filecache_prefetch_touch(const char *path);
+void filecache_ranged_get_init(off_t min_size);
+void filecache_ranged_get_stop(void);
+void filecache_kernel_cache_init(bool enable);
+void filecache_dedup_init(bool enable);
+void filecache_quota_init(filecache_t *cache, off_t max_bytes);
+void filecache_quota_stop(void);
+void filecache_writeback_init(filecache_t *cache, const char *cache_path, int nthreads, time_t delay);
+void filecache_writeback_stop(void);
+void filecache_writeback_flush(const char *path, GError **gerr);
+void filecache_writeback_cancel(const char *path);
 struct curl_slist* enhanced_logging(struct curl_slist *slist, int log_level, int section, const char *format, ...);
 
 #endif
@@ -50,6 +50,9 @@ struct fuse* fuse = NULL;
 // Run cache cleanup once a day.
 #define CACHE_CLEANUP_INTERVAL 86400
 
+// How long a thread waits on another thread's PROPFIND of the same directory before doing its own
+#define PROPFIND_COALESCE_TIMEOUT 30 // seconds
+
 struct fill_info {
     void *buf;
     fuse_fill_dir_t filler;
@@ -179,10 +182,12 @@ static void fill_stat_generic(struct stat *st, mode_t mode, bool is_dir, int fd,
     log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "Done with fill_stat_generic: fd = %d : size = %d", fd, st->st_size);
 }
 
-static void getdir_propfind_callback(__unused void *userdata, const char *path, struct stat st,
+// userdata is update_directory's stat_cache_batch; stat cache changes land there until it commits
+static void getdir_propfind_callback(void *userdata, const char *path, struct stat st,
     unsigned long status_code, GError **gerr) {
 
     struct fusedav_config *config = fuse_get_context()->private_data;
+    struct stat_cache_batch *batch = userdata;
     struct stat_cache_value value;
     GError *subgerr1 = NULL ;
     GError *subgerr2 = NULL ;
@@ -246,7 +251,7 @@ static void getdir_propfind_callback(__unused void *userdata, const char *path,
                 curl_easy_setopt(session, CURLOPT_NOBODY, 1);
 
                 log_print(LOG_DYNAMIC, SECTION_FUSEDAV_PROP, "getdir_propfind_callback: saw 410; calling HEAD on %s", path);
-                res = curl_easy_perform(session);
+                res = session_perform(session);
                 if(res == CURLE_OK) {
                     curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
                 }
@@ -284,8 +289,9 @@ static void getdir_propfind_callback(__unused void *userdata, const char *path,
         }
 
         log_print(LOG_DYNAMIC, SECTION_FUSEDAV_PROP, "Removing path: %s", path);
-        stat_cache_delete(config->cache, path, &subgerr1);
-        filecache_delete(config->cache, path, true, &subgerr2);
+        stat_cache_batch_delete(batch, path, &subgerr1);
+        // In the same write as the stat cache's delete, so the listing goes in whole
+        filecache_batch_delete(config->cache, stat_cache_batch_kvstore(batch), path, &subgerr2);
         // If we need to combine 2 errors, use one of the error messages in the propagated prefix
         if (subgerr1 && subgerr2) {
             g_propagate_prefixed_error(gerr, subgerr1, "getdir_propfind_callback: %s :: ", subgerr2->message);
@@ -299,7 +305,7 @@ static void getdir_propfind_callback(__unused void *userdata, const char *path,
     }
     else {
         log_print(LOG_DYNAMIC, SECTION_FUSEDAV_PROP, "getdir_propfind_callback: CREATE %s (%lu)", path, status_code);
-        stat_cache_value_set(config->cache, path, &value, &subgerr1);
+        stat_cache_batch_value_set(batch, path, &value, &subgerr1);
         if (subgerr1) {
             g_propagate_prefixed_error(gerr, subgerr1, "getdir_propfind_callback: ");
             return;
@@ -318,26 +324,35 @@ static void getdir_cache_callback(__unused const char *path_prefix, const char *
     }
 }
 
-static void update_directory(const char *path, bool attempt_progressive_update, GError **gerr) {
+static void do_update_directory(const char *path, bool attempt_progressive_update, GError **gerr) {
     struct fusedav_config *config = fuse_get_context()->private_data;
     GError *tmpgerr = NULL;
+    struct stat_cache_batch *batch;
     bool needs_update = true;
     time_t last_updated;
     time_t timestamp;
     int propfind_result;
 
+    // Everything the PROPFINDs bring in, the stale-entry deletions, and the updated_children
+    // timestamp are committed to the stat cache together at the end, or not at all.
+    batch = stat_cache_batch_begin(config->cache);
+    if (batch == NULL) {
+        g_set_error(gerr, fusedav_quark(), ENOMEM, "update_directory: failed to begin stat cache batch");
+        return;
+    }
+
     // Attempt to freshen the cache.
     if (attempt_progressive_update && config->progressive_propfind) {
         timestamp = time(NULL);
         last_updated = stat_cache_read_updated_children(config->cache, path, &tmpgerr);
         if (tmpgerr) {
             g_propagate_prefixed_error(gerr, tmpgerr, "update_directory: ");
-            return;
+            goto finish;
         }
         log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "update_directory: Freshening directory data: %s", path);
 
         propfind_result = simple_propfind_with_redirect(path, PROPFIND_DEPTH_ONE, last_updated - CLOCK_SKEW,
-            getdir_propfind_callback, NULL, &tmpgerr);
+            getdir_propfind_callback, batch, &tmpgerr);
         // On true error, we set an error and return, avoiding the complete PROPFIND.
         // On sucess we avoid the complete PROPFIND
         // On ESTALE, we do a complete PROPFIND
@@ -352,11 +367,11 @@ static void update_directory(const char *path, bool attempt_progressive_update,
         }
         else if (tmpgerr) { // if injecting errors, process this error in preference to fusedav_error_updatepropfind1
             g_propagate_prefixed_error(gerr, tmpgerr, "update_directory: ");
-            return;
+            goto finish;
         }
         else {
             g_set_error(gerr, fusedav_quark(), ENETDOWN, "update_directory: progressive propfind errored: ");
-            return;
+            goto finish;
         }
     }
 
@@ -369,36 +384,345 @@ static void update_directory(const char *path, bool attempt_progressive_update,
         timestamp = time(NULL);
         // min_generation gets value here
         min_generation = stat_cache_get_local_generation();
-        // getdir_propfind_callback calls stat_cache_value_set, which makes local_generation one higher than min_generation
-        propfind_result = simple_propfind_with_redirect(path, PROPFIND_DEPTH_ONE, 0, getdir_propfind_callback, NULL, &tmpgerr);
+        // getdir_propfind_callback calls stat_cache_batch_value_set, which makes local_generation higher than min_generation
+        propfind_result = simple_propfind_with_redirect(path, PROPFIND_DEPTH_ONE, 0, getdir_propfind_callback, batch, &tmpgerr);
         BUMP(propfind_complete_cache);
         if (tmpgerr) {
             g_propagate_prefixed_error(gerr, tmpgerr, "update_directory: ");
-            return;
+            goto finish;
         }
         else if (propfind_result < 0 || inject_error(fusedav_error_updatepropfind2)) {
             g_set_error(gerr, fusedav_quark(), ENETDOWN, "update_directory: Complete PROPFIND failed on %s", path);
-            return;
+            goto finish;
         }
 
         // All files in propfind list will have local_generation > min_generation and will not be subject to deletion
-        stat_cache_delete_older(config->cache, path, min_generation, &tmpgerr);
+        stat_cache_batch_delete_older(batch, path, min_generation, &tmpgerr);
         if (tmpgerr) {
             g_propagate_prefixed_error(gerr, tmpgerr, "update_directory: ");
-            return;
+            goto finish;
         }
     }
 
     // Mark the directory contents as updated.
     log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "update_directory: Marking directory %s as updated at timestamp %lu.", path, timestamp);
-    stat_cache_updated_children(config->cache, path, timestamp, &tmpgerr);
+    stat_cache_batch_updated_children(batch, path, timestamp, &tmpgerr);
     if (tmpgerr) {
         g_propagate_prefixed_error(gerr, tmpgerr, "update_directory: ");
-        return;
+        goto finish;
+    }
+
+    stat_cache_batch_commit(batch, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "update_directory: ");
+        goto finish;
     }
+
+finish:
+    stat_cache_batch_free(batch);
     return;
 }
 
+/* Single-flight for update_directory.
+ * Several FUSE threads missing on siblings in the same directory would each PROPFIND it, and
+ * during deploys these pile up at the server. The first thread to update a directory registers
+ * a flight for its path; threads arriving while it is in progress wait for its result instead
+ * of issuing their own. Its results are in the stat cache by the time they wake. A waiter
+ * gives up after PROPFIND_COALESCE_TIMEOUT and does the update itself.
+ */
+struct propfind_flight {
+    pthread_cond_t cond;
+    bool done;
+    unsigned int waiters;
+    int error_code; // 0 on success
+    char *error_message;
+};
+
+static pthread_mutex_t flights_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *flights = NULL; // path -> struct propfind_flight *; owns keys only
+
+static void propfind_flight_free(struct propfind_flight *flight) {
+    pthread_cond_destroy(&flight->cond);
+    free(flight->error_message);
+    free(flight);
+}
+
+static void update_directory(const char *path, bool attempt_progressive_update, GError **gerr) {
+    struct propfind_flight *flight;
+    GError *tmpgerr = NULL;
+    struct timespec deadline;
+    bool timed_out = false;
+    int ret = 0;
+
+    pthread_mutex_lock(&flights_mutex);
+    if (flights == NULL) {
+        flights = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    }
+    flight = g_hash_table_lookup(flights, path);
+    if (flight == NULL) {
+        flight = calloc(1, sizeof(struct propfind_flight));
+        if (flight == NULL) {
+            // Can't coalesce, but can still do the update
+            pthread_mutex_unlock(&flights_mutex);
+            do_update_directory(path, attempt_progressive_update, gerr);
+            return;
+        }
+        pthread_cond_init(&flight->cond, NULL);
+        g_hash_table_insert(flights, strdup(path), flight);
+        pthread_mutex_unlock(&flights_mutex);
+
+        do_update_directory(path, attempt_progressive_update, &tmpgerr);
+
+        pthread_mutex_lock(&flights_mutex);
+        flight->done = true;
+        if (tmpgerr) {
+            flight->error_code = tmpgerr->code;
+            flight->error_message = strdup(tmpgerr->message);
+        }
+        g_hash_table_remove(flights, path);
+        pthread_cond_broadcast(&flight->cond);
+        // The last waiter out frees it otherwise
+        if (flight->waiters == 0) {
+            propfind_flight_free(flight);
+        }
+        pthread_mutex_unlock(&flights_mutex);
+
+        if (tmpgerr) {
+            g_propagate_error(gerr, tmpgerr);
+        }
+        return;
+    }
+
+    // Someone else is already updating this directory; wait for them
+    log_print(LOG_DYNAMIC, SECTION_FUSEDAV_STAT, "update_directory: coalescing with PROPFIND in flight on %s", path);
+    ++flight->waiters;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PROPFIND_COALESCE_TIMEOUT;
+    while (!flight->done && ret == 0) {
+        ret = pthread_cond_timedwait(&flight->cond, &flights_mutex, &deadline);
+    }
+    --flight->waiters;
+    if (flight->done) {
+        BUMP(propfind_coalesced);
+        if (flight->error_code) {
+            g_set_error(gerr, fusedav_quark(), flight->error_code, "update_directory: coalesced PROPFIND on %s failed: %s",
+                path, flight->error_message ? flight->error_message : "");
+        }
+        if (flight->waiters == 0) {
+            propfind_flight_free(flight);
+        }
+    }
+    else {
+        timed_out = true;
+    }
+    pthread_mutex_unlock(&flights_mutex);
+
+    if (timed_out) {
+        BUMP(propfind_coalesce_timeout);
+        log_print(LOG_NOTICE, SECTION_FUSEDAV_STAT, "update_directory: timed out after %d seconds waiting on PROPFIND of %s; doing our own",
+            PROPFIND_COALESCE_TIMEOUT, path);
+        do_update_directory(path, attempt_progressive_update, gerr);
+    }
+}
+
+/* Readdir lookahead.
+ * Recursive walkers (rsync, du, find) list one directory at a time, so each stale directory
+ * in a tree costs a serial PROPFIND. With readdir_lookahead_threads set, each readdir also
+ * hands the directory to a small pool, which finds its subdirectories whose listings are
+ * stale and refreshes up to readdir_lookahead_max of them in parallel. By the time the walker
+ * descends, the listings are fresh, or in flight, and update_directory coalesces with them.
+ * The readdir of a subdirectory looks ahead in turn, so the refreshes run a level ahead.
+ *
+ * Finding the subdirectories needs a stat cache lookup per child, which is left to the pool
+ * too, so readdir itself only queues its path. The queue is bounded; when walkers outrun the
+ * pool, lookahead is dropped, not the readdirs held up. Nothing is looked ahead in saint mode.
+ */
+#define LOOKAHEAD_QUEUE_MAX 4096
+
+struct lookahead_job {
+    bool expand; // find stale subdirectories of path, rather than refresh path itself
+    char path[];
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    GQueue *queue; // struct lookahead_job *; expansions at the head, refreshes at the tail
+    GHashTable *pending; // paths queued or being refreshed; owns keys
+    bool stop;
+    int max_per_dir;
+    int nthreads;
+    pthread_t *threads;
+    struct fusedav_config *config;
+} lookahead = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Call with lookahead.mutex held
+static bool lookahead_enqueue(const char *path, bool expand) {
+    struct lookahead_job *job;
+    size_t len = strlen(path) + 1;
+
+    if (g_queue_get_length(lookahead.queue) >= LOOKAHEAD_QUEUE_MAX) {
+        BUMP(propfind_lookahead_drop);
+        return false;
+    }
+    job = malloc(sizeof(struct lookahead_job) + len);
+    if (job == NULL) return false;
+    job->expand = expand;
+    memcpy(job->path, path, len);
+    // Expansions are local and cheap, and queue the PROPFINDs; get them done first
+    if (expand) {
+        g_queue_push_head(lookahead.queue, job);
+    }
+    else {
+        g_hash_table_insert(lookahead.pending, strdup(path), NULL);
+        g_queue_push_tail(lookahead.queue, job);
+    }
+    pthread_cond_signal(&lookahead.cond);
+    return true;
+}
+
+// Call from dav_readdir once path has been listed
+static void lookahead_directory(const char *path) {
+    if (lookahead.nthreads == 0 || use_saint_mode()) return;
+
+    pthread_mutex_lock(&lookahead.mutex);
+    if (!lookahead.stop) lookahead_enqueue(path, true);
+    pthread_mutex_unlock(&lookahead.mutex);
+}
+
+struct lookahead_expansion {
+    int queued;
+};
+
+static void lookahead_enumerate_callback(const char *path_prefix, const char *filename, void *user) {
+    struct lookahead_expansion *expansion = user;
+    struct stat_cache_value *value;
+    char path[PATH_MAX];
+    bool fresh;
+
+    if (expansion->queued >= lookahead.max_per_dir || strlen(filename) == 0) return;
+
+    // The root enumerates with a path_prefix of "/"
+    if (snprintf(path, PATH_MAX, "%s/%s", strcmp(path_prefix, "/") ? path_prefix : "", filename) >= PATH_MAX) return;
+
+    value = stat_cache_value_get(lookahead.config->cache, path, true, NULL);
+    if (value == NULL) return;
+    fresh = !S_ISDIR(value->st.st_mode) || stat_cache_children_fresh(lookahead.config->cache, path, NULL);
+    stat_cache_value_free(value);
+    if (fresh) return;
+
+    pthread_mutex_lock(&lookahead.mutex);
+    if (!lookahead.stop && !g_hash_table_contains(lookahead.pending, path) && lookahead_enqueue(path, false)) {
+        ++expansion->queued;
+    }
+    pthread_mutex_unlock(&lookahead.mutex);
+}
+
+static void lookahead_refresh(const char *path) {
+    GError *gerr = NULL;
+    time_t updated;
+
+    // The walker may have got here first
+    if (use_saint_mode() || stat_cache_children_fresh(lookahead.config->cache, path, &updated)) {
+        BUMP(propfind_lookahead_skip);
+        return;
+    }
+
+    update_directory(path, updated > 0, &gerr);
+    BUMP(propfind_lookahead);
+    if (gerr) {
+        // The walker's own readdir will try again, and report it
+        log_print(LOG_INFO, SECTION_FUSEDAV_DIR, "lookahead_refresh: failed to update %s: %s", path, gerr->message);
+        g_clear_error(&gerr);
+    }
+}
+
+static void *lookahead_worker(__unused void *ptr) {
+    // update_directory and the PROPFIND callbacks find the config through the FUSE
+    // context, which threads FUSE didn't start have no private_data in
+    fuse_get_context()->private_data = lookahead.config;
+
+    pthread_mutex_lock(&lookahead.mutex);
+    while (true) {
+        struct lookahead_job *job;
+
+        while (!lookahead.stop && g_queue_is_empty(lookahead.queue)) {
+            pthread_cond_wait(&lookahead.cond, &lookahead.mutex);
+        }
+        if (lookahead.stop) break;
+
+        job = g_queue_pop_head(lookahead.queue);
+        pthread_mutex_unlock(&lookahead.mutex);
+
+        if (job->expand) {
+            struct lookahead_expansion expansion = { .queued = 0 };
+            stat_cache_enumerate(lookahead.config->cache, job->path, lookahead_enumerate_callback, &expansion, true);
+            if (expansion.queued > 0) {
+                log_print(LOG_DEBUG, SECTION_FUSEDAV_DIR, "lookahead_worker: %s: %d subdirectories to refresh", job->path, expansion.queued);
+            }
+        }
+        else {
+            lookahead_refresh(job->path);
+        }
+
+        pthread_mutex_lock(&lookahead.mutex);
+        if (!job->expand) g_hash_table_remove(lookahead.pending, job->path);
+        free(job);
+    }
+    pthread_mutex_unlock(&lookahead.mutex);
+    return NULL;
+}
+
+static void lookahead_start(struct fusedav_config *config) {
+    int idx;
+
+    lookahead.config = config;
+    lookahead.max_per_dir = config->readdir_lookahead_max;
+
+    pthread_mutex_lock(&lookahead.mutex);
+    lookahead.queue = g_queue_new();
+    lookahead.pending = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    pthread_mutex_unlock(&lookahead.mutex);
+
+    lookahead.threads = calloc(config->readdir_lookahead_threads, sizeof(pthread_t));
+    for (idx = 0; lookahead.threads && idx < config->readdir_lookahead_threads; idx++) {
+        if (pthread_create(&lookahead.threads[idx], NULL, lookahead_worker, NULL)) {
+            log_print(LOG_ERR, SECTION_FUSEDAV_DEFAULT, "lookahead_start: failed to create lookahead thread %d", idx);
+            break;
+        }
+    }
+    lookahead.nthreads = idx;
+    log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "lookahead_start: %d threads, up to %d subdirectories a listing",
+        lookahead.nthreads, lookahead.max_per_dir);
+}
+
+static void lookahead_stop(void) {
+    struct lookahead_job *job;
+
+    if (lookahead.queue == NULL) return;
+
+    pthread_mutex_lock(&lookahead.mutex);
+    lookahead.stop = true;
+    pthread_cond_broadcast(&lookahead.cond);
+    pthread_mutex_unlock(&lookahead.mutex);
+
+    for (int idx = 0; idx < lookahead.nthreads; idx++) {
+        pthread_join(lookahead.threads[idx], NULL);
+    }
+    free(lookahead.threads);
+    lookahead.threads = NULL;
+    while ((job = g_queue_pop_head(lookahead.queue))) {
+        free(job);
+    }
+    g_queue_free(lookahead.queue);
+    lookahead.queue = NULL;
+    g_hash_table_destroy(lookahead.pending);
+    lookahead.pending = NULL;
+}
+
 static int dav_readdir(
         const char *path,
         void *buf,
@@ -409,6 +733,7 @@ static int dav_readdir(
     struct fusedav_config *config = fuse_get_context()->private_data;
     struct fill_info f;
     GError *gerr = NULL;
+    unsigned long start = stats_clock();
     int ret;
     bool ignore_freshness = false;
 
@@ -443,6 +768,7 @@ static int dav_readdir(
             path, ret == -STAT_CACHE_OLD_DATA);
         update_directory(path, (ret == -STAT_CACHE_OLD_DATA), &gerr);
         if (gerr) {
+            LATENCY(STATS_LAT_READDIR, start);
             return processed_gerror("dav_readdir: failed to update directory: ", path, &gerr);
         }
 
@@ -450,9 +776,18 @@ static int dav_readdir(
         // (which should pass, anyway, unless it's grace mode).
         // At this point, we can only get a zero return, or an empty directory. Let both fall through and return 0
         stat_cache_enumerate(config->cache, path, getdir_cache_callback, &f, true);
+
+        // Fresh from the server, so likely cold in the file cache too
+        filecache_prefetch_directory(config->cache, path);
+    }
+    else {
+        filecache_prefetch_touch(path);
     }
 
+    lookahead_directory(path);
+
     log_print(LOG_DEBUG, SECTION_FUSEDAV_DIR, "dav_readdir: Successful readdir for path: %s", path);
+    LATENCY(STATS_LAT_READDIR, start);
     return 0;
 }
 
@@ -587,6 +922,14 @@ static void get_stat(const char *path, struct stat *stbuf, GError **gerr) {
         skip_freshness_check = SAINT_MODE;
     }
 
+    // A fresh listing of the parent without this name answers before any leveldb lookup
+    if (skip_freshness_check == OFF && stat_cache_known_absent(path)) {
+        log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "get_stat: %s is not in its parent's listing", path);
+        BUMP(propfind_negative_cache);
+        g_set_error(gerr, fusedav_quark(), ENOENT, "get_stat: ");
+        return;
+    }
+
     // Check if we can directly hit this entry in the stat cache.
     ret = get_stat_from_cache(path, stbuf, skip_freshness_check, &tmpgerr);
 
@@ -759,11 +1102,14 @@ static void common_getattr(const char *path, struct stat *stbuf, struct fuse_fil
 
 static int dav_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *info) {
     GError *gerr = NULL;
+    unsigned long start;
 
     BUMP(dav_fgetattr);
 
     log_print(LOG_INFO, SECTION_FUSEDAV_STAT, "CALLBACK: dav_fgetattr(%s)", path?path:"null path");
+    start = stats_clock();
     common_getattr(path, stbuf, info, &gerr);
+    LATENCY(STATS_LAT_GETATTR, start);
     if (gerr) {
         if (gerr->code == ENOENT) {
             int res = -gerr->code;
@@ -780,11 +1126,15 @@ static int dav_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_i
 
 static int dav_getattr(const char *path, struct stat *stbuf) {
     GError *gerr = NULL;
+    unsigned long start;
 
     BUMP(dav_getattr);
 
     log_print(LOG_INFO, SECTION_FUSEDAV_STAT, "CALLBACK: dav_getattr(%s)", path);
+    if (path) filecache_prefetch_touch(path);
+    start = stats_clock();
     common_getattr(path, stbuf, NULL, &gerr);
+    LATENCY(STATS_LAT_GETATTR, start);
     if (gerr) {
         // Don't print error on ENOENT; that's what get_attr is for
         if (gerr->code == ENOENT) {
@@ -818,6 +1168,9 @@ static void common_unlink(const char *path, bool do_unlink, GError **gerr) {
         return;
     }
 
+    // Don't let a queued PUT bring the file back after the DELETE
+    filecache_writeback_cancel(path);
+
     if (do_unlink) {
         CURLcode res = CURLE_OK;
         long response_code = 500; // seed it as bad so we can enter the loop
@@ -848,7 +1201,7 @@ static void common_unlink(const char *path, bool do_unlink, GError **gerr) {
             if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
 
             log_print(LOG_DYNAMIC, SECTION_FUSEDAV_FILE, "common_unlink: calling DELETE on %s", path);
-            res = curl_easy_perform(session);
+            res = session_perform(session);
             if(res == CURLE_OK) {
                 curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
             }
@@ -901,6 +1254,35 @@ static int dav_unlink(const char *path) {
     return 0;
 }
 
+/* The cache side of removing a directory, or with to, of renaming one: the stat cache and
+ * the file cache for everything below it, in one write to the store.
+ */
+static void subtree_update(struct fusedav_config *config, const char *path, const char *to, GError **gerr) {
+    struct stat_cache_batch *batch;
+    GError *tmpgerr = NULL;
+
+    batch = stat_cache_batch_begin(config->cache);
+    if (batch == NULL) {
+        g_set_error(gerr, fusedav_quark(), ENOMEM, "subtree_update: failed to begin stat cache batch");
+        return;
+    }
+
+    if (to) {
+        stat_cache_batch_move_subtree(batch, path, to, &tmpgerr);
+        if (!tmpgerr) filecache_move_subtree(config->cache, stat_cache_batch_kvstore(batch), path, to, &tmpgerr);
+    }
+    else {
+        stat_cache_batch_delete_subtree(batch, path, &tmpgerr);
+        if (!tmpgerr) filecache_delete_subtree(config->cache, stat_cache_batch_kvstore(batch), path, &tmpgerr);
+    }
+    if (!tmpgerr) stat_cache_batch_commit(batch, &tmpgerr);
+    stat_cache_batch_free(batch);
+
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "subtree_update: ");
+    }
+}
+
 static int dav_rmdir(const char *path) {
     struct fusedav_config *config = fuse_get_context()->private_data;
     GError *gerr = NULL;
@@ -963,7 +1345,7 @@ static int dav_rmdir(const char *path) {
         slist = enhanced_logging(slist, LOG_DYNAMIC, SECTION_FUSEDAV_DIR, "dav_rmdir: %s", path);
         if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
 
-        res = curl_easy_perform(session);
+        res = session_perform(session);
         if(res == CURLE_OK) {
             curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
         }
@@ -981,13 +1363,8 @@ static int dav_rmdir(const char *path) {
 
     log_print(LOG_DEBUG, SECTION_FUSEDAV_DIR, "dav_rmdir: removed(%s)", path);
 
-    stat_cache_delete(config->cache, path, &gerr);
-    if (gerr) {
-        return processed_gerror("dav_rmdir: ", path, &gerr);
-    }
-
-    // Delete Updated_children entry for path
-    stat_cache_updated_children(config->cache, path, 0, &gerr);
+    // The entry, its updated_children entry, and anything left below it
+    subtree_update(config, path, NULL, &gerr);
     if (gerr) {
         return processed_gerror("dav_rmdir: ", path, &gerr);
     }
@@ -1035,7 +1412,7 @@ static int dav_mkdir(const char *path, mode_t mode) {
         slist = enhanced_logging(slist, LOG_DYNAMIC, SECTION_FUSEDAV_DIR, "dav_mkdir: %s", path);
         if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
 
-        res = curl_easy_perform(session);
+        res = session_perform(session);
         if(res == CURLE_OK) {
             curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
         }
@@ -1075,6 +1452,7 @@ static int dav_rename(const char *from, const char *to) {
     int fd = -1;
     struct stat st;
     char fn[PATH_MAX];
+    const char *dir_from = NULL;
     struct stat_cache_value *entry = NULL;
     long response_code = 500; // seed it as bad so we can enter the loop
     CURLcode res = CURLE_OK;
@@ -1094,9 +1472,18 @@ static int dav_rename(const char *from, const char *to) {
 
     if (S_ISDIR(st.st_mode)) {
         snprintf(fn, sizeof(fn), "%s/", from);
+        dir_from = from;
         from = fn;
     }
 
+    // The MOVE can only carry what the server has; and whatever was queued for 'to' is moot
+    filecache_writeback_flush(from, &gerr);
+    if (gerr) {
+        server_ret = processed_gerror("dav_rename: ", from, &gerr);
+        goto finish;
+    }
+    filecache_writeback_cancel(to);
+
     for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
         CURL *session;
         struct curl_slist *slist = NULL;
@@ -1138,7 +1525,7 @@ static int dav_rename(const char *from, const char *to) {
 
         // Do the server side move
 
-        res = curl_easy_perform(session);
+        res = session_perform(session);
         if(res == CURLE_OK) {
             curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
         }
@@ -1175,6 +1562,17 @@ static int dav_rename(const char *from, const char *to) {
     }
 
     /* If the server_side failed, then both the stat_cache and filecache moves need to succeed */
+    if (dir_from) {
+        // Everything below goes too, all at once
+        subtree_update(config, dir_from, to, &gerr);
+        if (gerr) {
+            local_ret = processed_gerror("dav_rename: ", to, &gerr);
+            goto finish;
+        }
+        local_ret = 0;
+        goto finish;
+    }
+
     entry = stat_cache_value_get(config->cache, from, true, &gerr);
     if (gerr) {
         local_ret = processed_gerror("dav_rename: ", from, &gerr);
@@ -1242,7 +1640,7 @@ static int dav_release(const char *path, __unused struct fuse_file_info *info) {
     // We still need to close the file.
 
     if (path != NULL) {
-        bool wrote_data = filecache_sync(config->cache, path, info, true, &gerr);
+        bool wrote_data = filecache_sync(config->cache, path, info, FILECACHE_SYNC_QUEUE, &gerr);
 
         // If we didn't write data, we either got an error, which we handle below, or there is no error,
         // so just fall through (not writable, not modified are examples)
@@ -1357,7 +1755,7 @@ static int dav_fsync(const char *path, __unused int isdatasync, struct fuse_file
     // If path is NULL because we are accessing a bare file descriptor,
     // let filecache_sync handle it since we need to get the file
     // descriptor there
-    wrote_data = filecache_sync(config->cache, path, info, true, &gerr);
+    wrote_data = filecache_sync(config->cache, path, info, FILECACHE_SYNC_PUT, &gerr);
     if (gerr) {
         return processed_gerror("dav_fsync: ", path, &gerr);
     }
@@ -1393,7 +1791,7 @@ static int dav_flush(const char *path, struct fuse_file_info *info) {
         struct stat_cache_value value;
         memset(&value, 0, sizeof(struct stat_cache_value));
 
-        wrote_data = filecache_sync(config->cache, path, info, true, &gerr);
+        wrote_data = filecache_sync(config->cache, path, info, FILECACHE_SYNC_QUEUE, &gerr);
         if (gerr) {
             return processed_gerror("dav_flush: ", path, &gerr);
         }
@@ -1471,6 +1869,7 @@ static int dav_open(const char *path, struct fuse_file_info *info) {
     }
 
     log_print(LOG_INFO, SECTION_FUSEDAV_FILE, "CALLBACK: dav_open: open(%s, %x, trunc=%x)", path, info->flags, info->flags & O_TRUNC);
+    if (path) filecache_prefetch_touch(path);
     do_open(path, info, &gerr);
     if (gerr) {
         int ret = processed_gerror("dav_open: ", path, &gerr);
@@ -1525,6 +1924,23 @@ static int dav_read(const char *path, char *buf, size_t size, off_t offset, stru
     return bytes_read;
 }
 
+// Hands libfuse the cache file's fd rather than a copy of its data; see filecache_read_buf
+static int dav_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *info) {
+    GError *gerr = NULL;
+
+    BUMP(dav_read);
+
+    // As in dav_read, a null path means a bare file descriptor
+    log_print(LOG_INFO, SECTION_FUSEDAV_IO, "CALLBACK: dav_read_buf(%s, %lu+%lu)", path ? path : "null path", (unsigned long) offset, (unsigned long) size);
+
+    filecache_read_buf(info, bufp, size, offset, &gerr);
+    if (gerr) {
+        return processed_gerror("dav_read_buf: ", path, &gerr);
+    }
+
+    return 0;
+}
+
 static bool file_too_big(off_t fsz, off_t maxsz) {
     // NB. During tests transferring a file that was too large, the command line sftp
     // client recognized the write error, and the subsequent flush error, with the
@@ -1548,7 +1964,8 @@ static bool file_too_big(off_t fsz, off_t maxsz) {
     return false;
 }
 
-static int dav_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info) {
+// The data may come in a pipe the kernel spliced it into, which filecache_write_buf splices on to the cache file
+static int dav_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *info) {
     struct fusedav_config *config = fuse_get_context()->private_data;
     GError *gerr = NULL;
     ssize_t bytes_written;
@@ -1560,9 +1977,9 @@ static int dav_write(const char *path, const char *buf, size_t size, off_t offse
     // (we have unlinked the path but kept the file descriptor open)
     // In this case we continue to do the write, but we skip the sync below
 
-    log_print(LOG_INFO, SECTION_FUSEDAV_IO, "CALLBACK: dav_write(%s, %lu+%lu)", path ? path : "null path", (unsigned long) offset, (unsigned long) size);
+    log_print(LOG_INFO, SECTION_FUSEDAV_IO, "CALLBACK: dav_write(%s, %lu+%lu)", path ? path : "null path", (unsigned long) offset, (unsigned long) fuse_buf_size(buf));
 
-    bytes_written = filecache_write(info, buf, size, offset, &gerr);
+    bytes_written = filecache_write_buf(info, buf, offset, &gerr);
     if (gerr) {
         return processed_gerror("dav_write: ", path, &gerr);
     }
@@ -1574,7 +1991,7 @@ static int dav_write(const char *path, const char *buf, size_t size, off_t offse
 
     if (path != NULL) {
         int fd;
-        filecache_sync(config->cache, path, info, false, &gerr);
+        filecache_sync(config->cache, path, info, FILECACHE_SYNC_LOCAL, &gerr);
         if (gerr) {
             return processed_gerror("dav_write: ", path, &gerr);
         }
@@ -1605,6 +2022,14 @@ static int dav_write(const char *path, const char *buf, size_t size, off_t offse
    return bytes_written;
 }
 
+static int dav_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info) {
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+    // fuse_buf's mem isn't const, though a source is only read; copy the pointer rather than cast the const away
+    memcpy(&bufv.buf[0].mem, &buf, sizeof(buf));
+    return dav_write_buf(path, &bufv, offset, info);
+}
+
 static int dav_ftruncate(const char *path, off_t size, struct fuse_file_info *info) {
     struct fusedav_config *config = fuse_get_context()->private_data;
     struct stat_cache_value value;
@@ -1624,7 +2049,7 @@ static int dav_ftruncate(const char *path, off_t size, struct fuse_file_info *in
     }
 
     // Let sync handle a NULL path
-    filecache_sync(config->cache, path, info, false, &gerr);
+    filecache_sync(config->cache, path, info, FILECACHE_SYNC_LOCAL, &gerr);
     if (gerr) {
         return processed_gerror("dav_ftruncate: ", path, &gerr);
     }
@@ -1711,7 +2136,7 @@ static int dav_create(const char *path, mode_t mode, struct fuse_file_info *info
 
     // @TODO: Perform a chmod here based on mode.
 
-    filecache_sync(config->cache, path, info, false, &gerr);
+    filecache_sync(config->cache, path, info, FILECACHE_SYNC_LOCAL, &gerr);
     if (gerr) {
         return processed_gerror("dav_create: ", path, &gerr);
     }
@@ -1755,7 +2180,21 @@ static int dav_chown(__unused const char *path, __unused uid_t u, __unused gid_t
  * We don't implement releasedir, fsyncdir, and lock.
  */
 
+// Let the kernel splice reads from, and writes into, the cache files; see dav_read_buf and dav_write_buf
+static void *dav_init(struct fuse_conn_info *conn) {
+    struct fusedav_config *config = fuse_get_context()->private_data;
+
+    if (config->splice) {
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ);
+    }
+    log_print(LOG_NOTICE, SECTION_FUSEDAV_MAIN, "dav_init: splice %s (capable %x, want %x)",
+        config->splice ? "on" : "off", conn->capable, conn->want);
+
+    return config;
+}
+
 struct fuse_operations dav_oper = {
+    .init        = dav_init,
     .fgetattr     = dav_fgetattr,
     .getattr     = dav_getattr,
     .readdir     = dav_readdir,
@@ -1772,6 +2211,8 @@ struct fuse_operations dav_oper = {
     .open        = dav_open,
     .read        = dav_read,
     .write       = dav_write,
+    .read_buf    = dav_read_buf,
+    .write_buf   = dav_write_buf,
     .release     = dav_release,
     .fsync       = dav_fsync,
     .flush       = dav_flush,
@@ -1817,17 +2258,26 @@ static void *cache_cleanup(void *ptr) {
     struct fusedav_config *config = (struct fusedav_config *)ptr;
     GError *gerr = NULL;
     bool first = true;
+    time_t last_full = 0;
 
     log_print(LOG_DEBUG, SECTION_FUSEDAV_DEFAULT, "enter cache_cleanup");
 
     while (true) {
-        // We would like to do cleanup on startup, to resolve issues
-        // from errant stat and file caches
-        filecache_cleanup(config->cache, config->cache_path, first, &gerr);
+        // We would like to do a full cleanup on startup, to resolve issues
+        // from errant stat and file caches. After that, only revisit what has
+        // changed, with a full sweep every full_cleanup_interval.
+        bool full = first || (time(NULL) - last_full >= config->full_cleanup_interval);
+
+        log_print(LOG_INFO, SECTION_FUSEDAV_DEFAULT, "cache_cleanup: %s", full ? "full sweep" : "incremental");
+        filecache_cleanup(config->cache, config->cache_path, first, full, &gerr);
         if (gerr) {
             processed_gerror("cache_cleanup: ", config->cache_path, &gerr);
         }
-        stat_cache_prune(config->cache);
+        stat_cache_prune(config->cache, full);
+        if (full) {
+            last_full = time(NULL);
+        }
+        stat_cache_print_stats();
         if (!first) {
             binding_busyness_stats();
         }
@@ -1840,6 +2290,267 @@ static void *cache_cleanup(void *ptr) {
     return NULL;
 }
 
+/* Tree warm-up.
+ * After a restart, or with a fresh cache, each directory is otherwise only discovered by a
+ * readdir of its own. With warmup_threads set, a few workers walk the tree breadth-first at
+ * startup and refresh each directory through update_directory, so the stat cache is populated
+ * before lookups arrive. Depth-infinity PROPFINDs would need fewer requests, but servers often
+ * refuse them, one response for a whole tree is costly on both ends, and the stat cache tracks
+ * freshness per depth-1 listing.
+ *
+ * Progress is kept in <cache_path>/warmup: when the walk started, and when it finished. A walk
+ * cut short by a restart resumes; directories refreshed since it started are descended into
+ * but not fetched again. The workers share a rate limit of warmup_rate PROPFINDs a second,
+ * and stand down while in saint mode.
+ */
+#define WARMUP_STATE_FILE "warmup"
+// An unfinished walk older than this starts over instead of resuming
+#define WARMUP_RESUME_MAX 86400 // seconds
+#define WARMUP_SAINT_BACKOFF 10 // seconds
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    GQueue *queue; // paths of directories still to visit; owned
+    unsigned active; // workers visiting a directory right now
+    bool stop;
+    bool done;
+    int nthreads;
+    pthread_t *threads;
+    struct fusedav_config *config;
+    time_t started;
+    time_t epoch; // directories refreshed since then need no PROPFIND
+    long interval_ns; // between PROPFINDs, across all workers; 0 for no limit
+    struct timespec next_slot;
+} warmup = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void warmup_record(time_t started, time_t completed) {
+    char *state_path = NULL;
+    char *tmp_path = NULL;
+    FILE *fp;
+
+    asprintf(&state_path, "%s/%s", warmup.config->cache_path, WARMUP_STATE_FILE);
+    asprintf(&tmp_path, "%s.tmp", state_path);
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        log_print(LOG_WARNING, SECTION_FUSEDAV_DEFAULT, "warmup_record: can't write %s: %d %s", tmp_path, errno, strerror(errno));
+    }
+    else {
+        fprintf(fp, "%lu %lu\n", (unsigned long) started, (unsigned long) completed);
+        if (fclose(fp) != 0 || rename(tmp_path, state_path) != 0) {
+            log_print(LOG_WARNING, SECTION_FUSEDAV_DEFAULT, "warmup_record: can't write %s: %d %s", state_path, errno, strerror(errno));
+        }
+    }
+    free(tmp_path);
+    free(state_path);
+}
+
+// When the previous walk started if it never finished and is recent enough to resume; otherwise 0
+static time_t warmup_resume_point(void) {
+    char *state_path = NULL;
+    unsigned long started = 0;
+    unsigned long completed = 0;
+    FILE *fp;
+
+    asprintf(&state_path, "%s/%s", warmup.config->cache_path, WARMUP_STATE_FILE);
+    fp = fopen(state_path, "r");
+    free(state_path);
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%lu %lu", &started, &completed) != 2) {
+        started = 0;
+    }
+    fclose(fp);
+
+    if (completed != 0 || time(NULL) - (time_t) started > WARMUP_RESUME_MAX) return 0;
+    return (time_t) started;
+}
+
+// Call with warmup.mutex held. Broadcast, since throttled workers wait on the same condition.
+static void warmup_enqueue(const char *path) {
+    g_queue_push_tail(warmup.queue, strdup(path));
+    pthread_cond_broadcast(&warmup.cond);
+}
+
+// Wait for a turn under the shared rate limit; false if we're stopping instead
+static bool warmup_throttle(void) {
+    struct timespec now;
+    struct timespec slot;
+    bool ret;
+
+    pthread_mutex_lock(&warmup.mutex);
+    while (!warmup.stop && use_saint_mode()) {
+        clock_gettime(CLOCK_REALTIME, &slot);
+        slot.tv_sec += WARMUP_SAINT_BACKOFF;
+        pthread_cond_timedwait(&warmup.cond, &warmup.mutex, &slot);
+    }
+    if (warmup.interval_ns > 0) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (warmup.next_slot.tv_sec > now.tv_sec ||
+            (warmup.next_slot.tv_sec == now.tv_sec && warmup.next_slot.tv_nsec > now.tv_nsec)) {
+            slot = warmup.next_slot;
+        }
+        else {
+            slot = now;
+        }
+        warmup.next_slot.tv_sec = slot.tv_sec + (slot.tv_nsec + warmup.interval_ns) / 1000000000L;
+        warmup.next_slot.tv_nsec = (slot.tv_nsec + warmup.interval_ns) % 1000000000L;
+        while (!warmup.stop && pthread_cond_timedwait(&warmup.cond, &warmup.mutex, &slot) != ETIMEDOUT);
+    }
+    ret = !warmup.stop;
+    pthread_mutex_unlock(&warmup.mutex);
+    return ret;
+}
+
+static void warmup_enumerate_callback(const char *path_prefix, const char *filename, __unused void *user) {
+    char path[PATH_MAX];
+    struct stat_cache_value *value;
+
+    // The root enumerates with a path_prefix of "/"
+    if (snprintf(path, PATH_MAX, "%s/%s", strcmp(path_prefix, "/") ? path_prefix : "", filename) >= PATH_MAX) return;
+
+    value = stat_cache_value_get(warmup.config->cache, path, true, NULL);
+    if (value == NULL) return;
+    if (S_ISDIR(value->st.st_mode)) {
+        pthread_mutex_lock(&warmup.mutex);
+        warmup_enqueue(path);
+        pthread_mutex_unlock(&warmup.mutex);
+    }
+    stat_cache_value_free(value);
+}
+
+static void warmup_directory(const char *path) {
+    struct fusedav_config *config = warmup.config;
+    GError *gerr = NULL;
+    time_t updated;
+
+    updated = stat_cache_read_updated_children(config->cache, path, &gerr);
+    if (gerr) {
+        log_print(LOG_INFO, SECTION_FUSEDAV_DIR, "warmup_directory: %s: %s", path, gerr->message);
+        g_clear_error(&gerr);
+        updated = 0;
+    }
+
+    if (updated >= warmup.epoch) {
+        log_print(LOG_DEBUG, SECTION_FUSEDAV_DIR, "warmup_directory: already refreshed: %s", path);
+        BUMP(propfind_warmup_skip);
+    }
+    else {
+        if (!warmup_throttle()) return;
+        update_directory(path, updated > 0, &gerr);
+        BUMP(propfind_warmup);
+        if (gerr) {
+            // Leave it, and what's under it, to readdir
+            log_print(LOG_NOTICE, SECTION_FUSEDAV_DIR, "warmup_directory: failed to update %s: %s", path, gerr->message);
+            g_clear_error(&gerr);
+            return;
+        }
+    }
+
+    stat_cache_enumerate(config->cache, path, warmup_enumerate_callback, NULL, true);
+}
+
+static void *warmup_worker(__unused void *ptr) {
+    bool finished = false;
+
+    // update_directory and the PROPFIND callbacks find the config through the FUSE
+    // context, which threads FUSE didn't start have no private_data in
+    fuse_get_context()->private_data = warmup.config;
+
+    pthread_mutex_lock(&warmup.mutex);
+    while (true) {
+        char *path;
+
+        while (!warmup.stop && g_queue_is_empty(warmup.queue) && warmup.active > 0) {
+            pthread_cond_wait(&warmup.cond, &warmup.mutex);
+        }
+        // Stopping, or nothing queued and nobody left to queue more
+        if (warmup.stop || g_queue_is_empty(warmup.queue)) break;
+
+        path = g_queue_pop_head(warmup.queue);
+        ++warmup.active;
+        pthread_mutex_unlock(&warmup.mutex);
+
+        warmup_directory(path);
+        free(path);
+
+        pthread_mutex_lock(&warmup.mutex);
+        --warmup.active;
+        if (warmup.active == 0 && g_queue_is_empty(warmup.queue)) {
+            pthread_cond_broadcast(&warmup.cond);
+            if (!warmup.stop && !warmup.done) {
+                warmup.done = true;
+                finished = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&warmup.mutex);
+
+    if (finished) {
+        log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "warmup_worker: tree warm-up finished in %lu seconds",
+            (unsigned long) (time(NULL) - warmup.started));
+        warmup_record(warmup.started, time(NULL));
+    }
+    return NULL;
+}
+
+static void warmup_start(struct fusedav_config *config) {
+    time_t resume;
+    int idx;
+
+    warmup.config = config;
+    warmup.started = time(NULL);
+    resume = warmup_resume_point();
+    if (resume > 0) {
+        log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "warmup_start: resuming tree warm-up started at %lu", (unsigned long) resume);
+        warmup.started = resume;
+    }
+    warmup.epoch = warmup.started;
+    warmup.interval_ns = config->warmup_rate > 0 ? 1000000000L / config->warmup_rate : 0;
+    warmup_record(warmup.started, 0);
+
+    pthread_mutex_lock(&warmup.mutex);
+    warmup.queue = g_queue_new();
+    warmup_enqueue("/");
+    pthread_mutex_unlock(&warmup.mutex);
+
+    warmup.threads = calloc(config->warmup_threads, sizeof(pthread_t));
+    for (idx = 0; warmup.threads && idx < config->warmup_threads; idx++) {
+        if (pthread_create(&warmup.threads[idx], NULL, warmup_worker, NULL)) {
+            log_print(LOG_ERR, SECTION_FUSEDAV_DEFAULT, "warmup_start: failed to create warm-up thread %d", idx);
+            break;
+        }
+    }
+    warmup.nthreads = idx;
+    log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "warmup_start: %d threads, %d PROPFINDs per second",
+        warmup.nthreads, config->warmup_rate);
+}
+
+static void warmup_stop(void) {
+    char *path;
+
+    if (warmup.queue == NULL) return;
+
+    pthread_mutex_lock(&warmup.mutex);
+    warmup.stop = true;
+    pthread_cond_broadcast(&warmup.cond);
+    pthread_mutex_unlock(&warmup.mutex);
+
+    for (int idx = 0; idx < warmup.nthreads; idx++) {
+        pthread_join(warmup.threads[idx], NULL);
+    }
+    free(warmup.threads);
+    warmup.threads = NULL;
+    warmup.nthreads = 0;
+    while ((path = g_queue_pop_head(warmup.queue))) {
+        free(path);
+    }
+    g_queue_free(warmup.queue);
+    warmup.queue = NULL;
+}
+
 int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fusedav_config config;
@@ -1850,8 +2561,7 @@ int main(int argc, char *argv[]) {
     pthread_t error_injection_thread;
     int ret = -1;
 
-    // Initialize the statistics and configuration.
-    memset(&stats, 0, sizeof(struct statistics));
+    // Initialize the configuration; the statistics start out zeroed, per thread, in stats_attach.
     memset(&config, 0, sizeof(config));
 
     setup_signal_handlers(&gerr);
@@ -1894,6 +2604,8 @@ int main(int argc, char *argv[]) {
         goto finish;
     }
 
+    log_async_start(config.log_ring_size);
+
     // Error injection mechanism. Should only be run during development.
     // It should only be triggered by running 'make INJECT_ERRORS=1' during build. So under
     // normal circumstances, injecting_errors is #define'd to 'false'
@@ -1916,6 +2628,15 @@ int main(int argc, char *argv[]) {
     log_print(LOG_DEBUG, SECTION_FUSEDAV_MAIN, "Opened ldb file cache.");
 
     // Open the stat cache.
+    if (config.storage_engine && !kvstore_engine_parse(config.storage_engine, &config.cache_supplemental.options.engine)) {
+        log_print(LOG_CRIT, SECTION_FUSEDAV_MAIN, "main: storage_engine %s is not a known engine.", config.storage_engine);
+        goto finish;
+    }
+    config.cache_supplemental.options.block_cache_size = (size_t)config.leveldb_block_cache_size * 1024 * 1024;
+    config.cache_supplemental.options.bloom_bits_per_key = config.leveldb_bloom_bits_per_key;
+    config.cache_supplemental.options.write_buffer_size = (size_t)config.leveldb_write_buffer_size * 1024 * 1024;
+    config.cache_supplemental.options.max_open_files = config.leveldb_max_open_files;
+    config.cache_supplemental.options.map_size = (size_t)config.lmdb_map_size * 1024 * 1024;
     stat_cache_open(&config.cache, &config.cache_supplemental, config.cache_path, &gerr);
     if (gerr) {
         processed_gerror("main: ", config.cache_path, &gerr);
@@ -1924,11 +2645,28 @@ int main(int argc, char *argv[]) {
     }
     log_print(LOG_DEBUG, SECTION_FUSEDAV_MAIN, "Opened stat cache.");
 
+    filecache_prefetch_init(config.cache, config.cache_path, config.prefetch_threads,
+        (off_t)config.prefetch_max_size * 1024, config.stale_while_revalidate);
+    filecache_ranged_get_init((off_t)config.ranged_get_min_size * 1024 * 1024);
+    filecache_kernel_cache_init(config.kernel_cache_timeout > 0);
+    filecache_dedup_init(config.dedup);
+    filecache_quota_init(config.cache, (off_t)config.cache_quota * 1024 * 1024);
+    stats_socket_start(config.stats_socket);
+    filecache_writeback_init(config.cache, config.cache_path, config.writeback_threads, config.writeback_delay);
+
     if (pthread_create(&cache_cleanup_thread, NULL, cache_cleanup, &config)) {
         log_print(LOG_CRIT, SECTION_FUSEDAV_MAIN, "Failed to create cache cleanup thread.");
         goto finish;
     }
 
+    if (config.warmup_threads > 0) {
+        warmup_start(&config);
+    }
+
+    if (config.readdir_lookahead_threads > 0) {
+        lookahead_start(&config);
+    }
+
     log_print(LOG_NOTICE, SECTION_FUSEDAV_MAIN, "Startup complete. Entering main FUSE loop.");
 
     if (config.singlethread) {
@@ -1968,6 +2706,17 @@ finish:
 
     log_print(LOG_NOTICE, SECTION_FUSEDAV_MAIN, "Unmounted.");
 
+    // The workers run in stat cache and file cache code which may use fuse state, so join them
+    // while the fuse object is still there
+    warmup_stop();
+    lookahead_stop();
+    filecache_prefetch_stop();
+    filecache_ranged_get_stop();
+    filecache_writeback_stop();
+    filecache_quota_stop();
+    stats_socket_stop();
+    log_print(LOG_DEBUG, SECTION_FUSEDAV_MAIN, "Stopped background workers.");
+
     if (fuse) {
         fuse_destroy(fuse);
     }
@@ -1983,6 +2732,7 @@ finish:
     stat_cache_close(config.cache, config.cache_supplemental);
 
     log_print(LOG_NOTICE, SECTION_FUSEDAV_MAIN, "Shutdown was successful. Exiting.");
+    log_async_stop();
 
     // log statements getting lost going to journal. See if delay here
     // allows journal to catch up.
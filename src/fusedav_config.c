@@ -23,6 +23,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <leveldb/c.h>
+#ifdef HAVE_LMDB
+#include <lmdb.h>
+#endif
 
 #include "fusedav.h"
 #include "fusedav_config.h"
@@ -93,6 +97,9 @@ static int fusedav_opt_proc(void *data, const char *arg, int key, struct fuse_ar
     case KEY_VERSION:
         fprintf(stderr, "fusedav version %s\n", PACKAGE_VERSION);
         fprintf(stderr, "LevelDB version %d.%d\n", leveldb_major_version(), leveldb_minor_version());
+#ifdef HAVE_LMDB
+        fprintf(stderr, "%s\n", mdb_version(NULL, NULL, NULL));
+#endif
         fprintf(stderr, "%s\n", curl_version());
         //malloc_stats_print(NULL, NULL, "g");
         fuse_opt_add_arg(outargs, "--version");
@@ -124,6 +131,34 @@ static void print_config(struct fusedav_config *config) {
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "log_level_by_section %s", config->log_level_by_section);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "log_prefix %s", config->log_prefix);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "max_file_size %d", config->max_file_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "leveldb_block_cache_size %d", config->leveldb_block_cache_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "leveldb_bloom_bits_per_key %d", config->leveldb_bloom_bits_per_key);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "leveldb_write_buffer_size %d", config->leveldb_write_buffer_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "leveldb_max_open_files %d", config->leveldb_max_open_files);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "storage_engine %s", config->storage_engine);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "lmdb_map_size %d", config->lmdb_map_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "full_cleanup_interval %d", config->full_cleanup_interval);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "http2 %d", config->http2);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "max_streams_per_node %d", config->max_streams_per_node);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "load_balance %s", config->load_balance);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "hedge_percentile %d", config->hedge_percentile);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "hedge_min_delay %d", config->hedge_min_delay);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "prefetch_threads %d", config->prefetch_threads);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "prefetch_max_size %d", config->prefetch_max_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "stale_while_revalidate %d", config->stale_while_revalidate);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "warmup_threads %d", config->warmup_threads);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "warmup_rate %d", config->warmup_rate);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "readdir_lookahead_threads %d", config->readdir_lookahead_threads);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "readdir_lookahead_max %d", config->readdir_lookahead_max);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "ranged_get_min_size %d", config->ranged_get_min_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "splice %d", config->splice);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "kernel_cache_timeout %d", config->kernel_cache_timeout);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "writeback_threads %d", config->writeback_threads);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "writeback_delay %d", config->writeback_delay);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "dedup %d", config->dedup);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "cache_quota %d", config->cache_quota);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "stats_socket %s", config->stats_socket);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "log_ring_size %d", config->log_ring_size);
 
     // These are not subject to change by the parse config method
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "uri: %s", config->uri);
@@ -148,6 +183,34 @@ log_level=5
 log_level_by_section=0
 log_prefix=6f7a106722f74cc7bd96d4d06785ed78
 max_file_size=256
+leveldb_block_cache_size=32
+leveldb_bloom_bits_per_key=10
+leveldb_write_buffer_size=4
+leveldb_max_open_files=1000
+storage_engine=leveldb
+lmdb_map_size=8192
+full_cleanup_interval=604800
+http2=false
+max_streams_per_node=100
+load_balance=p2c
+hedge_percentile=95
+hedge_min_delay=20
+prefetch_threads=4
+prefetch_max_size=10
+stale_while_revalidate=60
+warmup_threads=4
+warmup_rate=20
+readdir_lookahead_threads=8
+readdir_lookahead_max=64
+ranged_get_min_size=10
+splice=true
+kernel_cache_timeout=3
+writeback_threads=4
+writeback_delay=2
+dedup=true
+cache_quota=10240
+stats_socket=/srv/bindings/6f7a106722f74cc7bd96d4d06785ed78/stats.sock
+log_ring_size=4096
 */
 
 // Note for future generations; as currently set up, inject error won't start until
@@ -187,6 +250,34 @@ static void parse_configs(struct fusedav_config *config, GError **gerr) {
         keytuple(fusedav, log_level_by_section, STRING),
         keytuple(fusedav, log_prefix, STRING),
         keytuple(fusedav, max_file_size, INT),
+        keytuple(fusedav, leveldb_block_cache_size, INT),
+        keytuple(fusedav, leveldb_bloom_bits_per_key, INT),
+        keytuple(fusedav, leveldb_write_buffer_size, INT),
+        keytuple(fusedav, leveldb_max_open_files, INT),
+        keytuple(fusedav, storage_engine, STRING),
+        keytuple(fusedav, lmdb_map_size, INT),
+        keytuple(fusedav, full_cleanup_interval, INT),
+        keytuple(fusedav, http2, BOOL),
+        keytuple(fusedav, max_streams_per_node, INT),
+        keytuple(fusedav, load_balance, STRING),
+        keytuple(fusedav, hedge_percentile, INT),
+        keytuple(fusedav, hedge_min_delay, INT),
+        keytuple(fusedav, prefetch_threads, INT),
+        keytuple(fusedav, prefetch_max_size, INT),
+        keytuple(fusedav, stale_while_revalidate, INT),
+        keytuple(fusedav, warmup_threads, INT),
+        keytuple(fusedav, warmup_rate, INT),
+        keytuple(fusedav, readdir_lookahead_threads, INT),
+        keytuple(fusedav, readdir_lookahead_max, INT),
+        keytuple(fusedav, ranged_get_min_size, INT),
+        keytuple(fusedav, splice, BOOL),
+        keytuple(fusedav, kernel_cache_timeout, INT),
+        keytuple(fusedav, writeback_threads, INT),
+        keytuple(fusedav, writeback_delay, INT),
+        keytuple(fusedav, dedup, BOOL),
+        keytuple(fusedav, cache_quota, INT),
+        keytuple(fusedav, stats_socket, STRING),
+        keytuple(fusedav, log_ring_size, INT),
         {NULL, NULL, 0, 0}
         };
 
@@ -264,6 +355,7 @@ static void parse_configs(struct fusedav_config *config, GError **gerr) {
 }
 
 void configure_fusedav(struct fusedav_config *config, struct fuse_args *args, char **mountpoint, GError **gerr) {
+    enum session_balance balance = SESSION_BALANCE_RANDOM;
     GError *tmpgerr = NULL;
 
     // Set defaults for key items in case some don't otherwise get set
@@ -277,6 +369,34 @@ void configure_fusedav(struct fusedav_config *config, struct fuse_args *args, ch
     config->nodaemon = false;
     config->max_file_size = 256; // 256M
     config->log_level = 5; // default log_level: LOG_NOTICE
+    config->leveldb_block_cache_size = 32; // 32M
+    config->leveldb_bloom_bits_per_key = 10; // ~1% false positives
+    config->leveldb_write_buffer_size = 0; // leveldb default, 4M
+    config->leveldb_max_open_files = 0; // leveldb default, 1000
+    config->storage_engine = NULL; // leveldb
+    config->lmdb_map_size = 8192; // 8G of address space; pages are only used as the store grows
+    config->full_cleanup_interval = 604800; // one week; cleanups in between only revisit what changed
+    config->http2 = false;
+    config->max_streams_per_node = 100; // libcurl's default
+    config->load_balance = NULL; // random
+    config->hedge_percentile = 0; // off
+    config->hedge_min_delay = 20;
+    config->prefetch_threads = 4; // started only once prefetch_max_size or stale_while_revalidate is on
+    config->prefetch_max_size = 0; // off; 10 (10K) would match the XSM GET bucket
+    config->stale_while_revalidate = 0; // off
+    config->warmup_threads = 0; // off
+    config->warmup_rate = 20;
+    config->readdir_lookahead_threads = 0; // off
+    config->readdir_lookahead_max = 64;
+    config->ranged_get_min_size = 0; // off; 10 (10M) would match the LG GET bucket
+    config->splice = true;
+    config->kernel_cache_timeout = 0; // off, leaving libfuse's 1 second timeouts
+    config->writeback_threads = 0; // off
+    config->writeback_delay = 2;
+    config->dedup = false;
+    config->cache_quota = 0; // no quota; only age and orphan cleanup
+    config->stats_socket = NULL; // off
+    config->log_ring_size = 0; // off; log_print sends to journald itself
 
     // Parse options.
     if (fuse_opt_parse(args, config, fusedav_opts, fusedav_opt_proc) < 0 || inject_error(config_error_parse)) {
@@ -294,6 +414,13 @@ void configure_fusedav(struct fusedav_config *config, struct fuse_args *args, ch
         g_set_error(gerr, fusedav_config_quark(), ENETDOWN, "configure_fusedav: Failed to initialize session system.");
         return;
     }
+    session_config_multiplex(config->http2, config->max_streams_per_node);
+    if (config->load_balance && !session_balance_parse(config->load_balance, &balance)) {
+        g_set_error(gerr, fusedav_config_quark(), EINVAL, "configure_fusedav: load_balance %s is not random, least_loaded or p2c.",
+            config->load_balance);
+        return;
+    }
+    session_config_balance(balance, config->hedge_percentile, config->hedge_min_delay);
 
     asprintf(&user_agent, "FuseDAV/%s %s", PACKAGE_VERSION, config->log_prefix);
 
@@ -308,6 +435,14 @@ void configure_fusedav(struct fusedav_config *config, struct fuse_args *args, ch
     // @TODO: is there a best place for fuse_opt_add_arg? Does it need to follow fuse_parse_cmdline?
     // fuse_opt_add_arg(&args, "-o atomic_o_trunc");
 
+    // For fuse_new; page caching across opens is up to filecache_open
+    if (config->kernel_cache_timeout > 0) {
+        char *opts = NULL;
+        asprintf(&opts, "-oattr_timeout=%d,entry_timeout=%d", config->kernel_cache_timeout, config->kernel_cache_timeout);
+        fuse_opt_add_arg(args, opts);
+        free(opts);
+    }
+
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "Parsed command line.");
 
     if (!config->uri || inject_error(config_error_uri)) {
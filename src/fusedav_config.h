@@ -53,6 +53,34 @@ struct fusedav_config {
     char *log_level_by_section;
     char *log_prefix;
     int  max_file_size;
+    int  leveldb_block_cache_size; // in M; 0 uses leveldb's default
+    int  leveldb_bloom_bits_per_key; // 0 disables the filter policy
+    int  leveldb_write_buffer_size; // in M; 0 uses leveldb's default
+    int  leveldb_max_open_files; // 0 uses leveldb's default
+    char *storage_engine; // metadata store: leveldb, or lmdb if built --with-lmdb; unset is leveldb
+    int  lmdb_map_size; // in M; the most the lmdb store can grow to
+    int  full_cleanup_interval; // in seconds; 0 makes every cache cleanup a full sweep
+    bool http2; // multiplex requests over HTTP/2 connections to the filesystem nodes
+    int  max_streams_per_node; // concurrent HTTP/2 streams per node connection
+    char *load_balance; // how requests pick a node: random, least_loaded, or p2c; unset is random
+    int  hedge_percentile; // resend GETs and PROPFINDs to a second node past this percentile of time to first byte; 0 disables
+    int  hedge_min_delay; // in ms; never hedge sooner than this
+    int  prefetch_threads; // background workers for prefetch and stale-while-revalidate, 4 by default; 0 disables both
+    int  prefetch_max_size; // in K; prefetch files up to this size after a readdir; 0 disables. 10 is the XSM GET bucket, 100 SM
+    int  stale_while_revalidate; // in seconds past the refresh interval; 0 disables
+    int  warmup_threads; // workers walking the tree into the stat cache at startup; 0 disables
+    int  warmup_rate; // PROPFINDs per second across the warm-up workers; 0 for no limit
+    int  readdir_lookahead_threads; // workers refreshing stale subdirectories of each listing ahead of recursive walkers; 0 disables
+    int  readdir_lookahead_max; // subdirectories refreshed ahead per listing
+    int  ranged_get_min_size; // in M; read-only opens of files this large return after the first chunk; 0 disables
+    bool splice; // splice file data between the kernel and the cache files where FUSE can
+    int  kernel_cache_timeout; // in seconds; kernel attribute and entry caching, and page caching across opens; 0 disables
+    int  writeback_threads; // background PUT workers; 0 PUTs on close, as before
+    int  writeback_delay; // in seconds; how long a closed file waits, so rewrites coalesce
+    bool dedup; // share one cache file among paths with identical contents, and skip PUTs the server already has
+    int  cache_quota; // in M; evict least recently used cache files beyond this; 0 disables
+    char *stats_socket; // Unix socket serving counters and latency histograms; unset disables
+    int  log_ring_size; // messages queued for a background journald writer; 0 logs synchronously
     char *conf;
     stat_cache_t *cache;
     struct stat_cache_supplemental cache_supplemental;
@@ -0,0 +1,845 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <leveldb/c.h>
+#ifdef HAVE_LMDB
+#include <lmdb.h>
+#endif
+
+#include "kvstore.h"
+#include "log.h"
+#include "log_sections.h"
+
+struct kvstore {
+    enum kvstore_engine engine;
+
+    leveldb_t *db;
+    leveldb_options_t *options;
+    leveldb_cache_t *lru;
+    leveldb_filterpolicy_t *filter_policy;
+    // leveldb option objects are only read by leveldb, so one set is shared by all threads.
+    // Point lookups fill the block cache; scans ask not to, so they don't evict the hot set.
+    leveldb_readoptions_t *roptions;
+    leveldb_readoptions_t *nofill_roptions;
+    leveldb_writeoptions_t *woptions;
+
+#ifdef HAVE_LMDB
+    MDB_env *env;
+    MDB_dbi dbi;
+    size_t max_key_size;
+    unsigned long generation; // tells a thread's cached read transaction which store it was for
+#endif
+};
+
+struct kvstore_iter {
+    kvstore_t *store;
+    leveldb_iterator_t *ldb_iter;
+    leveldb_readoptions_t *snapshot_roptions; // owned, if iterating a snapshot
+#ifdef HAVE_LMDB
+    MDB_txn *txn; // owned unless from a snapshot
+    bool owns_txn;
+    MDB_cursor *cursor;
+    MDB_val key;
+    MDB_val value;
+    bool valid;
+#endif
+};
+
+struct kvstore_snapshot {
+    const leveldb_snapshot_t *ldb_snapshot;
+#ifdef HAVE_LMDB
+    MDB_txn *txn;
+#endif
+};
+
+struct kvstore_batch {
+    kvstore_t *store;
+    leveldb_writebatch_t *wb;
+    // lmdb: the operations, in order, each a struct batch_op then its key and value
+    char *ops;
+    size_t len;
+    size_t size;
+};
+
+bool kvstore_engine_parse(const char *name, enum kvstore_engine *engine) {
+    if (name == NULL || strcmp(name, "leveldb") == 0) {
+        *engine = KVSTORE_LEVELDB;
+        return true;
+    }
+    if (strcmp(name, "lmdb") == 0) {
+        *engine = KVSTORE_LMDB;
+        return true;
+    }
+    return false;
+}
+
+const char *kvstore_engine_name(enum kvstore_engine engine) {
+    return engine == KVSTORE_LMDB ? "lmdb" : "leveldb";
+}
+
+static void set_error(char **errptr, const char *format, const char *detail) {
+    if (asprintf(errptr, format, detail) < 0) *errptr = strdup("kvstore: out of memory");
+}
+
+/* leveldb */
+
+static kvstore_t *leveldb_engine_open(kvstore_t *store, const char *path, const struct kvstore_options *options, char **errptr) {
+    store->options = leveldb_options_create();
+
+    // Initialize LevelDB's LRU block cache. Without one, leveldb uses a small internal default.
+    if (options->block_cache_size > 0) {
+        store->lru = leveldb_cache_create_lru(options->block_cache_size);
+        leveldb_options_set_cache(store->options, store->lru);
+    }
+
+    // A bloom filter per table lets a lookup for a missing key skip reading the table's blocks.
+    if (options->bloom_bits_per_key > 0) {
+        store->filter_policy = leveldb_filterpolicy_create_bloom(options->bloom_bits_per_key);
+        leveldb_options_set_filter_policy(store->options, store->filter_policy);
+    }
+
+    if (options->write_buffer_size > 0) {
+        leveldb_options_set_write_buffer_size(store->options, options->write_buffer_size);
+    }
+
+    if (options->max_open_files > 0) {
+        leveldb_options_set_max_open_files(store->options, options->max_open_files);
+    }
+
+    // Create the database if missing.
+    leveldb_options_set_create_if_missing(store->options, true);
+    leveldb_options_set_error_if_exists(store->options, false);
+
+    // Use a fusedav logger.
+    leveldb_options_set_info_log(store->options, NULL);
+
+    store->roptions = leveldb_readoptions_create();
+    store->nofill_roptions = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(store->nofill_roptions, false);
+    store->woptions = leveldb_writeoptions_create();
+
+    store->db = leveldb_open(store->options, path, errptr);
+    if (store->db == NULL) {
+        kvstore_close(store);
+        return NULL;
+    }
+    return store;
+}
+
+static void leveldb_engine_close(kvstore_t *store) {
+    if (store->db) leveldb_close(store->db);
+    if (store->options) leveldb_options_destroy(store->options);
+    if (store->lru) leveldb_cache_destroy(store->lru);
+    if (store->filter_policy) leveldb_filterpolicy_destroy(store->filter_policy);
+    if (store->roptions) leveldb_readoptions_destroy(store->roptions);
+    if (store->nofill_roptions) leveldb_readoptions_destroy(store->nofill_roptions);
+    if (store->woptions) leveldb_writeoptions_destroy(store->woptions);
+}
+
+/* lmdb
+ * Each write is a transaction of its own; lmdb serializes them, as leveldb does its writes.
+ * Commits aren't synced, which leaves the same window as leveldb's unsynced writes; the
+ * store is synced at close. A store lmdb can't open is a cache we can do without, so it is
+ * removed and created afresh.
+ *
+ * Point reads share a read transaction per thread, reset between reads and renewed for the
+ * next, so a read is a lookup and a copy out of the map. Those transactions are tracked so
+ * closing the store can end them, and so a thread exiting gives its reader slot back.
+ */
+#ifdef HAVE_LMDB
+
+#define LMDB_MAX_READERS 1024
+
+struct lmdb_reader {
+    MDB_txn *txn; // NULL until begun, and once its store closes
+    unsigned long generation;
+    struct lmdb_reader *prev;
+    struct lmdb_reader *next;
+};
+
+static pthread_mutex_t lmdb_readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct lmdb_reader *lmdb_readers = NULL; // those with a txn
+static unsigned long lmdb_generation = 0;
+static pthread_key_t lmdb_reader_key;
+static pthread_once_t lmdb_reader_once = PTHREAD_ONCE_INIT;
+
+// Call with lmdb_readers_mutex held
+static void lmdb_reader_unlink(struct lmdb_reader *reader) {
+    if (reader->prev) reader->prev->next = reader->next;
+    else lmdb_readers = reader->next;
+    if (reader->next) reader->next->prev = reader->prev;
+    reader->prev = reader->next = NULL;
+}
+
+static void lmdb_reader_exit(void *ptr) {
+    struct lmdb_reader *reader = ptr;
+
+    pthread_mutex_lock(&lmdb_readers_mutex);
+    if (reader->txn) {
+        mdb_txn_abort(reader->txn);
+        lmdb_reader_unlink(reader);
+    }
+    pthread_mutex_unlock(&lmdb_readers_mutex);
+    free(reader);
+}
+
+static void lmdb_reader_key_create(void) {
+    pthread_key_create(&lmdb_reader_key, lmdb_reader_exit);
+}
+
+static void lmdb_set_error(char **errptr, const char *what, int rc) {
+    if (asprintf(errptr, "lmdb: %s: %s", what, mdb_strerror(rc)) < 0) *errptr = strdup("lmdb: out of memory");
+}
+
+// This thread's read transaction on store, renewed; hand it back with mdb_txn_reset
+static MDB_txn *lmdb_read_begin(kvstore_t *store, char **errptr) {
+    struct lmdb_reader *reader = pthread_getspecific(lmdb_reader_key);
+    MDB_txn *txn;
+    int rc;
+
+    if (reader == NULL) {
+        reader = calloc(1, sizeof(struct lmdb_reader));
+        if (reader == NULL) {
+            set_error(errptr, "lmdb: %s", "out of memory");
+            return NULL;
+        }
+        pthread_setspecific(lmdb_reader_key, reader);
+    }
+
+    // Only this thread begins or renews reader->txn; closing the store clears it, but then
+    // the generation no longer matches
+    if (reader->txn && reader->generation == store->generation) {
+        rc = mdb_txn_renew(reader->txn);
+        if (rc == 0) return reader->txn;
+        log_print(LOG_NOTICE, SECTION_STATCACHE_CACHE, "lmdb_read_begin: mdb_txn_renew: %s", mdb_strerror(rc));
+    }
+
+    pthread_mutex_lock(&lmdb_readers_mutex);
+    if (reader->txn) {
+        mdb_txn_abort(reader->txn);
+        lmdb_reader_unlink(reader);
+        reader->txn = NULL;
+    }
+    pthread_mutex_unlock(&lmdb_readers_mutex);
+
+    rc = mdb_txn_begin(store->env, NULL, MDB_RDONLY, &txn);
+    if (rc != 0) {
+        lmdb_set_error(errptr, "mdb_txn_begin", rc);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lmdb_readers_mutex);
+    reader->txn = txn;
+    reader->generation = store->generation;
+    reader->next = lmdb_readers;
+    if (lmdb_readers) lmdb_readers->prev = reader;
+    lmdb_readers = reader;
+    pthread_mutex_unlock(&lmdb_readers_mutex);
+    return txn;
+}
+
+static int lmdb_env_try_open(kvstore_t *store, const char *path, size_t map_size) {
+    int rc;
+
+    rc = mdb_env_create(&store->env);
+    if (rc != 0) return rc;
+    rc = mdb_env_set_mapsize(store->env, map_size);
+    if (rc == 0) rc = mdb_env_set_maxreaders(store->env, LMDB_MAX_READERS);
+    // MDB_NOTLS: read transactions belong to their txn, not their thread, so a thread can hold
+    // an iterator's and its cached one at once
+    if (rc == 0) rc = mdb_env_open(store->env, path, MDB_NOTLS | MDB_NOSYNC | MDB_NORDAHEAD, 0660);
+    if (rc != 0) {
+        mdb_env_close(store->env);
+        store->env = NULL;
+    }
+    return rc;
+}
+
+static kvstore_t *lmdb_engine_open(kvstore_t *store, const char *path, const struct kvstore_options *options, char **errptr) {
+    size_t map_size = options->map_size ? options->map_size : (size_t)8192 * 1024 * 1024;
+    MDB_txn *txn;
+    int rc;
+
+    pthread_once(&lmdb_reader_once, lmdb_reader_key_create);
+
+    if (mkdir(path, 0770) == -1 && errno != EEXIST) {
+        set_error(errptr, "lmdb: can't create %s", path);
+        free(store);
+        return NULL;
+    }
+
+    rc = lmdb_env_try_open(store, path, map_size);
+    if (rc == MDB_INVALID || rc == MDB_CORRUPTED || rc == MDB_VERSION_MISMATCH) {
+        char file[PATH_MAX];
+
+        log_print(LOG_WARNING, SECTION_STATCACHE_CACHE, "kvstore_open: %s: %s; starting a new store", path, mdb_strerror(rc));
+        snprintf(file, sizeof(file), "%s/data.mdb", path);
+        unlink(file);
+        snprintf(file, sizeof(file), "%s/lock.mdb", path);
+        unlink(file);
+        rc = lmdb_env_try_open(store, path, map_size);
+    }
+    if (rc != 0) {
+        lmdb_set_error(errptr, "mdb_env_open", rc);
+        free(store);
+        return NULL;
+    }
+
+    rc = mdb_txn_begin(store->env, NULL, 0, &txn);
+    if (rc == 0) {
+        rc = mdb_dbi_open(txn, NULL, 0, &store->dbi);
+        if (rc == 0) rc = mdb_txn_commit(txn);
+        else mdb_txn_abort(txn);
+    }
+    if (rc != 0) {
+        lmdb_set_error(errptr, "mdb_dbi_open", rc);
+        mdb_env_close(store->env);
+        free(store);
+        return NULL;
+    }
+
+    // Keys are stored with their trailing NUL, which counts against the limit
+    store->max_key_size = mdb_env_get_maxkeysize(store->env);
+    pthread_mutex_lock(&lmdb_readers_mutex);
+    store->generation = ++lmdb_generation;
+    pthread_mutex_unlock(&lmdb_readers_mutex);
+    log_print(LOG_INFO, SECTION_STATCACHE_CACHE, "kvstore_open: lmdb at %s, map %lu bytes, keys up to %lu bytes",
+        path, map_size, store->max_key_size);
+    return store;
+}
+
+static void lmdb_engine_close(kvstore_t *store) {
+    struct lmdb_reader *reader;
+
+    // Every other thread is done with the store by now
+    pthread_mutex_lock(&lmdb_readers_mutex);
+    while ((reader = lmdb_readers)) {
+        mdb_txn_abort(reader->txn);
+        reader->txn = NULL;
+        lmdb_reader_unlink(reader);
+    }
+    pthread_mutex_unlock(&lmdb_readers_mutex);
+
+    mdb_env_sync(store->env, 1);
+    mdb_env_close(store->env);
+}
+
+static char *lmdb_stats(kvstore_t *store) {
+    MDB_stat stat;
+    MDB_envinfo info;
+    char *str = NULL;
+
+    if (mdb_env_stat(store->env, &stat) != 0 || mdb_env_info(store->env, &info) != 0) return NULL;
+    if (asprintf(&str, "entries %lu, depth %u, branch pages %lu, leaf pages %lu, overflow pages %lu\n"
+            "map %lu bytes, last page %lu of %u bytes, readers %u of %u\n",
+            (unsigned long) stat.ms_entries, stat.ms_depth, (unsigned long) stat.ms_branch_pages,
+            (unsigned long) stat.ms_leaf_pages, (unsigned long) stat.ms_overflow_pages,
+            (unsigned long) info.me_mapsize, (unsigned long) info.me_last_pgno, stat.ms_psize,
+            info.me_numreaders, info.me_maxreaders) < 0) {
+        return NULL;
+    }
+    return str;
+}
+
+struct batch_op {
+    bool put;
+    size_t klen;
+    size_t vlen;
+};
+
+#endif /* HAVE_LMDB */
+
+kvstore_t *kvstore_open(const char *path, const struct kvstore_options *options, char **errptr) {
+    kvstore_t *store;
+
+    store = calloc(1, sizeof(kvstore_t));
+    if (store == NULL) {
+        set_error(errptr, "kvstore_open: %s", "out of memory");
+        return NULL;
+    }
+    store->engine = options->engine;
+
+    if (options->engine == KVSTORE_LMDB) {
+#ifdef HAVE_LMDB
+        return lmdb_engine_open(store, path, options, errptr);
+#else
+        set_error(errptr, "kvstore_open: %s", "fusedav was built without lmdb; configure --with-lmdb");
+        free(store);
+        return NULL;
+#endif
+    }
+    return leveldb_engine_open(store, path, options, errptr);
+}
+
+void kvstore_close(kvstore_t *store) {
+    if (store == NULL) return;
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) lmdb_engine_close(store);
+#endif
+    if (store->engine == KVSTORE_LEVELDB) leveldb_engine_close(store);
+    free(store);
+}
+
+enum kvstore_engine kvstore_engine(kvstore_t *store) {
+    return store->engine;
+}
+
+size_t kvstore_max_key_size(kvstore_t *store) {
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) return store->max_key_size;
+#endif
+    (void) store;
+    return 0;
+}
+
+char *kvstore_property(kvstore_t *store, const char *name) {
+    if (store == NULL) return NULL;
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) {
+        return strcmp(name, KVSTORE_PROPERTY_STATS) == 0 ? lmdb_stats(store) : NULL;
+    }
+#endif
+    if (strcmp(name, KVSTORE_PROPERTY_STATS) == 0) name = "leveldb.stats";
+    return leveldb_property_value(store->db, name);
+}
+
+void kvstore_free(void *ptr) {
+    free(ptr);
+}
+
+char *kvstore_get(kvstore_t *store, const char *key, size_t klen, size_t *vallen, char **errptr) {
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) {
+        MDB_val k = { klen, (void *) key };
+        MDB_val v;
+        MDB_txn *txn;
+        char *value = NULL;
+        int rc;
+
+        *vallen = 0;
+        // Too long to have been stored
+        if (klen > store->max_key_size) return NULL;
+        txn = lmdb_read_begin(store, errptr);
+        if (txn == NULL) return NULL;
+        rc = mdb_get(txn, store->dbi, &k, &v);
+        if (rc == 0) {
+            // One more than asked, so string values can be terminated by the caller
+            value = malloc(v.mv_size + 1);
+            if (value) {
+                memcpy(value, v.mv_data, v.mv_size);
+                *vallen = v.mv_size;
+            }
+            else {
+                set_error(errptr, "lmdb: %s", "out of memory");
+            }
+        }
+        else if (rc != MDB_NOTFOUND) {
+            lmdb_set_error(errptr, "mdb_get", rc);
+        }
+        mdb_txn_reset(txn);
+        return value;
+    }
+#endif
+    return leveldb_get(store->db, store->roptions, key, klen, vallen, errptr);
+}
+
+bool kvstore_get_into(kvstore_t *store, const char *key, size_t klen, void *buf, size_t buflen, size_t *vallen, char **errptr) {
+    char *value;
+    size_t len;
+
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) {
+        MDB_val k = { klen, (void *) key };
+        MDB_val v;
+        MDB_txn *txn;
+        int rc;
+
+        *vallen = 0;
+        if (klen > store->max_key_size) return false;
+        txn = lmdb_read_begin(store, errptr);
+        if (txn == NULL) return false;
+        rc = mdb_get(txn, store->dbi, &k, &v);
+        if (rc == 0) {
+            memcpy(buf, v.mv_data, v.mv_size < buflen ? v.mv_size : buflen);
+            *vallen = v.mv_size;
+        }
+        else if (rc != MDB_NOTFOUND) {
+            lmdb_set_error(errptr, "mdb_get", rc);
+        }
+        mdb_txn_reset(txn);
+        return rc == 0;
+    }
+#endif
+    // leveldb's C API only hands out copies
+    value = leveldb_get(store->db, store->roptions, key, klen, &len, errptr);
+    *vallen = 0;
+    if (value == NULL) return false;
+    memcpy(buf, value, len < buflen ? len : buflen);
+    *vallen = len;
+    leveldb_free(value);
+    return true;
+}
+
+void kvstore_put(kvstore_t *store, const char *key, size_t klen, const char *val, size_t vlen, char **errptr) {
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) {
+        MDB_val k = { klen, (void *) key };
+        MDB_val v = { vlen, (void *) val };
+        MDB_txn *txn;
+        int rc;
+
+        rc = mdb_txn_begin(store->env, NULL, 0, &txn);
+        if (rc == 0) {
+            rc = mdb_put(txn, store->dbi, &k, &v, 0);
+            if (rc == 0) rc = mdb_txn_commit(txn);
+            else mdb_txn_abort(txn);
+        }
+        if (rc != 0) lmdb_set_error(errptr, "mdb_put", rc);
+        return;
+    }
+#endif
+    leveldb_put(store->db, store->woptions, key, klen, val, vlen, errptr);
+}
+
+void kvstore_delete(kvstore_t *store, const char *key, size_t klen, char **errptr) {
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) {
+        MDB_val k = { klen, (void *) key };
+        MDB_txn *txn;
+        int rc;
+
+        if (klen > store->max_key_size) return;
+        rc = mdb_txn_begin(store->env, NULL, 0, &txn);
+        if (rc == 0) {
+            rc = mdb_del(txn, store->dbi, &k, NULL);
+            if (rc == 0) {
+                rc = mdb_txn_commit(txn);
+            }
+            else {
+                mdb_txn_abort(txn);
+                // As with leveldb, deleting what isn't there is not an error
+                if (rc == MDB_NOTFOUND) rc = 0;
+            }
+        }
+        if (rc != 0) lmdb_set_error(errptr, "mdb_del", rc);
+        return;
+    }
+#endif
+    leveldb_delete(store->db, store->woptions, key, klen, errptr);
+}
+
+kvstore_batch_t *kvstore_batch_create(kvstore_t *store) {
+    kvstore_batch_t *batch;
+
+    batch = calloc(1, sizeof(kvstore_batch_t));
+    if (batch == NULL) return NULL;
+    batch->store = store;
+    if (store->engine == KVSTORE_LEVELDB) {
+        batch->wb = leveldb_writebatch_create();
+    }
+    return batch;
+}
+
+#ifdef HAVE_LMDB
+static void batch_append(kvstore_batch_t *batch, bool put, const char *key, size_t klen, const char *val, size_t vlen) {
+    struct batch_op op = { .put = put, .klen = klen, .vlen = vlen };
+    size_t need = sizeof(op) + klen + vlen;
+
+    if (batch->len + need > batch->size) {
+        size_t size = batch->size ? batch->size : 4096;
+        char *ops;
+
+        while (size < batch->len + need) size *= 2;
+        ops = realloc(batch->ops, size);
+        // The commit finds it short and fails, as a leveldb batch that couldn't grow would
+        if (ops == NULL) {
+            batch->size = (size_t) -1;
+            return;
+        }
+        batch->ops = ops;
+        batch->size = size;
+    }
+    memcpy(batch->ops + batch->len, &op, sizeof(op));
+    memcpy(batch->ops + batch->len + sizeof(op), key, klen);
+    if (vlen) memcpy(batch->ops + batch->len + sizeof(op) + klen, val, vlen);
+    batch->len += need;
+}
+#endif
+
+void kvstore_batch_put(kvstore_batch_t *batch, const char *key, size_t klen, const char *val, size_t vlen) {
+#ifdef HAVE_LMDB
+    if (batch->store->engine == KVSTORE_LMDB) {
+        batch_append(batch, true, key, klen, val, vlen);
+        return;
+    }
+#endif
+    leveldb_writebatch_put(batch->wb, key, klen, val, vlen);
+}
+
+void kvstore_batch_delete(kvstore_batch_t *batch, const char *key, size_t klen) {
+#ifdef HAVE_LMDB
+    if (batch->store->engine == KVSTORE_LMDB) {
+        batch_append(batch, false, key, klen, NULL, 0);
+        return;
+    }
+#endif
+    leveldb_writebatch_delete(batch->wb, key, klen);
+}
+
+void kvstore_batch_clear(kvstore_batch_t *batch) {
+    if (batch->wb) leveldb_writebatch_clear(batch->wb);
+    batch->len = 0;
+    if (batch->size == (size_t) -1) batch->size = 0;
+}
+
+void kvstore_batch_destroy(kvstore_batch_t *batch) {
+    if (batch == NULL) return;
+    if (batch->wb) leveldb_writebatch_destroy(batch->wb);
+    free(batch->ops);
+    free(batch);
+}
+
+void kvstore_write(kvstore_t *store, kvstore_batch_t *batch, char **errptr) {
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) {
+        MDB_txn *txn;
+        size_t pos = 0;
+        int rc;
+
+        if (batch->size == (size_t) -1) {
+            set_error(errptr, "lmdb: %s", "out of memory building batch");
+            return;
+        }
+        rc = mdb_txn_begin(store->env, NULL, 0, &txn);
+        if (rc != 0) {
+            lmdb_set_error(errptr, "mdb_txn_begin", rc);
+            return;
+        }
+        while (rc == 0 && pos < batch->len) {
+            struct batch_op op;
+            MDB_val k;
+            MDB_val v;
+
+            memcpy(&op, batch->ops + pos, sizeof(op));
+            k.mv_size = op.klen;
+            k.mv_data = batch->ops + pos + sizeof(op);
+            v.mv_size = op.vlen;
+            v.mv_data = batch->ops + pos + sizeof(op) + op.klen;
+            pos += sizeof(op) + op.klen + op.vlen;
+
+            if (op.put) {
+                rc = mdb_put(txn, store->dbi, &k, &v, 0);
+            }
+            else if (op.klen <= store->max_key_size) {
+                rc = mdb_del(txn, store->dbi, &k, NULL);
+                if (rc == MDB_NOTFOUND) rc = 0;
+            }
+        }
+        if (rc == 0) {
+            rc = mdb_txn_commit(txn);
+        }
+        else {
+            mdb_txn_abort(txn);
+        }
+        if (rc != 0) lmdb_set_error(errptr, "batch write", rc);
+        return;
+    }
+#endif
+    leveldb_write(store->db, store->woptions, batch->wb, errptr);
+}
+
+kvstore_snapshot_t *kvstore_snapshot_create(kvstore_t *store, char **errptr) {
+    kvstore_snapshot_t *snapshot;
+
+    snapshot = calloc(1, sizeof(kvstore_snapshot_t));
+    if (snapshot == NULL) {
+        set_error(errptr, "kvstore_snapshot_create: %s", "out of memory");
+        return NULL;
+    }
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) {
+        int rc = mdb_txn_begin(store->env, NULL, MDB_RDONLY, &snapshot->txn);
+        if (rc != 0) {
+            lmdb_set_error(errptr, "mdb_txn_begin", rc);
+            free(snapshot);
+            return NULL;
+        }
+        return snapshot;
+    }
+#endif
+    snapshot->ldb_snapshot = leveldb_create_snapshot(store->db);
+    return snapshot;
+}
+
+void kvstore_snapshot_release(kvstore_t *store, kvstore_snapshot_t *snapshot) {
+    if (snapshot == NULL) return;
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) mdb_txn_abort(snapshot->txn);
+#endif
+    if (store->engine == KVSTORE_LEVELDB) leveldb_release_snapshot(store->db, snapshot->ldb_snapshot);
+    free(snapshot);
+}
+
+kvstore_iter_t *kvstore_iter_create(kvstore_t *store, kvstore_snapshot_t *snapshot, bool fill_cache) {
+    kvstore_iter_t *iter;
+
+    iter = calloc(1, sizeof(kvstore_iter_t));
+    if (iter == NULL) return NULL;
+    iter->store = store;
+
+#ifdef HAVE_LMDB
+    if (store->engine == KVSTORE_LMDB) {
+        int rc;
+
+        if (snapshot) {
+            iter->txn = snapshot->txn;
+        }
+        else {
+            rc = mdb_txn_begin(store->env, NULL, MDB_RDONLY, &iter->txn);
+            if (rc != 0) {
+                log_print(LOG_ERR, SECTION_STATCACHE_ITER, "kvstore_iter_create: mdb_txn_begin: %s", mdb_strerror(rc));
+                free(iter);
+                return NULL;
+            }
+            iter->owns_txn = true;
+        }
+        rc = mdb_cursor_open(iter->txn, store->dbi, &iter->cursor);
+        if (rc != 0) {
+            log_print(LOG_ERR, SECTION_STATCACHE_ITER, "kvstore_iter_create: mdb_cursor_open: %s", mdb_strerror(rc));
+            if (iter->owns_txn) mdb_txn_abort(iter->txn);
+            free(iter);
+            return NULL;
+        }
+        return iter;
+    }
+#endif
+
+    if (snapshot) {
+        iter->snapshot_roptions = leveldb_readoptions_create();
+        leveldb_readoptions_set_snapshot(iter->snapshot_roptions, snapshot->ldb_snapshot);
+        leveldb_readoptions_set_fill_cache(iter->snapshot_roptions, fill_cache);
+        iter->ldb_iter = leveldb_create_iterator(store->db, iter->snapshot_roptions);
+    }
+    else {
+        iter->ldb_iter = leveldb_create_iterator(store->db, fill_cache ? store->roptions : store->nofill_roptions);
+    }
+    return iter;
+}
+
+void kvstore_iter_destroy(kvstore_iter_t *iter) {
+    if (iter == NULL) return;
+#ifdef HAVE_LMDB
+    if (iter->cursor) mdb_cursor_close(iter->cursor);
+    if (iter->owns_txn) mdb_txn_abort(iter->txn);
+#endif
+    if (iter->ldb_iter) leveldb_iter_destroy(iter->ldb_iter);
+    if (iter->snapshot_roptions) leveldb_readoptions_destroy(iter->snapshot_roptions);
+    free(iter);
+}
+
+#ifdef HAVE_LMDB
+static void lmdb_iter_move(kvstore_iter_t *iter, MDB_cursor_op op) {
+    int rc = mdb_cursor_get(iter->cursor, &iter->key, &iter->value, op);
+
+    iter->valid = (rc == 0);
+    if (rc != 0 && rc != MDB_NOTFOUND) {
+        log_print(LOG_ERR, SECTION_STATCACHE_ITER, "kvstore_iter: mdb_cursor_get: %s", mdb_strerror(rc));
+    }
+}
+#endif
+
+void kvstore_iter_seek(kvstore_iter_t *iter, const char *key, size_t klen) {
+#ifdef HAVE_LMDB
+    if (iter->store->engine == KVSTORE_LMDB) {
+        size_t max = iter->store->max_key_size;
+
+        // lmdb won't take a seek key longer than a stored one could be. Seek to its longest
+        // prefix instead, which sorts no later, then step past what sorts before the key.
+        iter->key.mv_size = klen < max ? klen : max;
+        iter->key.mv_data = (void *) key;
+        lmdb_iter_move(iter, MDB_SET_RANGE);
+        while (klen > max && iter->valid) {
+            size_t len = iter->key.mv_size < klen ? iter->key.mv_size : klen;
+            int cmp = memcmp(iter->key.mv_data, key, len);
+            if (cmp > 0 || (cmp == 0 && iter->key.mv_size >= klen)) break;
+            lmdb_iter_move(iter, MDB_NEXT);
+        }
+        return;
+    }
+#endif
+    leveldb_iter_seek(iter->ldb_iter, key, klen);
+}
+
+void kvstore_iter_seek_to_first(kvstore_iter_t *iter) {
+#ifdef HAVE_LMDB
+    if (iter->store->engine == KVSTORE_LMDB) {
+        lmdb_iter_move(iter, MDB_FIRST);
+        return;
+    }
+#endif
+    leveldb_iter_seek_to_first(iter->ldb_iter);
+}
+
+bool kvstore_iter_valid(const kvstore_iter_t *iter) {
+#ifdef HAVE_LMDB
+    if (iter->store->engine == KVSTORE_LMDB) return iter->valid;
+#endif
+    return leveldb_iter_valid(iter->ldb_iter);
+}
+
+void kvstore_iter_next(kvstore_iter_t *iter) {
+#ifdef HAVE_LMDB
+    if (iter->store->engine == KVSTORE_LMDB) {
+        lmdb_iter_move(iter, MDB_NEXT);
+        return;
+    }
+#endif
+    leveldb_iter_next(iter->ldb_iter);
+}
+
+const char *kvstore_iter_key(const kvstore_iter_t *iter, size_t *klen) {
+#ifdef HAVE_LMDB
+    if (iter->store->engine == KVSTORE_LMDB) {
+        *klen = iter->key.mv_size;
+        return iter->key.mv_data;
+    }
+#endif
+    return leveldb_iter_key(iter->ldb_iter, klen);
+}
+
+const char *kvstore_iter_value(const kvstore_iter_t *iter, size_t *vlen) {
+#ifdef HAVE_LMDB
+    if (iter->store->engine == KVSTORE_LMDB) {
+        *vlen = iter->value.mv_size;
+        return iter->value.mv_data;
+    }
+#endif
+    return leveldb_iter_value(iter->ldb_iter, vlen);
+}
@@ -0,0 +1,102 @@
+#ifndef fookvstorehfoo
+#define fookvstorehfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The metadata store the stat cache and the file cache share: an ordered map of byte-string
+ * keys, with the calls they need of it. Errors come back as a malloc'd string in *errptr, and
+ * values from kvstore_get are malloc'd, as with leveldb's C API, which this mirrors.
+ * Keys and values returned by an iterator are only good until it moves.
+ *
+ * Two engines:
+ *   leveldb: the default
+ *   lmdb:    a memory-mapped B-tree (configure --with-lmdb). Reads copy straight out of the
+ *            map, and there is no compaction; writes are serialized and each is its own
+ *            transaction. Keys are limited to kvstore_max_key_size.
+ */
+typedef struct kvstore kvstore_t;
+typedef struct kvstore_iter kvstore_iter_t;
+typedef struct kvstore_batch kvstore_batch_t;
+typedef struct kvstore_snapshot kvstore_snapshot_t;
+
+enum kvstore_engine {
+    KVSTORE_LEVELDB,
+    KVSTORE_LMDB,
+};
+
+struct kvstore_options {
+    enum kvstore_engine engine;
+    // leveldb; zero leaves leveldb's default. A zero bloom_bits_per_key means no filter policy.
+    size_t block_cache_size; // bytes
+    size_t write_buffer_size; // bytes
+    int bloom_bits_per_key;
+    int max_open_files;
+    // lmdb; the most the store can grow to. Address space only, until used.
+    size_t map_size; // bytes
+};
+
+// For kvstore_property, the engine's own statistics
+#define KVSTORE_PROPERTY_STATS "stats"
+
+bool kvstore_engine_parse(const char *name, enum kvstore_engine *engine);
+const char *kvstore_engine_name(enum kvstore_engine engine);
+
+kvstore_t *kvstore_open(const char *path, const struct kvstore_options *options, char **errptr);
+void kvstore_close(kvstore_t *store);
+enum kvstore_engine kvstore_engine(kvstore_t *store);
+// Longest key the engine takes, counting any trailing NUL; 0 for no limit
+size_t kvstore_max_key_size(kvstore_t *store);
+char *kvstore_property(kvstore_t *store, const char *name);
+void kvstore_free(void *ptr);
+
+char *kvstore_get(kvstore_t *store, const char *key, size_t klen, size_t *vallen, char **errptr);
+// Copies up to buflen bytes of the value into buf, without allocating; false if there is none
+bool kvstore_get_into(kvstore_t *store, const char *key, size_t klen, void *buf, size_t buflen, size_t *vallen, char **errptr);
+void kvstore_put(kvstore_t *store, const char *key, size_t klen, const char *val, size_t vlen, char **errptr);
+void kvstore_delete(kvstore_t *store, const char *key, size_t klen, char **errptr);
+
+// Applied all together or not at all, by kvstore_write
+kvstore_batch_t *kvstore_batch_create(kvstore_t *store);
+void kvstore_batch_put(kvstore_batch_t *batch, const char *key, size_t klen, const char *val, size_t vlen);
+void kvstore_batch_delete(kvstore_batch_t *batch, const char *key, size_t klen);
+void kvstore_batch_clear(kvstore_batch_t *batch);
+void kvstore_batch_destroy(kvstore_batch_t *batch);
+void kvstore_write(kvstore_t *store, kvstore_batch_t *batch, char **errptr);
+
+// A consistent view for iterators; destroy the iterators before releasing it
+kvstore_snapshot_t *kvstore_snapshot_create(kvstore_t *store, char **errptr);
+void kvstore_snapshot_release(kvstore_t *store, kvstore_snapshot_t *snapshot);
+
+/* Iterators see the store as of their creation, or of snapshot if given. fill_cache false
+ * keeps a scan from evicting the hot set from leveldb's block cache. kvstore_iter_create
+ * returns NULL if it fails, as under lmdb it can; the other calls want a real iterator.
+ */
+kvstore_iter_t *kvstore_iter_create(kvstore_t *store, kvstore_snapshot_t *snapshot, bool fill_cache);
+void kvstore_iter_destroy(kvstore_iter_t *iter);
+void kvstore_iter_seek(kvstore_iter_t *iter, const char *key, size_t klen);
+void kvstore_iter_seek_to_first(kvstore_iter_t *iter);
+bool kvstore_iter_valid(const kvstore_iter_t *iter);
+void kvstore_iter_next(kvstore_iter_t *iter);
+const char *kvstore_iter_key(const kvstore_iter_t *iter, size_t *klen);
+const char *kvstore_iter_value(const kvstore_iter_t *iter, size_t *vlen);
+
+#endif
@@ -26,11 +26,16 @@
 #include <syscall.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "log.h"
 #include "log_sections.h"
 #include "session.h"
 #include "fusedav_config.h"
+#include "stats.h"
+#include "util.h"
 
 __thread unsigned int LOG_DYNAMIC = LOG_INFO;
 
@@ -167,47 +172,243 @@ int logging(unsigned int log_level, unsigned int section) {
     return log_level <= local_log_level;
 }
 
-static int print_it(const char const *formatwithtid, const char const *msg, int log_level) {
+// A thread's tid doesn't change, so make the syscall once per thread rather than twice per message
+static __thread pid_t log_tid = 0;
+
+static pid_t thread_id(void) {
+    if (log_tid == 0) log_tid = syscall(SYS_gettid);
+    return log_tid;
+}
+
+static int print_it(const char *msg, int log_level, pid_t tid) {
     int ret;
     // fusedav-valhalla standardizing on names BINDING, SITE, and ENVIRONMENT
-    ret = sd_journal_send("MESSAGE=%s%s", formatwithtid, msg,
+    ret = sd_journal_send("MESSAGE=%s", msg,
                           "PRIORITY=%d", log_level,
                           "USER_AGENT=%s", get_user_agent(),
                           "SITE=%s", log_key_value[BASEURL_FOURTH],
                           "ENVIRONMENT=%s", log_key_value[BASEURL_SIXTH],
                           "HOST_ADDRESS=%s", log_key_value[BASEURL_SECOND],
-                          "TID=%lu", syscall(SYS_gettid),
+                          "TID=%d", tid,
                           "PACKAGE_VERSION=%s", PACKAGE_VERSION,
                           NULL);
     return ret;
 }
 
 #define max_msg_sz 2048
+#define max_prefix_sz 128
+
+/* The journald writer. sd_journal_send is a blocking sendmsg to the journal socket, which during an
+ * incident, with dynamic logging on, is when it backs up. With log_ring_size set, log_print copies
+ * the formatted message into a bounded ring and a writer thread sends it on, so a FUSE thread never
+ * waits on the journal. When the ring is full the message is dropped and counted, rather than
+ * blocking; the writer logs how many it lost once it catches up.
+ *
+ * The ring is the usual bounded queue of sequenced slots: a producer claims a slot by advancing
+ * head with a CAS, fills it, and publishes it by setting its seq to position + 1; the writer takes
+ * slots in order and hands each back for the next lap by setting seq to position + size.
+ */
+struct log_entry {
+    unsigned long seq;
+    int log_level;
+    pid_t tid;
+    char msg[max_prefix_sz + max_msg_sz];
+};
+
+static struct {
+    struct log_entry *entries;
+    unsigned long mask;
+    bool running;
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long dropped;
+    unsigned long tail __attribute__((aligned(64)));
+    unsigned long reported;
+    bool idle;
+    bool stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+} ring = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static bool ring_push(const char *msg, int log_level, pid_t tid) {
+    unsigned long pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+    struct log_entry *entry;
+
+    for (;;) {
+        long diff;
+
+        entry = &ring.entries[pos & ring.mask];
+        diff = (long) (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring.head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        }
+        else if (diff < 0) {
+            // The writer hasn't sent this slot's last lap yet, so the ring is full
+            __atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+            BUMP(log_dropped);
+            return false;
+        }
+        else {
+            pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+        }
+    }
+
+    entry->log_level = log_level;
+    entry->tid = tid;
+    strncpy(entry->msg, msg, sizeof(entry->msg) - 1);
+    entry->msg[sizeof(entry->msg) - 1] = '\0';
+    __atomic_store_n(&entry->seq, pos + 1, __ATOMIC_SEQ_CST);
+    BUMP(log_queued);
+
+    // Only take the mutex if the writer has gone to sleep
+    if (__atomic_load_n(&ring.idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&ring.mutex);
+        pthread_cond_signal(&ring.cond);
+        pthread_mutex_unlock(&ring.mutex);
+    }
+    return true;
+}
+
+// Called only by the writer thread, or by log_async_stop once it has gone
+static bool ring_pop(void) {
+    struct log_entry *entry = &ring.entries[ring.tail & ring.mask];
+
+    if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != ring.tail + 1) return false;
+    print_it(entry->msg, entry->log_level, entry->tid);
+    __atomic_store_n(&entry->seq, ring.tail + ring.mask + 1, __ATOMIC_RELEASE);
+    ++ring.tail;
+    return true;
+}
+
+// At most once a second, unless forced, so that under a flood the notices don't add to it
+static void ring_report_dropped(bool force) {
+    static time_t last_report = 0;
+    unsigned long dropped = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+    struct timespec now;
+    char msg[max_prefix_sz];
+
+    if (dropped == ring.reported) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!force && now.tv_sec == last_report) return;
+    last_report = now.tv_sec;
+    snprintf(msg, sizeof(msg), "[tid=%d] [bid=%s] %slog_print: ring full, dropped %lu messages",
+        thread_id(), log_key_value[USER_AGENT_ABBREV], errlevel[LOG_WARNING], dropped - ring.reported);
+    print_it(msg, LOG_WARNING, thread_id());
+    ring.reported = dropped;
+}
+
+static void *log_writer(__unused void *arg) {
+    for (;;) {
+        struct timespec deadline;
+
+        while (ring_pop());
+        ring_report_dropped(false);
+
+        pthread_mutex_lock(&ring.mutex);
+        if (ring.stop) {
+            pthread_mutex_unlock(&ring.mutex);
+            break;
+        }
+        // Say we're going to sleep before the last look, so a producer publishing now signals us.
+        // The timeout covers the producer who looked just before we said so.
+        __atomic_store_n(&ring.idle, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring.entries[ring.tail & ring.mask].seq, __ATOMIC_SEQ_CST) != ring.tail + 1) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&ring.cond, &ring.mutex, &deadline);
+        }
+        __atomic_store_n(&ring.idle, false, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&ring.mutex);
+    }
+    return NULL;
+}
+
+/* Start the writer. Call after daemonizing, since the thread wouldn't survive the fork. Until then,
+ * and if this fails, log_print sends to the journal itself.
+ */
+void log_async_start(int ring_size) {
+    unsigned long size = 1;
+
+    if (ring_size <= 0) return;
+    while (size < (unsigned long) ring_size) size <<= 1;
+
+    ring.entries = malloc(size * sizeof(struct log_entry));
+    if (ring.entries == NULL) {
+        log_print(LOG_ERR, SECTION_FUSEDAV_DEFAULT, "log_async_start: failed to allocate %lu entries", size);
+        return;
+    }
+    for (unsigned long idx = 0; idx < size; idx++) {
+        ring.entries[idx].seq = idx;
+    }
+    ring.mask = size - 1;
+    ring.head = ring.tail = 0;
+    ring.stop = false;
+
+    if (pthread_create(&ring.thread, NULL, log_writer, NULL)) {
+        log_print(LOG_ERR, SECTION_FUSEDAV_DEFAULT, "log_async_start: failed to start the writer thread");
+        free(ring.entries);
+        ring.entries = NULL;
+        return;
+    }
+    __atomic_store_n(&ring.running, true, __ATOMIC_RELEASE);
+    log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "log_async_start: %lu entries", size);
+}
+
+// Send whatever is queued and go back to logging synchronously
+void log_async_stop(void) {
+    if (!__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE)) return;
+
+    __atomic_store_n(&ring.running, false, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&ring.mutex);
+    ring.stop = true;
+    pthread_cond_signal(&ring.cond);
+    pthread_mutex_unlock(&ring.mutex);
+    pthread_join(ring.thread, NULL);
+
+    // Anything pushed by a thread that saw running just before it went false
+    while (ring_pop());
+    ring_report_dropped(true);
+    // The entries are left allocated; a thread that saw running still might be writing one
+}
+
+// Formatting goes into a per-thread buffer, so a message costs no allocation
+static __thread char log_buf[max_prefix_sz + max_msg_sz];
+
+static int emit(const char *msg, int log_level, pid_t tid) {
+    if (__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE)) {
+        ring_push(msg, log_level, tid);
+        return 0;
+    }
+    return print_it(msg, log_level, tid);
+}
+
 int log_print(unsigned int log_level, unsigned int section, const char *format, ...) {
     int ret = 0;
     if (logging(log_level, section)) {
         va_list ap;
-        char *formatwithtid;
-        char msg[max_msg_sz + 1];
+        pid_t tid = thread_id();
+        int len;
+
+        len = snprintf(log_buf, max_prefix_sz, "[tid=%d] [bid=%s] %s", tid, log_key_value[USER_AGENT_ABBREV], errlevel[log_level]);
+        if (len < 0) len = 0;
+        else if (len >= max_prefix_sz) len = max_prefix_sz - 1;
 
         va_start(ap, format);
-        vsnprintf(msg, max_msg_sz, format, ap);
-        asprintf(&formatwithtid, "[tid=%lu] [bid=%s] %s", syscall(SYS_gettid), log_key_value[USER_AGENT_ABBREV], errlevel[log_level]);
-        assert(formatwithtid);
+        vsnprintf(log_buf + len, max_msg_sz, format, ap);
+        va_end(ap);
 
         // print the intended message
-        ret = print_it(formatwithtid, msg, log_level);
+        ret = emit(log_buf, log_level, tid);
 
         // Check and see if we're no longer doing dynamic logging. If so, it will take effect after this call. Then print a message
         if (turning_off_dynamic_logging()) {
-            strcpy(msg, "revert_dynamic_logging");
-            print_it(formatwithtid, msg, log_level);
+            strcpy(log_buf + len, "revert_dynamic_logging");
+            emit(log_buf, log_level, tid);
         }
-
-        free(formatwithtid);
-        va_end(ap);
     }
 
     return ret;
 }
-
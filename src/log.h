@@ -26,3 +26,5 @@ void log_init(unsigned int log_level, const char *log_level_by_section, const ch
 int log_print(unsigned int log_level, unsigned int section, const char *format, ...);
 int logging(unsigned int log_level, unsigned int section);
 void set_dynamic_logging(void);
+void log_async_start(int ring_size);
+void log_async_stop(void);
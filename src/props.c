@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <expat.h>
 #include <curl/curl.h>
 #include <errno.h>
@@ -34,6 +35,7 @@
 #include "props.h"
 #include "session.h"
 #include "util.h"
+#include "stats.h"
 #include "filecache.h"
 #include "fusedav_config.h"
 
@@ -43,6 +45,33 @@ static G_DEFINE_QUARK(PROP, props)
 // Really an indeterminate error, so use EIO as catchall
 #define E_SC_PROPSERR EIO
 
+
+// The elements we act on. The parser is namespace-aware, so names arrive as "DAV:href";
+// each start tag is mapped to one of these once, and the rest of the parse works on the id.
+enum dav_element {
+    DAV_OTHER = 0,
+    DAV_RESPONSE,
+    DAV_HREF,
+    DAV_STATUS,
+    DAV_COLLECTION,
+    DAV_GETCONTENTLENGTH,
+    DAV_GETLASTMODIFIED,
+    DAV_CREATIONDATE,
+};
+
+// Elements nested deeper than this are still counted, just not identified
+#define PROPS_MAX_DEPTH 32
+
+// Results per batch handed to the props_result_callback
+#define PROPS_BATCH_SIZE 256
+
+// Growable buffer which is reset rather than freed, so steady-state parsing doesn't allocate
+struct props_arena {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
 struct response_state {
     char path[PATH_MAX];
     unsigned long status_code;
@@ -50,19 +79,66 @@ struct response_state {
 };
 
 struct element_state {
-    char *current_data;
-    size_t current_data_len;
+    enum dav_element stack[PROPS_MAX_DEPTH];
+    unsigned depth;
+    // Character data is only kept for the leaf elements we read. It goes in
+    // propfind_state.text, which is reset at the end of each DAV:response.
+    bool collecting;
+    size_t text_start;
+};
+
+struct props_result {
+    size_t path; // offset into propfind_state.paths
+    unsigned long status_code;
+    struct stat st;
+};
+
+struct props_batch {
+    struct props_batch *next;
+    unsigned count;
+    struct props_result results[PROPS_BATCH_SIZE];
 };
 
 struct propfind_state {
     props_result_callback callback;
     void *userdata;
-    CURL *session;
     struct response_state rstate;
     struct element_state estate;
-    bool failure;
+    // The response body, as the sink got it; parsed once the request is done
+    struct props_arena body;
+    struct props_arena text;
+    // Parsed results waiting for props_deliver
+    struct props_arena paths;
+    struct props_batch *batches;
+    struct props_batch *last_batch;
+    // Path part of the base url, so hrefs can usually be stripped without a full uri parse
+    const char *base_path;
+    size_t base_path_len;
+    uid_t uid;
+    gid_t gid;
 };
 
+static void arena_reserve(struct props_arena *arena, size_t len) {
+    size_t size = arena->size ? arena->size : 4096;
+
+    if (arena->len + len <= arena->size) return;
+
+    while (arena->len + len > size) size *= 2;
+    arena->data = realloc(arena->data, size);
+    arena->size = size;
+}
+
+// Append len bytes, keeping the arena NUL-terminated; returns the offset of what was appended
+static size_t arena_append(struct props_arena *arena, const char *s, size_t len) {
+    size_t offset = arena->len;
+
+    arena_reserve(arena, len + 1);
+    memcpy(arena->data + offset, s, len);
+    arena->len += len;
+    arena->data[arena->len] = '\0';
+    return offset;
+}
+
 static char *get_relative_path(UriUriA *base_uri, UriUriA *source_uri) {
     char *path = NULL;
     char *segment;
@@ -166,149 +242,395 @@ finish:
 }
 
 
-static void startElement(__unused void *userData, __unused const XML_Char *name, __unused const XML_Char **atts) {
+static enum dav_element dav_element_id(const XML_Char *name) {
+    if (strncmp(name, "DAV:", 4) != 0)
+        return DAV_OTHER;
+
+    name += 4;
+    switch (name[0]) {
+        case 'r':
+            if (strcmp(name, "response") == 0) return DAV_RESPONSE;
+            break;
+        case 'h':
+            if (strcmp(name, "href") == 0) return DAV_HREF;
+            break;
+        case 's':
+            if (strcmp(name, "status") == 0) return DAV_STATUS;
+            break;
+        case 'c':
+            if (strcmp(name, "collection") == 0) return DAV_COLLECTION;
+            if (strcmp(name, "creationdate") == 0) return DAV_CREATIONDATE;
+            break;
+        case 'g':
+            if (strcmp(name, "getcontentlength") == 0) return DAV_GETCONTENTLENGTH;
+            if (strcmp(name, "getlastmodified") == 0) return DAV_GETLASTMODIFIED;
+            break;
+    }
+    return DAV_OTHER;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Percent-decode len bytes of src into dst, as curl_easy_unescape does; dst is always terminated
+static void unescape_into(char *dst, size_t dst_size, const char *src, size_t len) {
+    size_t out = 0;
+
+    for (size_t idx = 0; idx < len && out < dst_size - 1; idx++) {
+        int high, low;
+        if (src[idx] == '%' && idx + 2 < len &&
+            (high = hex_value(src[idx + 1])) >= 0 && (low = hex_value(src[idx + 2])) >= 0) {
+            dst[out++] = (char) (high << 4 | low);
+            idx += 2;
+        }
+        else {
+            dst[out++] = src[idx];
+        }
+    }
+    dst[out] = '\0';
+}
+
+// Strip the base path off an href and decode the rest straight into rstate.path.
+// Returns false for anything a quick scan can't vouch for (dot segments, doubled
+// slashes, queries, hrefs outside the base); those go through get_path_beyond_base.
+static bool href_to_path(struct propfind_state *state, const char *href, size_t len) {
+    const char *pnt = href;
+    const char *end = href + len;
+
+    // An absolute url; skip the scheme and authority
+    if (*pnt != '/') {
+        pnt = strstr(href, "://");
+        if (pnt == NULL) return false;
+        pnt = strchr(pnt + 3, '/');
+        if (pnt == NULL) return false;
+    }
+
+    // Anything uri normalization would change
+    for (const char *scan = pnt; scan < end; scan++) {
+        if (*scan == '?' || *scan == '#') return false;
+        if (*scan == '/' && scan + 1 < end) {
+            if (scan[1] == '/') return false;
+            if (scan[1] == '.' && (scan + 2 == end || scan[2] == '/')) return false;
+            if (scan[1] == '.' && scan + 2 < end && scan[2] == '.' && (scan + 3 == end || scan[3] == '/')) return false;
+        }
+    }
+
+    if ((size_t) (end - pnt) < state->base_path_len || strncmp(pnt, state->base_path, state->base_path_len) != 0)
+        return false;
+    pnt += state->base_path_len;
+    // e.g. a base of /files/1 and an href of /files/12
+    if (pnt < end && *pnt != '/')
+        return false;
+
+    // Drop any trailing slash, and the leading one, which we put back below
+    if (end > pnt && end[-1] == '/') --end;
+    if (pnt < end) ++pnt;
+
+    state->rstate.path[0] = '/';
+    unescape_into(state->rstate.path + 1, PATH_MAX - 1, pnt, end > pnt ? end - pnt : 0);
+    return true;
+}
+
+static int parse_digits(const char *s, int count) {
+    int value = 0;
+
+    for (int idx = 0; idx < count; idx++) {
+        if (s[idx] < '0' || s[idx] > '9') return -1;
+        value = value * 10 + (s[idx] - '0');
+    }
+    return value;
+}
+
+// DAV:getlastmodified is an RFC 1123 date, e.g. "Tue, 14 Oct 2025 10:00:00 GMT".
+// Take that exact form apart directly; curl_getdate handles anything else.
+static time_t parse_http_date(const char *text, size_t len) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char *month_name;
+    int day, month, year, hour, minute, second;
+    int era, year_of_era, day_of_year, day_of_era;
+
+    if (len != 29 || text[3] != ',' || strcmp(text + 25, " GMT") != 0)
+        return curl_getdate(text, NULL);
+
+    day = parse_digits(text + 5, 2);
+    year = parse_digits(text + 12, 4);
+    hour = parse_digits(text + 17, 2);
+    minute = parse_digits(text + 20, 2);
+    second = parse_digits(text + 23, 2);
+    month_name = memmem(months, sizeof(months) - 1, text + 8, 3);
+    if (day < 1 || year < 1970 || hour < 0 || minute < 0 || second < 0 || month_name == NULL ||
+        (month_name - months) % 3 != 0 || text[4] != ' ' || text[7] != ' ' || text[11] != ' ' ||
+        text[16] != ' ' || text[19] != ':' || text[22] != ':')
+        return curl_getdate(text, NULL);
+    month = (month_name - months) / 3 + 1;
+
+    // Days since the epoch from the civil date
+    year -= month <= 2;
+    era = year / 400;
+    year_of_era = year - era * 400;
+    day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+    return ((time_t) era * 146097 + day_of_era - 719468) * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+static void href_to_path_slow(struct propfind_state *state, const char *href) {
+    char *relative_path = get_path_beyond_base(href);
+    char *path = NULL;
+    char *unescaped_path;
+
+    asprintf(&path, "/%s", relative_path ? relative_path : "");
+    free(relative_path);
+    unescaped_path = curl_easy_unescape(NULL, path, 0, NULL);
+    free(path);
+    strncpy(state->rstate.path, unescaped_path, PATH_MAX);
+    state->rstate.path[PATH_MAX - 1] = '\0';
+    curl_free(unescaped_path);
+}
+
+static void startElement(void *userData, const XML_Char *name, __unused const XML_Char **atts) {
     struct propfind_state *state = (struct propfind_state *) userData;
+    struct element_state *estate = &state->estate;
+    enum dav_element id = dav_element_id(name);
+
+    if (estate->depth < PROPS_MAX_DEPTH) {
+        estate->stack[estate->depth] = id;
+    }
+    ++estate->depth;
 
-    state->estate.current_data = malloc(1);
-    state->estate.current_data[0] = '\0';
-    state->estate.current_data_len = 1;
+    estate->collecting = (id == DAV_HREF || id == DAV_STATUS || id == DAV_GETCONTENTLENGTH ||
+        id == DAV_GETLASTMODIFIED || id == DAV_CREATIONDATE);
+    if (estate->collecting) {
+        estate->text_start = arena_append(&state->text, "", 0);
+    }
 }
 
 static void characterDataHandler(void *userData, const XML_Char *s, int len) {
     struct propfind_state *state = (struct propfind_state *) userData;
 
-    // Extend the size of current_data by len. If it's uninitialized,
-    // realloc will malloc for size len.
-    state->estate.current_data = realloc(state->estate.current_data, state->estate.current_data_len + len);
+    if (state->estate.collecting) {
+        arena_append(&state->text, s, len);
+    }
+}
+
+static void finish_response(struct propfind_state *state) {
+    struct stat *st = &state->rstate.st;
+    struct props_batch *batch = state->last_batch;
+    struct props_result *result;
 
-    // Copy in the new data, starting by overwriting the NUL terminator.
-    strncpy(state->estate.current_data + state->estate.current_data_len - 1, s, len);
+    // Default to a normal file if it's not explicitly a directory.
+    if (st->st_mode & S_IFDIR) {
+        st->st_mode |= 0770;
+        st->st_nlink = 3;
+    }
+    else {
+        st->st_mode |= S_IFREG | 0660;
+        st->st_nlink = 1;
+    }
+    st->st_blksize = 4096;
 
-    // Update the string length.
-    state->estate.current_data_len += len;
+    // We get st_size back, but we need to set st_blocks as well. Programs
+    // like "du" use st_blocks for their calculations.
+    if (st->st_blocks == 0 && st->st_size > 0) {
+        st->st_blocks = (st->st_size+511)/512;
+    }
 
-    // NUL-terminate the new string.
-    state->estate.current_data[state->estate.current_data_len - 1] = '\0';
+    // Default to the current time or mtime.
+    if (st->st_mtime == 0)
+        st->st_mtime = time(NULL);
+    if (st->st_atime == 0)
+        st->st_atime = st->st_mtime;
+    if (st->st_ctime == 0)
+        st->st_ctime = st->st_mtime;
+
+    st->st_uid = state->uid;
+    st->st_gid = state->gid;
+
+    log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "finish_response: Response for path: %s (code %lu, size, %lu)",
+        state->rstate.path, state->rstate.status_code, st->st_size);
+
+    if (batch == NULL || batch->count == PROPS_BATCH_SIZE) {
+        batch = calloc(1, sizeof(struct props_batch));
+        if (state->last_batch) state->last_batch->next = batch;
+        else state->batches = batch;
+        state->last_batch = batch;
+    }
+    result = &batch->results[batch->count++];
+    result->path = arena_append(&state->paths, state->rstate.path, strlen(state->rstate.path));
+    // Keep the terminator, so each path stays a string of its own
+    ++state->paths.len;
+    result->status_code = state->rstate.status_code;
+    result->st = *st;
+
+    // Reset response state.
+    memset(&state->rstate, 0, sizeof(struct response_state));
+    state->text.len = 0;
 }
 
-static void endElement(void *userData, const XML_Char *name) {
+static void endElement(void *userData, __unused const XML_Char *name) {
     struct propfind_state *state = (struct propfind_state *) userData;
+    struct element_state *estate = &state->estate;
+    enum dav_element id = DAV_OTHER;
+    const char *text = "";
+    size_t text_len = 0;
+
+    if (estate->depth > 0) --estate->depth;
+    if (estate->depth < PROPS_MAX_DEPTH) id = estate->stack[estate->depth];
+
+    if (estate->collecting) {
+        text = state->text.data + estate->text_start;
+        text_len = state->text.len - estate->text_start;
+        estate->collecting = false;
+    }
 
-    if (strcmp(name, "DAV:status") == 0) {
-        char *token_status = NULL;
-        strtok_r(state->estate.current_data, " ", &token_status);
-        state->rstate.status_code = (unsigned long) atol(strtok_r(NULL, " ", &token_status));
-    }
-    else if (strcmp(name, "DAV:href") == 0) {
-        char *path = get_path_beyond_base(state->estate.current_data);
-        char *unescaped_path = NULL;
-        asprintf(&path, "/%s", path);
-        unescaped_path = curl_easy_unescape(state->session, path, 0, NULL);
-        free(path);
-        log_print(LOG_INFO, SECTION_PROPS_DEFAULT, "DAV:href: %s", state->estate.current_data);
-        strncpy(state->rstate.path, unescaped_path, PATH_MAX);
-        state->rstate.path[PATH_MAX - 1] = '\0';
-        free(unescaped_path);
-    }
-    else if (strcmp(name, "DAV:collection") == 0) {
-        state->rstate.st.st_mode |= S_IFDIR;
-    }
-    else if (strcmp(name, "DAV:getcontentlength") == 0) {
-        state->rstate.st.st_size = atol(state->estate.current_data);
-    }
-    else if (strcmp(name, "DAV:getlastmodified") == 0) {
-        state->rstate.st.st_mtime = curl_getdate(state->estate.current_data, NULL);
-        state->rstate.st.st_atime = state->rstate.st.st_mtime;
-        log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "DAV:getlastmodified: mtime: %lu", state->rstate.st.st_mtime);
-    }
-    else if (strcmp(name, "DAV:creationdate") == 0) {
-        struct tm t;
-        strptime(state->estate.current_data, "%FT%H:%M:%S%z", &t);
-        state->rstate.st.st_ctime = mktime(&t);
-        log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "DAV:creationdate: %s (ctime: %lu)",
-            state->estate.current_data, state->rstate.st.st_ctime);
-    }
-    else if (strcmp(name, "DAV:response") == 0) {
-        GError *subgerr = NULL;
-
-        // Default to a normal file if it's not explicitly a directory.
-        if (state->rstate.st.st_mode & S_IFDIR) {
-            state->rstate.st.st_mode |= 0770;
-            state->rstate.st.st_nlink = 3;
-        }
-        else {
-            state->rstate.st.st_mode |= S_IFREG | 0660;
-            state->rstate.st.st_nlink = 1;
-        }
-        state->rstate.st.st_blksize = 4096;
-
-        // We get st_size back, but we need to set st_blocks as well. Programs
-        // like "du" use st_blocks for their calculations.
-        if (state->rstate.st.st_blocks == 0 && state->rstate.st.st_size > 0) {
-            state->rstate.st.st_blocks = (state->rstate.st.st_size+511)/512;
+    switch (id) {
+        case DAV_STATUS: {
+            // e.g. "HTTP/1.1 200 OK"
+            const char *code = text + strspn(text, " \t\r\n");
+            code = strchr(code, ' ');
+            state->rstate.status_code = code ? strtoul(code, NULL, 10) : 0;
+            break;
         }
-
-        // Default to the current time or mtime.
-        if (state->rstate.st.st_mtime == 0)
-            state->rstate.st.st_mtime = time(NULL);
-        if (state->rstate.st.st_atime == 0)
+        case DAV_HREF:
+            log_print(LOG_INFO, SECTION_PROPS_DEFAULT, "DAV:href: %s", text);
+            if (!href_to_path(state, text, text_len)) {
+                href_to_path_slow(state, text);
+            }
+            break;
+        case DAV_COLLECTION:
+            state->rstate.st.st_mode |= S_IFDIR;
+            break;
+        case DAV_GETCONTENTLENGTH:
+            state->rstate.st.st_size = atol(text);
+            break;
+        case DAV_GETLASTMODIFIED:
+            state->rstate.st.st_mtime = parse_http_date(text, text_len);
             state->rstate.st.st_atime = state->rstate.st.st_mtime;
-        if (state->rstate.st.st_ctime == 0)
-            state->rstate.st.st_ctime = state->rstate.st.st_mtime;
+            log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "DAV:getlastmodified: mtime: %lu", state->rstate.st.st_mtime);
+            break;
+        case DAV_CREATIONDATE: {
+            struct tm t;
+            memset(&t, 0, sizeof(struct tm));
+            strptime(text, "%FT%H:%M:%S%z", &t);
+            state->rstate.st.st_ctime = mktime(&t);
+            log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "DAV:creationdate: %s (ctime: %lu)",
+                text, state->rstate.st.st_ctime);
+            break;
+        }
+        case DAV_RESPONSE:
+            finish_response(state);
+            break;
+        case DAV_OTHER:
+            break;
+    }
+}
 
-        state->rstate.st.st_uid = getuid();
-        state->rstate.st.st_gid = getgid();
+static void propfind_state_init(struct propfind_state *state, props_result_callback results, void *userdata) {
+    const char *base_url = get_base_url();
+    const char *pnt = NULL;
 
-        log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "endElement: Response for path: %s (code %lu, size, %lu)",
-            state->rstate.path, state->rstate.status_code, state->rstate.st.st_size);
-        state->callback(state->userdata, state->rstate.path, state->rstate.st, state->rstate.status_code, &subgerr);
-        if (subgerr) {
-            // There's no mechanism to pass gerr back from endElement, so just print here
-            log_print(LOG_WARNING, SECTION_PROPS_DEFAULT, "endElement: Error from callback (%d : %s)",
-                subgerr->code, subgerr->message);
-            // Fall through, we still want to reset response state
-        }
+    memset(state, 0, sizeof(struct propfind_state));
+    state->callback = results;
+    state->userdata = userdata;
+    state->uid = getuid();
+    state->gid = getgid();
 
-        // Reset response state.
-        memset(&state->rstate, 0, sizeof(struct response_state));
+    // "https://host:port/some/path" -> "/some/path"
+    if (base_url && (pnt = strstr(base_url, "://")) != NULL) {
+        pnt = strchr(pnt + 3, '/');
     }
+    state->base_path = pnt ? pnt : "";
+    state->base_path_len = strlen(state->base_path);
+}
 
-    // Reset element state.
-    free(state->estate.current_data);
+// Drop what an earlier attempt parsed, but keep the arenas' memory
+static void propfind_state_reset(struct propfind_state *state) {
+    while (state->batches) {
+        struct props_batch *next = state->batches->next;
+        free(state->batches);
+        state->batches = next;
+    }
+    state->last_batch = NULL;
+    state->body.len = 0;
+    state->paths.len = 0;
+    state->text.len = 0;
+    memset(&state->rstate, 0, sizeof(struct response_state));
     memset(&state->estate, 0, sizeof(struct element_state));
 }
 
-#define PARSE_FAILURE_STR_SIZE 64
-static size_t write_parsing_callback(void *contents, size_t length, size_t nmemb, void *userp) {
-    XML_Parser parser = (XML_Parser) userp;
-    size_t real_size = length * nmemb;
-    struct propfind_state *state;
-
-    log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "Got chunk of %u bytes.", real_size);
+static void propfind_state_free(struct propfind_state *state) {
+    propfind_state_reset(state);
+    free(state->body.data);
+    free(state->text.data);
+    free(state->paths.data);
+}
 
-    state = (struct propfind_state *) XML_GetUserData(parser);
+static XML_Parser propfind_parser_create(struct propfind_state *state) {
+    XML_Parser parser = XML_ParserCreateNS(NULL, '\0');
+    XML_SetUserData(parser, state);
+    XML_SetElementHandler(parser, startElement, endElement);
+    XML_SetCharacterDataHandler(parser, characterDataHandler);
+    return parser;
+}
 
-    // Skip further parsing if we're already in a failure state.
-    if (!state->failure) {
-        if (XML_Parse(parser, contents, real_size, 0) == 0) {
-            int error_code = XML_GetErrorCode(parser);
-            char failure_str[PARSE_FAILURE_STR_SIZE + 1];
-            failure_str[0] = '\0';
-            if (contents) {
-                strncpy(failure_str, contents, PARSE_FAILURE_STR_SIZE);
-                failure_str[PARSE_FAILURE_STR_SIZE] = '\0';
+// Hand the parsed results to the callback, a batch at a time. This happens on the thread
+// which asked for the PROPFIND, as the parsing does; the callbacks use fuse_get_context and can
+// make requests of their own.
+static void props_deliver(struct propfind_state *state) {
+    for (struct props_batch *batch = state->batches; batch; batch = batch->next) {
+        for (unsigned idx = 0; idx < batch->count; idx++) {
+            struct props_result *result = &batch->results[idx];
+            GError *subgerr = NULL;
+
+            state->callback(state->userdata, state->paths.data + result->path, result->st, result->status_code, &subgerr);
+            if (subgerr) {
+                // There's no mechanism to pass gerr back per result, so just print here
+                log_print(LOG_WARNING, SECTION_PROPS_DEFAULT, "props_deliver: Error from callback (%d : %s)",
+                    subgerr->code, subgerr->message);
+                g_clear_error(&subgerr);
             }
-            log_print(LOG_NOTICE, SECTION_PROPS_DEFAULT, "write_parsing_callback: Parsing response buffer of length %u failed with error: %s -- return string: %s", real_size, XML_ErrorString(error_code), failure_str);
-            state->failure = true;
-        }
-        else {
-            log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "write_parsing_callback: Response %s", (char *)contents);
         }
     }
+}
+
+int props_parse_multistatus(const char *body, size_t len, props_result_callback results, void *userdata, GError **gerr) {
+    struct propfind_state state;
+    XML_Parser parser;
+    int ret = 0;
+
+    propfind_state_init(&state, results, userdata);
+    parser = propfind_parser_create(&state);
+
+    if (XML_Parse(parser, body, len, 1) == 0) {
+        int error_code = XML_GetErrorCode(parser);
+        g_set_error(gerr, props_quark(), E_SC_PROPSERR, "props_parse_multistatus: Parsing failed with error: %s", XML_ErrorString(error_code));
+        ret = -1;
+    }
+    else {
+        props_deliver(&state);
+    }
+
+    XML_ParserFree(parser);
+    propfind_state_free(&state);
+    return ret;
+}
 
+// The sink's write runs on the session engine's thread, so it only keeps the body for
+// simple_propfind to parse once session_perform_hedged returns
+static size_t write_buffering_callback(void *contents, size_t length, size_t nmemb, void *userp) {
+    struct props_arena *body = (struct props_arena *) userp;
+    size_t real_size = length * nmemb;
+
+    log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "Got chunk of %u bytes.", real_size);
+    arena_append(body, contents, real_size);
     return real_size;
 }
 
+#define PARSE_FAILURE_STR_SIZE 64
 int simple_propfind(const char *path, size_t depth, time_t last_updated, props_result_callback results,
         void *userdata, GError **gerr) {
     static __thread unsigned long count = 0;
@@ -321,11 +643,15 @@ int simple_propfind(const char *path, size_t depth, time_t last_updated, props_r
     // Local variables for Expat and parsing.
     XML_Parser parser = NULL;
     struct propfind_state state;
+    unsigned long start = stats_clock();
 
     int ret = -1;
 
+    propfind_state_init(&state, results, userdata);
+
     for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
         CURL *session;
+        struct session_sink_s sink;
         struct curl_slist *slist = NULL;
         char *header = NULL;
         char *query_string = NULL;
@@ -351,22 +677,12 @@ int simple_propfind(const char *path, size_t depth, time_t last_updated, props_r
             goto finish;
         }
 
-        if (parser) XML_ParserFree(parser);
-
-        // Set a blank initial state, except for the callback.
-        memset(&state, 0, sizeof(struct propfind_state));
-        state.callback = results;
-        state.userdata = userdata;
-        state.failure = false;
-        state.session = session;
+        // Start from a blank state; nothing from a failed attempt gets parsed.
+        propfind_state_reset(&state);
 
-        // Configure the parser.
-        parser = XML_ParserCreateNS(NULL, '\0');
-        XML_SetUserData(parser, &state);
-        XML_SetElementHandler(parser, startElement, endElement);
-        XML_SetCharacterDataHandler(parser, characterDataHandler);
-        curl_easy_setopt(session, CURLOPT_WRITEDATA, (void *) parser);
-        curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, write_parsing_callback);
+        memset(&sink, 0, sizeof(sink));
+        sink.write = write_buffering_callback;
+        sink.write_data = (void *) &state.body;
 
         // Add the Depth header and PROPFIND verb.
         curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, "PROPFIND");
@@ -389,10 +705,7 @@ int simple_propfind(const char *path, size_t depth, time_t last_updated, props_r
         log_print(LOG_DYNAMIC, SECTION_PROPS_DEFAULT, "simple_propfind: About to perform (%s) PROPFIND (%ul).",
             last_updated > 0 ? "progressive" : "complete", last_updated);
 
-        res = curl_easy_perform(session);
-        if(res == CURLE_OK) {
-            curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
-        }
+        res = session_perform_hedged(session, STATS_LAT_PROPFIND, &sink, &response_code);
         if (slist) curl_slist_free_all(slist);
 
         log_filesystem_nodes("simple_propfind", res, response_code, idx, path);
@@ -411,21 +724,27 @@ int simple_propfind(const char *path, size_t depth, time_t last_updated, props_r
 
     // injected error props_error_spropfindunkcode will fall through to the else clause
     if (response_code == 207 && !inject_error(props_error_spropfindunkcode)) {
-        // Finalize parsing.
-        if (state.failure || inject_error(props_error_spropfindstatefailure)) {
-            log_print(LOG_WARNING, SECTION_PROPS_DEFAULT, "simple_propfind: Could not finalize parsing of the 207 response because it's already in a failed state.");
-            g_set_error(gerr, props_quark(), E_SC_PROPSERR, "simple_propfind: Could not finalize parsing of the 207 response because it's already in a failed state.");
-            goto finish;
-        }
-
-        if (XML_Parse(parser, NULL, 0, 1) == 0 || inject_error(props_error_spropfindxmlparse)) {
+        // Parse here rather than as the body arrives, so the parser runs on this thread
+        parser = propfind_parser_create(&state);
+        if (XML_Parse(parser, state.body.data, state.body.len, 1) == 0 || inject_error(props_error_spropfindstatefailure) ||
+            inject_error(props_error_spropfindxmlparse)) {
             int error_code = XML_GetErrorCode(parser);
-            g_set_error(gerr, props_quark(), E_SC_PROPSERR, "simple_propfind: Finalizing parsing failed with error: %s", XML_ErrorString(error_code));
+            char failure_str[PARSE_FAILURE_STR_SIZE + 1];
+            failure_str[0] = '\0';
+            if (state.body.data) {
+                strncpy(failure_str, state.body.data, PARSE_FAILURE_STR_SIZE);
+                failure_str[PARSE_FAILURE_STR_SIZE] = '\0';
+            }
+            log_print(LOG_NOTICE, SECTION_PROPS_DEFAULT, "simple_propfind: Parsing response of length %u failed with error: %s -- return string: %s",
+                state.body.len, XML_ErrorString(error_code), failure_str);
+            g_set_error(gerr, props_quark(), E_SC_PROPSERR, "simple_propfind: Parsing failed with error: %s", XML_ErrorString(error_code));
             goto finish;
         }
         else {
-            log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "simple_propfind: Finished final parsing on the PROPFIND response.");
+            log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "simple_propfind: Finished parsing the PROPFIND response.");
         }
+
+        props_deliver(&state);
     }
     else if (response_code == 404 && !inject_error(props_error_spropfindunkcode)) {
         GError *subgerr = NULL;
@@ -452,9 +771,11 @@ int simple_propfind(const char *path, size_t depth, time_t last_updated, props_r
     ret = 0;
 
 finish:
+    LATENCY(STATS_LAT_PROPFIND, start);
     asprintf(&description, "%s-propfinds", last_updated > 0 ? "progressive" : "complete");
     aggregate_log_print_server(LOG_INFO, SECTION_ENHANCED, "simple_propfind", &previous_time, description, &count, 1, NULL, NULL, 0);
     free(description);
-    XML_ParserFree(parser);
+    if (parser) XML_ParserFree(parser);
+    propfind_state_free(&state);
     return ret;
 }
@@ -27,5 +27,7 @@
 
 typedef void (*props_result_callback)(void *userdata, const char *href, struct stat st, unsigned long status_code, GError **gerr);
 int simple_propfind(const char *path, size_t depth, time_t last_updated, props_result_callback results, void *userdata, GError **gerr);
+// Parse a complete multistatus body that is already in memory, e.g. for tests/propfind-parse
+int props_parse_multistatus(const char *body, size_t len, props_result_callback results, void *userdata, GError **gerr);
 
 #endif
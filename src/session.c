@@ -22,7 +22,9 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include <curl/curl.h>
 #include <netdb.h>
@@ -42,6 +44,7 @@
 #include "log_sections.h"
 #include "util.h"
 #include "session.h"
+#include "stats.h"
 
 static pthread_once_t session_once = PTHREAD_ONCE_INIT;
 static pthread_key_t session_tsd_key;
@@ -54,6 +57,12 @@ static pthread_key_t session_tsd_key;
 // Grab the node address out of the curl message and keep track for later logging
 #define LOGSTRSZ 80
 static __thread char nodeaddr[LOGSTRSZ];
+// What the most recent request on this thread cost in connections, and whether it rode an HTTP/2 stream
+static __thread long request_connects;
+static __thread bool request_multiplexed;
+// The node session_request_init steered this thread's request to, or -1, and the CURLOPT_CONNECT_TO which does it
+static __thread int request_node = -1;
+static __thread struct curl_slist *request_connect_to;
 
 // REVIEW: We track connection health thread-by-thread. Ultimately all threads should have a similar view of the health
 // of the system. We don't want to take a node out of rotation for long periods of time, so we enter them back into
@@ -100,6 +109,17 @@ int num_filesystem_server_nodes = 3;
 
 static __thread time_t session_start_time;
 
+static void session_engine_stop(void);
+
+// HTTP/2 multiplexing; see session_config_multiplex
+static bool use_http2 = false;
+static long max_streams_per_node = 100;
+
+// Node selection, and hedging of idempotent requests; see session_config_balance
+static enum session_balance balance = SESSION_BALANCE_RANDOM;
+static unsigned hedge_permille = 0;
+static unsigned long hedge_min_delay_us = 0;
+
 static char *ca_certificate = NULL;
 static char *client_certificate = NULL;
 static char *base_url = NULL;
@@ -172,7 +192,46 @@ int session_config_init(char *base, char *ca_cert, char *client_cert) {
     return 0;
 }
 
+/* Multiplex requests over HTTP/2 to the filesystem nodes. Must be called before the first request,
+ * since the engine reads it when it starts. max_streams caps the concurrent streams on each node
+ * connection; 0 or less leaves libcurl's default.
+ */
+void session_config_multiplex(bool http2, int max_streams) {
+    if (http2 && !(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2)) {
+        log_print(LOG_WARNING, SECTION_SESSION_DEFAULT, "session_config_multiplex: libcurl lacks HTTP/2 support; staying with HTTP/1.1");
+        http2 = false;
+    }
+    use_http2 = http2;
+    if (max_streams > 0) max_streams_per_node = max_streams;
+    log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "session_config_multiplex: http2 %d, max_streams_per_node %ld",
+        use_http2, max_streams_per_node);
+}
+
+bool session_balance_parse(const char *name, enum session_balance *mode) {
+    if (strcmp(name, "random") == 0) *mode = SESSION_BALANCE_RANDOM;
+    else if (strcmp(name, "least_loaded") == 0) *mode = SESSION_BALANCE_LEAST_LOADED;
+    else if (strcmp(name, "p2c") == 0) *mode = SESSION_BALANCE_P2C;
+    else return false;
+    return true;
+}
+
+/* How requests are spread over the filesystem nodes. Must be called before the first request.
+ * mode other than random steers each request to the node with the least latency and load (see
+ * node_select). percentile, from 1 to 99, hedges GETs and PROPFINDs made with session_perform_hedged:
+ * one that has had no response by that percentile of recent times to first byte, and no sooner
+ * than min_delay_ms, is sent to a second node as well, and the first to answer is used. 0 disables.
+ */
+void session_config_balance(enum session_balance mode, int percentile, int min_delay_ms) {
+    balance = mode;
+    if (percentile > 99) percentile = 99;
+    hedge_permille = percentile > 0 ? percentile * 10 : 0;
+    hedge_min_delay_us = min_delay_ms > 0 ? min_delay_ms * 1000UL : 0;
+    log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "session_config_balance: balance %d, hedge permille %u, min delay %lu us",
+        balance, hedge_permille, hedge_min_delay_us);
+}
+
 void session_config_free(void) {
+    session_engine_stop();
     free(base_url);
     free(ca_certificate);
     free(client_certificate);
@@ -195,6 +254,8 @@ static void handle_cleanup(void *s) {
     // Free the resolve_slist before exiting the session
     curl_slist_free_all(node_status.resolve_slist);
     node_status.resolve_slist = NULL;
+    curl_slist_free_all(request_connect_to);
+    request_connect_to = NULL;
     curl_easy_cleanup(session);
 }
 
@@ -226,20 +287,19 @@ static char * logstr(char *addr) {
  * will help us know that we are accessing the nodes in a balanced way.
  * (We access the filesystem nodes via a domain which resolves to many
  * A records or IP addrs; our mechanism chooses one of those A records (IP addr).
- * We know the address used because we capture the libcurl message
- * "Trying <ip addr>...". Kind of clunky since the message can change. Do
- * we have a better way?
+ * We used to capture the libcurl message "Trying <ip addr>...", but the debug
+ * callback now runs on the engine thread, not on the thread which owns nodeaddr.
+ * So ask the handle for the address it used once the request completes.
  */
-static void print_ipaddr_pair(char *msg) {
-    // nodeaddr is global so it can be reused in later logging
-    char *end;
-    // msg+9 takes us past "  Trying ". We assume the ip addr starts there.
-    strncpy(nodeaddr, msg + 9, LOGSTRSZ);
+static void print_ipaddr_pair(CURL *session) {
+    // nodeaddr is thread-local so it can be reused in later logging
+    char *ipaddr = NULL;
+
+    curl_easy_getinfo(session, CURLINFO_PRIMARY_IP, &ipaddr);
+    // No address means we never got as far as a connection; keep the previous one
+    if (ipaddr == NULL || ipaddr[0] == '\0') return;
+    strncpy(nodeaddr, ipaddr, LOGSTRSZ);
     nodeaddr[LOGSTRSZ - 1] = '\0'; // Just make sure it's null terminated
-    // end finds the first two dots after the ip addr. We put a zero there
-    // to turn the original string into just the IP addr.
-    end = strstr(nodeaddr, "..");
-    end[0] = '\0';
     // Change dots in addr to underscore for logging
     logstr(nodeaddr);
     // We print the key=value pair.
@@ -253,22 +313,580 @@ static int session_debug(__unused CURL *handle, curl_infotype type, char *data,
             strncpy(msg, data, size);
             msg[size] = '\0';
             if (msg[size - 1] == '\n') msg[size - 1] = '\0';
-            // We want to see the "Trying <ip addr> message, but the others only when in some
-            // level of debug
-            if (strstr(msg, "Trying")) {
-                log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "cURL: %s", msg);
-                print_ipaddr_pair(msg);
-            }
-            else {
-                // TODO Make LOG_DYNAMIC but make sure first it won't overwhelm the system
-                log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "cURL: %s", msg);
-            }
+            // TODO Make LOG_DYNAMIC but make sure first it won't overwhelm the system
+            log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "cURL: %s", msg);
             free(msg);
         }
     }
     return 0;
 }
 
+/* Node health, shared by every thread and the engine. Where each thread's node_status only learns of
+ * a sick node by failing on it, this table follows every request: each node keeps an EWMA of its time
+ * to first byte, and a count of the requests in flight to it. construct_resolve_slist adds each node it
+ * resolves. A slot, once claimed, is never freed or reused, so readers take no lock, and the fields are
+ * updated with atomics; two updates racing may lose a sample, which an average can afford.
+ * With load_balance set, session_request_init steers each request with CURLOPT_CONNECT_TO, which
+ * (unlike the resolve slist) also decides which pooled connection is reused, to the node node_select
+ * picks, and the engine uses it to pick the node for a hedge.
+ */
+#define NODE_SLOT_EMPTY 0
+#define NODE_SLOT_CLAIMED 1
+#define NODE_SLOT_READY 2
+// Each new sample is weighted 1/8 in the EWMA
+#define NODE_EWMA_SHIFT 3
+// A node's EWMA halves for each of these without a sample, so a node which was slow gets tried again
+#define NODE_EWMA_DECAY_US 10000000UL
+// A node which failed within this long is only picked if they all have; as saint_mode_duration
+#define NODE_FAILURE_PENALTY_US 10000000UL
+
+struct node_health_s {
+    int state;
+    char ipaddr[IPSTR_SZ]; // as inet_ntop has it, not logstr's
+    unsigned long ewma_us;
+    unsigned long sampled_at; // stats_clock() at the last sample
+    unsigned long failed_at;
+    int inflight;
+};
+
+static struct node_health_s node_table[MAX_NODES];
+
+// The node's slot, which is claimed for it if add; -1 if it has none, or there is no room
+static int node_lookup(const char *ipaddr, bool add) {
+    for (int idx = 0; idx < MAX_NODES; idx++) {
+        struct node_health_s *node = &node_table[idx];
+        int state = __atomic_load_n(&node->state, __ATOMIC_ACQUIRE);
+
+        if (state == NODE_SLOT_EMPTY) {
+            if (!add) return -1;
+            if (__atomic_compare_exchange_n(&node->state, &state, NODE_SLOT_CLAIMED, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                strncpy(node->ipaddr, ipaddr, IPSTR_SZ - 1);
+                __atomic_store_n(&node->state, NODE_SLOT_READY, __ATOMIC_RELEASE);
+                log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "node_lookup: added node %s at %d", ipaddr, idx);
+                return idx;
+            }
+            // Another thread got there first; see whose slot it is
+        }
+        while (state == NODE_SLOT_CLAIMED) {
+            sched_yield();
+            state = __atomic_load_n(&node->state, __ATOMIC_ACQUIRE);
+        }
+        if (strcmp(node->ipaddr, ipaddr) == 0) return idx;
+    }
+    return -1;
+}
+
+// The node a finished request went to, by the address it connected to
+static int node_find(CURL *session) {
+    char *ipaddr = NULL;
+
+    curl_easy_getinfo(session, CURLINFO_PRIMARY_IP, &ipaddr);
+    if (ipaddr == NULL || ipaddr[0] == '\0') return -1;
+    return node_lookup(ipaddr, false);
+}
+
+static unsigned long node_decay(unsigned long ewma, unsigned long sampled_at, unsigned long now) {
+    unsigned long idle;
+
+    // Another thread may have sampled since we read the clock
+    if (sampled_at >= now) return ewma;
+    idle = (now - sampled_at) / NODE_EWMA_DECAY_US;
+    return idle < 64 ? ewma >> idle : 0;
+}
+
+// Lower is better: the expected wait, were the node to work through what it has in flight one by one
+static unsigned long node_cost(int idx, unsigned long now) {
+    const struct node_health_s *node = &node_table[idx];
+    unsigned long failed_at = __atomic_load_n(&node->failed_at, __ATOMIC_RELAXED);
+    int inflight = __atomic_load_n(&node->inflight, __ATOMIC_RELAXED);
+    unsigned long ewma = node_decay(__atomic_load_n(&node->ewma_us, __ATOMIC_RELAXED),
+        __atomic_load_n(&node->sampled_at, __ATOMIC_RELAXED), now);
+
+    if (failed_at != 0 && (failed_at >= now || now - failed_at < NODE_FAILURE_PENALTY_US)) return ULONG_MAX;
+    // A node without samples costs next to nothing, so it gets some
+    return (ewma + 1) * (inflight > 0 ? inflight + 1 : 1);
+}
+
+/* Pick a node other than exclude (-1 for none): the least costly of them all, or for p2c, the less
+ * costly of two picked at random, which keeps every thread from piling onto the one node which looks
+ * best. -1 if there is no other node.
+ */
+static int node_select(enum session_balance how, int exclude) {
+    static __thread unsigned int seed = 0;
+    int candidates[MAX_NODES];
+    int count = 0;
+    unsigned long now = stats_clock();
+    unsigned long best_cost;
+    int start;
+    int best;
+
+    if (seed == 0) seed = (unsigned int)now ^ (unsigned int)pthread_self();
+
+    for (int idx = 0; idx < MAX_NODES; idx++) {
+        int state = __atomic_load_n(&node_table[idx].state, __ATOMIC_ACQUIRE);
+        if (state == NODE_SLOT_EMPTY) break;
+        if (state == NODE_SLOT_READY && idx != exclude) candidates[count++] = idx;
+    }
+    if (count == 0) return -1;
+
+    if (how == SESSION_BALANCE_P2C && count > 2) {
+        int first = rand_r(&seed) % count;
+        int second = rand_r(&seed) % (count - 1);
+
+        if (second >= first) ++second;
+        first = candidates[first];
+        second = candidates[second];
+        return node_cost(second, now) < node_cost(first, now) ? second : first;
+    }
+
+    // Least loaded; with two nodes or fewer, p2c comes to the same. Start anywhere, so ties spread out.
+    start = rand_r(&seed) % count;
+    best = candidates[start];
+    best_cost = node_cost(best, now);
+    for (int offset = 1; offset < count; offset++) {
+        int candidate = candidates[(start + offset) % count];
+        unsigned long cost = node_cost(candidate, now);
+
+        if (cost < best_cost) {
+            best = candidate;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+static struct curl_slist *node_connect_to(struct curl_slist *slist, int idx) {
+    const char *ipaddr = node_table[idx].ipaddr;
+    // As in a URL, an IPv6 address goes in brackets
+    bool ipv6 = strchr(ipaddr, ':') != NULL;
+    char entry[IPSTR_SZ * 2];
+
+    snprintf(entry, sizeof(entry), "%s:%s:%s%s%s:%s", filesystem_domain, filesystem_port,
+        ipv6 ? "[" : "", ipaddr, ipv6 ? "]" : "", filesystem_port);
+    return curl_slist_append(slist, entry);
+}
+
+static void node_start(int idx) {
+    if (idx >= 0) __atomic_add_fetch(&node_table[idx].inflight, 1, __ATOMIC_RELAXED);
+}
+
+static void node_done(int idx) {
+    if (idx >= 0) __atomic_sub_fetch(&node_table[idx].inflight, 1, __ATOMIC_RELAXED);
+}
+
+// at_least for a request cut short, which took latency_us and would have taken longer
+static void node_sample(int idx, bool failed, bool at_least, unsigned long latency_us) {
+    struct node_health_s *node = &node_table[idx];
+    unsigned long now = stats_clock();
+    unsigned long sampled_at;
+    unsigned long ewma;
+    unsigned long next;
+
+    if (failed) {
+        __atomic_store_n(&node->failed_at, now, __ATOMIC_RELAXED);
+        return;
+    }
+    sampled_at = __atomic_load_n(&node->sampled_at, __ATOMIC_RELAXED);
+    ewma = __atomic_load_n(&node->ewma_us, __ATOMIC_RELAXED);
+    do {
+        unsigned long decayed = node_decay(ewma, sampled_at, now);
+
+        if (at_least && latency_us < decayed) latency_us = decayed;
+        next = decayed == 0 ? latency_us : decayed - (decayed >> NODE_EWMA_SHIFT) + (latency_us >> NODE_EWMA_SHIFT);
+    } while (!__atomic_compare_exchange_n(&node->ewma_us, &ewma, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_store_n(&node->sampled_at, now, __ATOMIC_RELAXED);
+}
+
+/* The I/O engine. A single thread drives one curl multi handle on behalf of every thread in the process.
+ * Callers still build their requests on their own easy handle (session_request_init), but hand it to
+ * session_perform, which queues it for the engine and waits for it to complete. Because every transfer
+ * runs on the same multi handle, connections land in one pool and a TLS connection set up by one thread
+ * is reused by the next, rather than each FUSE thread holding (and re-handshaking) its own.
+ * The multi's DNS cache is shared too, but each transfer loads its own resolve_slist as it starts, and
+ * the engine starts transfers one at a time, so per-thread node ordering still holds for new connections.
+ */
+
+// Cap on connections in the pool per filesystem node. The cap libcurl enforces is per host name, and all
+// nodes sit behind the one filesystem domain, so we scale it by the number of nodes we rotate through.
+#define SESSION_CONNECTIONS_PER_NODE 32
+// With HTTP/2, requests queue for a stream on an existing connection (CURLOPT_PIPEWAIT) and only open a
+// new one when every connection is at max_streams_per_node, so a few connections per node suffice.
+#define SESSION_H2_CONNECTIONS_PER_NODE 2
+// How long the engine sleeps in curl_multi_poll when nothing is happening; submitters wake it early
+#define SESSION_ENGINE_POLL_MS 1000
+// Hedging waits for this many times to first byte of a kind before it has a percentile to go by,
+// recomputes it every SESSION_HEDGE_RECOMPUTE, and halves the counts every SESSION_HEDGE_WINDOW, so
+// that it follows what the nodes are doing now
+#define SESSION_HEDGE_MIN_SAMPLES 100
+#define SESSION_HEDGE_RECOMPUTE 64
+#define SESSION_HEDGE_WINDOW 4096
+
+struct session_request_s;
+
+/* One transfer of a request; there are two once a request is hedged, the caller's handle and its copy.
+ * For session_perform_hedged, each writes its response through gate_write and gate_header, and only
+ * the first to get a response gets through to the caller's sink.
+ */
+struct session_gate_s {
+    struct session_request_s *request;
+    CURL *handle;
+    int node; // as steered, for its count in flight; -1 if not
+    unsigned long started; // stats_clock()
+    bool running;
+};
+
+struct session_request_s {
+    CURL *session;
+    CURLcode res;
+    bool done;
+    pthread_cond_t cond;
+    struct session_request_s *next;
+    struct session_gate_s gates[2];
+    // The rest only for session_perform_hedged, and only touched by the engine until done
+    enum stats_latency kind;
+    const struct session_sink_s *sink;
+    // The transfer whose response got through; when done, the one whose result stands
+    CURL *winner;
+    unsigned long deadline; // stats_clock() at which to hedge
+    struct curl_slist *hedge_connect_to;
+    bool hedging; // on engine.hedges
+    struct session_request_s *next_hedge;
+};
+
+// Recent times to first byte, kept by the engine thread alone
+struct session_hedge_latency_s {
+    struct stats_histogram ttfb;
+    unsigned long count;
+    unsigned long threshold; // in us; 0 until there are enough samples
+};
+
+static struct {
+    CURLM *multi;
+    CURLSH *share;
+    pthread_t thread;
+    // Protects pending, stop, and each request's done flag
+    pthread_mutex_t mutex;
+    struct session_request_s *pending;
+    bool running;
+    bool stop;
+    // Engine thread only: hedgeable requests still in flight, and what decides when to hedge them
+    struct session_request_s *hedges;
+    struct session_hedge_latency_s latency[STATS_LAT_MAX];
+} engine = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock(__unused CURL *handle, curl_lock_data data, __unused curl_lock_access access, __unused void *userp) {
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(__unused CURL *handle, curl_lock_data data, __unused void *userp) {
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+static void session_engine_complete(struct session_request_s *request, CURLcode res) {
+    pthread_mutex_lock(&engine.mutex);
+    request->res = res;
+    request->done = true;
+    pthread_cond_signal(&request->cond);
+    pthread_mutex_unlock(&engine.mutex);
+}
+
+// A transfer is over, one way or another; tell the node table how the node did
+static void session_gate_finish(struct session_gate_s *gate, CURLcode res, bool cancelled) {
+    long response_code = 0;
+    curl_off_t ttfb = 0;
+    int node = gate->node;
+
+    if (node >= 0) node_done(node);
+    else node = node_find(gate->handle);
+    if (node < 0) return;
+
+    // Stopped for being slower than its twin; we only know it would have taken at least this long
+    if (cancelled) {
+        node_sample(node, false, true, stats_clock() - gate->started);
+        return;
+    }
+    curl_easy_getinfo(gate->handle, CURLINFO_RESPONSE_CODE, &response_code);
+    // A write error is a gate stopping the slower transfer, or the caller's sink failing; the node answered either way
+    if ((res != CURLE_OK && res != CURLE_WRITE_ERROR) || response_code >= 500) {
+        node_sample(node, true, false, 0);
+        return;
+    }
+    curl_easy_getinfo(gate->handle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+    node_sample(node, false, false, ttfb);
+}
+
+static void session_gate_cancel(struct session_gate_s *gate) {
+    if (!gate->running) return;
+    curl_multi_remove_handle(engine.multi, gate->handle);
+    gate->running = false;
+    session_gate_finish(gate, CURLE_OK, true);
+}
+
+static void hedge_sample(enum stats_latency kind, unsigned long ttfb_us) {
+    struct session_hedge_latency_s *latency = &engine.latency[kind];
+
+    stats_histogram_add(&latency->ttfb, ttfb_us);
+    if (++latency->count % SESSION_HEDGE_RECOMPUTE != 0) return;
+
+    if (latency->count >= SESSION_HEDGE_WINDOW) {
+        latency->count = 0;
+        for (int idx = 0; idx < STATS_HIST_BUCKETS; idx++) {
+            latency->ttfb.buckets[idx] /= 2;
+            latency->count += latency->ttfb.buckets[idx];
+        }
+        latency->ttfb.sum /= 2;
+    }
+    if (latency->count >= SESSION_HEDGE_MIN_SAMPLES) {
+        unsigned long threshold = stats_histogram_percentile(&latency->ttfb, latency->count, hedge_permille);
+
+        latency->threshold = threshold > hedge_min_delay_us ? threshold : hedge_min_delay_us;
+    }
+}
+
+// First through the gate wins; true if that is this transfer
+static bool gate_open(struct session_gate_s *gate) {
+    struct session_request_s *request = gate->request;
+
+    if (request->winner == NULL) {
+        request->winner = gate->handle;
+        hedge_sample(request->kind, stats_clock() - request->gates[0].started);
+        if (gate == &request->gates[1]) BUMP(session_hedge_won);
+    }
+    return request->winner == gate->handle;
+}
+
+// Returning short of size * nmemb fails the transfer, which is how the slower of the two stops
+static size_t gate_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct session_gate_s *gate = userdata;
+    const struct session_sink_s *sink = gate->request->sink;
+
+    if (!gate_open(gate)) return 0;
+    return sink->write(ptr, size, nmemb, sink->write_data);
+}
+
+static size_t gate_header(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct session_gate_s *gate = userdata;
+    const struct session_sink_s *sink = gate->request->sink;
+
+    if (!gate_open(gate)) return 0;
+    if (sink->header == NULL) return size * nmemb;
+    return sink->header(ptr, size, nmemb, sink->header_data);
+}
+
+static void hedge_unlink(struct session_request_s *request) {
+    if (!request->hedging) return;
+    for (struct session_request_s **link = &engine.hedges; *link; link = &(*link)->next_hedge) {
+        if (*link == request) {
+            *link = request->next_hedge;
+            break;
+        }
+    }
+    request->hedging = false;
+}
+
+// Send a copy of the request to another node; false if there is none to send it to
+static bool session_engine_hedge(struct session_request_s *request) {
+    struct session_gate_s *gate = &request->gates[1];
+    int exclude = request->gates[0].node >= 0 ? request->gates[0].node : node_find(request->session);
+    int node = node_select(balance == SESSION_BALANCE_RANDOM ? SESSION_BALANCE_LEAST_LOADED : balance, exclude);
+    CURL *hedge;
+
+    if (node < 0) return false;
+    hedge = curl_easy_duphandle(request->session);
+    if (hedge == NULL) return false;
+
+    request->hedge_connect_to = node_connect_to(NULL, node);
+    curl_easy_setopt(hedge, CURLOPT_CONNECT_TO, request->hedge_connect_to);
+    curl_easy_setopt(hedge, CURLOPT_PRIVATE, gate);
+    curl_easy_setopt(hedge, CURLOPT_WRITEDATA, gate);
+    curl_easy_setopt(hedge, CURLOPT_HEADERDATA, gate);
+    gate->request = request;
+    gate->handle = hedge;
+    gate->node = node;
+    gate->started = stats_clock();
+    if (curl_multi_add_handle(engine.multi, hedge) != CURLM_OK) {
+        // session_perform_hedged cleans up the handle and slist
+        return false;
+    }
+    gate->running = true;
+    node_start(node);
+    BUMP(session_hedged);
+    log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "session_engine_hedge: no response after %lu us; hedging to %s",
+        gate->started - request->gates[0].started, node_table[node].ipaddr);
+    return true;
+}
+
+// Hedge whatever is due; returns how long until the next is, in ms, up to SESSION_ENGINE_POLL_MS
+static int session_engine_hedges(void) {
+    unsigned long now = stats_clock();
+    unsigned long wait_us = SESSION_ENGINE_POLL_MS * 1000UL;
+    struct session_request_s **link = &engine.hedges;
+
+    while (*link) {
+        struct session_request_s *request = *link;
+
+        if (request->winner == NULL && now < request->deadline) {
+            if (request->deadline - now < wait_us) wait_us = request->deadline - now;
+            link = &request->next_hedge;
+            continue;
+        }
+        // Answered, or due; either way it no longer waits on us
+        *link = request->next_hedge;
+        request->hedging = false;
+        if (request->winner == NULL) session_engine_hedge(request);
+    }
+    return (wait_us + 999) / 1000;
+}
+
+// A transfer is done; the request is, unless its twin is still going and may yet be the one to answer
+static void session_engine_done(struct session_gate_s *gate, CURLcode res) {
+    struct session_request_s *request = gate->request;
+    struct session_gate_s *other = &request->gates[gate == &request->gates[0] ? 1 : 0];
+
+    curl_multi_remove_handle(engine.multi, gate->handle);
+    gate->running = false;
+    session_gate_finish(gate, res, false);
+
+    if (request->winner ? request->winner != gate->handle : other->running) return;
+
+    session_gate_cancel(other);
+    request->winner = gate->handle;
+    hedge_unlink(request);
+    session_engine_complete(request, res);
+}
+
+static void *session_engine(__unused void *ptr) {
+    log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "session_engine: starting");
+
+    while (true) {
+        struct session_request_s *request;
+        struct session_request_s *next;
+        struct session_request_s *reversed = NULL;
+        CURLMsg *msg;
+        int running;
+        int queued;
+        int timeout;
+        bool stop;
+
+        // Take everything submitted since the last pass; reverse it so requests start in submission order
+        pthread_mutex_lock(&engine.mutex);
+        request = engine.pending;
+        engine.pending = NULL;
+        stop = engine.stop;
+        pthread_mutex_unlock(&engine.mutex);
+
+        for (; request; request = next) {
+            next = request->next;
+            request->next = reversed;
+            reversed = request;
+        }
+
+        for (request = reversed; request; request = next) {
+            struct session_gate_s *gate = &request->gates[0];
+            CURLMcode mres;
+
+            next = request->next;
+            gate->started = stats_clock();
+            curl_easy_setopt(request->session, CURLOPT_PRIVATE, gate);
+            // If we are stopping, fail new requests rather than start them
+            mres = stop ? CURLM_BAD_HANDLE : curl_multi_add_handle(engine.multi, request->session);
+            if (mres != CURLM_OK) {
+                log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "session_engine: curl_multi_add_handle: %s", curl_multi_strerror(mres));
+                session_engine_complete(request, CURLE_FAILED_INIT);
+                continue;
+            }
+            gate->running = true;
+            node_start(gate->node);
+            if (request->sink && engine.latency[request->kind].threshold > 0) {
+                request->deadline = gate->started + engine.latency[request->kind].threshold;
+                request->hedging = true;
+                request->next_hedge = engine.hedges;
+                engine.hedges = request;
+            }
+        }
+
+        curl_multi_perform(engine.multi, &running);
+
+        while ((msg = curl_multi_info_read(engine.multi, &queued))) {
+            if (msg->msg == CURLMSG_DONE) {
+                struct session_gate_s *gate;
+
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&gate);
+                session_engine_done(gate, msg->data.result);
+            }
+        }
+
+        if (stop && running == 0) break;
+
+        // Nothing new gets hedged once we are stopping
+        timeout = stop ? SESSION_ENGINE_POLL_MS : session_engine_hedges();
+        curl_multi_poll(engine.multi, NULL, 0, timeout, NULL);
+    }
+
+    log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "session_engine: exiting");
+    return NULL;
+}
+
+static void session_engine_init(void) {
+    long per_node = use_http2 ? SESSION_H2_CONNECTIONS_PER_NODE : SESSION_CONNECTIONS_PER_NODE;
+    long max_connections = per_node * num_filesystem_server_nodes;
+
+    for (int idx = 0; idx < CURL_LOCK_DATA_LAST; idx++) {
+        pthread_mutex_init(&share_locks[idx], NULL);
+    }
+
+    // Share TLS session ids so that even a new connection (e.g. on a bounced handle) can resume rather
+    // than do a full handshake. Connections themselves are shared by virtue of the one multi handle.
+    engine.share = curl_share_init();
+    if (engine.share) {
+        curl_share_setopt(engine.share, CURLSHOPT_LOCKFUNC, share_lock);
+        curl_share_setopt(engine.share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+        curl_share_setopt(engine.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    engine.multi = curl_multi_init();
+    if (engine.multi == NULL) {
+        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "session_engine_init: curl_multi_init failed; falling back to blocking requests");
+        return;
+    }
+    curl_multi_setopt(engine.multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_connections);
+    curl_multi_setopt(engine.multi, CURLMOPT_MAXCONNECTS, max_connections);
+    if (use_http2) {
+        curl_multi_setopt(engine.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(engine.multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_streams_per_node);
+    }
+
+    if (pthread_create(&engine.thread, NULL, session_engine, NULL)) {
+        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "session_engine_init: pthread_create failed; falling back to blocking requests");
+        curl_multi_cleanup(engine.multi);
+        engine.multi = NULL;
+        return;
+    }
+    engine.running = true;
+
+    log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "session_engine_init: engine started; max connections %ld; http2 %d",
+        max_connections, use_http2);
+}
+
+static void session_engine_stop(void) {
+    if (!engine.running) return;
+
+    pthread_mutex_lock(&engine.mutex);
+    engine.stop = true;
+    pthread_mutex_unlock(&engine.mutex);
+    curl_multi_wakeup(engine.multi);
+    pthread_join(engine.thread, NULL);
+    engine.running = false;
+
+    curl_multi_cleanup(engine.multi);
+    engine.multi = NULL;
+    // Fails harmlessly if a handle still holds on to it
+    if (engine.share) curl_share_cleanup(engine.share);
+}
+
 static CURL *session_get_handle(bool new_handle) {
     CURL *session;
 
@@ -636,6 +1254,9 @@ static int construct_resolve_slist(CURL *session, bool force) {
 
         strcat(ipstr, ipaddr);
 
+        // Before logstr has its way with ipaddr
+        node_lookup(ipaddr, true);
+
         // Check if ipstr is in hashtable, or put it there. Function returns the struct, but throw it away.
         get_health_status(logstr(ipaddr), ipstr);
         // ipstr gets strdup'ed before being made the hashtable key, so free it here
@@ -721,6 +1342,7 @@ CURL *session_request_init(const char *path, const char *query_string, bool temp
     CURL *session;
     char *full_url = NULL;
     char *escaped_path;
+    int previous_node;
     int error;
 
     // If the whole cluster is sad, avoid access altogether for a given period of time.
@@ -784,6 +1406,18 @@ CURL *session_request_init(const char *path, const char *query_string, bool temp
     curl_easy_setopt(session, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
     curl_easy_setopt(session, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
 
+    pthread_once(&engine_once, session_engine_init);
+    if (engine.share) curl_easy_setopt(session, CURLOPT_SHARE, engine.share);
+    // Bouncing the handle used to drop its connections along with it; now they live in the engine's pool.
+    // A caller asking for a new slist is retrying after a failure, so don't hand it a pooled connection
+    // to a node it is trying to get away from.
+    if (new_slist) curl_easy_setopt(session, CURLOPT_FRESH_CONNECT, 1L);
+    if (use_http2) {
+        // Only negotiated over TLS (ALPN); plain http stays on HTTP/1.1
+        curl_easy_setopt(session, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(session, CURLOPT_PIPEWAIT, 1L);
+    }
+
     error = construct_resolve_slist(session, new_slist);
     /* If we get an error from construct_resolve_slist, we didn't set up the
      * randomized slist and call CURLOPT_RESOLVE. libcurl will revert to calling
@@ -796,9 +1430,136 @@ CURL *session_request_init(const char *path, const char *query_string, bool temp
             "session_request_init: Error creating randomized resolve slist; libcurl can survive but with load imbalance");
     }
 
+    // Otherwise the resolve slist decides. A retry gets away from the node the last attempt went to.
+    previous_node = request_node;
+    request_node = -1;
+    if (balance != SESSION_BALANCE_RANDOM) {
+        request_node = node_select(balance, new_slist ? previous_node : -1);
+    }
+    if (request_node >= 0) {
+        curl_slist_free_all(request_connect_to);
+        request_connect_to = node_connect_to(NULL, request_node);
+        curl_easy_setopt(session, CURLOPT_CONNECT_TO, request_connect_to);
+        BUMP(session_balanced);
+        log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "session_request_init: steering to node %s", node_table[request_node].ipaddr);
+    }
+
     return session;
 }
 
+// Called on the requesting thread once a request completes, for log_filesystem_nodes
+static void record_request(CURL *session) {
+    long http_version = 0;
+
+    print_ipaddr_pair(session);
+    request_connects = 0;
+    curl_easy_getinfo(session, CURLINFO_NUM_CONNECTS, &request_connects);
+    curl_easy_getinfo(session, CURLINFO_HTTP_VERSION, &http_version);
+    request_multiplexed = (http_version == CURL_HTTP_VERSION_2_0);
+}
+
+static void session_set_sink(CURL *session, const struct session_sink_s *sink) {
+    curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, sink->write);
+    curl_easy_setopt(session, CURLOPT_WRITEDATA, sink->write_data);
+    curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, sink->header);
+    curl_easy_setopt(session, CURLOPT_HEADERDATA, sink->header_data);
+}
+
+// Hand the request to the engine and wait for it; without an engine, perform it here
+static CURLcode session_submit(struct session_request_s *request) {
+    struct session_gate_s *gate = &request->gates[0];
+    CURLcode res;
+
+    pthread_once(&engine_once, session_engine_init);
+
+    gate->request = request;
+    gate->handle = request->session;
+    gate->node = request_node;
+    pthread_cond_init(&request->cond, NULL);
+
+    pthread_mutex_lock(&engine.mutex);
+    if (!engine.running || engine.stop) {
+        pthread_mutex_unlock(&engine.mutex);
+        pthread_cond_destroy(&request->cond);
+        // Nothing to hedge with, so the sink can have the response directly
+        if (request->sink) session_set_sink(request->session, request->sink);
+        gate->started = stats_clock();
+        node_start(gate->node);
+        res = curl_easy_perform(request->session);
+        session_gate_finish(gate, res, false);
+        return res;
+    }
+    request->next = engine.pending;
+    engine.pending = request;
+    // Still under the mutex, so the engine cannot have seen stop and torn down the multi handle
+    curl_multi_wakeup(engine.multi);
+    pthread_mutex_unlock(&engine.mutex);
+
+    pthread_mutex_lock(&engine.mutex);
+    while (!request->done) {
+        pthread_cond_wait(&request->cond, &engine.mutex);
+    }
+    res = request->res;
+    pthread_mutex_unlock(&engine.mutex);
+    pthread_cond_destroy(&request->cond);
+
+    return res;
+}
+
+/* Perform a request prepared by session_request_init. Use in place of curl_easy_perform.
+ * The calling thread blocks until the engine completes the transfer, so write and header
+ * callbacks run on the engine thread, not the caller's.
+ */
+CURLcode session_perform(CURL *session) {
+    struct session_request_s request;
+    CURLcode res;
+
+    memset(&request, 0, sizeof(request));
+    request.session = session;
+    res = session_submit(&request);
+
+    record_request(session);
+
+    return res;
+}
+
+/* As session_perform, for an idempotent request, a GET or a PROPFIND, whose response goes to sink
+ * rather than to callbacks set on the handle. With hedging on (session_config_balance), the engine
+ * sends a copy to a second node if the first has not answered in time, and whichever answers first
+ * is delivered to sink and the other stopped. As that may not be the caller's handle, the response
+ * code comes back in response_code, which is only set on CURLE_OK.
+ */
+CURLcode session_perform_hedged(CURL *session, enum stats_latency kind, const struct session_sink_s *sink, long *response_code) {
+    struct session_request_s request;
+    CURL *answered;
+    CURLcode res;
+
+    memset(&request, 0, sizeof(request));
+    request.session = session;
+    if (hedge_permille == 0) {
+        session_set_sink(session, sink);
+    }
+    else {
+        request.kind = kind;
+        request.sink = sink;
+        curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, gate_write);
+        curl_easy_setopt(session, CURLOPT_WRITEDATA, &request.gates[0]);
+        curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, gate_header);
+        curl_easy_setopt(session, CURLOPT_HEADERDATA, &request.gates[0]);
+    }
+    res = session_submit(&request);
+
+    answered = request.winner ? request.winner : session;
+    record_request(answered);
+    if (res == CURLE_OK) {
+        curl_easy_getinfo(answered, CURLINFO_RESPONSE_CODE, response_code);
+    }
+    if (request.gates[1].handle) curl_easy_cleanup(request.gates[1].handle);
+    curl_slist_free_all(request.hedge_connect_to);
+
+    return res;
+}
+
 static void increment_node_failure(char *addr, const CURLcode res, const long response_code) {
     struct health_status_s *health_status = get_health_status(addr, NULL);
     // Currently treat !CURLE_OK and response_code > 500 the same, but leave in structure if we want to treat them differently.
@@ -827,12 +1588,18 @@ static void increment_node_success(char *addr) {
 
 void log_filesystem_nodes(const char *fcn_name, const CURLcode res, const long response_code, const int iter, const char *path) {
     static __thread unsigned long count = 0;
+    // New connections opened, and requests which were streams on a multiplexed connection
+    static __thread unsigned long connections = 0;
+    static __thread unsigned long streams = 0;
     static __thread time_t previous_time = 0;
     static __thread char previous_nodeaddr[LOGSTRSZ];
     // Print every 100th access
     const unsigned long count_trigger = 1000;
     // Print every 60th second
     const time_t time_trigger = 60;
+    // -1 is the call from handle_cleanup; there is no request to account for
+    const unsigned long this_connections = (iter != -1) ? (unsigned long)request_connects : 0;
+    const unsigned long this_streams = (iter != -1 && request_multiplexed) ? 1 : 0;
     time_t current_time;
     bool print_it;
     int nodeaddr_changed;
@@ -848,17 +1615,33 @@ void log_filesystem_nodes(const char *fcn_name, const CURLcode res, const long r
     // If this is the very first call, initialize previous to current
     if (previous_nodeaddr[0] == '\0') strncpy(previous_nodeaddr, nodeaddr, LOGSTRSZ);
     nodeaddr_changed = strncmp(nodeaddr, previous_nodeaddr, LOGSTRSZ);
+    if (!nodeaddr_changed) {
+        connections += this_connections;
+        streams += this_streams;
+    }
     // Also print if we have exceeded count
     if (print_it || count >= count_trigger || nodeaddr_changed) {
         if (nodeaddr_changed) --count; // Print for previous node, which doesn't include this call, then for this call
         log_print(LOG_INFO, SECTION_ENHANCED,
             "curl iter %d on path %s -- fusedav.%s.server-%s.attempts:%lu|c", iter, path, filesystem_cluster, previous_nodeaddr, count);
+        log_print(LOG_INFO, SECTION_ENHANCED,
+            "curl iter %d on path %s -- fusedav.%s.server-%s.connections:%lu|c", iter, path, filesystem_cluster, previous_nodeaddr, connections);
+        log_print(LOG_INFO, SECTION_ENHANCED,
+            "curl iter %d on path %s -- fusedav.%s.server-%s.streams:%lu|c", iter, path, filesystem_cluster, previous_nodeaddr, streams);
         count = 0;
+        connections = 0;
+        streams = 0;
         previous_time = current_time;
         if (nodeaddr_changed) {
             log_print(LOG_INFO, SECTION_ENHANCED,
                 "curl iter %d changed to path %s -- fusedav.%s.server-%s.attempts:%lu|c",
                 iter, path, filesystem_cluster, nodeaddr, 1);
+            log_print(LOG_INFO, SECTION_ENHANCED,
+                "curl iter %d changed to path %s -- fusedav.%s.server-%s.connections:%lu|c",
+                iter, path, filesystem_cluster, nodeaddr, this_connections);
+            log_print(LOG_INFO, SECTION_ENHANCED,
+                "curl iter %d changed to path %s -- fusedav.%s.server-%s.streams:%lu|c",
+                iter, path, filesystem_cluster, nodeaddr, this_streams);
             strncpy(previous_nodeaddr, nodeaddr, LOGSTRSZ);
         }
     }
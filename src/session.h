@@ -22,14 +22,38 @@
 #include <stdbool.h>
 #include <curl/curl.h>
 
+#include "stats.h"
+
 extern int num_filesystem_server_nodes;
 
+// How session_request_init picks the node for a request; see session_config_balance
+enum session_balance {
+    SESSION_BALANCE_RANDOM, // each thread's shuffled resolve slist
+    SESSION_BALANCE_LEAST_LOADED,
+    SESSION_BALANCE_P2C, // the better of two nodes picked at random
+};
+
+// Where session_perform_hedged delivers the response; as for CURLOPT_WRITEFUNCTION and CURLOPT_HEADERFUNCTION
+typedef size_t (*session_write_callback)(void *ptr, size_t size, size_t nmemb, void *userdata);
+
+struct session_sink_s {
+    session_write_callback write;
+    void *write_data;
+    session_write_callback header; // NULL to ignore the headers
+    void *header_data;
+};
+
 int session_config_init(char *base, char *ca_cert, char *client_cert);
 CURL *session_request_init(const char *path, const char *query_string, bool temporary_handle, bool new_slist);
+void session_config_multiplex(bool http2, int max_streams);
+bool session_balance_parse(const char *name, enum session_balance *balance);
+void session_config_balance(enum session_balance mode, int percentile, int min_delay_ms);
 void session_config_free(void);
 const char *get_base_url(void);
 char *escape_except_slashes(CURL *session, const char *path);
 void session_temp_handle_destroy(CURL *session);
+CURLcode session_perform(CURL *session);
+CURLcode session_perform_hedged(CURL *session, enum stats_latency kind, const struct session_sink_s *sink, long *response_code);
 void log_filesystem_nodes(const char *fcn_name, const CURLcode res, const long response_code, const int iter, const char *path);
 void aggregate_log_print_server(unsigned int log_level, unsigned int section, const char *name, time_t *previous_time,
     const char *description1, unsigned long *count1, unsigned long value1,
@@ -38,6 +62,7 @@ void aggregate_log_print_local(unsigned int log_level, unsigned int section, con
     const char *description1, unsigned long *count1, unsigned long value1,
     const char *description2, long *count2, long value2);
 
+extern const int saint_mode_duration;
 void set_saint_mode(void);
 bool use_saint_mode(void);
 
@@ -26,6 +26,8 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <unistd.h>
+#include <string.h>
+#include <stdint.h>
 
 #include "statcache.h"
 #include "fusedav.h"
@@ -37,15 +39,16 @@
 
 #define CACHE_TIMEOUT 3
 
-static pthread_mutex_t counter_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 struct stat_cache_entry {
     const char *key;
     const struct stat_cache_value *value;
 };
 
-// GError mechanism. The only gerrors we return from statcache are leveldb errors
-static G_DEFINE_QUARK(LDB, leveldb)
+// GError mechanism. The only gerrors we return from statcache are store errors
+static G_DEFINE_QUARK(KVS, kvstore)
+
+// The longest key, with its NUL, that both STAT_CACHE_KEY_MAX and the store allow; set at open
+static size_t key_limit = STAT_CACHE_KEY_MAX;
 
 unsigned long stat_cache_get_local_generation(void) {
     static unsigned long counter = 0;
@@ -53,17 +56,15 @@ unsigned long stat_cache_get_local_generation(void) {
 
     BUMP(statcache_local_gen);
 
-    pthread_mutex_lock(&counter_mutex);
-    if (counter == 0) {
+    // Called for every entry a PROPFIND brings in, so no mutex; only the first caller's seed sticks
+    if (__sync_fetch_and_or(&counter, 0) == 0) {
         // Top 40 bits for the timestamp. Bottom 24 bits for the counter.
         // Will be safe for at least a couple hundred years.
-        counter = time(NULL);
-        //log_print(LOG_DEBUG, SECTION_STATCACHE_DEFAULT, "Pre-shift counter: %lu", counter);
-        counter <<= 24;
-        //log_print(LOG_DEBUG, SECTION_STATCACHE_DEFAULT, "Initialized counter: %lu", counter);
+        unsigned long seed = time(NULL);
+        seed <<= 24;
+        __sync_bool_compare_and_swap(&counter, 0, seed);
     }
-    ret = ++counter;
-    pthread_mutex_unlock(&counter_mutex);
+    ret = __sync_add_and_fetch(&counter, 1);
     log_print(LOG_DEBUG, SECTION_STATCACHE_DEFAULT, "stat_cache_get_local_generation: %lu", ret);
     return ret;
 }
@@ -84,13 +85,29 @@ int print_stat(struct stat *stbuf, const char *title) {
 }
 
 void stat_cache_value_free(struct stat_cache_value *value) {
-    leveldb_free(value);
+    free(value);
 }
 
-// Allocates a new string.
-static char *path2key(const char *path, bool prefix) {
-    char *key = NULL;
+/* Stat cache keys are STAT_CACHE_KEY_PREFIX, the depth as a fixed-width decimal, then the path,
+ * e.g. "sc1:0003/sites/files/foo.php". The fixed width makes leveldb's bytewise order match
+ * numeric depth order, so every directory sorts before its descendants and prune can process
+ * the whole cache in one ordered sweep. (The original format, "<depth><path>" with an unpadded
+ * depth, sorted "10" before "6"; stat_cache_migrate_keys rewrites it at open.)
+ * STAT_CACHE_KEY_VERSION is stored under STAT_CACHE_VERSION_KEY once the cache is in this format.
+ */
+#define STAT_CACHE_KEY_VERSION 1
+#define STAT_CACHE_KEY_PREFIX "sc1:"
+#define STAT_CACHE_VERSION_KEY "stat_cache_key_version"
+#define STAT_CACHE_DEPTH_MAX 9999
+#define STAT_CACHE_MIGRATE_BATCH 1024
+
+/* Builds the key into the caller's buffer, which should be STAT_CACHE_KEY_MAX bytes;
+ * getattr is hot enough that a malloc per key shows up in the jemalloc stats.
+ * Returns NULL if the key doesn't fit.
+ */
+static char *path2key(const char *path, bool prefix, char *key, size_t keylen) {
     unsigned int depth = 0;
+    int len;
     size_t pos = 0;
     bool slash_found = false;
     size_t last_slash_pos = 0;
@@ -115,14 +132,21 @@ static char *path2key(const char *path, bool prefix) {
     // This should only be the case for the root directory
     if (prefix && slash_found && last_slash_pos == pos - 1) {
         depth--;
-        asprintf(&key, "%u%s", depth, path);
+        len = snprintf(key, keylen, STAT_CACHE_KEY_PREFIX "%04u%s", depth, path);
     }
     // If we have a prefix and the string doesn't already end in a slash, add one
     else if (prefix) {
-        asprintf(&key, "%u%s/", depth, path);
+        len = snprintf(key, keylen, STAT_CACHE_KEY_PREFIX "%04u%s/", depth, path);
     }
     else {
-        asprintf(&key, "%u%s", depth, path);
+        len = snprintf(key, keylen, STAT_CACHE_KEY_PREFIX "%04u%s", depth, path);
+    }
+
+    // PATH_MAX bounds the depth well below what four digits hold, but check anyway; a wider
+    // depth would silently break the sort order
+    if (depth > STAT_CACHE_DEPTH_MAX || len < 0 || (size_t)len >= keylen || (size_t)len >= key_limit) {
+        log_print(LOG_WARNING, SECTION_STATCACHE_DEFAULT, "path2key: key for path %s is too long", path);
+        return NULL;
     }
 
     log_print(LOG_DEBUG, SECTION_STATCACHE_DEFAULT, "path2key: %s, %i, %s", path, prefix, key);
@@ -144,62 +168,764 @@ static const char *key2path(const char *key) {
     return NULL;
 }
 
+// Same as above, for the "updated_children:" keys
+static char *updated_children_key(const char *path, char *key, size_t keylen) {
+    int len;
+
+    len = snprintf(key, keylen, "updated_children:%s", path);
+    if (len < 0 || (size_t)len >= keylen || (size_t)len >= key_limit) {
+        log_print(LOG_WARNING, SECTION_STATCACHE_DEFAULT, "updated_children_key: key for path %s is too long", path);
+        return NULL;
+    }
+    return key;
+}
+
+/* Stored stat cache values. The original format was the struct stat_cache_value itself, most
+ * of it zeros: a struct stat of which we set ten fields, and a remote_generation nothing fills.
+ * Values are now written as STAT_CACHE_VALUE_VERSION, a varint of which fields follow, then each
+ * of those fields as a varint, in stat_cache_value_field order:
+ *   atime and ctime as the difference from mtime, zigzagged, since they are mostly equal to it
+ *   blocks only if it isn't (size + 511) / 512
+ *   prepopulated as the flag alone; remote_generation as its length then its bytes
+ * Fields not set are zero, as they are in a value from the server. The struct stat fields we don't
+ * set (st_dev, st_ino, st_rdev and the nanoseconds) aren't kept.
+ * Old values are still read; they are exactly sizeof(struct stat_cache_value) long, which no
+ * encoded value can be, and are rewritten in this format as their paths are next written.
+ */
+#define STAT_CACHE_VALUE_VERSION 2
+#define STAT_CACHE_VARINT_MAX 10
+
+enum stat_cache_value_field {
+    SCV_MODE,
+    SCV_SIZE,
+    SCV_MTIME,
+    SCV_ATIME,
+    SCV_CTIME,
+    SCV_NLINK,
+    SCV_UID,
+    SCV_GID,
+    SCV_BLOCKS,
+    SCV_BLKSIZE,
+    SCV_LOCAL_GENERATION,
+    SCV_UPDATED,
+    SCV_PREPOPULATED,
+    SCV_REMOTE_GENERATION,
+    SCV_FIELDS
+};
+
+// Version byte, field bits, a varint for each field but the flag, and remote_generation's bytes
+#define STAT_CACHE_VALUE_ENCODED_MAX (1 + 3 + (SCV_FIELDS - 1) * STAT_CACHE_VARINT_MAX + RGEN_LEN)
+
+// A legacy value's length must not be one an encoded value can have
+typedef char stat_cache_value_encoded_fits[STAT_CACHE_VALUE_ENCODED_MAX < sizeof(struct stat_cache_value) ? 1 : -1];
+
+static size_t varint_put(unsigned char *buf, uint64_t value) {
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        buf[len++] = (unsigned char)value | 0x80;
+        value >>= 7;
+    }
+    buf[len++] = (unsigned char)value;
+    return len;
+}
+
+// Returns false if the buffer ends before the varint does, or it runs past 64 bits
+static bool varint_get(const unsigned char **pos, const unsigned char *end, uint64_t *value) {
+    uint64_t result = 0;
+
+    for (unsigned shift = 0; shift < 64 && *pos < end; shift += 7) {
+        unsigned char byte = *(*pos)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static uint64_t derived_blocks(const struct stat *st) {
+    return ((uint64_t)st->st_size + 511) / 512;
+}
+
+// Encodes value into buf, which should be STAT_CACHE_VALUE_ENCODED_MAX bytes; returns the length
+static size_t stat_cache_value_encode(const struct stat_cache_value *value, char *buf) {
+    uint64_t fields[SCV_FIELDS];
+    unsigned char *out = (unsigned char *)buf;
+    uint64_t present = 0;
+    size_t rgen_len;
+    size_t len = 0;
+
+    fields[SCV_MODE] = value->st.st_mode;
+    fields[SCV_SIZE] = (uint64_t)value->st.st_size;
+    fields[SCV_MTIME] = (uint64_t)value->st.st_mtime;
+    // Differences are taken modulo 2^64, so no pair of times overflows
+    fields[SCV_ATIME] = zigzag((int64_t)((uint64_t)value->st.st_atime - (uint64_t)value->st.st_mtime));
+    fields[SCV_CTIME] = zigzag((int64_t)((uint64_t)value->st.st_ctime - (uint64_t)value->st.st_mtime));
+    fields[SCV_NLINK] = value->st.st_nlink;
+    fields[SCV_UID] = value->st.st_uid;
+    fields[SCV_GID] = value->st.st_gid;
+    fields[SCV_BLOCKS] = (uint64_t)value->st.st_blocks;
+    fields[SCV_BLKSIZE] = (uint64_t)value->st.st_blksize;
+    fields[SCV_LOCAL_GENERATION] = value->local_generation;
+    fields[SCV_UPDATED] = (uint64_t)value->updated;
+    fields[SCV_PREPOPULATED] = value->prepopulated;
+    rgen_len = strnlen(value->remote_generation, RGEN_LEN - 1);
+    fields[SCV_REMOTE_GENERATION] = rgen_len;
+
+    for (int field = 0; field < SCV_FIELDS; field++) {
+        if (field == SCV_BLOCKS ? fields[field] != derived_blocks(&value->st) : fields[field] != 0) {
+            present |= 1ULL << field;
+        }
+    }
+
+    out[len++] = STAT_CACHE_VALUE_VERSION;
+    len += varint_put(out + len, present);
+    for (int field = 0; field < SCV_FIELDS; field++) {
+        if (!(present & (1ULL << field)) || field == SCV_PREPOPULATED) continue;
+        len += varint_put(out + len, fields[field]);
+    }
+    memcpy(out + len, value->remote_generation, rgen_len);
+    len += rgen_len;
+    return len;
+}
+
+// Decodes either format into value; returns false if buf is neither
+static bool stat_cache_value_decode(const char *buf, size_t len, struct stat_cache_value *value) {
+    const unsigned char *pos = (const unsigned char *)buf;
+    const unsigned char *end = pos + len;
+    uint64_t fields[SCV_FIELDS] = {0};
+    uint64_t present;
+
+    if (len == sizeof(struct stat_cache_value)) {
+        BUMP(statcache_value_legacy);
+        memcpy(value, buf, sizeof(struct stat_cache_value));
+        return true;
+    }
+
+    if (len < 2 || *pos++ != STAT_CACHE_VALUE_VERSION) return false;
+    if (!varint_get(&pos, end, &present) || present >> SCV_FIELDS) return false;
+    for (int field = 0; field < SCV_FIELDS; field++) {
+        if (!(present & (1ULL << field))) continue;
+        if (field == SCV_PREPOPULATED) {
+            fields[field] = 1;
+        }
+        else if (!varint_get(&pos, end, &fields[field])) {
+            return false;
+        }
+    }
+    if (fields[SCV_REMOTE_GENERATION] >= RGEN_LEN || (size_t)(end - pos) != fields[SCV_REMOTE_GENERATION]) return false;
+
+    memset(value, 0, sizeof(struct stat_cache_value));
+    value->st.st_mode = fields[SCV_MODE];
+    value->st.st_size = (off_t)fields[SCV_SIZE];
+    value->st.st_mtime = (time_t)fields[SCV_MTIME];
+    value->st.st_atime = (time_t)(fields[SCV_MTIME] + (uint64_t)unzigzag(fields[SCV_ATIME]));
+    value->st.st_ctime = (time_t)(fields[SCV_MTIME] + (uint64_t)unzigzag(fields[SCV_CTIME]));
+    value->st.st_nlink = fields[SCV_NLINK];
+    value->st.st_uid = fields[SCV_UID];
+    value->st.st_gid = fields[SCV_GID];
+    value->st.st_blocks = (present & (1ULL << SCV_BLOCKS)) ? (blkcnt_t)fields[SCV_BLOCKS] : (blkcnt_t)derived_blocks(&value->st);
+    value->st.st_blksize = (blksize_t)fields[SCV_BLKSIZE];
+    value->local_generation = fields[SCV_LOCAL_GENERATION];
+    value->updated = (time_t)fields[SCV_UPDATED];
+    value->prepopulated = fields[SCV_PREPOPULATED];
+    memcpy(value->remote_generation, pos, fields[SCV_REMOTE_GENERATION]);
+    return true;
+}
+
 static stat_cache_t *gcache; // Save off pointer to cache for stat_cache_walk
 
+// Count of writes to stat cache entries; lets prune skip a sweep when nothing has changed
+static unsigned long stat_cache_writes = 0;
+
+/* Paths deleted since the last prune. Deleting a directory is what leaves orphans behind,
+ * so an incremental prune only needs to revisit these subtrees rather than the whole cache.
+ * If the set grows past STAT_CACHE_DIRTY_MAX we drop it and fall back to a full sweep.
+ */
+#define STAT_CACHE_DIRTY_MAX 65536
+static pthread_mutex_t dirty_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *dirty_paths = NULL; // owns its keys; values are unused
+static bool dirty_overflow = false;
+
+static void stat_cache_mark_dirty(const char *path) {
+    pthread_mutex_lock(&dirty_mutex);
+    if (!dirty_overflow) {
+        if (dirty_paths == NULL) {
+            dirty_paths = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+        }
+        if (g_hash_table_size(dirty_paths) >= STAT_CACHE_DIRTY_MAX) {
+            log_print(LOG_INFO, SECTION_STATCACHE_PRUNE, "stat_cache_mark_dirty: dirty set full; next prune is a full sweep");
+            g_hash_table_remove_all(dirty_paths);
+            dirty_overflow = true;
+        }
+        else {
+            g_hash_table_replace(dirty_paths, strdup(path), NULL);
+        }
+    }
+    pthread_mutex_unlock(&dirty_mutex);
+}
+
+// Hands the current dirty set to the caller, who destroys it, and starts a new one.
+// Returns NULL if nothing is dirty. Sets *overflow if changes were lost to overflow.
+static GHashTable *stat_cache_take_dirty(bool *overflow) {
+    GHashTable *taken;
+
+    pthread_mutex_lock(&dirty_mutex);
+    taken = dirty_paths;
+    dirty_paths = NULL;
+    *overflow = dirty_overflow;
+    dirty_overflow = false;
+    pthread_mutex_unlock(&dirty_mutex);
+
+    if (taken != NULL && g_hash_table_size(taken) == 0) {
+        g_hash_table_destroy(taken);
+        taken = NULL;
+    }
+    return taken;
+}
+
+
+/* In-memory tier in front of leveldb.
+ * getattr is our most frequent callback, and every miss on this tier costs a path2key,
+ * a leveldb_get, and a malloc'd value. Keep a bounded set of recently used values in
+ * memory, striped over STAT_CACHE_MEM_SHARDS independently locked hash tables so
+ * concurrent FUSE threads rarely contend on the same lock. Each shard keeps an LRU list
+ * and evicts from its tail once it holds more than its share of STAT_CACHE_MEM_MAX_ENTRIES.
+ * The tier is write-through: every leveldb put or delete of a stat entry updates or
+ * invalidates the memory entry, so leveldb remains the source of truth.
+ */
+#define STAT_CACHE_MEM_SHARDS 64
+#define STAT_CACHE_MEM_MAX_ENTRIES 65536
+#define STAT_CACHE_MEM_SHARD_MAX (STAT_CACHE_MEM_MAX_ENTRIES / STAT_CACHE_MEM_SHARDS)
+
+struct stat_cache_mem_entry {
+    char *path; // owned; also the key in the shard's hash table
+    struct stat_cache_value value;
+    struct stat_cache_mem_entry *prev;
+    struct stat_cache_mem_entry *next;
+};
+
+struct stat_cache_mem_shard {
+    pthread_mutex_t lock;
+    GHashTable *table;
+    struct stat_cache_mem_entry *head; // most recently used
+    struct stat_cache_mem_entry *tail; // least recently used
+    unsigned int count;
+    // Bumped on every write or invalidation, so a reader who went to leveldb can tell
+    // whether the value it got is still current before populating this tier with it.
+    unsigned long sequence;
+};
+
+static struct stat_cache_mem_shard mem_shards[STAT_CACHE_MEM_SHARDS];
+static bool mem_tier_initialized = false;
+
+static struct stat_cache_mem_shard *mem_shard(const char *path) {
+    return &mem_shards[g_str_hash(path) % STAT_CACHE_MEM_SHARDS];
+}
+
+static void mem_entry_unlink(struct stat_cache_mem_shard *shard, struct stat_cache_mem_entry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else shard->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else shard->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void mem_entry_push_head(struct stat_cache_mem_shard *shard, struct stat_cache_mem_entry *entry) {
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head) shard->head->prev = entry;
+    shard->head = entry;
+    if (shard->tail == NULL) shard->tail = entry;
+}
+
+// The hash table does not own keys or values; removal from the table is always
+// paired with unlinking from the LRU list and freeing here.
+static void mem_entry_remove(struct stat_cache_mem_shard *shard, struct stat_cache_mem_entry *entry) {
+    g_hash_table_remove(shard->table, entry->path);
+    mem_entry_unlink(shard, entry);
+    --shard->count;
+    free(entry->path);
+    free(entry);
+}
+
+static void stat_cache_mem_init(void) {
+    for (int idx = 0; idx < STAT_CACHE_MEM_SHARDS; idx++) {
+        struct stat_cache_mem_shard *shard = &mem_shards[idx];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->table = g_hash_table_new(g_str_hash, g_str_equal);
+        shard->head = shard->tail = NULL;
+        shard->count = 0;
+        shard->sequence = 0;
+    }
+    mem_tier_initialized = true;
+}
+
+static void stat_cache_mem_destroy(void) {
+    if (!mem_tier_initialized) return;
+    mem_tier_initialized = false;
+    for (int idx = 0; idx < STAT_CACHE_MEM_SHARDS; idx++) {
+        struct stat_cache_mem_shard *shard = &mem_shards[idx];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->head) {
+            mem_entry_remove(shard, shard->head);
+        }
+        g_hash_table_destroy(shard->table);
+        shard->table = NULL;
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
+
+// On hit, copies the value into a newly malloc'd stat_cache_value, the same as leveldb_get would.
+// On miss, returns NULL and the shard's current sequence, to be passed to stat_cache_mem_fill.
+static struct stat_cache_value *stat_cache_mem_get(const char *path, unsigned long *sequence) {
+    struct stat_cache_mem_shard *shard;
+    struct stat_cache_mem_entry *entry;
+    struct stat_cache_value *value = NULL;
+
+    if (!mem_tier_initialized) return NULL;
+
+    shard = mem_shard(path);
+    pthread_mutex_lock(&shard->lock);
+    entry = g_hash_table_lookup(shard->table, path);
+    if (entry) {
+        // Move to the front of the LRU list
+        if (entry != shard->head) {
+            mem_entry_unlink(shard, entry);
+            mem_entry_push_head(shard, entry);
+        }
+        value = malloc(sizeof(struct stat_cache_value));
+        if (value) memcpy(value, &entry->value, sizeof(struct stat_cache_value));
+    }
+    *sequence = shard->sequence;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (value) BUMP(statcache_mem_hit);
+    else BUMP(statcache_mem_miss);
+
+    return value;
+}
+
+// Writers hold the shard lock across the leveldb write and the memory update,
+// so the two tiers can't be left disagreeing by concurrent writers to the same path.
+static struct stat_cache_mem_shard *stat_cache_mem_lock(const char *path) {
+    struct stat_cache_mem_shard *shard;
+
+    if (!mem_tier_initialized) return NULL;
+
+    shard = mem_shard(path);
+    pthread_mutex_lock(&shard->lock);
+    return shard;
+}
+
+static void stat_cache_mem_unlock(struct stat_cache_mem_shard *shard) {
+    if (shard) pthread_mutex_unlock(&shard->lock);
+}
+
+static void mem_insert_locked(struct stat_cache_mem_shard *shard, const char *path, const struct stat_cache_value *value) {
+    struct stat_cache_mem_entry *entry;
+
+    entry = g_hash_table_lookup(shard->table, path);
+    if (entry) {
+        memcpy(&entry->value, value, sizeof(struct stat_cache_value));
+        if (entry != shard->head) {
+            mem_entry_unlink(shard, entry);
+            mem_entry_push_head(shard, entry);
+        }
+        return;
+    }
+
+    entry = malloc(sizeof(struct stat_cache_mem_entry));
+    if (entry == NULL) return;
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        free(entry);
+        return;
+    }
+    memcpy(&entry->value, value, sizeof(struct stat_cache_value));
+    g_hash_table_insert(shard->table, entry->path, entry);
+    mem_entry_push_head(shard, entry);
+    ++shard->count;
+
+    while (shard->count > STAT_CACHE_MEM_SHARD_MAX && shard->tail) {
+        mem_entry_remove(shard, shard->tail);
+        BUMP(statcache_mem_evict);
+    }
+}
+
+// Call with the shard lock held, after a successful leveldb put.
+static void stat_cache_mem_store_locked(struct stat_cache_mem_shard *shard, const char *path, const struct stat_cache_value *value) {
+    if (shard == NULL) return;
+    ++shard->sequence;
+    mem_insert_locked(shard, path, value);
+}
+
+// Call with the shard lock held, after a leveldb delete.
+static void stat_cache_mem_invalidate_locked(struct stat_cache_mem_shard *shard, const char *path) {
+    struct stat_cache_mem_entry *entry;
+
+    if (shard == NULL) return;
+    ++shard->sequence;
+    entry = g_hash_table_lookup(shard->table, path);
+    if (entry) {
+        mem_entry_remove(shard, entry);
+    }
+}
+
+// Populate the tier after a miss was satisfied from leveldb. If any writer has touched
+// this shard since stat_cache_mem_get handed out sequence, what we read may already be
+// stale, so just drop it; the next lookup will go back to leveldb.
+static void stat_cache_mem_fill(const char *path, const struct stat_cache_value *value, unsigned long sequence) {
+    struct stat_cache_mem_shard *shard;
+
+    if (!mem_tier_initialized) return;
+
+    shard = mem_shard(path);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->sequence == sequence) {
+        mem_insert_locked(shard, path, value);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Negative entries.
+ * Much of our getattr volume is for paths that don't exist: PHP include-path probing and
+ * .htaccess lookups. Each one costs a leveldb lookup for the path, one for the parent's
+ * updated_children, and, having found the listing fresh, a second lookup for the path.
+ * So once a directory is listed, keep a bloom filter of its children's names beside the
+ * listing's timestamp. While the listing is fresh, a name not in the filter doesn't exist,
+ * and stat_cache_known_absent says so without touching leveldb.
+ * A filter only gains names. A name whose entry is deleted stays behind as a false positive,
+ * which costs a lookup, as before. stat_cache_value_set and batch commits add each new name
+ * to its parent's filter, so a filter has every name the cache has. A child can get added
+ * while a filter is being built from a scan, and the scan might miss it, so that build is
+ * thrown away.
+ */
+#define STAT_CACHE_NEG_SHARDS 16
+#define STAT_CACHE_NEG_MAX_DIRS 1024
+#define STAT_CACHE_NEG_SHARD_MAX (STAT_CACHE_NEG_MAX_DIRS / STAT_CACHE_NEG_SHARDS)
+// Holds a filter to about 20K; larger directories go without
+#define STAT_CACHE_NEG_MAX_CHILDREN 15000
+
+struct stat_cache_neg_entry {
+    bloomfilter_options_t *filter; // NULL until built
+    time_t listed; // the updated_children timestamp the filter goes with
+    unsigned long build; // the build in progress, if building
+    bool building;
+    bool changed; // a child was added while building
+};
+
+struct stat_cache_neg_shard {
+    pthread_mutex_t lock;
+    GHashTable *dirs; // directory path -> struct stat_cache_neg_entry *; owns both
+};
+
+static struct stat_cache_neg_shard neg_shards[STAT_CACHE_NEG_SHARDS];
+static bool neg_tier_initialized = false;
+static unsigned long neg_builds = 0;
+
+static void stat_cache_neg_listed(stat_cache_t *cache, const char *path, time_t listed);
+static void prune_filter_load(const char *cache_path);
+static void prune_filter_save(void);
+
+static struct stat_cache_neg_shard *neg_shard(const char *path) {
+    return &neg_shards[g_str_hash(path) % STAT_CACHE_NEG_SHARDS];
+}
+
+static void neg_entry_free(void *ptr) {
+    struct stat_cache_neg_entry *entry = ptr;
+
+    if (entry->filter) bloomfilter_destroy(entry->filter);
+    free(entry);
+}
+
+static void stat_cache_neg_init(void) {
+    for (int idx = 0; idx < STAT_CACHE_NEG_SHARDS; idx++) {
+        pthread_mutex_init(&neg_shards[idx].lock, NULL);
+        neg_shards[idx].dirs = g_hash_table_new_full(g_str_hash, g_str_equal, free, neg_entry_free);
+    }
+    neg_tier_initialized = true;
+}
+
+static void stat_cache_neg_destroy(void) {
+    if (!neg_tier_initialized) return;
+    neg_tier_initialized = false;
+    for (int idx = 0; idx < STAT_CACHE_NEG_SHARDS; idx++) {
+        pthread_mutex_lock(&neg_shards[idx].lock);
+        g_hash_table_destroy(neg_shards[idx].dirs);
+        neg_shards[idx].dirs = NULL;
+        pthread_mutex_unlock(&neg_shards[idx].lock);
+    }
+}
+
+// Splits path into its parent, copied to parent (PATH_MAX), and returns its name; NULL for the root
+static const char *neg_split(const char *path, char *parent) {
+    const char *slash = strrchr(path, '/');
+    size_t len;
+
+    if (slash == NULL || slash[1] == '\0') return NULL;
+    len = slash - path;
+    if (len == 0) len = 1; // a child of the root
+    if (len >= PATH_MAX) return NULL;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    return slash + 1;
+}
+
+// A new entry for path; keep its parent's filter complete
+static void stat_cache_neg_add(const char *path) {
+    struct stat_cache_neg_shard *shard;
+    struct stat_cache_neg_entry *entry;
+    char parent[PATH_MAX];
+    const char *name;
+
+    if (!neg_tier_initialized) return;
+    name = neg_split(path, parent);
+    if (name == NULL) return;
+
+    shard = neg_shard(parent);
+    pthread_mutex_lock(&shard->lock);
+    entry = g_hash_table_lookup(shard->dirs, parent);
+    if (entry != NULL) {
+        if (entry->building) entry->changed = true;
+        if (entry->filter) bloomfilter_add(entry->filter, name, strlen(name));
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void stat_cache_neg_forget(const char *path) {
+    struct stat_cache_neg_shard *shard;
+
+    if (!neg_tier_initialized) return;
+    shard = neg_shard(path);
+    pthread_mutex_lock(&shard->lock);
+    g_hash_table_remove(shard->dirs, path);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Makes room by dropping the directory listed longest ago
+static void neg_evict_locked(struct stat_cache_neg_shard *shard) {
+    GHashTableIter hiter;
+    gpointer key;
+    gpointer value;
+    const char *oldest = NULL;
+    time_t oldest_listed = 0;
+
+    g_hash_table_iter_init(&hiter, shard->dirs);
+    while (g_hash_table_iter_next(&hiter, &key, &value)) {
+        struct stat_cache_neg_entry *entry = value;
+        if (entry->building) continue;
+        if (oldest == NULL || entry->listed < oldest_listed) {
+            oldest = key;
+            oldest_listed = entry->listed;
+        }
+    }
+    if (oldest) g_hash_table_remove(shard->dirs, oldest);
+}
+
+/* True if path's parent has a fresh listing and path is not in it. False means we don't know,
+ * including when the filter has a false positive.
+ */
+bool stat_cache_known_absent(const char *path) {
+    struct stat_cache_neg_shard *shard;
+    struct stat_cache_neg_entry *entry;
+    char parent[PATH_MAX];
+    const char *name;
+    bool absent = false;
+
+    if (!neg_tier_initialized) return false;
+    name = neg_split(path, parent);
+    if (name == NULL) return false;
+
+    shard = neg_shard(parent);
+    pthread_mutex_lock(&shard->lock);
+    entry = g_hash_table_lookup(shard->dirs, parent);
+    if (entry != NULL && entry->filter != NULL && time(NULL) - entry->listed <= CACHE_TIMEOUT) {
+        absent = !bloomfilter_exists(entry->filter, name, strlen(name));
+        if (absent) BUMP(statcache_neg_hit);
+        else BUMP(statcache_neg_pass);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_known_absent: %s: %d", path, absent);
+    return absent;
+}
+
+/* Rewrites entries in the original "<depth><path>" key format to the current one.
+ * Runs once per cache, at open, before any other thread can see the cache. The iterator reads
+ * from an implicit snapshot, so the batched rewrites don't disturb the scan. If we fail part way,
+ * the version key is never written and the next open picks up where we left off.
+ */
+static void stat_cache_migrate_keys(stat_cache_t *cache, GError **gerr) {
+    kvstore_iter_t *iter;
+    kvstore_batch_t *batch;
+    const int version = STAT_CACHE_KEY_VERSION;
+    char keybuf[STAT_CACHE_KEY_MAX];
+    char *errptr = NULL;
+    int *stored_version;
+    size_t vallen;
+    unsigned int migrated = 0;
+    unsigned int dropped = 0;
+    unsigned int batched = 0;
+    clock_t elapsedtime;
+
+    stored_version = (int *) kvstore_get(cache, STAT_CACHE_VERSION_KEY, strlen(STAT_CACHE_VERSION_KEY) + 1, &vallen, &errptr);
+    if (errptr != NULL) {
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_migrate_keys: kvstore_get error: %s", errptr);
+        free(errptr);
+        return;
+    }
+    if (stored_version != NULL) {
+        bool current = (vallen == sizeof(int) && *stored_version == STAT_CACHE_KEY_VERSION);
+        log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_migrate_keys: stored key version %d", vallen == sizeof(int) ? *stored_version : -1);
+        kvstore_free(stored_version);
+        if (current) return;
+    }
+
+    elapsedtime = clock();
+    log_print(LOG_NOTICE, SECTION_STATCACHE_CACHE, "stat_cache_migrate_keys: migrating stat cache to key version %d", STAT_CACHE_KEY_VERSION);
+
+    batch = kvstore_batch_create(cache);
+    iter = kvstore_iter_create(cache, NULL, false);
+    if (iter == NULL) {
+        kvstore_batch_destroy(batch);
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_migrate_keys: kvstore_iter_create failed");
+        return;
+    }
+    // Old-format keys begin with a digit, and digits sort before any of our other key prefixes
+    kvstore_iter_seek(iter, "0", 1);
+    for (; kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
+        size_t klen;
+        size_t vlen;
+        const char *iterkey = kvstore_iter_key(iter, &klen);
+        const char *itervalue;
+        char *endptr;
+        unsigned long depth;
+        int len;
+
+        if (iterkey[0] < '0' || iterkey[0] > '9') break;
+
+        depth = strtoul(iterkey, &endptr, 10);
+        len = -1;
+        if (*endptr == '/' && depth <= STAT_CACHE_DEPTH_MAX) {
+            len = snprintf(keybuf, sizeof(keybuf), STAT_CACHE_KEY_PREFIX "%04lu%s", depth, endptr);
+        }
+        if (len > 0 && (size_t)len < sizeof(keybuf)) {
+            itervalue = kvstore_iter_value(iter, &vlen);
+            kvstore_batch_put(batch, keybuf, len + 1, itervalue, vlen);
+            ++migrated;
+        }
+        else {
+            // Malformed; prune would have removed it anyway
+            log_print(LOG_NOTICE, SECTION_STATCACHE_CACHE, "stat_cache_migrate_keys: dropping malformed key %s", iterkey);
+            ++dropped;
+        }
+        kvstore_batch_delete(batch, iterkey, klen);
+
+        if (++batched == STAT_CACHE_MIGRATE_BATCH) {
+            kvstore_write(cache, batch, &errptr);
+            kvstore_batch_clear(batch);
+            batched = 0;
+            if (errptr != NULL) break;
+        }
+    }
+    kvstore_iter_destroy(iter);
+
+    if (errptr == NULL) {
+        // The version goes in the same batch as the last rewrites
+        kvstore_batch_put(batch, STAT_CACHE_VERSION_KEY, strlen(STAT_CACHE_VERSION_KEY) + 1, (const char *) &version, sizeof(version));
+        kvstore_write(cache, batch, &errptr);
+    }
+    kvstore_batch_destroy(batch);
+
+    if (errptr != NULL || inject_error(statcache_error_migrate)) {
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_migrate_keys: kvstore_write error: %s", errptr ? errptr : "inject-error");
+        free(errptr);
+        return;
+    }
+
+    elapsedtime = clock() - elapsedtime;
+    log_print(LOG_NOTICE, SECTION_STATCACHE_CACHE, "stat_cache_migrate_keys: migrated %u entries; dropped %u; elapsedtime %lu ms",
+        migrated, dropped, (unsigned long)(elapsedtime * 1000 / CLOCKS_PER_SEC));
+}
+
 void stat_cache_open(stat_cache_t **cache, struct stat_cache_supplemental *supplemental, char *cache_path, GError **gerr) {
     char *errptr = NULL;
     char storage_path[PATH_MAX];
+    GError *tmpgerr = NULL;
 
     BUMP(statcache_open);
 
     // Check that a directory is set.
     if (!cache_path || inject_error(statcache_error_cachepath)) {
-        g_set_error (gerr, leveldb_quark(), EINVAL, "stat_cache_open: no cache path specified.");
+        g_set_error (gerr, kvstore_quark(), EINVAL, "stat_cache_open: no cache path specified.");
         return;
     }
 
-    snprintf(storage_path, PATH_MAX, "%s/leveldb", cache_path);
-
-    supplemental->options = leveldb_options_create();
-
-    // Initialize LevelDB's LRU cache.
-    supplemental->lru = NULL;
-    //supplemental->lru = leveldb_cache_create_lru(5 * 1048576); // 5MB
-    //leveldb_options_set_cache(supplemental->options, supplemental->lru);
+    snprintf(storage_path, PATH_MAX, "%s/%s", cache_path, kvstore_engine_name(supplemental->options.engine));
 
-    // Create the database if missing.
-    leveldb_options_set_create_if_missing(supplemental->options, true);
-    leveldb_options_set_error_if_exists(supplemental->options, false);
+    log_print(LOG_INFO, SECTION_STATCACHE_CACHE, "stat_cache_open: engine %s; block_cache_size %lu; bloom_bits_per_key %d; write_buffer_size %lu; max_open_files %d; map_size %lu",
+        kvstore_engine_name(supplemental->options.engine), supplemental->options.block_cache_size, supplemental->options.bloom_bits_per_key,
+        supplemental->options.write_buffer_size, supplemental->options.max_open_files, supplemental->options.map_size);
 
-    // Use a fusedav logger.
-    leveldb_options_set_info_log(supplemental->options, NULL);
-
-    *cache = leveldb_open(supplemental->options, storage_path, &errptr);
+    *cache = kvstore_open(storage_path, &supplemental->options, &errptr);
     gcache = *cache; // save off pointer to cache for stat_cache_walk
     if (errptr || inject_error(statcache_error_openldb)) {
-        g_set_error (gerr, leveldb_quark(), E_SC_LDBERR, "stat_cache_open: Error opening db; %s.", errptr ? errptr : "inject-error");
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_open: Error opening db; %s.", errptr ? errptr : "inject-error");
         free(errptr);
         return;
     }
 
+    // Keys the engine can't take fail path2key, as paths too long for the stat cache do
+    key_limit = STAT_CACHE_KEY_MAX;
+    if (kvstore_max_key_size(*cache) > 0 && kvstore_max_key_size(*cache) < key_limit) {
+        key_limit = kvstore_max_key_size(*cache);
+    }
+
+    stat_cache_migrate_keys(*cache, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "stat_cache_open: ");
+        return;
+    }
+
+    stat_cache_mem_init();
+    stat_cache_neg_init();
+    prune_filter_load(cache_path);
+
     return;
 }
 
 void stat_cache_close(stat_cache_t *cache, struct stat_cache_supplemental supplemental) {
+    // The store owns everything made from the options
+    (void) supplemental;
 
     BUMP(statcache_close);
 
-    if (cache != NULL) {
-        leveldb_close(cache);
-        log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_close: closed leveldb");
-    }
-    if (supplemental.options != NULL) {
-        leveldb_options_destroy(supplemental.options);
-        log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_close: leveldb_options_destroy");
+    stat_cache_mem_destroy();
+    stat_cache_neg_destroy();
+    prune_filter_save();
+
+    {
+        bool overflow;
+        GHashTable *dirty = stat_cache_take_dirty(&overflow);
+        if (dirty) g_hash_table_destroy(dirty);
     }
-    if (supplemental.lru != NULL) {
-        leveldb_cache_destroy(supplemental.lru);
-        log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_close: leveldb_cache_destroy");
+
+    if (cache != NULL) {
+        kvstore_close(cache);
+        gcache = NULL;
+        log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_close: closed the store");
     }
     return;
 }
@@ -207,45 +933,61 @@ void stat_cache_close(stat_cache_t *cache, struct stat_cache_supplemental supple
 struct stat_cache_value *stat_cache_value_get(stat_cache_t *cache, const char *path, bool skip_freshness_check, GError **gerr) {
     struct stat_cache_value *value = NULL;
     GError *tmpgerr = NULL;
+    char keybuf[STAT_CACHE_KEY_MAX];
     char *key;
-    leveldb_readoptions_t *options;
+    // Either format fits; see stat_cache_value_decode
+    char valbuf[sizeof(struct stat_cache_value)];
     size_t vallen;
     char *errptr = NULL;
+    bool found;
     time_t current_time;
+    unsigned long mem_sequence = 0;
 
     BUMP(statcache_value_get);
 
-    key = path2key(path, false);
+    value = stat_cache_mem_get(path, &mem_sequence);
+    if (value != NULL) {
+        log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_value_get: memory hit on path: %s", path);
+        goto check_freshness;
+    }
+
+    key = path2key(path, false, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_value_get: path too long: %s", path);
+        return NULL;
+    }
 
     log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_value_get: key %s", key);
 
-    options = leveldb_readoptions_create();
-    leveldb_readoptions_set_fill_cache(options, false);
-    value = (struct stat_cache_value *) leveldb_get(cache, options, key, strlen(key) + 1, &vallen, &errptr);
-    leveldb_readoptions_destroy(options);
-    free(key);
+    found = kvstore_get_into(cache, key, strlen(key) + 1, valbuf, sizeof(valbuf), &vallen, &errptr);
 
     if (errptr != NULL || inject_error(statcache_error_getldb)) {
-        g_set_error (gerr, leveldb_quark(), E_SC_LDBERR, "stat_cache_value_get: leveldb_get error: %s", errptr ? errptr : "inject-error");
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_value_get: kvstore_get error: %s", errptr ? errptr : "inject-error");
         free(errptr);
-        free(value);
-        log_print(LOG_ALERT, SECTION_STATCACHE_CACHE, "stat_cache_value_get: leveldb_get error, kill fusedav process");
+        log_print(LOG_ALERT, SECTION_STATCACHE_CACHE, "stat_cache_value_get: kvstore_get error, kill fusedav process");
         kill(getpid(), SIGTERM);
         return NULL;
     }
 
-    if (value == NULL) {
+    if (!found) {
         log_print(LOG_DYNAMIC, SECTION_STATCACHE_CACHE, "stat_cache_value_get: miss on path: %s", path);
         return NULL;
     }
 
-    if (vallen != sizeof(struct stat_cache_value)) {
-        g_set_error (gerr, leveldb_quark(), E_SC_LDBERR, "stat_cache_value_get: Length %lu is not expected length %lu.", vallen, sizeof(struct stat_cache_value));
-        free(errptr);
+    value = malloc(sizeof(struct stat_cache_value));
+    if (value == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENOMEM, "stat_cache_value_get: failed to allocate value");
+        return NULL;
+    }
+    if (vallen > sizeof(valbuf) || !stat_cache_value_decode(valbuf, vallen, value)) {
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_value_get: Value of length %lu is not a stat cache value.", vallen);
         free(value);
         return NULL;
     }
 
+    stat_cache_mem_fill(path, value, mem_sequence);
+
+check_freshness:
     if (!skip_freshness_check) {
         current_time = time(NULL);
 
@@ -296,76 +1038,89 @@ struct stat_cache_value *stat_cache_value_get(stat_cache_t *cache, const char *p
 }
 
 void stat_cache_updated_children(stat_cache_t *cache, const char *path, time_t timestamp, GError **gerr) {
-    leveldb_writeoptions_t *options;
-    char *key = NULL;
+    char keybuf[STAT_CACHE_KEY_MAX];
+    char *key;
     char *errptr = NULL;
 
     BUMP(statcache_updated_ch);
 
-    asprintf(&key, "updated_children:%s", path);
+    key = updated_children_key(path, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_updated_children: path too long: %s", path);
+        return;
+    }
 
-    options = leveldb_writeoptions_create();
     if (timestamp == 0)
-        leveldb_delete(cache, options, key, strlen(key) + 1, &errptr);
+        kvstore_delete(cache, key, strlen(key) + 1, &errptr);
     else
-        leveldb_put(cache, options, key, strlen(key) + 1, (char *) &timestamp, sizeof(time_t), &errptr);
-    leveldb_writeoptions_destroy(options);
-
-    free(key);
+        kvstore_put(cache, key, strlen(key) + 1, (char *) &timestamp, sizeof(time_t), &errptr);
+    __sync_fetch_and_add(&stat_cache_writes, 1);
 
     if (errptr != NULL || inject_error(statcache_error_childrenldb)) {
-        g_set_error (gerr, leveldb_quark(), E_SC_LDBERR, "stat_cache_updated_children: leveldb_set error: %s", errptr ? errptr : "inject-error");
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_updated_children: kvstore_put error: %s", errptr ? errptr : "inject-error");
         free(errptr);
-        log_print(LOG_ALERT, SECTION_STATCACHE_CACHE, "stat_cache_updated_children: leveldb_set error, kill fusedav process");
+        log_print(LOG_ALERT, SECTION_STATCACHE_CACHE, "stat_cache_updated_children: kvstore_put error, kill fusedav process");
         kill(getpid(), SIGTERM);
+        stat_cache_neg_forget(path);
         return;
     }
 
+    stat_cache_neg_listed(cache, path, timestamp);
+
     return;
 }
 
 time_t stat_cache_read_updated_children(stat_cache_t *cache, const char *path, GError **gerr) {
-    leveldb_readoptions_t *options;
-    char *key = NULL;
+    char keybuf[STAT_CACHE_KEY_MAX];
+    char *key;
     char *errptr = NULL;
-    time_t *value = NULL;
-    time_t ret;
+    time_t ret = 0;
     size_t vallen;
+    bool found;
 
     BUMP(statcache_read_updated);
 
-    asprintf(&key, "updated_children:%s", path);
-
-    options = leveldb_readoptions_create();
-    leveldb_readoptions_set_fill_cache(options, false);
-    value = (time_t *) leveldb_get(cache, options, key, strlen(key) + 1, &vallen, &errptr);
-    leveldb_readoptions_destroy(options);
+    key = updated_children_key(path, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_read_updated_children: path too long: %s", path);
+        return 0;
+    }
 
-    free(key);
+    // The value is one time_t; copy it out rather than have the store allocate for it
+    found = kvstore_get_into(cache, key, strlen(key) + 1, &ret, sizeof(ret), &vallen, &errptr);
 
     if (errptr != NULL || inject_error(statcache_error_readchildrenldb)) {
-        g_set_error (gerr, leveldb_quark(), E_SC_LDBERR, "stat_cache_read_updated_children: leveldb_get error: %s", errptr ? errptr : "inject-error");
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_read_updated_children: kvstore_get error: %s", errptr ? errptr : "inject-error");
         free(errptr);
-        free(value);
-        log_print(LOG_ALERT, SECTION_STATCACHE_CACHE, "stat_cache_read_updated_children: leveldb_get error, kill fusedav process");
+        log_print(LOG_ALERT, SECTION_STATCACHE_CACHE, "stat_cache_read_updated_children: kvstore_get error, kill fusedav process");
         kill(getpid(), SIGTERM);
         return 0;
     }
 
-    if (value == NULL) return 0;
-
-    ret = *value;
+    if (!found || vallen < sizeof(ret)) return 0;
 
     log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "Children for directory %s were updated at timestamp %lu.", path, ret);
 
-    free(value);
     return ret;
 }
 
+// Whether stat_cache_enumerate would list path without a PROPFIND; sets *updated, if given, to its updated_children
+bool stat_cache_children_fresh(stat_cache_t *cache, const char *path, time_t *updated) {
+    time_t timestamp;
+
+    // As stat_cache_enumerate does, treat an error as no data
+    timestamp = stat_cache_read_updated_children(cache, path, NULL);
+    if (updated) *updated = timestamp;
+    return timestamp != 0 && time(NULL) - timestamp <= CACHE_TIMEOUT;
+}
+
 void stat_cache_value_set(stat_cache_t *cache, const char *path, struct stat_cache_value *value, GError **gerr) {
-    leveldb_writeoptions_t *options;
+    struct stat_cache_mem_shard *shard;
     char *errptr = NULL;
+    char keybuf[STAT_CACHE_KEY_MAX];
     char *key;
+    char encoded[STAT_CACHE_VALUE_ENCODED_MAX];
+    size_t encoded_len;
 
     if (path == NULL) {
         log_print(LOG_NOTICE, SECTION_STATCACHE_CACHE, "stat_cache_value_set: input path is null");
@@ -379,45 +1134,70 @@ void stat_cache_value_set(stat_cache_t *cache, const char *path, struct stat_cac
     value->updated = time(NULL);
     value->local_generation = stat_cache_get_local_generation();
 
-    key = path2key(path, false);
+    key = path2key(path, false, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_value_set: path too long: %s", path);
+        return;
+    }
     log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "CSET: %s (mode %04o: updated %lu: loc_gen %lu)",
         key, value->st.st_mode, value->updated, value->local_generation);
 
-    options = leveldb_writeoptions_create();
-    leveldb_put(cache, options, key, strlen(key) + 1, (char *) value, sizeof(struct stat_cache_value), &errptr);
-    leveldb_writeoptions_destroy(options);
+    encoded_len = stat_cache_value_encode(value, encoded);
 
-    free(key);
+    shard = stat_cache_mem_lock(path);
+    kvstore_put(cache, key, strlen(key) + 1, encoded, encoded_len, &errptr);
+    __sync_fetch_and_add(&stat_cache_writes, 1);
+    if (errptr == NULL) {
+        stat_cache_mem_store_locked(shard, path, value);
+    }
+    else {
+        stat_cache_mem_invalidate_locked(shard, path);
+    }
+    stat_cache_mem_unlock(shard);
 
     if (errptr != NULL || inject_error(statcache_error_setldb)) {
-        g_set_error (gerr, leveldb_quark(), E_SC_LDBERR, "stat_cache_value_set: leveldb_set error: %s", errptr ? errptr : "inject-error");
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_value_set: kvstore_put error: %s", errptr ? errptr : "inject-error");
         free(errptr);
-        log_print(LOG_ALERT, SECTION_STATCACHE_CACHE, "stat_cache_value_set: leveldb_get error, kill fusedav process");
+        log_print(LOG_ALERT, SECTION_STATCACHE_CACHE, "stat_cache_value_set: kvstore_get error, kill fusedav process");
         kill(getpid(), SIGTERM);
         return;
     }
 
+    stat_cache_neg_add(path);
+
     return;
 }
 
-void stat_cache_delete(stat_cache_t *cache, const char *path, GError **gerr) {
-    leveldb_writeoptions_t *options;
+// mark_dirty is false when prune itself deletes, since it has already dealt with the subtree
+static void stat_cache_delete_entry(stat_cache_t *cache, const char *path, bool mark_dirty, GError **gerr) {
+    struct stat_cache_mem_shard *shard;
+    char keybuf[STAT_CACHE_KEY_MAX];
     char *key;
     char *errptr = NULL;
 
     BUMP(statcache_delete);
 
-    key = path2key(path, false);
+    key = path2key(path, false, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_delete: path too long: %s", path);
+        return;
+    }
 
     log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_delete: %s", key);
 
-    options = leveldb_writeoptions_create();
-    leveldb_delete(cache, options, key, strlen(key) + 1, &errptr);
-    leveldb_writeoptions_destroy(options);
-    free(key);
+    shard = stat_cache_mem_lock(path);
+    kvstore_delete(cache, key, strlen(key) + 1, &errptr);
+    __sync_fetch_and_add(&stat_cache_writes, 1);
+    // Invalidate even on error; a missing memory entry only costs a leveldb lookup
+    stat_cache_mem_invalidate_locked(shard, path);
+    stat_cache_mem_unlock(shard);
+
+    if (mark_dirty) {
+        stat_cache_mark_dirty(path);
+    }
 
     if (errptr != NULL || inject_error(statcache_error_deleteldb)) {
-        g_set_error (gerr, leveldb_quark(), E_SC_LDBERR, "stat_cache_delete: leveldb_delete error: %s", errptr ? errptr : "inject-error");
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_delete: kvstore_delete error: %s", errptr ? errptr : "inject-error");
         free(errptr);
         return;
     }
@@ -427,6 +1207,10 @@ void stat_cache_delete(stat_cache_t *cache, const char *path, GError **gerr) {
     return;
 }
 
+void stat_cache_delete(stat_cache_t *cache, const char *path, GError **gerr) {
+    stat_cache_delete_entry(cache, path, true, gerr);
+}
+
 void stat_cache_delete_parent(stat_cache_t *cache, const char *path, GError **gerr) {
     char *p;
     GError *tmpgerr = NULL;
@@ -470,9 +1254,7 @@ static void stat_cache_iterator_free(struct stat_cache_iterator *iter) {
 
     BUMP(statcache_iter_free);
 
-    leveldb_iter_destroy(iter->ldb_iter);
-    leveldb_readoptions_destroy(iter->ldb_options);
-    free(iter->key_prefix);
+    kvstore_iter_destroy(iter->ldb_iter);
     free(iter);
 }
 
@@ -482,22 +1264,32 @@ static struct stat_cache_iterator *stat_cache_iter_init(stat_cache_t *cache, con
     BUMP(statcache_iter_init);
 
     iter = malloc(sizeof(struct stat_cache_iterator));
-    iter->key_prefix = path2key(path_prefix, true); // Handles allocating the duplicate.
+    if (iter == NULL) {
+        log_print(LOG_ERR, SECTION_STATCACHE_ITER, "stat_cache_iter_init: failed to allocate iterator for %s", path_prefix);
+        return NULL;
+    }
+    if (path2key(path_prefix, true, iter->key_prefix, sizeof(iter->key_prefix)) == NULL) {
+        free(iter);
+        return NULL;
+    }
     iter->key_prefix_len = strlen(iter->key_prefix) + 1;
 
-    log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "creating leveldb iterator for prefix %s", iter->key_prefix);
-    iter->ldb_options = leveldb_readoptions_create();
-    leveldb_readoptions_set_fill_cache(iter->ldb_options, false);
-    iter->ldb_iter = leveldb_create_iterator(cache, iter->ldb_options);
+    log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "creating kvstore iterator for prefix %s", iter->key_prefix);
+    iter->ldb_iter = kvstore_iter_create(cache, NULL, false);
+    if (iter->ldb_iter == NULL) {
+        log_print(LOG_ERR, SECTION_STATCACHE_ITER, "stat_cache_iter_init: failed to create kvstore iterator for %s", path_prefix);
+        free(iter);
+        return NULL;
+    }
 
-    leveldb_iter_seek(iter->ldb_iter, iter->key_prefix, iter->key_prefix_len);
+    kvstore_iter_seek(iter->ldb_iter, iter->key_prefix, iter->key_prefix_len);
 
     return iter;
 }
 
-static struct stat_cache_entry *stat_cache_iter_current(struct stat_cache_iterator *iter) {
-    struct stat_cache_entry *entry;
-    const struct stat_cache_value *value;
+// Fills in the caller's entry; returns false at the end of the prefix range.
+static bool stat_cache_iter_current(struct stat_cache_iterator *iter, struct stat_cache_entry *entry) {
+    const char *value;
     const char *key;
     size_t klen, vlen;
 
@@ -505,60 +1297,158 @@ static struct stat_cache_entry *stat_cache_iter_current(struct stat_cache_iterat
 
     assert(iter);
 
-    // If we've gone beyond the end of the dataset, quit.
-    if (!leveldb_iter_valid(iter->ldb_iter)) {
-        return NULL;
-    }
+    for (;;) {
+        // If we've gone beyond the end of the dataset, quit.
+        if (!kvstore_iter_valid(iter->ldb_iter)) {
+            return false;
+        }
 
-    key = leveldb_iter_key(iter->ldb_iter, &klen);
-    log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "fetched key: %s", key);
+        key = kvstore_iter_key(iter->ldb_iter, &klen);
+        log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "fetched key: %s", key);
 
-    // If we've gone beyond the end of the prefix range, quit.
-    // Use (iter->key_prefix_len - 1) to exclude the NULL at the prefix end.
-    if (strncmp(key, iter->key_prefix, iter->key_prefix_len - 1) != 0) {
-        log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "Key %s does not match prefix %s for %lu characters. Ending iteration.", key, iter->key_prefix, iter->key_prefix_len);
-        return NULL;
-    }
+        // If we've gone beyond the end of the prefix range, quit.
+        // Use (iter->key_prefix_len - 1) to exclude the NULL at the prefix end.
+        if (strncmp(key, iter->key_prefix, iter->key_prefix_len - 1) != 0) {
+            log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "Key %s does not match prefix %s for %lu characters. Ending iteration.", key, iter->key_prefix, iter->key_prefix_len);
+            return false;
+        }
+
+        value = kvstore_iter_value(iter->ldb_iter, &vlen);
+        if (stat_cache_value_decode(value, vlen, &iter->value)) break;
 
-    value = (const struct stat_cache_value *) leveldb_iter_value(iter->ldb_iter, &vlen);
+        // Prune deletes these; until then, step past them
+        log_print(LOG_NOTICE, SECTION_STATCACHE_ITER, "iter_current: skipping bad value of length %lu for key %s", vlen, key);
+        kvstore_iter_next(iter->ldb_iter);
+    }
 
-    entry = malloc(sizeof(struct stat_cache_entry));
     entry->key = key;
-    entry->value = value;
-    log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "iter_current: key = %s; value = %s", key, value);
-    return entry;
+    entry->value = &iter->value;
+    log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "iter_current: key = %s; mode = %04o", key, iter->value.st.st_mode);
+    return true;
 }
 
 static void stat_cache_iter_next(struct stat_cache_iterator *iter) {
 
     BUMP(statcache_iter_next);
 
-    leveldb_iter_next(iter->ldb_iter);
+    kvstore_iter_next(iter->ldb_iter);
 }
 
-/*
-static void stat_cache_list_all(stat_cache_t *cache, const char *path) {
-    leveldb_iterator_t *iter = NULL;
-    leveldb_readoptions_t *options;
-    const struct stat_cache_value *itervalue;
+/* Builds path's filter from a scan of its children, for the listing at timestamp listed.
+ * Scans run at the end of a directory refresh, which has already had the listing over the network.
+ */
+static void stat_cache_neg_build(stat_cache_t *cache, const char *path, time_t listed) {
+    struct stat_cache_neg_shard *shard;
+    struct stat_cache_neg_entry *entry;
+    struct stat_cache_iterator *iter;
+    struct stat_cache_entry child;
+    bloomfilter_options_t *filter = NULL;
+    GQueue *names;
+    char *name;
+    char *errptr = NULL;
+    unsigned long build;
+
+    shard = neg_shard(path);
+    pthread_mutex_lock(&shard->lock);
+    entry = g_hash_table_lookup(shard->dirs, path);
+    if (entry == NULL) {
+        if (g_hash_table_size(shard->dirs) >= STAT_CACHE_NEG_SHARD_MAX) {
+            neg_evict_locked(shard);
+        }
+        entry = calloc(1, sizeof(struct stat_cache_neg_entry));
+        if (entry == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            return;
+        }
+        g_hash_table_replace(shard->dirs, strdup(path), entry);
+    }
+    else if (entry->filter) {
+        bloomfilter_destroy(entry->filter);
+        entry->filter = NULL;
+    }
+    build = __atomic_add_fetch(&neg_builds, 1, __ATOMIC_RELAXED);
+    entry->build = build;
+    entry->building = true;
+    entry->changed = false;
+    pthread_mutex_unlock(&shard->lock);
+
+    // The scan starts after we're marked as building, so anything it misses marks us changed
+    names = g_queue_new();
+    iter = stat_cache_iter_init(cache, path);
+    if (iter != NULL) {
+        while (stat_cache_iter_current(iter, &child) && g_queue_get_length(names) <= STAT_CACHE_NEG_MAX_CHILDREN) {
+            g_queue_push_tail(names, strdup(child.key + (iter->key_prefix_len - 1)));
+            stat_cache_iter_next(iter);
+        }
+        stat_cache_iterator_free(iter);
+
+        if (g_queue_get_length(names) <= STAT_CACHE_NEG_MAX_CHILDREN) {
+            unsigned long count = g_queue_get_length(names);
+            // Room for the files created before the next refresh
+            filter = bloomfilter_init(count + count / 2 + 1, 0, 0, &errptr);
+            if (filter == NULL) {
+                log_print(LOG_WARNING, SECTION_STATCACHE_CACHE, "stat_cache_neg_build: %s: %s", path, errptr);
+                free(errptr);
+            }
+        }
+    }
+    while ((name = g_queue_pop_head(names)) != NULL) {
+        if (filter) bloomfilter_add(filter, name, strlen(name));
+        free(name);
+    }
+    g_queue_free(names);
+
+    pthread_mutex_lock(&shard->lock);
+    entry = g_hash_table_lookup(shard->dirs, path);
+    // Another build may have started since, or the directory been forgotten
+    if (entry != NULL && entry->build == build) {
+        if (filter != NULL && !entry->changed) {
+            entry->filter = filter;
+            entry->listed = listed;
+            entry->building = false;
+            filter = NULL;
+            BUMP(statcache_neg_build);
+        }
+        else {
+            g_hash_table_remove(shard->dirs, path);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (filter) bloomfilter_destroy(filter);
+}
+
+// path's updated_children is now listed; a fresh listing gets a filter, a stale one loses it
+static void stat_cache_neg_listed(stat_cache_t *cache, const char *path, time_t listed) {
+    if (!neg_tier_initialized) return;
+    if (listed > 0 && time(NULL) - listed <= CACHE_TIMEOUT) {
+        stat_cache_neg_build(cache, path, listed);
+    }
+    else {
+        stat_cache_neg_forget(path);
+    }
+}
+
+/*
+static void stat_cache_list_all(stat_cache_t *cache, const char *path) {
+    kvstore_iter_t *iter = NULL;
+    const struct stat_cache_value *itervalue;
     struct stat_cache_value *value;
     size_t klen, vlen;
     const char *iterkey;
     char *key = path2key(path, true);
 
-    options = leveldb_readoptions_create();
-    iter = leveldb_create_iterator(cache, options);
-    leveldb_readoptions_destroy(options);
+    iter = kvstore_iter_create(cache, NULL, true);
 
-    leveldb_iter_seek(iter, key, strlen(key) + 1);
+    kvstore_iter_seek(iter, key, strlen(key) + 1);
     free(key);
 
-    while (leveldb_iter_valid(iter)) {
-        //log_print(LOG_DEBUG, SECTION_STATCACHE_DEFAULT, "Listing key: %s", leveldb_iter_key(iter, &klen));
+    while (kvstore_iter_valid(iter)) {
+        //log_print(LOG_DEBUG, SECTION_STATCACHE_DEFAULT, "Listing key: %s", kvstore_iter_key(iter, &klen));
 
-        itervalue = (const struct stat_cache_value *) leveldb_iter_value(iter, &vlen);
+        itervalue = (const struct stat_cache_value *) kvstore_iter_value(iter, &vlen);
         if (S_ISDIR(itervalue->st.st_mode)) {
-            iterkey = leveldb_iter_key(iter, &klen);
+            iterkey = kvstore_iter_key(iter, &klen);
             log_print(LOG_DEBUG, SECTION_STATCACHE_DEFAULT, "Listing directory: %s", iterkey);
 
             value = stat_cache_value_get(cache, key2path(iterkey));
@@ -568,16 +1458,16 @@ static void stat_cache_list_all(stat_cache_t *cache, const char *path) {
             }
         }
 
-        leveldb_iter_next(iter);
+        kvstore_iter_next(iter);
     }
 
-    leveldb_iter_destroy(iter);
+    kvstore_iter_destroy(iter);
 }
 */
 
 int stat_cache_enumerate(stat_cache_t *cache, const char *path_prefix, void (*f) (const char *path_prefix, const char *filename, void *user), void *user, bool force) {
     struct stat_cache_iterator *iter;
-    struct stat_cache_entry *entry;
+    struct stat_cache_entry entry;
     unsigned found_entries = 0;
     time_t timestamp;
     time_t current_time;
@@ -604,14 +1494,16 @@ int stat_cache_enumerate(stat_cache_t *cache, const char *path_prefix, void (*f)
     }
 
     iter = stat_cache_iter_init(cache, path_prefix);
+    if (iter == NULL) {
+        return -STAT_CACHE_NO_DATA;
+    }
     log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "iterator initialized with prefix: %s", iter->key_prefix);
 
-    while ((entry = stat_cache_iter_current(iter))) {
-        log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "key: %s", entry->key);
-        log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "fn: %s", entry->key + (iter->key_prefix_len - 1));
-        f(path_prefix, entry->key + (iter->key_prefix_len - 1), user);
+    while (stat_cache_iter_current(iter, &entry)) {
+        log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "key: %s", entry.key);
+        log_print(LOG_DEBUG, SECTION_STATCACHE_ITER, "fn: %s", entry.key + (iter->key_prefix_len - 1));
+        f(path_prefix, entry.key + (iter->key_prefix_len - 1), user);
         ++found_entries;
-        free(entry);
         stat_cache_iter_next(iter);
     }
     stat_cache_iterator_free(iter);
@@ -623,29 +1515,56 @@ int stat_cache_enumerate(stat_cache_t *cache, const char *path_prefix, void (*f)
     return E_SC_SUCCESS;
 }
 
+// Returns the store's value for property (e.g. KVSTORE_PROPERTY_STATS), or NULL. Caller frees.
+char *stat_cache_get_property(const char *property) {
+    if (gcache == NULL) return NULL;
+    return kvstore_property(gcache, property);
+}
+
+// Log the store's own statistics: for leveldb, per-level file counts and sizes, and compaction work
+void stat_cache_print_stats(void) {
+    const char *engine;
+    char *ldbstats;
+    char *line;
+    char *saveptr = NULL;
+
+    if (gcache == NULL) return;
+    engine = kvstore_engine_name(kvstore_engine(gcache));
+    ldbstats = stat_cache_get_property(KVSTORE_PROPERTY_STATS);
+    if (ldbstats == NULL) {
+        log_print(LOG_NOTICE, SECTION_STATCACHE_OUTPUT, "stat_cache_print_stats: no %s stats available", engine);
+        return;
+    }
+
+    for (line = strtok_r(ldbstats, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        log_print(LOG_NOTICE, SECTION_STATCACHE_OUTPUT, "%s: %s", engine, line);
+    }
+    free(ldbstats);
+}
+
 void stat_cache_walk(void) {
-    leveldb_readoptions_t *roptions;
-    struct leveldb_iterator_t *iter;
+    kvstore_iter_t *iter;
 
     log_print(LOG_NOTICE, SECTION_STATCACHE_CACHE, "stat_cache_walk: starting: %p", gcache);
 
-    roptions = leveldb_readoptions_create();
-    leveldb_readoptions_set_fill_cache(roptions, false);
-    iter = leveldb_create_iterator(gcache, roptions); // We've kept a pointer to cache for just this call
-    leveldb_iter_seek_to_first(iter);
-    for (; leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+    iter = kvstore_iter_create(gcache, NULL, false); // We've kept a pointer to cache for just this call
+    if (iter == NULL) {
+        log_print(LOG_ERR, SECTION_STATCACHE_CACHE, "stat_cache_walk: kvstore_iter_create failed");
+        return;
+    }
+    kvstore_iter_seek_to_first(iter);
+    for (; kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
         size_t klen;
-        const char *iterkey = leveldb_iter_key(iter, &klen);
+        const char *iterkey = kvstore_iter_key(iter, &klen);
         log_print(LOG_NOTICE, SECTION_STATCACHE_CACHE, "stat_cache_walk: iterkey = %s", iterkey);
     }
-    leveldb_iter_destroy(iter);
-    leveldb_readoptions_destroy(roptions);
+    kvstore_iter_destroy(iter);
     log_print(LOG_NOTICE, SECTION_STATCACHE_CACHE, "stat_cache_walk: exiting");
 }
 
 bool stat_cache_dir_has_child(stat_cache_t *cache, const char *path) {
     struct stat_cache_iterator *iter;
-    struct stat_cache_entry *entry;
+    struct stat_cache_entry entry;
     bool has_children = false;
 
     BUMP(statcache_has_child);
@@ -653,10 +1572,13 @@ bool stat_cache_dir_has_child(stat_cache_t *cache, const char *path) {
     log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_dir_has_children(%s)", path);
 
     iter = stat_cache_iter_init(cache, path);
-    if ((entry = stat_cache_iter_current(iter))) {
+    if (iter == NULL) {
+        // Err on the side of not removing a directory we can't check
+        return true;
+    }
+    if (stat_cache_iter_current(iter, &entry)) {
         has_children = true;
-        log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_dir_has_children(%s); entry \'%s\'", path, entry->key);
-        free(entry);
+        log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_dir_has_children(%s); entry \'%s\'", path, entry.key);
     }
     stat_cache_iterator_free(iter);
 
@@ -665,7 +1587,7 @@ bool stat_cache_dir_has_child(stat_cache_t *cache, const char *path) {
 
 void stat_cache_delete_older(stat_cache_t *cache, const char *path_prefix, unsigned long minimum_local_generation, GError **gerr) {
     struct stat_cache_iterator *iter;
-    struct stat_cache_entry *entry;
+    struct stat_cache_entry entry;
     GError *tmpgerr = NULL;
     unsigned int deleted_entries = 0;
 
@@ -673,20 +1595,22 @@ void stat_cache_delete_older(stat_cache_t *cache, const char *path_prefix, unsig
 
     log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_delete_older: %s", path_prefix);
     iter = stat_cache_iter_init(cache, path_prefix);
-    while ((entry = stat_cache_iter_current(iter))) {
+    if (iter == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_delete_older: path too long: %s", path_prefix);
+        return;
+    }
+    while (stat_cache_iter_current(iter, &entry)) {
         log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_delete_older: %s: min_gen %lu: loc_gen %lu",
-            entry->key, minimum_local_generation, entry->value->local_generation);
-        if (entry->value->local_generation < minimum_local_generation) {
-            stat_cache_delete(cache, key2path(entry->key), &tmpgerr);
+            entry.key, minimum_local_generation, entry.value->local_generation);
+        if (entry.value->local_generation < minimum_local_generation) {
+            stat_cache_delete(cache, key2path(entry.key), &tmpgerr);
             ++deleted_entries;
             if (tmpgerr) {
                 g_propagate_prefixed_error(gerr, tmpgerr, "stat_cache_delete_older: ");
-                free(entry);
                 stat_cache_iterator_free(iter);
                 return;
             }
         }
-        free(entry);
         stat_cache_iter_next(iter);
     }
     stat_cache_iterator_free(iter);
@@ -694,33 +1618,645 @@ void stat_cache_delete_older(stat_cache_t *cache, const char *path_prefix, unsig
     log_print(LOG_INFO, SECTION_STATCACHE_CACHE, "stat_cache_delete_older: calling stat_cache_prune on %s : deletedentries %u", path_prefix, deleted_entries);
     // Only prune if there are deleted entries; otherwise there's no work to do
     if (deleted_entries > 0) {
-        stat_cache_prune(cache);
+        stat_cache_prune(cache, false);
     }
 
     return;
 }
 
-void stat_cache_prune(stat_cache_t *cache) {
-    // leveldb stuff
-    leveldb_readoptions_t *roptions;
-    leveldb_writeoptions_t *woptions;
-    struct leveldb_iterator_t *iter;
+/* Ingestion batches.
+ * A complete PROPFIND of a large directory used to be one leveldb_put per response, then a
+ * leveldb_delete per stale entry, then the updated_children put. A batch gathers all of these
+ * in a kvstore_batch_t and commits them with a single atomic write. Until the commit,
+ * nothing is visible to readers; stat_cache_batch_free without a commit discards it all.
+ * The ops table tracks each path's final state in the batch (a value, or NULL for deleted),
+ * for delete_older and for updating the memory tier on commit.
+ */
+struct stat_cache_batch {
+    stat_cache_t *cache;
+    kvstore_batch_t *wb;
+    GHashTable *ops; // path -> struct stat_cache_value *, or NULL if deleted; owns both
+    GHashTable *listed; // directory -> its updated_children time_t *; owns both
+    GHashTable *subtrees; // roots of subtrees removed whole, for the prune; NULL until one is
+    unsigned int writes; // every op, including updated_children
+    unsigned int deletes;
+    bool shared; // the file cache has written to wb too
+};
+
+struct stat_cache_batch *stat_cache_batch_begin(stat_cache_t *cache) {
+    struct stat_cache_batch *batch;
+
+    batch = calloc(1, sizeof(struct stat_cache_batch));
+    if (batch == NULL) {
+        log_print(LOG_ERR, SECTION_STATCACHE_CACHE, "stat_cache_batch_begin: failed to allocate batch");
+        return NULL;
+    }
+    batch->cache = cache;
+    batch->wb = kvstore_batch_create(cache);
+    batch->ops = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+    batch->listed = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+    return batch;
+}
+
+void stat_cache_batch_free(struct stat_cache_batch *batch) {
+    if (batch == NULL) return;
+    kvstore_batch_destroy(batch->wb);
+    g_hash_table_destroy(batch->ops);
+    g_hash_table_destroy(batch->listed);
+    if (batch->subtrees) g_hash_table_destroy(batch->subtrees);
+    free(batch);
+}
+
+/* For the file cache, which shares the store, to put its side of an operation in the same
+ * atomic write. The commit then goes ahead even if the stat cache wrote nothing.
+ */
+kvstore_batch_t *stat_cache_batch_kvstore(struct stat_cache_batch *batch) {
+    batch->shared = true;
+    return batch->wb;
+}
+
+void stat_cache_batch_value_set(struct stat_cache_batch *batch, const char *path, struct stat_cache_value *value, GError **gerr) {
+    struct stat_cache_value *copy;
+    char keybuf[STAT_CACHE_KEY_MAX];
+    char *key;
+    char encoded[STAT_CACHE_VALUE_ENCODED_MAX];
+    size_t encoded_len;
+
+    if (path == NULL) {
+        log_print(LOG_NOTICE, SECTION_STATCACHE_CACHE, "stat_cache_batch_value_set: input path is null");
+        return;
+    }
+
+    BUMP(statcache_value_set);
+
+    assert(value);
+
+    value->updated = time(NULL);
+    value->local_generation = stat_cache_get_local_generation();
+
+    key = path2key(path, false, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_batch_value_set: path too long: %s", path);
+        return;
+    }
+    log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "BSET: %s (mode %04o: updated %lu: loc_gen %lu)",
+        key, value->st.st_mode, value->updated, value->local_generation);
+
+    copy = malloc(sizeof(struct stat_cache_value));
+    if (copy == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENOMEM, "stat_cache_batch_value_set: failed to allocate value for %s", path);
+        return;
+    }
+    memcpy(copy, value, sizeof(struct stat_cache_value));
+
+    encoded_len = stat_cache_value_encode(value, encoded);
+    kvstore_batch_put(batch->wb, key, strlen(key) + 1, encoded, encoded_len);
+    g_hash_table_replace(batch->ops, strdup(path), copy);
+    ++batch->writes;
+}
+
+void stat_cache_batch_delete(struct stat_cache_batch *batch, const char *path, GError **gerr) {
+    char keybuf[STAT_CACHE_KEY_MAX];
+    char *key;
+
+    BUMP(statcache_delete);
+
+    key = path2key(path, false, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_batch_delete: path too long: %s", path);
+        return;
+    }
+    log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_batch_delete: %s", key);
+
+    kvstore_batch_delete(batch->wb, key, strlen(key) + 1);
+    g_hash_table_replace(batch->ops, strdup(path), NULL);
+    ++batch->writes;
+    ++batch->deletes;
+}
+
+void stat_cache_batch_updated_children(struct stat_cache_batch *batch, const char *path, time_t timestamp, GError **gerr) {
+    char keybuf[STAT_CACHE_KEY_MAX];
+    char *key;
+    time_t *listed;
+
+    BUMP(statcache_updated_ch);
+
+    key = updated_children_key(path, keybuf, sizeof(keybuf));
+    if (key == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_batch_updated_children: path too long: %s", path);
+        return;
+    }
+
+    if (timestamp == 0)
+        kvstore_batch_delete(batch->wb, key, strlen(key) + 1);
+    else
+        kvstore_batch_put(batch->wb, key, strlen(key) + 1, (char *) &timestamp, sizeof(time_t));
+    ++batch->writes;
+
+    listed = malloc(sizeof(time_t));
+    if (listed == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENOMEM, "stat_cache_batch_updated_children: failed to allocate timestamp for %s", path);
+        return;
+    }
+    *listed = timestamp;
+    g_hash_table_replace(batch->listed, strdup(path), listed);
+}
+
+// As stat_cache_delete_older, but a path's state in the batch takes precedence over the cache
+void stat_cache_batch_delete_older(struct stat_cache_batch *batch, const char *path_prefix, unsigned long minimum_local_generation, GError **gerr) {
+    struct stat_cache_iterator *iter;
+    struct stat_cache_entry entry;
+    GError *tmpgerr = NULL;
+
+    BUMP(statcache_delete_older);
+
+    log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_batch_delete_older: %s", path_prefix);
+    iter = stat_cache_iter_init(batch->cache, path_prefix);
+    if (iter == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "stat_cache_batch_delete_older: path too long: %s", path_prefix);
+        return;
+    }
+    while (stat_cache_iter_current(iter, &entry)) {
+        const char *path = key2path(entry.key);
+        gpointer batched_ptr = NULL;
+        const struct stat_cache_value *batched;
+        unsigned long local_generation = entry.value->local_generation;
+
+        if (g_hash_table_lookup_extended(batch->ops, path, NULL, &batched_ptr)) {
+            batched = batched_ptr;
+            // Already deleted in this batch
+            if (batched == NULL) {
+                stat_cache_iter_next(iter);
+                continue;
+            }
+            local_generation = batched->local_generation;
+        }
+        log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_batch_delete_older: %s: min_gen %lu: loc_gen %lu",
+            entry.key, minimum_local_generation, local_generation);
+        if (local_generation < minimum_local_generation) {
+            stat_cache_batch_delete(batch, path, &tmpgerr);
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "stat_cache_batch_delete_older: ");
+                stat_cache_iterator_free(iter);
+                return;
+            }
+        }
+        stat_cache_iter_next(iter);
+    }
+    stat_cache_iterator_free(iter);
+}
+
+// One entry of batch_subtree's walk, at the iterator
+static void batch_subtree_entry(struct stat_cache_batch *batch, kvstore_iter_t *iter, const char *path, const char *to, GError **gerr) {
+    char newpath[PATH_MAX];
+    const char *iterpath;
+    GError *tmpgerr = NULL;
+    size_t klen;
+
+    iterpath = key2path(kvstore_iter_key(iter, &klen));
+    if (to) {
+        struct stat_cache_value moved;
+        const char *value;
+        size_t vlen;
+        int len;
+
+        len = snprintf(newpath, sizeof(newpath), "%s%s", to, iterpath + strlen(path));
+        if (len < 0 || (size_t)len >= sizeof(newpath)) {
+            g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "batch_subtree_entry: path too long: %s%s", to, iterpath + strlen(path));
+            return;
+        }
+        // A bad value only goes; prune would have deleted it anyway
+        value = kvstore_iter_value(iter, &vlen);
+        if (stat_cache_value_decode(value, vlen, &moved)) {
+            stat_cache_batch_value_set(batch, newpath, &moved, &tmpgerr);
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "batch_subtree_entry: ");
+                return;
+            }
+        }
+    }
+    stat_cache_batch_delete(batch, iterpath, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "batch_subtree_entry: ");
+    }
+}
+
+// One updated_children entry of batch_subtree's walk, at the iterator; its path starts at offset
+static void batch_subtree_listed(struct stat_cache_batch *batch, kvstore_iter_t *iter, size_t offset, const char *path, const char *to, GError **gerr) {
+    char newpath[PATH_MAX];
+    const char *iterpath;
+    GError *tmpgerr = NULL;
+    size_t klen;
+
+    iterpath = kvstore_iter_key(iter, &klen) + offset;
+    if (to) {
+        const char *value;
+        size_t vlen;
+        int len;
+
+        len = snprintf(newpath, sizeof(newpath), "%s%s", to, iterpath + strlen(path));
+        if (len < 0 || (size_t)len >= sizeof(newpath)) {
+            g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "batch_subtree_listed: path too long: %s%s", to, iterpath + strlen(path));
+            return;
+        }
+        // The listing is still good; the directory's children went with it
+        value = kvstore_iter_value(iter, &vlen);
+        if (vlen == sizeof(time_t)) {
+            time_t timestamp;
+
+            memcpy(&timestamp, value, sizeof(time_t));
+            stat_cache_batch_updated_children(batch, newpath, timestamp, &tmpgerr);
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "batch_subtree_listed: ");
+                return;
+            }
+        }
+    }
+    stat_cache_batch_updated_children(batch, iterpath, 0, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "batch_subtree_listed: ");
+    }
+}
+
+/* Moves everything at and below path to the same place under to, or with to NULL deletes it:
+ * the stat entries, level by level, and the updated_children entries of path and its
+ * descendants. As with prune_subtree, the levels stop at the first with nothing under path.
+ * The walk sees the store as committed, not what is already in the batch.
+ */
+static void batch_subtree(struct stat_cache_batch *batch, const char *path, const char *to, GError **gerr) {
+    kvstore_iter_t *iter;
+    char prefix[STAT_CACHE_KEY_MAX];
+    size_t prefix_len;
+    size_t klen;
+    const char *iterkey;
+    unsigned int depth = 0;
+    GError *tmpgerr = NULL;
+    int len;
+
+    if (strcmp(path, "/") == 0) {
+        g_set_error (gerr, kvstore_quark(), EINVAL, "batch_subtree: not on the root");
+        return;
+    }
+    if (path2key(path, false, prefix, sizeof(prefix)) == NULL) {
+        g_set_error (gerr, kvstore_quark(), ENAMETOOLONG, "batch_subtree: path too long: %s", path);
+        return;
+    }
+    for (const char *pnt = path; *pnt; pnt++) {
+        if (*pnt == '/') ++depth;
+    }
+
+    if (batch->subtrees == NULL) {
+        batch->subtrees = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    }
+    g_hash_table_add(batch->subtrees, strdup(path));
+
+    log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "batch_subtree: %s to %s", path, to ? to : "(deleted)");
+    iter = kvstore_iter_create(batch->cache, NULL, false);
+    if (iter == NULL) {
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "batch_subtree: kvstore_iter_create failed");
+        return;
+    }
+
+    prefix_len = strlen(prefix) + 1;
+    kvstore_iter_seek(iter, prefix, prefix_len);
+    if (kvstore_iter_valid(iter)) {
+        iterkey = kvstore_iter_key(iter, &klen);
+        if (klen == prefix_len && memcmp(iterkey, prefix, klen) == 0) {
+            batch_subtree_entry(batch, iter, path, to, &tmpgerr);
+            if (tmpgerr) goto finish;
+        }
+    }
+
+    for (++depth; depth <= STAT_CACHE_DEPTH_MAX; depth++) {
+        int found = 0;
+
+        len = snprintf(prefix, sizeof(prefix), STAT_CACHE_KEY_PREFIX "%04u%s/", depth, path);
+        if (len < 0 || (size_t)len >= sizeof(prefix)) break;
+        prefix_len = len;
+
+        for (kvstore_iter_seek(iter, prefix, prefix_len); kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
+            iterkey = kvstore_iter_key(iter, &klen);
+            if (strncmp(iterkey, prefix, prefix_len) != 0) break;
+            ++found;
+            batch_subtree_entry(batch, iter, path, to, &tmpgerr);
+            if (tmpgerr) goto finish;
+        }
+        if (found == 0) break;
+    }
+
+    // updated_children:<path> itself, then those of its descendants
+    if (updated_children_key(path, prefix, sizeof(prefix)) == NULL) goto finish;
+    prefix_len = strlen(prefix);
+    kvstore_iter_seek(iter, prefix, prefix_len + 1);
+    if (kvstore_iter_valid(iter)) {
+        iterkey = kvstore_iter_key(iter, &klen);
+        if (klen == prefix_len + 1 && memcmp(iterkey, prefix, klen) == 0) {
+            batch_subtree_listed(batch, iter, prefix_len - strlen(path), path, to, &tmpgerr);
+            if (tmpgerr) goto finish;
+        }
+    }
+    if (prefix_len + 1 >= sizeof(prefix)) goto finish;
+    prefix[prefix_len++] = '/';
+    prefix[prefix_len] = '\0';
+    for (kvstore_iter_seek(iter, prefix, prefix_len); kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
+        iterkey = kvstore_iter_key(iter, &klen);
+        if (strncmp(iterkey, prefix, prefix_len) != 0) break;
+        batch_subtree_listed(batch, iter, prefix_len - 1 - strlen(path), path, to, &tmpgerr);
+        if (tmpgerr) goto finish;
+    }
+
+finish:
+    kvstore_iter_destroy(iter);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "batch_subtree: ");
+    }
+}
+
+/* A directory rename: whatever was at to goes, and from's subtree takes its place. Both
+ * go in the one write, so after a crash the cache has either the old tree or the new one.
+ */
+void stat_cache_batch_move_subtree(struct stat_cache_batch *batch, const char *from, const char *to, GError **gerr) {
+    GError *tmpgerr = NULL;
+
+    BUMP(statcache_subtree);
+
+    batch_subtree(batch, to, NULL, &tmpgerr);
+    if (!tmpgerr) batch_subtree(batch, from, to, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "stat_cache_batch_move_subtree: ");
+    }
+}
+
+void stat_cache_batch_delete_subtree(struct stat_cache_batch *batch, const char *path, GError **gerr) {
+    GError *tmpgerr = NULL;
+
+    BUMP(statcache_subtree);
+
+    batch_subtree(batch, path, NULL, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "stat_cache_batch_delete_subtree: ");
+    }
+}
+
+// Below the root of a subtree gone in the batch; the prune of the root covers it
+static bool batch_subtree_covers(struct stat_cache_batch *batch, const char *path) {
+    char parent[PATH_MAX];
+    char *slash;
+
+    if (batch->subtrees == NULL || strlen(path) >= sizeof(parent)) return false;
+    strcpy(parent, path);
+    while ((slash = strrchr(parent, '/')) != NULL && slash != parent) {
+        *slash = '\0';
+        if (g_hash_table_contains(batch->subtrees, parent)) return true;
+    }
+    return false;
+}
+
+/* Writes the batch with one kvstore_write, with no shard lock held, and then publishes it to the
+ * memory tier shard by shard (batch_publish). The store is the authority throughout: a getattr
+ * during the write misses or finds the old entry and fills from the store, and the publish
+ * afterwards either replaces that or, where someone else changed the shard, invalidates it.
+ * Committing with deletions prunes their subtrees, as stat_cache_delete_older does; of a
+ * subtree the batch took whole, only the root is left to the prune.
+ */
+struct batch_publish {
+    struct stat_cache_mem_shard *shard;
+    const char *path;
+    const struct stat_cache_value *value; // NULL for a delete
+};
+
+static int batch_publish_cmp(const void *a, const void *b) {
+    const struct batch_publish *x = a;
+    const struct batch_publish *y = b;
+    return x->shard < y->shard ? -1 : x->shard > y->shard;
+}
+
+/* Bring the memory tier in line with a batch once it's in the store. The store is written
+ * first, without the shard locks, so getattrs carry on while a large listing goes in; then
+ * each shard is locked only long enough to take its entries. Readers who went to the store
+ * meanwhile see the bumped sequence and don't fill with what they read. A writer who touched
+ * the shard since written_sequences were taken may have put a newer value of one of our paths,
+ * so in that shard ours are invalidated rather than stored, and the store says which won.
+ */
+static void batch_publish(struct stat_cache_batch *batch, const unsigned long *written_sequences, bool written) {
+    struct batch_publish *entries;
+    GHashTableIter hiter;
+    gpointer key;
+    gpointer value;
+    unsigned count = 0;
+
+    entries = malloc(g_hash_table_size(batch->ops) * sizeof(struct batch_publish) + 1);
+    if (entries == NULL) {
+        // Can't sort them by shard, so take each shard's lock as we go
+        g_hash_table_iter_init(&hiter, batch->ops);
+        while (g_hash_table_iter_next(&hiter, &key, &value)) {
+            struct stat_cache_mem_shard *shard = stat_cache_mem_lock(key);
+            stat_cache_mem_invalidate_locked(shard, key);
+            stat_cache_mem_unlock(shard);
+        }
+        return;
+    }
+
+    g_hash_table_iter_init(&hiter, batch->ops);
+    while (g_hash_table_iter_next(&hiter, &key, &value)) {
+        entries[count].shard = mem_shard(key);
+        entries[count].path = key;
+        entries[count].value = value;
+        ++count;
+    }
+    qsort(entries, count, sizeof(struct batch_publish), batch_publish_cmp);
+
+    for (unsigned idx = 0; idx < count; ) {
+        struct stat_cache_mem_shard *shard = entries[idx].shard;
+        bool store;
+
+        pthread_mutex_lock(&shard->lock);
+        store = written && shard->sequence == written_sequences[shard - mem_shards];
+        for (; idx < count && entries[idx].shard == shard; idx++) {
+            if (store && entries[idx].value != NULL) {
+                stat_cache_mem_store_locked(shard, entries[idx].path, entries[idx].value);
+            }
+            else {
+                stat_cache_mem_invalidate_locked(shard, entries[idx].path);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    free(entries);
+}
+
+void stat_cache_batch_commit(struct stat_cache_batch *batch, GError **gerr) {
+    unsigned long written_sequences[STAT_CACHE_MEM_SHARDS];
+    GHashTableIter hiter;
+    gpointer key;
+    gpointer value;
+    char *errptr = NULL;
+
+    BUMP(statcache_batch_commit);
+
+    if (batch->writes == 0 && !batch->shared) return;
+
+    log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_batch_commit: %u writes; %u deletes", batch->writes, batch->deletes);
+
+    if (mem_tier_initialized) {
+        for (int idx = 0; idx < STAT_CACHE_MEM_SHARDS; idx++) {
+            pthread_mutex_lock(&mem_shards[idx].lock);
+            written_sequences[idx] = mem_shards[idx].sequence;
+            pthread_mutex_unlock(&mem_shards[idx].lock);
+        }
+    }
+
+    kvstore_write(batch->cache, batch->wb, &errptr);
+    __sync_fetch_and_add(&stat_cache_writes, batch->writes);
+    TIMING(statcache_batch_ops, batch->writes);
+
+    if (mem_tier_initialized) {
+        batch_publish(batch, written_sequences, errptr == NULL);
+    }
+
+    if (errptr != NULL || inject_error(statcache_error_batchldb)) {
+        g_set_error (gerr, kvstore_quark(), E_SC_LDBERR, "stat_cache_batch_commit: kvstore_write error: %s", errptr ? errptr : "inject-error");
+        free(errptr);
+        log_print(LOG_ALERT, SECTION_STATCACHE_CACHE, "stat_cache_batch_commit: kvstore_write error, kill fusedav process");
+        kill(getpid(), SIGTERM);
+        g_hash_table_iter_init(&hiter, batch->listed);
+        while (g_hash_table_iter_next(&hiter, &key, &value)) {
+            stat_cache_neg_forget(key);
+        }
+        return;
+    }
+
+    // New entries first, so a filter built for a listing below was scanned with them in place
+    g_hash_table_iter_init(&hiter, batch->ops);
+    while (g_hash_table_iter_next(&hiter, &key, &value)) {
+        if (value != NULL) stat_cache_neg_add(key);
+    }
+    g_hash_table_iter_init(&hiter, batch->listed);
+    while (g_hash_table_iter_next(&hiter, &key, &value)) {
+        stat_cache_neg_listed(batch->cache, key, *(time_t *) value);
+    }
+
+    if (batch->deletes > 0) {
+        g_hash_table_iter_init(&hiter, batch->ops);
+        while (g_hash_table_iter_next(&hiter, &key, &value)) {
+            if (value == NULL && !batch_subtree_covers(batch, key)) stat_cache_mark_dirty(key);
+        }
+        log_print(LOG_INFO, SECTION_STATCACHE_CACHE, "stat_cache_batch_commit: calling stat_cache_prune: deletes %u", batch->deletes);
+        stat_cache_prune(batch->cache, false);
+    }
+}
+
+/* The full prune's filter of reachable directories, kept from one prune to the next. Its contents
+ * have to be rebuilt each time, since directories it holds may since have been deleted, and a
+ * filter still holding them would keep their orphans forever. What carries over is the size:
+ * the number of directories the last prune found, kept across restarts in the cache directory,
+ * so the first prune after one starts with a filter already sized to the site.
+ */
+static pthread_mutex_t prune_filter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bloomfilter_options_t *prune_filter = NULL;
+static unsigned long prune_filter_keys = 0; // 0 for none known yet
+static char prune_filter_path[PATH_MAX] = "";
+
+static bloomfilter_options_t *prune_filter_take(char **errptr) {
+    bloomfilter_options_t *filter;
+    unsigned long keys;
+    unsigned long maxkeys = 0;
+
+    pthread_mutex_lock(&prune_filter_mutex);
+    filter = prune_filter;
+    prune_filter = NULL;
+    keys = prune_filter_keys;
+    pthread_mutex_unlock(&prune_filter_mutex);
+
+    if (filter != NULL) {
+        if (keys <= bloomfilter_maxkeys(filter)) {
+            bloomfilter_clear(filter);
+            return filter;
+        }
+        log_print(LOG_INFO, SECTION_STATCACHE_PRUNE, "stat_cache_prune: growing filter from %lu to %lu keys",
+            bloomfilter_maxkeys(filter), keys + keys / 2);
+        bloomfilter_destroy(filter);
+    }
+    if (keys > 0) maxkeys = keys + keys / 2;
+    return bloomfilter_init(maxkeys, 0, 0, errptr);
+}
+
+static void prune_filter_put(bloomfilter_options_t *filter) {
+    pthread_mutex_lock(&prune_filter_mutex);
+    prune_filter_keys = bloomfilter_keys(filter);
+    // A prune that ran alongside us may have put one back already
+    if (prune_filter != NULL) bloomfilter_destroy(prune_filter);
+    prune_filter = filter;
+    pthread_mutex_unlock(&prune_filter_mutex);
+}
+
+static void prune_filter_load(const char *cache_path) {
+    char old_path[PATH_MAX];
+    FILE *fp;
+
+    // Older versions saved the whole filter
+    snprintf(old_path, sizeof(old_path), "%s/prune.bloom", cache_path);
+    unlink(old_path);
+
+    snprintf(prune_filter_path, sizeof(prune_filter_path), "%s/prune.keys", cache_path);
+    fp = fopen(prune_filter_path, "r");
+    if (fp == NULL || fscanf(fp, "%lu", &prune_filter_keys) != 1) {
+        log_print(LOG_INFO, SECTION_STATCACHE_PRUNE, "stat_cache_open: no saved prune filter size in %s", prune_filter_path);
+        prune_filter_keys = 0;
+    }
+    if (fp) fclose(fp);
+}
+
+static void prune_filter_save(void) {
+    char tmp_path[PATH_MAX + 4];
+    FILE *fp;
+    bool ok;
+
+    pthread_mutex_lock(&prune_filter_mutex);
+    if (prune_filter_path[0] && prune_filter_keys > 0) {
+        // Written aside and renamed into place, so a crash doesn't leave half a number
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", prune_filter_path);
+        fp = fopen(tmp_path, "w");
+        ok = (fp != NULL && fprintf(fp, "%lu\n", prune_filter_keys) > 0);
+        if (fp != NULL && fclose(fp) != 0) ok = false;
+        if (!ok || rename(tmp_path, prune_filter_path) < 0) {
+            log_print(LOG_NOTICE, SECTION_STATCACHE_PRUNE, "stat_cache_close: saving %s: %s", prune_filter_path, strerror(errno));
+            unlink(tmp_path);
+        }
+    }
+    if (prune_filter != NULL) {
+        bloomfilter_destroy(prune_filter);
+        prune_filter = NULL;
+    }
+    pthread_mutex_unlock(&prune_filter_mutex);
+}
+
+// Visit every stat cache entry, deleting those whose parent directory is not in the cache
+static void stat_cache_prune_full(stat_cache_t *cache) {
+    // store stuff
+    kvstore_iter_t *iter;
     const char *iterkey;
     const char *key;
     char path[PATH_MAX];
-    const struct stat_cache_value *itervalue;
+    const char *iterbytes;
+    struct stat_cache_value itervalue_buf;
+    const struct stat_cache_value *itervalue = &itervalue_buf;
     size_t klen, vlen;
+    const size_t key_prefix_len = strlen(STAT_CACHE_KEY_PREFIX);
 
     // bloom filter stuff
     bloomfilter_options_t *boptions;
     char *errptr = NULL;
 
-    int pass = 0;
-    int passes = 1; // passes will grow as we detect larger depths
-    int depth;
-    int max_depth = 0;
     const char *base_directory = "/";
 
+    // Change detection; see stat_cache_writes
+    static bool pruned = false;
+    static unsigned long pruned_writes = 0;
+    unsigned long writes;
+    unsigned long own_writes = 0;
+    bool complete = true;
+
     // Statistics
     int visited_entries = 0;
     unsigned long size_of_files = 0;
@@ -734,13 +2270,19 @@ void stat_cache_prune(stat_cache_t *cache) {
     static unsigned int numcalls = 0;
     static unsigned long totaltime = 0; //
 
-    BUMP(statcache_prune);
+    // If nothing has been written since the last sweep, it would visit the same entries and find nothing to delete
+    writes = __sync_fetch_and_or(&stat_cache_writes, 0);
+    if (pruned && writes == pruned_writes) {
+        BUMP(statcache_prune_skip);
+        log_print(LOG_INFO, SECTION_STATCACHE_PRUNE, "stat_cache_prune: no changes since last prune; skipping");
+        return;
+    }
 
     elapsedtime = clock();
 
     log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: enter");
 
-    boptions = bloomfilter_init(0, NULL, 0, &errptr);
+    boptions = prune_filter_take(&errptr);
     if (boptions == NULL) {
         log_print(LOG_WARNING, SECTION_STATCACHE_PRUNE, "stat_cache_prune: failed to allocate bloom filter: %s", errptr);
         free(errptr);
@@ -751,142 +2293,111 @@ void stat_cache_prune(stat_cache_t *cache) {
     log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: attempting base_directory %s)", base_directory);
     if (bloomfilter_add(boptions, base_directory, strlen(base_directory)) < 0) {
         log_print(LOG_WARNING, SECTION_STATCACHE_PRUNE, "stat_cache_prune: seed: error on ITERKEY: \'%s\')", path);
+        prune_filter_put(boptions);
         return;
     }
 
     log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: put base_directory %s in filter", base_directory);
 
-    roptions = leveldb_readoptions_create();
-    leveldb_readoptions_set_fill_cache(roptions, false);
-    iter = leveldb_create_iterator(cache, roptions);
-
-    // Entries are in alphabetical order, so 10 is before 6;
-    // on the first pass, find the first depth less than 10, and process to the end;
-    // on the second pass, process depth greater or equal to than 10 but less than 99;
-    // on the second pass, process depth greater or equal to than 100 but less than 999;
-    // on the second pass, process depth greater or equal to than 1000 but less than 9999;
-    while (pass < passes) {
-
-        log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: Changing pass:%d (%d)", pass, passes);
-        leveldb_iter_seek_to_first(iter);
-
-        for (; leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
-            iterkey = leveldb_iter_key(iter, &klen);
-            // I have encountered bad entries in stat cache during development;
-            // armor against potential faults
-            key = key2path(iterkey);
-            if (key == NULL) {
-                log_print(LOG_NOTICE, SECTION_STATCACHE_PRUNE, "stat_cache_prune: ignoring malformed iterkey");
-                woptions = leveldb_writeoptions_create();
-                leveldb_delete(cache, woptions, iterkey, strlen(iterkey) + 1, &errptr);
-                leveldb_writeoptions_destroy(woptions);
-                ++issues;
-                continue;
-            }
-            // We'll need to change path below, so we don't want it to be a part of iterkey.
-            // Make a copy first.
-            strncpy(path, key, PATH_MAX);
-            log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: ITERKEY: \'%s\' :: %s :: %s", iterkey, path, key);
-            itervalue = (const struct stat_cache_value *) leveldb_iter_value(iter, &vlen);
-
-            // We control what kinds of entries are in the leveldb db.
-            // Those beginning with a number are stat cache entries and
-            // will be alphabetically first. As soon as we find an entry that
-            // strtol cannot turn into a number, we know we have passed beyond
-            // the normal stat cache entries into something else (e.g. filecache).
-            // However, we also have to handle "updated_children" entries. We
-            // handle them separately below.
-            errno = 0;
-            depth = strtol(iterkey, NULL, 10);
-
-            // @TODO seems not to set errno on returning 0
-            if (depth == 0 /*&& errno != 0*/) {
-                log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: depth = 0; break:%d, %d", depth, errno);
-                break;
-            }
+    iter = kvstore_iter_create(cache, NULL, false);
+    if (iter == NULL) {
+        log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune: kvstore_iter_create failed");
+        prune_filter_put(boptions);
+        return;
+    }
 
-            /* We need to handle paths which have up to 4096 directories in the path name.
-             * (Note, the length of the path name itself, not the number of directories in a
-             * particular subdirectory.)
-             * Since we don't expect depths greater than 99, we avoid iterating again
-             * when we know we don't have depths that great.
-             * When max_depth crosses a boundary (10, 100, 1000), set it to the max
-             * at that boundary (99, 999, 9999) to prevent continually calling this section.
-             */
-            if (depth > max_depth) {
-                max_depth = depth;
-                if (max_depth >= 1000) {
-                    passes = 4;
-                    max_depth = 9999;
-                }
-                else if (max_depth >= 100) {
-                    passes = 3;
-                    max_depth = 999;
-                }
-                else if (max_depth >= 10) {
-                    passes = 2;
-                    max_depth = 99;
-                }
-                log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: New max_depth %d (%d :: %d %d)", max_depth, depth, pass, passes);
-            }
+    // Keys sort by fixed-width depth (see path2key), so every directory is visited, and if
+    // it is reachable added to the filter, before any of its children.
+    kvstore_iter_seek(iter, STAT_CACHE_KEY_PREFIX, key_prefix_len);
+    for (; kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
+        char *parentpath;
 
-            if ((pass == 0 && depth <= 9) || (pass == 1 && (depth >= 10 && depth <= 99)) ||
-                (pass == 2 && (depth >= 100 && depth <= 999)) || (pass == 3 && depth >= 1000)) {
+        iterkey = kvstore_iter_key(iter, &klen);
+
+        // Past the stat cache entries
+        if (strncmp(iterkey, STAT_CACHE_KEY_PREFIX, key_prefix_len) != 0) {
+            break;
+        }
+
+        // I have encountered bad entries in stat cache during development;
+        // armor against potential faults
+        key = key2path(iterkey);
+        if (key == NULL) {
+            log_print(LOG_NOTICE, SECTION_STATCACHE_PRUNE, "stat_cache_prune: ignoring malformed iterkey");
+            kvstore_delete(cache, iterkey, strlen(iterkey) + 1, &errptr);
+            if (errptr != NULL) {
+                log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune: kvstore_delete error: %s", errptr);
+                free(errptr);
+                errptr = NULL;
+            }
+            ++issues;
+            continue;
+        }
+        // We'll need to change path below, so we don't want it to be a part of iterkey.
+        // Make a copy first.
+        strncpy(path, key, PATH_MAX - 1);
+        path[PATH_MAX - 1] = '\0';
+        log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: ITERKEY: \'%s\' :: %s", iterkey, path);
+        iterbytes = kvstore_iter_value(iter, &vlen);
+        if (!stat_cache_value_decode(iterbytes, vlen, &itervalue_buf)) {
+            log_print(LOG_NOTICE, SECTION_STATCACHE_PRUNE, "stat_cache_prune: deleting entry with bad value \'%s\'", path);
+            stat_cache_delete_entry(cache, path, false, NULL);
+            ++own_writes;
+            ++deleted_entries;
+            ++issues;
+            continue;
+        }
 
-                char *parentpath;
+        ++visited_entries;
+        size_of_files += itervalue->st.st_size;
 
-                log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: Pass %d (%d)", pass, passes);
-                ++visited_entries;
-                size_of_files += itervalue->st.st_size;
+        // If base_directory is in the stat cache, we don't want to compare it
+        // to its parent directory, find it absent in the filter, and remove base_directory
+        if (strcmp(path, base_directory) == 0) {
+            log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: path == base_directory");
+            continue;
+        }
 
-                // If base_directory is in the stat cache, we don't want to compare it
-                // to its parent directory, find it absent in the filter, and remove base_directory
-                if (strcmp(path, base_directory) == 0) {
-                    log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: path == base_directory");
-                    continue;
-                }
+        parentpath = path_parent(path);
+        log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: path %s parent_path %s", path, parentpath);
 
-                parentpath = path_parent(path);
-                log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: path %s parent_path %s", path, parentpath);
+        if (parentpath == NULL) {
+            log_print(LOG_NOTICE, SECTION_STATCACHE_PRUNE, "stat_cache_prune: ignoring errant entry \'%s\'", path);
+            ++issues;
+            continue;
+        }
 
-                if (parentpath == NULL) {
-                    log_print(LOG_NOTICE, SECTION_STATCACHE_PRUNE, "stat_cache_prune: ignoring errant entry \'%s\'", path);
+        if (bloomfilter_exists(boptions, parentpath, strlen(parentpath))) {
+            log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: exists in bloom filter\'%s\'", parentpath);
+            // If the parent is in the filter, and this child is a directory, add it to
+            // the filter so its own children, which sort later, are kept
+            if (S_ISDIR(itervalue->st.st_mode)) {
+                log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: add path to filter \'%s\')", path);
+                if (bloomfilter_add(boptions, path, strlen(path)) < 0) {
+                    log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune: error on bloomfilter_add: \'%s\')", path);
                     ++issues;
-                    continue;
-                }
-
-                if (bloomfilter_exists(boptions, parentpath, strlen(parentpath))) {
-                    log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: exists in bloom filter\'%s\'", parentpath);
-                    // If the parent is in the filter, and this child is a directory, add it to
-                    // the filter for iteration at the next depth
-                    if (S_ISDIR(itervalue->st.st_mode)) {
-                        log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: add path to filter \'%s\')", path);
-                        if (bloomfilter_add(boptions, path, strlen(path)) < 0) {
-                            log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune: error on bloomfilter_add: \'%s\')", path);
-                            ++issues;
-                            break;
-                        }
-                    }
+                    complete = false;
+                    free(parentpath);
+                    break;
                 }
-                else {
-                    log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: doesn't exist in bloom filter \'%s\'", parentpath);
-                    ++deleted_entries;
-                    log_print(LOG_INFO, SECTION_STATCACHE_PRUNE, "stat_cache_prune: deleting \'%s\'", path);
-                    stat_cache_delete(cache, path, NULL);
-                }
-                free(parentpath);
             }
         }
-        ++pass;
-        log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: updating pass %d", pass);
+        else {
+            log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: doesn't exist in bloom filter \'%s\'", parentpath);
+            ++deleted_entries;
+            log_print(LOG_INFO, SECTION_STATCACHE_PRUNE, "stat_cache_prune: deleting \'%s\'", path);
+            stat_cache_delete_entry(cache, path, false, NULL);
+            ++own_writes;
+        }
+        free(parentpath);
     }
 
     // Handle updated_children entries
-    leveldb_iter_seek(iter, "updated_children:", strlen("updated_children:") + 1);
+    kvstore_iter_seek(iter, "updated_children:", strlen("updated_children:") + 1);
 
-    for (; leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+    for (; kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
         const char *basepath = NULL;
-        iterkey = leveldb_iter_key(iter, &klen);
+        iterkey = kvstore_iter_key(iter, &klen);
 
         // If we pass the last key which begins with updated_children:, we're done
         if (strncmp(iterkey, "updated_children:", strlen("updated_children:"))) {
@@ -902,11 +2413,9 @@ void stat_cache_prune(stat_cache_t *cache) {
         // Bad entry. Log, delete from cache, continue
         if (basepath == NULL) {
             log_print(LOG_NOTICE, SECTION_STATCACHE_PRUNE, "stat_cache_prune: key error in updated_children entry: %s", iterkey);
-            woptions = leveldb_writeoptions_create();
-            leveldb_delete(cache, woptions, iterkey, strlen(iterkey) + 1, &errptr);
-            leveldb_writeoptions_destroy(woptions);
+            kvstore_delete(cache, iterkey, strlen(iterkey) + 1, &errptr);
             if (errptr != NULL) {
-                log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune: leveldb_delete error: %s", errptr);
+                log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune: kvstore_delete error: %s", errptr);
                 free(errptr);
             }
             ++issues;
@@ -921,19 +2430,16 @@ void stat_cache_prune(stat_cache_t *cache) {
             ++deleted_entries;
             // We recreate the basics of stat_cache_delete here, since we can't call it directly
             // since it doesn't deal with keys with "updated_children:"
-            woptions = leveldb_writeoptions_create();
-            leveldb_delete(cache, woptions, iterkey, strlen(iterkey) + 1, &errptr);
-            leveldb_writeoptions_destroy(woptions);
+            kvstore_delete(cache, iterkey, strlen(iterkey) + 1, &errptr);
             if (errptr != NULL) {
-                log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune: leveldb_delete error: %s", errptr);
+                log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune: kvstore_delete error: %s", errptr);
                 free(errptr);
                 ++issues;
             }
         }
     }
 
-    leveldb_iter_destroy(iter);
-    leveldb_readoptions_destroy(roptions);
+    kvstore_iter_destroy(iter);
 
     elapsedtime = clock() - elapsedtime;
     elapsedtime *= 1000;
@@ -968,7 +2474,157 @@ void stat_cache_prune(stat_cache_t *cache) {
         log_print(LOG_NOTICE, SECTION_STATCACHE_PRUNE, "site_stats: small site by file size %.1f M (< %lu M)",
             size_of_files / (1024.0 * 1024.0), medium_size / (1024 * 1024));
     }
-    bloomfilter_destroy(boptions);
+    prune_filter_put(boptions);
+
+    // Our own deletes don't need another sweep: their descendants sort after them and were
+    // removed in this one. Any other write since we started will trigger the next prune.
+    pruned_writes = writes + own_writes;
+    pruned = complete;
 
     return;
 }
+
+/* Deletes everything below path, which is no longer in the cache: its stat entries, level by
+ * level, and its updated_children entries. Stops at the first level with nothing under path;
+ * odd gaps (a grandchild cached without its parent) are left for the next full sweep.
+ */
+static void prune_subtree(stat_cache_t *cache, kvstore_iter_t *iter, const char *path, int *visited_entries, int *deleted_entries) {
+    char prefix[STAT_CACHE_KEY_MAX];
+    char *errptr = NULL;
+    size_t prefix_len;
+    unsigned int depth = 0;
+    int len;
+
+    for (const char *pnt = path; *pnt; pnt++) {
+        if (*pnt == '/') ++depth;
+    }
+
+    for (++depth; depth <= STAT_CACHE_DEPTH_MAX; depth++) {
+        int found = 0;
+
+        len = snprintf(prefix, sizeof(prefix), STAT_CACHE_KEY_PREFIX "%04u%s/", depth, path);
+        if (len < 0 || (size_t)len >= sizeof(prefix)) break;
+        prefix_len = len;
+
+        for (kvstore_iter_seek(iter, prefix, prefix_len); kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
+            size_t klen;
+            const char *iterkey = kvstore_iter_key(iter, &klen);
+
+            if (strncmp(iterkey, prefix, prefix_len) != 0) break;
+            ++found;
+            ++*visited_entries;
+            log_print(LOG_INFO, SECTION_STATCACHE_PRUNE, "prune_subtree: deleting \'%s\' under \'%s\'", key2path(iterkey), path);
+            stat_cache_delete_entry(cache, key2path(iterkey), false, NULL);
+            ++*deleted_entries;
+        }
+        if (found == 0) break;
+    }
+
+    // updated_children:<path> itself, then those of its descendants
+    if (updated_children_key(path, prefix, sizeof(prefix)) == NULL) return;
+    kvstore_delete(cache, prefix, strlen(prefix) + 1, &errptr);
+    if (errptr != NULL) {
+        log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "prune_subtree: kvstore_delete error: %s", errptr);
+        free(errptr);
+        errptr = NULL;
+    }
+    prefix_len = strlen(prefix);
+    if (prefix_len + 1 >= sizeof(prefix)) return;
+    prefix[prefix_len++] = '/';
+    prefix[prefix_len] = '\0';
+    for (kvstore_iter_seek(iter, prefix, prefix_len); kvstore_iter_valid(iter); kvstore_iter_next(iter)) {
+        size_t klen;
+        const char *iterkey = kvstore_iter_key(iter, &klen);
+
+        if (strncmp(iterkey, prefix, prefix_len) != 0) break;
+        ++*visited_entries;
+        log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "prune_subtree: updated_children: deleting \'%s\'", iterkey);
+        kvstore_delete(cache, iterkey, klen, &errptr);
+        if (errptr != NULL) {
+            log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "prune_subtree: kvstore_delete error: %s", errptr);
+            free(errptr);
+            errptr = NULL;
+        }
+        ++*deleted_entries;
+    }
+}
+
+// Revisit only the subtrees of paths deleted since the last prune
+static void stat_cache_prune_dirty(stat_cache_t *cache, GHashTable *dirty) {
+    kvstore_iter_t *iter;
+    GHashTableIter hiter;
+    gpointer dirty_path;
+    char keybuf[STAT_CACHE_KEY_MAX];
+    int dirty_count = 0;
+    int visited_entries = 0;
+    int deleted_entries = 0;
+    clock_t elapsedtime;
+
+    elapsedtime = clock();
+
+    iter = kvstore_iter_create(cache, NULL, false);
+    if (iter == NULL) {
+        // The next full prune covers what these would have
+        log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune_dirty: kvstore_iter_create failed; skipping %u paths", g_hash_table_size(dirty));
+        return;
+    }
+    g_hash_table_iter_init(&hiter, dirty);
+    while (g_hash_table_iter_next(&hiter, &dirty_path, NULL)) {
+        const char *path = dirty_path;
+        char *key;
+        char *value;
+        char *errptr = NULL;
+        size_t vallen;
+
+        ++dirty_count;
+        if (strcmp(path, "/") == 0) continue;
+
+        // Recreated since it was deleted; its children are live again
+        key = path2key(path, false, keybuf, sizeof(keybuf));
+        if (key == NULL) continue;
+        value = kvstore_get(cache, key, strlen(key) + 1, &vallen, &errptr);
+        if (errptr != NULL) {
+            log_print(LOG_ERR, SECTION_STATCACHE_PRUNE, "stat_cache_prune_dirty: kvstore_get error: %s", errptr);
+            free(errptr);
+            continue;
+        }
+        if (value != NULL) {
+            kvstore_free(value);
+            continue;
+        }
+
+        prune_subtree(cache, iter, path, &visited_entries, &deleted_entries);
+    }
+    kvstore_iter_destroy(iter);
+
+    elapsedtime = clock() - elapsedtime;
+    log_print(LOG_INFO, SECTION_STATCACHE_PRUNE, "stat_cache_prune_dirty: %d dirty paths; visited %d cache entries; deleted %d; elapsedtime %lu ms",
+        dirty_count, visited_entries, deleted_entries, (unsigned long)(elapsedtime * 1000 / CLOCKS_PER_SEC));
+}
+
+/* With full, or if the dirty set overflowed, sweep the whole cache; otherwise only revisit
+ * what was deleted since the last prune.
+ */
+void stat_cache_prune(stat_cache_t *cache, bool full) {
+    GHashTable *dirty;
+    bool overflow;
+
+    BUMP(statcache_prune);
+
+    // A full sweep covers everything dirtied before it starts
+    dirty = stat_cache_take_dirty(&overflow);
+    if (full || overflow) {
+        if (dirty) g_hash_table_destroy(dirty);
+        stat_cache_prune_full(cache);
+        return;
+    }
+
+    if (dirty == NULL) {
+        log_print(LOG_DEBUG, SECTION_STATCACHE_PRUNE, "stat_cache_prune: nothing dirty");
+        return;
+    }
+
+    BUMP(statcache_prune_incr);
+    stat_cache_prune_dirty(cache, dirty);
+    g_hash_table_destroy(dirty);
+}
@@ -20,37 +20,34 @@
 ***/
 
 #include <sys/stat.h>
-#include <leveldb/c.h>
+#include <limits.h>
 #include <glib.h>
 #include <errno.h>
 #include <stdbool.h>
 
+#include "kvstore.h"
+
 #define RGEN_LEN 128
 #define STAT_CACHE_OLD_DATA 2
 #define STAT_CACHE_NO_DATA 1
 
 #define STAT_CACHE_NEGATIVE_TTL 2
 
+// Room for the depth prefix, the path, and a trailing slash; also fits "updated_children:<path>"
+#define STAT_CACHE_KEY_MAX (PATH_MAX + 32)
+
 /* Since ultimately we return errno-like values, assign them here to our errors.
- * The only one is a leveldb error. Use EIO, since it indicates something unusual
+ * The only one is a store error. Use EIO, since it indicates something unusual
  * has happened. This is probably the best approximation.
  */
 #define E_SC_SUCCESS 0
 #define E_SC_LDBERR EIO
 
-typedef leveldb_t stat_cache_t;
+typedef kvstore_t stat_cache_t;
 
 struct stat_cache_supplemental {
-    leveldb_cache_t *lru;
-    leveldb_options_t *options;
-};
-
-// Used opaquely outside this library.
-struct stat_cache_iterator {
-    leveldb_iterator_t *ldb_iter;
-    leveldb_readoptions_t *ldb_options;
-    char *key_prefix;
-    size_t key_prefix_len;
+    // Set by the caller before stat_cache_open
+    struct kvstore_options options;
 };
 
 struct stat_cache_value {
@@ -61,7 +58,16 @@ struct stat_cache_value {
     char remote_generation[RGEN_LEN];
 };
 
+// Used opaquely outside this library.
+struct stat_cache_iterator {
+    kvstore_iter_t *ldb_iter;
+    char key_prefix[STAT_CACHE_KEY_MAX];
+    size_t key_prefix_len;
+    struct stat_cache_value value; // the current entry's, decoded
+};
+
 void stat_cache_print_stats(void);
+char *stat_cache_get_property(const char *property);
 int print_stat(struct stat *stbuf, const char *title);
 
 unsigned long stat_cache_get_local_generation(void);
@@ -72,16 +78,31 @@ void stat_cache_close(stat_cache_t *cache, struct stat_cache_supplemental supple
 struct stat_cache_value *stat_cache_value_get(stat_cache_t *cache, const char *path, bool skip_freshness_check, GError **gerr);
 void stat_cache_updated_children(stat_cache_t *cache, const char *path, time_t timestamp, GError **gerr);
 time_t stat_cache_read_updated_children(stat_cache_t *cache, const char *path, GError **gerr);
+bool stat_cache_children_fresh(stat_cache_t *cache, const char *path, time_t *updated);
 void stat_cache_value_set(stat_cache_t *cache, const char *path, struct stat_cache_value *value, GError **gerr);
 void stat_cache_value_free(struct stat_cache_value *value);
+bool stat_cache_known_absent(const char *path);
 
 void stat_cache_delete(stat_cache_t *cache, const char* path, GError **gerr);
 void stat_cache_delete_parent(stat_cache_t *cache, const char *path, GError **gerr);
 void stat_cache_delete_older(stat_cache_t *cache, const char *key_prefix, unsigned long minimum_local_generation, GError **gerr);
 
+// Batched ingestion; see statcache.c
+struct stat_cache_batch;
+struct stat_cache_batch *stat_cache_batch_begin(stat_cache_t *cache);
+void stat_cache_batch_value_set(struct stat_cache_batch *batch, const char *path, struct stat_cache_value *value, GError **gerr);
+void stat_cache_batch_delete(struct stat_cache_batch *batch, const char *path, GError **gerr);
+void stat_cache_batch_updated_children(struct stat_cache_batch *batch, const char *path, time_t timestamp, GError **gerr);
+void stat_cache_batch_delete_older(struct stat_cache_batch *batch, const char *path_prefix, unsigned long minimum_local_generation, GError **gerr);
+void stat_cache_batch_move_subtree(struct stat_cache_batch *batch, const char *from, const char *to, GError **gerr);
+void stat_cache_batch_delete_subtree(struct stat_cache_batch *batch, const char *path, GError **gerr);
+kvstore_batch_t *stat_cache_batch_kvstore(struct stat_cache_batch *batch);
+void stat_cache_batch_commit(struct stat_cache_batch *batch, GError **gerr);
+void stat_cache_batch_free(struct stat_cache_batch *batch);
+
 void stat_cache_walk(void);
 int stat_cache_enumerate(stat_cache_t *cache, const char *key_prefix, void (*f) (const char *path_prefix, const char *filename, void *user), void *user, bool force);
 bool stat_cache_dir_has_child(stat_cache_t *cache, const char *path);
-void stat_cache_prune(stat_cache_t *cache);
+void stat_cache_prune(stat_cache_t *cache, bool full);
 
 #endif
@@ -25,7 +25,13 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "util.h"
 #include "log.h"
@@ -35,7 +41,164 @@
 
 #define MAX_LINE_LEN 256
 
-struct statistics stats;
+// Padded out to whole cache lines, so no two threads' counters share one
+struct stats_shard {
+    struct statistics counts;
+    struct stats_shard *next;
+    bool in_use;
+} __attribute__((aligned(64)));
+
+__thread struct statistics *stats_local = NULL;
+
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_shard *shards = NULL;
+static struct statistics cleared; // totals as of each counter's last CLEAR; under shards_mutex
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+// A thread going away leaves its counts for the next thread to add to
+static void shard_detach(void *ptr) {
+    struct stats_shard *shard = ptr;
+
+    pthread_mutex_lock(&shards_mutex);
+    shard->in_use = false;
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+static void shard_key_create(void) {
+    pthread_key_create(&shard_key, shard_detach);
+}
+
+struct statistics *stats_attach(void) {
+    struct stats_shard *shard;
+
+    pthread_once(&shard_key_once, shard_key_create);
+
+    pthread_mutex_lock(&shards_mutex);
+    for (shard = shards; shard && shard->in_use; shard = shard->next);
+    if (shard == NULL) {
+        if (posix_memalign((void **) &shard, 64, sizeof(struct stats_shard))) {
+            // Nowhere else to count; stats_local stays NULL, so the next count tries again
+            static struct statistics overflow;
+            pthread_mutex_unlock(&shards_mutex);
+            return &overflow;
+        }
+        memset(shard, 0, sizeof(struct stats_shard));
+        shard->next = shards;
+        shards = shard;
+    }
+    shard->in_use = true;
+    pthread_mutex_unlock(&shards_mutex);
+
+    pthread_setspecific(shard_key, shard);
+    stats_local = &shard->counts;
+    return stats_local;
+}
+
+// Call with shards_mutex held
+static unsigned long shards_sum(size_t offset, size_t size) {
+    uint64_t sum64 = 0;
+    uint32_t sum32 = 0;
+
+    for (struct stats_shard *shard = shards; shard; shard = shard->next) {
+        const char *field = (const char *) &shard->counts + offset;
+        if (size == sizeof(uint64_t)) sum64 += __atomic_load_n((const uint64_t *) field, __ATOMIC_RELAXED);
+        else sum32 += __atomic_load_n((const uint32_t *) field, __ATOMIC_RELAXED);
+    }
+    // Sums wrap as the counters themselves would, which gauges going down rely on
+    return size == sizeof(uint64_t) ? sum64 : sum32;
+}
+
+unsigned long stats_fetch(size_t offset, size_t size) {
+    const char *base = (const char *) &cleared + offset;
+    unsigned long value;
+
+    pthread_mutex_lock(&shards_mutex);
+    value = shards_sum(offset, size);
+    if (size == sizeof(uint64_t)) value -= *(const uint64_t *) base;
+    else value = (uint32_t) (value - *(const uint32_t *) base);
+    pthread_mutex_unlock(&shards_mutex);
+    return value;
+}
+
+void stats_clear(size_t offset, size_t size) {
+    char *base = (char *) &cleared + offset;
+    unsigned long value;
+
+    pthread_mutex_lock(&shards_mutex);
+    value = shards_sum(offset, size);
+    if (size == sizeof(uint64_t)) *(uint64_t *) base = value;
+    else *(uint32_t *) base = value;
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+unsigned long stats_clock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+static int histogram_bucket(unsigned long value) {
+    int msb;
+    int shift;
+    int bucket;
+
+    if (value < STATS_HIST_SUB) return value;
+    msb = 63 - __builtin_clzl(value);
+    shift = msb - STATS_HIST_SUB_BITS;
+    bucket = (shift + 1) * STATS_HIST_SUB + (int) ((value >> shift) - STATS_HIST_SUB);
+    return bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1;
+}
+
+// The largest value bucket holds
+static unsigned long histogram_value(int bucket) {
+    int shift;
+
+    if (bucket < STATS_HIST_SUB) return bucket;
+    shift = bucket / STATS_HIST_SUB - 1;
+    return (((unsigned long) (STATS_HIST_SUB + bucket % STATS_HIST_SUB) + 1) << shift) - 1;
+}
+
+void stats_latency(enum stats_latency which, unsigned long start) {
+    struct stats_histogram *histogram = &stats_shard()->latency[which];
+    unsigned long elapsed = stats_clock() - start;
+    int bucket = histogram_bucket(elapsed);
+
+    __atomic_store_n(&histogram->buckets[bucket], histogram->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + elapsed, __ATOMIC_RELAXED);
+}
+
+static void histogram_fetch(enum stats_latency which, struct stats_histogram *total) {
+    memset(total, 0, sizeof(struct stats_histogram));
+    pthread_mutex_lock(&shards_mutex);
+    for (struct stats_shard *shard = shards; shard; shard = shard->next) {
+        const struct stats_histogram *histogram = &shard->counts.latency[which];
+        for (int idx = 0; idx < STATS_HIST_BUCKETS; idx++) {
+            total->buckets[idx] += __atomic_load_n(&histogram->buckets[idx], __ATOMIC_RELAXED);
+        }
+        total->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+// For a histogram of the caller's own, which only it updates
+void stats_histogram_add(struct stats_histogram *histogram, unsigned long value) {
+    ++histogram->buckets[histogram_bucket(value)];
+    histogram->sum += value;
+}
+
+// The value below which permille thousandths of the samples fall
+unsigned long stats_histogram_percentile(const struct stats_histogram *histogram, unsigned long count, unsigned permille) {
+    unsigned long rank = (count * permille + 999) / 1000;
+    unsigned long seen = 0;
+
+    for (int idx = 0; idx < STATS_HIST_BUCKETS; idx++) {
+        seen += histogram->buckets[idx];
+        if (seen >= rank && seen > 0) return histogram_value(idx);
+    }
+    return 0;
+}
 
 // print the line, maybe to the log, maybe to a stats file, maybe to both
 // log = true means print to log; fd >= 0 means print to stats file
@@ -81,13 +244,10 @@ static void malloc_stats_output(void *cbopaque, const char *s) {
 #define STAT_PATH_SIZE 80
 // xxsm, xsm, sm, med, lg, xlg * 2 (one for get, one for put)
 #define latency_items 13
+
+static void print_counters(bool log, int fd);
+
 void dump_stats(bool log, const char *cache_path) {
-    struct latency_s {
-        unsigned long count;
-        unsigned long timing;
-        const char *name;
-    };
-    struct latency_s latency[latency_items];
     char str[MAX_LINE_LEN];
     int fd = -1;
 
@@ -157,6 +317,41 @@ void dump_stats(bool log, const char *cache_path) {
     // Use cbopaque to pass in fd, if there is one
     malloc_stats_print(malloc_stats_output, (void *)(long)fd, "");
 
+    print_counters(log, fd);
+
+    if (fd >= 0) close(fd);
+}
+
+static void print_latency(bool log, int fd) {
+    static const char *names[STATS_LAT_MAX] = {"getattr", "readdir", "propfind", "get", "put"};
+    struct stats_histogram histogram;
+    char str[MAX_LINE_LEN];
+
+    snprintf(str, MAX_LINE_LEN, "Latency (us):");
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    for (int which = 0; which < STATS_LAT_MAX; which++) {
+        unsigned long count = 0;
+
+        histogram_fetch(which, &histogram);
+        for (int idx = 0; idx < STATS_HIST_BUCKETS; idx++) count += histogram.buckets[idx];
+        snprintf(str, MAX_LINE_LEN, "  %-10s count %lu mean %lu p50 %lu p99 %lu p999 %lu", names[which], count,
+            count > 0 ? histogram.sum / count : 0, stats_histogram_percentile(&histogram, count, 500),
+            stats_histogram_percentile(&histogram, count, 990), stats_histogram_percentile(&histogram, count, 999));
+        print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    }
+}
+
+// Everything counted, for dump_stats and the stats socket
+static void print_counters(bool log, int fd) {
+    struct latency_s {
+        unsigned long count;
+        unsigned long timing;
+        const char *name;
+    };
+    struct latency_s latency[latency_items];
+    char str[MAX_LINE_LEN];
+    char *ldbstats;
+
     snprintf(str, MAX_LINE_LEN, "Operations:");
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  chmod:            %u", FETCH(dav_chmod));
@@ -204,6 +399,30 @@ void dump_stats(bool log, const char *cache_path) {
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  nprop:            %u", FETCH(propfind_negative_cache));
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  coalesced:        %u", FETCH(propfind_coalesced));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  coalesce_tmo:     %u", FETCH(propfind_coalesce_timeout));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  warmup:           %u", FETCH(propfind_warmup));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  warmup_skip:      %u", FETCH(propfind_warmup_skip));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  lookahead:        %u", FETCH(propfind_lookahead));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  lookahead_skip:   %u", FETCH(propfind_lookahead_skip));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  lookahead_drop:   %u", FETCH(propfind_lookahead_drop));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  log_queued:       %u", FETCH(log_queued));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  log_dropped:      %u", FETCH(log_dropped));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  balanced:         %u", FETCH(session_balanced));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  hedged:           %u", FETCH(session_hedged));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  hedge_won:        %u", FETCH(session_hedge_won));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
 
 
     snprintf(str, MAX_LINE_LEN, "  cache_file:       %u", FETCH(filecache_cache_file));
@@ -234,10 +453,66 @@ void dump_stats(bool log, const char *cache_path) {
     print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  pdata_move:       %u", FETCH(filecache_pdata_move));
     print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  subtree:          %u", FETCH(filecache_subtree));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  orphans:          %u", FETCH(filecache_orphans));
     print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  cleanup:          %u", FETCH(filecache_cleanup));
     print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  cleanup_incr:     %u", FETCH(filecache_cleanup_incr));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  prefetch_queued:  %u", FETCH(filecache_prefetch_queued));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  prefetch_done:    %u", FETCH(filecache_prefetch_done));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  prefetch_cancel:  %u", FETCH(filecache_prefetch_cancel));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  revalidate:       %u", FETCH(filecache_revalidate));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  range_open:       %u", FETCH(filecache_range_open));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  range_get:        %u", FETCH(filecache_range_get));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  range_wait:       %u", FETCH(filecache_range_wait));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  range_fail:       %u", FETCH(filecache_range_fail));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  kernel_keep:      %u", FETCH(filecache_kernel_keep));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  kernel_drop:      %u", FETCH(filecache_kernel_drop));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  wb_queued:        %u", FETCH(filecache_writeback_queued));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  wb_coalesced:     %u", FETCH(filecache_writeback_coalesced));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  wb_put:           %u", FETCH(filecache_writeback_put));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  wb_retry:         %u", FETCH(filecache_writeback_retry));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  wb_fail:          %u", FETCH(filecache_writeback_fail));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  wb_sync:          %u", FETCH(filecache_writeback_sync));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  dedup_new:        %u", FETCH(filecache_dedup_new));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  dedup_hit:        %u", FETCH(filecache_dedup_hit));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  dedup_cow:        %u", FETCH(filecache_dedup_cow));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  dedup_gc:         %u", FETCH(filecache_dedup_gc));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  put_skip:         %u", FETCH(filecache_put_skip));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  quota_evict:      %u", FETCH(filecache_quota_evict));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  quota_evict_b:    %lu", FETCH(filecache_quota_evict_bytes));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  quota_skip:       %u", FETCH(filecache_quota_skip));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  resident_files:   %u", FETCH(filecache_resident_files));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  resident_bytes:   %lu", FETCH(filecache_resident_bytes));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  get_fd:           %u", FETCH(filecache_get_fd));
     print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  set_error:        %u", FETCH(filecache_set_error));
@@ -302,6 +577,8 @@ void dump_stats(bool log, const char *cache_path) {
         print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
     }
 
+    print_latency(log, fd);
+
     snprintf(str, MAX_LINE_LEN, "Stat Cache Operations:");
     print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  local_gen:        %u", FETCH(statcache_local_gen));
@@ -342,6 +619,44 @@ void dump_stats(bool log, const char *cache_path) {
     print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  prune:            %u", FETCH(statcache_prune));
     print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  prune_skip:       %u", FETCH(statcache_prune_skip));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  prune_incr:       %u", FETCH(statcache_prune_incr));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  batch_commit:     %u", FETCH(statcache_batch_commit));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  batch_ops:        %u", FETCH(statcache_batch_ops));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  subtree:          %u", FETCH(statcache_subtree));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  mem_hit:          %u", FETCH(statcache_mem_hit));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  mem_miss:         %u", FETCH(statcache_mem_miss));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  mem_evict:        %u", FETCH(statcache_mem_evict));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  neg_hit:          %u", FETCH(statcache_neg_hit));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  neg_pass:         %u", FETCH(statcache_neg_pass));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  neg_build:        %u", FETCH(statcache_neg_build));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  value_legacy:     %u", FETCH(statcache_value_legacy));
+    print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+
+    ldbstats = stat_cache_get_property(KVSTORE_PROPERTY_STATS);
+    if (ldbstats) {
+        char *line;
+        char *saveptr = NULL;
+
+        snprintf(str, MAX_LINE_LEN, "Store:");
+        print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+        for (line = strtok_r(ldbstats, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+            snprintf(str, MAX_LINE_LEN, "  %s", line);
+            print_line(log, fd, LOG_NOTICE, SECTION_STATCACHE_OUTPUT, str);
+        }
+        free(ldbstats);
+    }
 }
 
 void print_stats(void) {
@@ -401,3 +716,73 @@ void binding_busyness_stats(void) {
     CLEAR(filecache_put_lg_count);
     CLEAR(filecache_put_xlg_count);
 }
+
+/* Stats socket. Each connection to the Unix socket at path gets the counters and latency
+ * histograms, as dump_stats would write them, and is closed; e.g. socat - UNIX:<path>.
+ */
+static struct {
+    int fd;
+    char *path;
+    pthread_t thread;
+} stats_socket = { .fd = -1 };
+
+static void *stats_socket_worker(__unused void *ptr) {
+    int client;
+
+    // Fails once stats_socket_stop shuts the socket down
+    while ((client = accept(stats_socket.fd, NULL, NULL)) >= 0 || errno == EINTR) {
+        if (client < 0) continue;
+        print_counters(false, client);
+        close(client);
+    }
+    return NULL;
+}
+
+void stats_socket_start(const char *path) {
+    struct sockaddr_un addr;
+
+    if (path == NULL || path[0] == '\0') return;
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_print(LOG_ERR, SECTION_FUSEDAV_OUTPUT, "stats_socket_start: path too long: %s", path);
+        return;
+    }
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    stats_socket.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (stats_socket.fd < 0) {
+        log_print(LOG_ERR, SECTION_FUSEDAV_OUTPUT, "stats_socket_start: socket: %d %s", errno, strerror(errno));
+        return;
+    }
+    // Left behind by an earlier run
+    unlink(path);
+    if (bind(stats_socket.fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) || listen(stats_socket.fd, 8)) {
+        log_print(LOG_ERR, SECTION_FUSEDAV_OUTPUT, "stats_socket_start: bind/listen on %s: %d %s", path, errno, strerror(errno));
+        goto fail;
+    }
+    if (pthread_create(&stats_socket.thread, NULL, stats_socket_worker, NULL)) {
+        log_print(LOG_ERR, SECTION_FUSEDAV_OUTPUT, "stats_socket_start: failed to start the thread for %s", path);
+        unlink(path);
+        goto fail;
+    }
+    stats_socket.path = strdup(path);
+    log_print(LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, "stats_socket_start: serving stats on %s", path);
+    return;
+
+fail:
+    close(stats_socket.fd);
+    stats_socket.fd = -1;
+}
+
+void stats_socket_stop(void) {
+    if (stats_socket.fd < 0) return;
+
+    shutdown(stats_socket.fd, SHUT_RDWR);
+    pthread_join(stats_socket.thread, NULL);
+    close(stats_socket.fd);
+    stats_socket.fd = -1;
+    unlink(stats_socket.path);
+    free(stats_socket.path);
+}
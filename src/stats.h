@@ -20,6 +20,29 @@
 ***/
 
 #include <stdbool.h>
+#include <stddef.h>
+
+/* Latency histograms, in microseconds. Log-linear: values under STATS_HIST_SUB each have a
+ * bucket, and every power of two above that is split into STATS_HIST_SUB linear steps, so a
+ * bucket is within 1/STATS_HIST_SUB of the values it holds. The buckets reach past four hours.
+ */
+#define STATS_HIST_SUB_BITS 3
+#define STATS_HIST_SUB (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_BUCKETS 256
+
+enum stats_latency {
+    STATS_LAT_GETATTR,
+    STATS_LAT_READDIR,
+    STATS_LAT_PROPFIND,
+    STATS_LAT_GET,
+    STATS_LAT_PUT,
+    STATS_LAT_MAX
+};
+
+struct stats_histogram {
+    unsigned long buckets[STATS_HIST_BUCKETS];
+    unsigned long sum;
+};
 
 struct statistics {
     unsigned dav_chmod;
@@ -45,6 +68,20 @@ struct statistics {
     unsigned propfind_negative_cache;
     unsigned propfind_progressive_cache;
     unsigned propfind_complete_cache;
+    unsigned propfind_coalesced;
+    unsigned propfind_coalesce_timeout;
+    unsigned propfind_warmup;
+    unsigned propfind_warmup_skip;
+    unsigned propfind_lookahead;
+    unsigned propfind_lookahead_skip;
+    unsigned propfind_lookahead_drop;
+
+    unsigned log_queued;
+    unsigned log_dropped;
+
+    unsigned session_balanced;
+    unsigned session_hedged;
+    unsigned session_hedge_won;
 
     unsigned filecache_cache_file;
     unsigned filecache_pdata_set;
@@ -60,8 +97,36 @@ struct statistics {
     unsigned filecache_truncate;
     unsigned filecache_delete;
     unsigned filecache_pdata_move;
+    unsigned filecache_subtree;
     unsigned filecache_orphans;
     unsigned filecache_cleanup;
+    unsigned filecache_cleanup_incr;
+    unsigned filecache_prefetch_queued;
+    unsigned filecache_prefetch_done;
+    unsigned filecache_prefetch_cancel;
+    unsigned filecache_revalidate;
+    unsigned filecache_range_open;
+    unsigned filecache_range_get;
+    unsigned filecache_range_wait;
+    unsigned filecache_range_fail;
+    unsigned filecache_kernel_keep;
+    unsigned filecache_kernel_drop;
+    unsigned filecache_writeback_queued;
+    unsigned filecache_writeback_coalesced;
+    unsigned filecache_writeback_put;
+    unsigned filecache_writeback_retry;
+    unsigned filecache_writeback_fail;
+    unsigned filecache_writeback_sync;
+    unsigned filecache_dedup_new;
+    unsigned filecache_dedup_hit;
+    unsigned filecache_dedup_cow;
+    unsigned filecache_dedup_gc;
+    unsigned filecache_put_skip;
+    unsigned filecache_quota_evict;
+    unsigned long filecache_quota_evict_bytes;
+    unsigned filecache_quota_skip;
+    unsigned filecache_resident_files; // gauge
+    unsigned long filecache_resident_bytes; // gauge
     unsigned filecache_get_fd;
     unsigned filecache_set_error;
     unsigned filecache_forensic_haven;
@@ -113,17 +178,62 @@ struct statistics {
     unsigned statcache_has_child;
     unsigned statcache_delete_older;
     unsigned statcache_prune;
+    unsigned statcache_prune_skip;
+    unsigned statcache_prune_incr;
+    unsigned statcache_batch_commit;
+    unsigned statcache_batch_ops;
+    unsigned statcache_subtree;
+    unsigned statcache_mem_hit;
+    unsigned statcache_mem_miss;
+    unsigned statcache_mem_evict;
+    unsigned statcache_neg_hit;
+    unsigned statcache_neg_pass;
+    unsigned statcache_neg_build;
+    unsigned statcache_value_legacy;
+
+    struct stats_histogram latency[STATS_LAT_MAX];
 };
 
-extern struct statistics stats;
+/* Each thread counts into a struct statistics of its own, so the counters take no locked
+ * instructions and threads don't bounce each other's cache lines. FETCH adds up the threads'
+ * shards. A thread's shard outlives it, going to the next new thread, so counts are kept.
+ */
+extern __thread struct statistics *stats_local;
+struct statistics *stats_attach(void);
+
+static inline struct statistics *stats_shard(void) {
+    return stats_local ? stats_local : stats_attach();
+}
+
+// Only the owning thread writes a shard; the relaxed store keeps readers from seeing a torn value
+#define STATS_ADD(op, delta) do { \
+    struct statistics *shard_ = stats_shard(); \
+    __atomic_store_n(&shard_->op, shard_->op + (delta), __ATOMIC_RELAXED); \
+} while (0)
+
+#define STATS_FIELD(c) offsetof(struct statistics, c), sizeof(((struct statistics *)0)->c)
+
+#define TIMING(op, timing) STATS_ADD(op, (timing))
+#define BUMP(op) STATS_ADD(op, 1)
+#define FETCH(c) ((__typeof__(((struct statistics *)0)->c)) stats_fetch(STATS_FIELD(c)))
+// Counts from here on; FETCH reports the new total less the total at the last CLEAR
+#define CLEAR(c) stats_clear(STATS_FIELD(c))
+// For gauges, which go down as well as up
+#define ADJUST(op, delta) STATS_ADD(op, (delta))
+// start is from stats_clock()
+#define LATENCY(which, start) stats_latency((which), (start))
 
-#define TIMING(op, timing) __sync_fetch_and_add(&stats.op, (timing))
-#define BUMP(op) __sync_fetch_and_add(&stats.op, 1)
-#define FETCH(c) __sync_fetch_and_or(&stats.c, 0)
-#define CLEAR(c) __sync_fetch_and_and(&stats.c, 0)
+unsigned long stats_fetch(size_t offset, size_t size);
+void stats_clear(size_t offset, size_t size);
+unsigned long stats_clock(void);
+void stats_latency(enum stats_latency which, unsigned long start);
+void stats_histogram_add(struct stats_histogram *histogram, unsigned long value);
+unsigned long stats_histogram_percentile(const struct stats_histogram *histogram, unsigned long count, unsigned permille);
 
 void print_stats(void);
 void dump_stats(bool log, const char *cache_path);
 void binding_busyness_stats(void);
+void stats_socket_start(const char *path);
+void stats_socket_stop(void);
 
 #endif
@@ -224,7 +224,7 @@ static void filecache_forensic_haven_test(void) {
         {filecache_error_getldb, "filecache_error_getldb"},
         {filecache_error_getvallen, "filecache_error_getvallen"},
         {filecache_error_freshopen1, "filecache_error_freshopen1"},
-        /* {filecache_error_freshflock1, "filecache_error_freshflock1"}, this will leave lock locked */
+        {filecache_error_freshflock1, "filecache_error_freshflock1"},
         {filecache_error_freshftrunc, "filecache_error_freshftrunc"},
         {filecache_error_freshflock2, "filecache_error_freshflock2"},
         {filecache_error_freshsession, "filecache_error_freshsession"},
@@ -238,7 +238,7 @@ static void filecache_forensic_haven_test(void) {
         {filecache_error_readread, "filecache_error_readread"},
         {filecache_error_writesdata, "filecache_error_writesdata"},
         {filecache_error_writewriteable, "filecache_error_writewriteable"},
-        /* {filecache_error_writeflock1, "filecache_error_writeflock1"}, this will leave lock locked */
+        {filecache_error_writeflock1, "filecache_error_writeflock1"},
         {filecache_error_writewrite, "filecache_error_writewrite"},
         {filecache_error_writeflock2, "filecache_error_writeflock2"},
         {filecache_error_closesdata, "filecache_error_closesdata"},
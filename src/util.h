@@ -107,6 +107,9 @@ void *inject_error_mechanism(void *ptr);
 #define filecache_error_movepdata 64
 #define filecache_error_orphanopendir 65
 #define filecache_error_enhanced_logging 66
+#define filecache_error_rangecurl 67
+#define filecache_error_rangechunk 68
+#define filecache_error_wbldb 69
 
 #define statcache_error_cachepath 70
 #define statcache_error_openldb 71
@@ -115,6 +118,8 @@ void *inject_error_mechanism(void *ptr);
 #define statcache_error_readchildrenldb 74
 #define statcache_error_setldb 75
 #define statcache_error_deleteldb 76
+#define statcache_error_migrate 77
+#define statcache_error_batchldb 78
 
 #define config_error_parse 80
 #define config_error_sessioninit 81
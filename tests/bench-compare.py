@@ -0,0 +1,103 @@
+#! /usr/bin/env python
+# This file is part of fusedav.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+# Holds the results of two fusedav-replay -o runs, say one build and the next, against each
+# other. Prints each metric with its change, and marks as worse those that moved the wrong way
+# by more than --threshold percent: latencies (_us), errors and requests to the server up, ops/s
+# down. Counts are the same from runs of the same trace, and they and maxima are only printed.
+#
+# Exits 1 if anything got worse, so it can gate a build:
+#   bench-compare.py --threshold 10 before.tsv after.tsv
+
+from __future__ import print_function
+
+import argparse
+import sys
+
+
+def read_results(path):
+    results = {}
+    order = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line or line.startswith('#'):
+                continue
+            name, _, value = line.partition('\t')
+            try:
+                results[name] = float(value)
+            except ValueError:
+                continue
+            order.append(name)
+    return results, order
+
+
+def direction(name):
+    # 1 if the metric is better higher, -1 if lower, 0 if it is only informational. A max is one
+    # sample, and too noisy to call.
+    if name.endswith('.max_us'):
+        return 0
+    if name.endswith('_per_s'):
+        return 1
+    if name.endswith('_us') or name.endswith('.errors') or name.startswith('server.'):
+        return -1
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare two fusedav-replay results files')
+    parser.add_argument('--threshold', type=float, default=5.0, help='percent change counted as worse; 5 by default')
+    parser.add_argument('--all', action='store_true', help='print every metric, not only those that changed')
+    parser.add_argument('old')
+    parser.add_argument('new')
+    args = parser.parse_args()
+
+    old, order = read_results(args.old)
+    new, new_order = read_results(args.new)
+    order += [name for name in new_order if name not in old]
+
+    worse = []
+    print('%-28s %12s %12s %9s' % ('metric', 'old', 'new', 'change'))
+    for name in order:
+        if name not in old or name not in new:
+            print('%-28s %12s %12s' % (name, old.get(name, '-'), new.get(name, '-')))
+            continue
+        before, after = old[name], new[name]
+        if before == after and not args.all:
+            continue
+        if before:
+            change = 100.0 * (after - before) / before
+        else:
+            change = 0.0 if after == 0 else float('inf')
+        mark = ''
+        sign = direction(name)
+        # Errors from none to some is worse at any threshold
+        if sign and (change * sign < -args.threshold or (sign < 0 and before == 0 and after > 0)):
+            mark = 'worse'
+            worse.append(name)
+        elif sign and change * sign > args.threshold:
+            mark = 'better'
+        print('%-28s %12g %12g %+8.1f%% %s' % (name, before, after, change, mark))
+
+    if worse:
+        print('%d metrics worse by more than %g%%: %s' % (len(worse), args.threshold, ' '.join(worse)))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,401 @@
+/* Microbenchmark: the bloom filter stat_cache_prune and the negative stat cache use.
+ *
+ * Builds bloom-filter.c directly (see tests/Makefile) and measures, on path-like keys,
+ * false positive rate and ns per add, per lookup of a key that was added, and per lookup
+ * of one that wasn't, for:
+ *   legacy:  the filter bloom-filter.c used to be (adler32, two bits a key picked from
+ *            one 32-bit hash, a fixed 8K bitfield, byte at a time)
+ *   blocked: bloomfilter_init's filter, once at the legacy filter's memory and once at
+ *            the default 10 bits a key
+ * Then saves and reloads the blocked filter and checks it answers the same for every key,
+ * or we exit 1.
+ *
+ * The legacy filter only holds up to 22755 keys, the default for -n; past that it is skipped.
+ *
+ * e.g. bloom-filter-bench -n 22755 -i 8
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <zlib.h>
+
+#include "bloom-filter.h"
+
+// Normally provided by log.c, which pulls in the rest of fusedav
+int log_print(unsigned int log_level, unsigned int section, const char *format, ...) {
+    (void)log_level; (void)section; (void)format;
+    return 0;
+}
+
+static bool verbose = false;
+
+static void usage(void) {
+    printf("-n <keys> number of keys to add, 22755 by default\n");
+    printf("-i <iters> passes per measurement, 8 by default\n");
+    printf("-d <dir> where to save the filter for the reload check, /tmp by default\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* The legacy filter, as it was in bloom-filter.c, less its debug logging and the custom
+ * hash function option nothing passed.
+ */
+struct legacy_filter {
+    unsigned char *bitfield;
+    unsigned int maxkeys;
+    unsigned long salt;
+    unsigned int bits_in_chunk;
+    unsigned int num_chunks;
+    unsigned int bits_in_hash_return;
+    unsigned long filtersize;
+};
+
+typedef struct legacy_values_s {
+    unsigned char bitvalue;
+    unsigned long bytevalue;
+    unsigned long hashvalue;
+} legacy_values_t;
+
+static int legacy_calculate_sizes(struct legacy_filter *options) {
+    options->filtersize = options->maxkeys * 1.44;
+    if (((options->filtersize * 2) <= UCHAR_MAX) && (options->bits_in_hash_return >= 16)) {
+        options->bits_in_chunk = 8;
+        options->num_chunks = 2;
+        options->filtersize = ((UCHAR_MAX) / 8) + 1;
+    }
+    else if (((options->filtersize * 2) <= USHRT_MAX) && options->bits_in_hash_return >= 32) {
+        options->bits_in_chunk = 16;
+        options->num_chunks = 2;
+        options->filtersize = ((USHRT_MAX) / 8) + 1;
+    }
+    else if (((options->filtersize * 2) <= UINT_MAX) && options->bits_in_hash_return >= 64) {
+        options->bits_in_chunk = 32;
+        options->num_chunks = 2;
+        options->filtersize = ((UINT_MAX) / 8) + 1;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+static struct legacy_filter *legacy_init(unsigned long maxkeys) {
+    struct legacy_filter *options;
+
+    options = calloc(1, sizeof(struct legacy_filter));
+    if (options == NULL) return NULL;
+    options->maxkeys = maxkeys ? maxkeys : 22755;
+    options->salt = time(NULL);
+    options->bits_in_hash_return = 32;
+    if (legacy_calculate_sizes(options) < 0) {
+        free(options);
+        return NULL;
+    }
+    options->bitfield = calloc(options->filtersize, sizeof(unsigned char));
+    if (options->bitfield == NULL) {
+        free(options);
+        return NULL;
+    }
+    return options;
+}
+
+static legacy_values_t legacy_byte_bit_location(unsigned long startvalue, int bits_in_chunk) {
+    unsigned long hashvalue;
+    legacy_values_t values;
+
+    hashvalue = startvalue & ((1UL << bits_in_chunk) - 1);
+    values.bitvalue = 1 << (hashvalue & 0x7);
+    values.bytevalue = hashvalue >> 3;
+    values.hashvalue = startvalue >> bits_in_chunk;
+    return values;
+}
+
+static int legacy_add(struct legacy_filter *options, const void *key, size_t klen) {
+    legacy_values_t values;
+
+    values.hashvalue = adler32(options->salt, (const Bytef *)key, klen);
+    for (unsigned int idx = 0; idx < options->num_chunks; idx++) {
+        values = legacy_byte_bit_location(values.hashvalue, options->bits_in_chunk);
+        options->bitfield[values.bytevalue] |= values.bitvalue;
+    }
+    return 0;
+}
+
+static bool legacy_exists(struct legacy_filter *options, const void *key, size_t klen) {
+    legacy_values_t values;
+
+    values.hashvalue = adler32(options->salt, (const Bytef *)key, klen);
+    for (unsigned int idx = 0; idx < options->num_chunks; idx++) {
+        values = legacy_byte_bit_location(values.hashvalue, options->bits_in_chunk);
+        if ((options->bitfield[values.bytevalue] & values.bitvalue) == 0) return false;
+    }
+    return true;
+}
+
+static void legacy_destroy(struct legacy_filter *options) {
+    if (options) {
+        free(options->bitfield);
+        free(options);
+    }
+}
+
+// Lets one measurement loop drive either filter
+struct filter_ops {
+    const char *name;
+    void *filter;
+    size_t bytes;
+    int (*add)(void *filter, const void *key, size_t klen);
+    bool (*exists)(void *filter, const void *key, size_t klen);
+    void (*clear)(void *filter);
+};
+
+static int legacy_add_op(void *filter, const void *key, size_t klen) {
+    return legacy_add(filter, key, klen);
+}
+
+static bool legacy_exists_op(void *filter, const void *key, size_t klen) {
+    return legacy_exists(filter, key, klen);
+}
+
+static void legacy_clear_op(void *filter) {
+    struct legacy_filter *options = filter;
+    memset(options->bitfield, 0, options->filtersize);
+}
+
+static int blocked_add_op(void *filter, const void *key, size_t klen) {
+    return bloomfilter_add(filter, key, klen);
+}
+
+static bool blocked_exists_op(void *filter, const void *key, size_t klen) {
+    return bloomfilter_exists(filter, key, klen);
+}
+
+static void blocked_clear_op(void *filter) {
+    bloomfilter_clear(filter);
+}
+
+/* Keys like the stat cache's: directories under a site's files, a few hundred to a parent.
+ * The keys not added are the ones numbered after those that were, so differ from them
+ * only the way the cache's keys differ from one another.
+ */
+struct keys {
+    char **key;
+    size_t *len;
+    int count;
+};
+
+static struct keys make_keys(int first, int count) {
+    struct keys keys;
+
+    keys.key = malloc(count * sizeof(char *));
+    keys.len = malloc(count * sizeof(size_t));
+    keys.count = count;
+    for (int idx = 0; idx < count; idx++) {
+        int num = first + idx;
+        if (asprintf(&keys.key[idx], "/sites/files/styles/dir%04d/sub%03d", num / 300, num % 300) < 0) {
+            printf("FAIL: out of memory\n");
+            exit(1);
+        }
+        keys.len[idx] = strlen(keys.key[idx]);
+    }
+    return keys;
+}
+
+static void free_keys(struct keys *keys) {
+    for (int idx = 0; idx < keys->count; idx++) free(keys->key[idx]);
+    free(keys->key);
+    free(keys->len);
+}
+
+static void run_pass(struct filter_ops *ops, struct keys *present, struct keys *absent, int iters) {
+    unsigned long add_ns = 0;
+    unsigned long hit_ns = 0;
+    unsigned long miss_ns = 0;
+    unsigned long found = 0;
+    unsigned long false_positives = 0;
+    unsigned long start;
+
+    for (int iter = 0; iter < iters; iter++) {
+        ops->clear(ops->filter);
+        start = now_ns();
+        for (int idx = 0; idx < present->count; idx++) {
+            ops->add(ops->filter, present->key[idx], present->len[idx]);
+        }
+        add_ns += now_ns() - start;
+
+        start = now_ns();
+        for (int idx = 0; idx < present->count; idx++) {
+            found += ops->exists(ops->filter, present->key[idx], present->len[idx]);
+        }
+        hit_ns += now_ns() - start;
+
+        start = now_ns();
+        for (int idx = 0; idx < absent->count; idx++) {
+            false_positives += ops->exists(ops->filter, absent->key[idx], absent->len[idx]);
+        }
+        miss_ns += now_ns() - start;
+    }
+
+    if (found != (unsigned long)present->count * iters) {
+        printf("FAIL: %s: %lu of %lu added keys found\n", ops->name, found, (unsigned long)present->count * iters);
+        exit(1);
+    }
+
+    printf("%-24s %7zu bytes  fp %7.4f%%  add %6.1f ns  hit %6.1f ns  miss %6.1f ns\n", ops->name, ops->bytes,
+        100.0 * false_positives / ((double)absent->count * iters),
+        (double)add_ns / ((double)present->count * iters),
+        (double)hit_ns / ((double)present->count * iters),
+        (double)miss_ns / ((double)absent->count * iters));
+}
+
+static struct filter_ops blocked_ops(const char *name, unsigned long maxkeys, unsigned int bits_per_key) {
+    struct filter_ops ops;
+    char *errptr = NULL;
+
+    ops.name = name;
+    ops.filter = bloomfilter_init(maxkeys, bits_per_key, 0, &errptr);
+    if (ops.filter == NULL) {
+        printf("FAIL: %s: bloomfilter_init: %s\n", name, errptr);
+        exit(1);
+    }
+    // Whole 512-bit blocks
+    ops.bytes = (maxkeys * bits_per_key + 511) / 512 * 64;
+    ops.add = blocked_add_op;
+    ops.exists = blocked_exists_op;
+    ops.clear = blocked_clear_op;
+    return ops;
+}
+
+// Save the filter, load it back, and check the copy answers the same for every key
+static bool reload_check(bloomfilter_options_t *filter, const char *dir, struct keys *present, struct keys *absent) {
+    bloomfilter_options_t *loaded;
+    char path[PATH_MAX];
+    char *errptr = NULL;
+    bool same = true;
+
+    snprintf(path, sizeof(path), "%s/bloom-filter-bench.%d", dir, getpid());
+    if (bloomfilter_save(filter, path, &errptr) < 0) {
+        printf("FAIL: bloomfilter_save: %s\n", errptr);
+        return false;
+    }
+    loaded = bloomfilter_load(path, &errptr);
+    unlink(path);
+    if (loaded == NULL) {
+        printf("FAIL: bloomfilter_load: %s\n", errptr);
+        return false;
+    }
+
+    if (bloomfilter_keys(loaded) != bloomfilter_keys(filter) || bloomfilter_maxkeys(loaded) != bloomfilter_maxkeys(filter)) {
+        printf("FAIL: reloaded filter has %lu of %lu keys, saved had %lu of %lu\n", bloomfilter_keys(loaded),
+            bloomfilter_maxkeys(loaded), bloomfilter_keys(filter), bloomfilter_maxkeys(filter));
+        same = false;
+    }
+    for (int idx = 0; idx < present->count && same; idx++) {
+        if (!bloomfilter_exists(loaded, present->key[idx], present->len[idx])) {
+            printf("FAIL: reloaded filter lost \'%s\'\n", present->key[idx]);
+            same = false;
+        }
+    }
+    for (int idx = 0; idx < absent->count && same; idx++) {
+        if (bloomfilter_exists(loaded, absent->key[idx], absent->len[idx]) !=
+            bloomfilter_exists(filter, absent->key[idx], absent->len[idx])) {
+            printf("FAIL: reloaded filter differs on \'%s\'\n", absent->key[idx]);
+            same = false;
+        }
+    }
+    v_printf("reload: %s %lu keys\n", same ? "same answers for" : "differs, ", bloomfilter_keys(loaded));
+    bloomfilter_destroy(loaded);
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    struct filter_ops same_memory;
+    struct filter_ops default_bits;
+    struct keys present;
+    struct keys absent;
+    const char *dir = "/tmp";
+    int count = 22755;
+    int iters = 8;
+    bool same;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:i:d:vh")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'i':
+                iters = atoi(optarg);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+    if (count <= 0 || iters <= 0) usage();
+
+    present = make_keys(0, count);
+    absent = make_keys(count, count);
+    v_printf("%d keys, %d passes\n", count, iters);
+
+    if (count <= 22755) {
+        struct filter_ops legacy;
+        struct legacy_filter *filter = legacy_init(count);
+
+        legacy.name = "legacy";
+        legacy.filter = filter;
+        legacy.bytes = filter->filtersize;
+        legacy.add = legacy_add_op;
+        legacy.exists = legacy_exists_op;
+        legacy.clear = legacy_clear_op;
+        run_pass(&legacy, &present, &absent, iters);
+        legacy_destroy(filter);
+    }
+    else {
+        printf("legacy: skipped, it only holds 22755 keys\n");
+    }
+
+    // About the legacy filter's 8K at its default 22755 keys
+    same_memory = blocked_ops("blocked, 3 bits a key", count, 3);
+    run_pass(&same_memory, &present, &absent, iters);
+    bloomfilter_destroy(same_memory.filter);
+
+    default_bits = blocked_ops("blocked, 10 bits a key", count, BLOOM_DEFAULT_BITS_PER_KEY);
+    run_pass(&default_bits, &present, &absent, iters);
+    same = reload_check(default_bits.filter, dir, &present, &absent);
+    bloomfilter_destroy(default_bits.filter);
+
+    free_keys(&present);
+    free_keys(&absent);
+    return same ? 0 : 1;
+}
@@ -0,0 +1,975 @@
+/* Load replay: runs a trace of filesystem operations against a fusedav mount and reports
+ * ops/s and latency percentiles per operation, and, against mock-dav-server.py, how many
+ * requests fusedav made of the server per operation.
+ *
+ * A trace has one operation per line, on paths relative to the mount:
+ *   getattr <path>                  lstat
+ *   readdir <path>                  opendir, readdir to the end, closedir
+ *   open <path> <flags>             flags are r, w or rw, then any of c (create) t (truncate) a (append)
+ *   create <path>                   open with O_WRONLY|O_CREAT|O_TRUNC
+ *   read <path> <offset> <size>     pread on the path's open file
+ *   write <path> <offset> <size>    pwrite on the path's open file
+ *   fsync <path>
+ *   truncate <path> <size>          ftruncate on the path's open file
+ *   release <path>                  close the path's open file
+ *   mkdir <path>, rmdir <path>, unlink <path>, rename <from> <to>
+ * Blank lines and lines starting with # are skipped. fusedav's own log lines are read as well, so
+ * a trace can be taken from production by logging at LOG_INFO and keeping the CALLBACK lines, e.g.
+ *   journalctl -o cat -u <binding mount> | grep 'CALLBACK: dav_' > trace
+ * -g writes a synthetic trace instead, a mix like a PHP site's over the files that
+ * mock-dav-server.py --files -n --dirs -D creates, e.g.
+ *   fusedav-replay -g 200000 -n 20000 -D 200 > mix.trace
+ *
+ * Each of -t threads replays, in trace order, the operations on the paths which hash to it, so
+ * the operations on any one file stay in order; -t 1 replays exactly a trace whose operations
+ * depend on one another across paths, a rename into a new directory say. With -P, first creates
+ * what the trace expects to find: directories it lists and files it opens, long enough for its
+ * reads. -W passes are replayed before the -l passes measured.
+ *
+ * -o writes the results as "metric<tab>value" lines, for bench-compare.py to hold against
+ * those of another build.
+ *
+ * e.g. fusedav-replay -m /mnt/dav -f mix.trace -t 8 -P -W 1 -s 127.0.0.1:8080 -o results.tsv
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define LINE_MAX_LEN (2 * PATH_MAX + 128)
+#define SERVER_METHODS_MAX 16
+
+enum op_e {
+    OP_GETATTR,
+    OP_READDIR,
+    OP_OPEN,
+    OP_CREATE,
+    OP_READ,
+    OP_WRITE,
+    OP_FSYNC,
+    OP_TRUNCATE,
+    OP_RELEASE,
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_UNLINK,
+    OP_RENAME,
+    OP_MAX
+};
+
+static const char *op_names[OP_MAX] = {
+    "getattr", "readdir", "open", "create", "read", "write", "fsync", "truncate", "release",
+    "mkdir", "rmdir", "unlink", "rename",
+};
+
+struct op {
+    enum op_e op;
+    char *path;
+    char *path2; // rename's destination
+    int flags; // open
+    off_t offset;
+    size_t size; // read, write; truncate's length
+};
+
+struct samples {
+    unsigned long *ns;
+    size_t count;
+    size_t alloc;
+    unsigned long errors;
+};
+
+// A path's open files, most recent first
+struct open_file {
+    char *path;
+    int fd;
+    struct open_file *next;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    struct op **ops;
+    size_t count;
+    size_t alloc;
+    struct open_file *open;
+    char *buf;
+    size_t buflen;
+    bool measure;
+    struct samples samples[OP_MAX];
+};
+
+static bool verbose = false;
+static const char *mount = NULL;
+
+static void usage(void) {
+    printf("-m <dir> the fusedav mount the trace's paths are under\n");
+    printf("-f <file> the trace; - for stdin\n");
+    printf("-t <threads> 4 by default\n");
+    printf("-l <passes> measured passes over the trace, 1 by default\n");
+    printf("-W <passes> passes before those, to warm the caches; 0 by default\n");
+    printf("-P first create the directories and files the trace expects\n");
+    printf("-s <host:port> a mock-dav-server.py node, to count the requests fusedav makes of it\n");
+    printf("-o <file> also write the results here, for bench-compare.py\n");
+    printf("-g <ops> write a synthetic trace of this many operations to stdout, and exit\n");
+    printf("-n <files> -D <dirs> the files and directories of mock-dav-server.py --files --dirs, for -g; 20000 and 200 by default\n");
+    printf("-S <seed> for -g, 1 by default\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        printf("out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static char *xstrdup(const char *str) {
+    char *copy = strdup(str);
+    if (copy == NULL) {
+        printf("out of memory\n");
+        exit(1);
+    }
+    return copy;
+}
+
+static int parse_open_flags(const char *str) {
+    int flags;
+
+    if (strncmp(str, "rw", 2) == 0) {
+        flags = O_RDWR;
+        str += 2;
+    }
+    else if (str[0] == 'w') {
+        flags = O_WRONLY;
+        ++str;
+    }
+    else if (str[0] == 'r') {
+        flags = O_RDONLY;
+        ++str;
+    }
+    else {
+        return -1;
+    }
+    for (; *str; str++) {
+        if (*str == 'c') flags |= O_CREAT;
+        else if (*str == 't') flags |= O_TRUNC;
+        else if (*str == 'a') flags |= O_APPEND;
+        else return -1;
+    }
+    return flags;
+}
+
+static enum op_e op_lookup(const char *name) {
+    for (int idx = 0; idx < OP_MAX; idx++) {
+        if (strcmp(name, op_names[idx]) == 0) return idx;
+    }
+    return OP_MAX;
+}
+
+static bool null_path(const char *path) {
+    return strcasecmp(path, "null path") == 0 || strcmp(path, "(null)") == 0;
+}
+
+/* A fusedav log line, from "CALLBACK: dav_" on, e.g.
+ *   CALLBACK: dav_read(/sites/default/files/x.css, 0+4096)
+ *   CALLBACK: dav_open: open(/index.php, 8000, trunc=0)
+ * Calls with no syscall of their own to replay (fgetattr, flush, utimens, chmod) are skipped.
+ */
+static bool parse_log_line(char *call, struct op *op) {
+    char *args;
+    char *end;
+    char *comma;
+
+    // "dav_open: open(" and "dav_release: release(" name the call twice
+    args = strchr(call, '(');
+    end = strrchr(call, ')');
+    if (args == NULL || end == NULL || end < args) return false;
+    *args++ = '\0';
+    *end = '\0';
+    if (strchr(call, ':')) *strchr(call, ':') = '\0';
+    call += strlen("dav_");
+
+    if (strcmp(call, "getattr") == 0 || strcmp(call, "readdir") == 0 || strcmp(call, "release") == 0 ||
+        strcmp(call, "fsync") == 0 || strcmp(call, "unlink") == 0 || strcmp(call, "rmdir") == 0) {
+        op->op = op_lookup(call);
+        op->path = xstrdup(args);
+        return !null_path(args);
+    }
+    // Everything else has arguments after the path; paths with ", " in them are rare enough
+    comma = strrchr(args, ',');
+    if (comma == NULL) return false;
+    *comma = '\0';
+    if (strcmp(call, "read") == 0 || strcmp(call, "read_buf") == 0 || strcmp(call, "write") == 0) {
+        unsigned long offset, size;
+        if (sscanf(comma + 1, " %lu+%lu", &offset, &size) != 2) return false;
+        op->op = call[0] == 'r' ? OP_READ : OP_WRITE;
+        op->offset = offset;
+        op->size = size;
+    }
+    else if (strcmp(call, "open") == 0) {
+        unsigned int flags;
+        // open(path, flags, trunc=x): drop the trunc, then the flags are after the comma before it
+        comma = strrchr(args, ',');
+        if (comma == NULL || sscanf(comma + 1, " %x", &flags) != 1) return false;
+        *comma = '\0';
+        op->op = OP_OPEN;
+        op->flags = flags & (O_ACCMODE | O_CREAT | O_TRUNC | O_APPEND);
+    }
+    else if (strcmp(call, "create") == 0 || strcmp(call, "mkdir") == 0) {
+        op->op = call[0] == 'c' ? OP_CREATE : OP_MKDIR;
+    }
+    else if (strcmp(call, "ftruncate") == 0) {
+        unsigned long size;
+        if (sscanf(comma + 1, " %lu", &size) != 1) return false;
+        op->op = OP_TRUNCATE;
+        op->size = size;
+    }
+    else if (strcmp(call, "rename") == 0) {
+        op->op = OP_RENAME;
+        op->path2 = xstrdup(comma + 1 + strspn(comma + 1, " "));
+    }
+    else {
+        return false;
+    }
+    op->path = xstrdup(args);
+    return !null_path(args);
+}
+
+static bool parse_line(char *line, struct op *op) {
+    char name[32];
+    char path[PATH_MAX];
+    char arg1[PATH_MAX];
+    unsigned long num1 = 0, num2 = 0;
+    char *call;
+    int fields;
+
+    memset(op, 0, sizeof(struct op));
+    call = strstr(line, "CALLBACK: dav_");
+    if (call) return parse_log_line(call + strlen("CALLBACK: "), op);
+
+    fields = sscanf(line, "%31s %4095s %4095s %lu", name, path, arg1, &num2);
+    if (fields < 2) return false;
+    op->op = op_lookup(name);
+    switch (op->op) {
+        case OP_OPEN:
+            if (fields < 3 || (op->flags = parse_open_flags(arg1)) < 0) return false;
+            break;
+        case OP_READ:
+        case OP_WRITE:
+            if (fields < 4) return false;
+            num1 = strtoul(arg1, NULL, 10);
+            op->offset = num1;
+            op->size = num2;
+            break;
+        case OP_TRUNCATE:
+            if (fields < 3) return false;
+            op->size = strtoul(arg1, NULL, 10);
+            break;
+        case OP_RENAME:
+            if (fields < 3) return false;
+            op->path2 = xstrdup(arg1);
+            break;
+        case OP_MAX:
+            return false;
+        default:
+            break;
+    }
+    op->path = xstrdup(path);
+    return true;
+}
+
+static struct op *read_trace(const char *file, size_t *count) {
+    FILE *fp;
+    char line[LINE_MAX_LEN];
+    struct op *ops = NULL;
+    size_t alloc = 0;
+    unsigned long lineno = 0;
+    unsigned long skipped = 0;
+
+    fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+    if (fp == NULL) {
+        printf("can't open %s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+    *count = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char *pnt = line + strspn(line, " \t");
+
+        ++lineno;
+        pnt[strcspn(pnt, "\r\n")] = '\0';
+        if (*pnt == '\0' || *pnt == '#') continue;
+        if (*count == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            ops = realloc(ops, alloc * sizeof(struct op));
+            if (ops == NULL) {
+                printf("out of memory\n");
+                exit(1);
+            }
+        }
+        if (parse_line(pnt, &ops[*count])) {
+            ++*count;
+        }
+        else {
+            free(ops[*count].path);
+            free(ops[*count].path2);
+            v_printf("skipping line %lu: %s\n", lineno, pnt);
+            ++skipped;
+        }
+    }
+    if (fp != stdin) fclose(fp);
+    printf("%zu operations from %s; %lu lines skipped\n", *count, file, skipped);
+    return ops;
+}
+
+static void full_path(char *buf, size_t len, const char *path) {
+    snprintf(buf, len, "%s%s%s", mount, path[0] == '/' ? "" : "/", path);
+}
+
+static void samples_add(struct samples *samples, unsigned long ns) {
+    if (samples->count == samples->alloc) {
+        samples->alloc = samples->alloc ? samples->alloc * 2 : 256;
+        samples->ns = realloc(samples->ns, samples->alloc * sizeof(unsigned long));
+        if (samples->ns == NULL) {
+            printf("out of memory\n");
+            exit(1);
+        }
+    }
+    samples->ns[samples->count++] = ns;
+}
+
+static void open_push(struct worker *worker, const char *path, int fd) {
+    struct open_file *file = xmalloc(sizeof(struct open_file));
+    file->path = xstrdup(path);
+    file->fd = fd;
+    file->next = worker->open;
+    worker->open = file;
+}
+
+static int open_find(struct worker *worker, const char *path) {
+    for (struct open_file *file = worker->open; file; file = file->next) {
+        if (strcmp(file->path, path) == 0) return file->fd;
+    }
+    return -1;
+}
+
+static int open_pop(struct worker *worker, const char *path) {
+    for (struct open_file **pnt = &worker->open; *pnt; pnt = &(*pnt)->next) {
+        struct open_file *file = *pnt;
+        if (strcmp(file->path, path) == 0) {
+            int fd = file->fd;
+            *pnt = file->next;
+            free(file->path);
+            free(file);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static bool ensure_buf(struct worker *worker, size_t size) {
+    if (size <= worker->buflen) return true;
+    free(worker->buf);
+    worker->buf = xmalloc(size);
+    memset(worker->buf, 'r', size);
+    worker->buflen = size;
+    return true;
+}
+
+// Returns false on error; the time spent is the caller's to take
+static bool run_op(struct worker *worker, const struct op *op) {
+    char path[PATH_MAX];
+    char path2[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    full_path(path, sizeof(path), op->path);
+    switch (op->op) {
+        case OP_GETATTR:
+            // A miss is an answer too; fusedav answers a good share of getattrs with ENOENT
+            return lstat(path, &st) == 0 || errno == ENOENT;
+        case OP_READDIR: {
+            DIR *dir = opendir(path);
+            if (dir == NULL) return false;
+            while (readdir(dir) != NULL);
+            closedir(dir);
+            return true;
+        }
+        case OP_OPEN:
+        case OP_CREATE:
+            fd = op->op == OP_CREATE ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, op->flags, 0644);
+            if (fd < 0) return false;
+            open_push(worker, op->path, fd);
+            return true;
+        case OP_READ:
+        case OP_WRITE:
+            fd = open_find(worker, op->path);
+            if (fd < 0) return false;
+            ensure_buf(worker, op->size);
+            if (op->op == OP_READ) return pread(fd, worker->buf, op->size, op->offset) >= 0;
+            return pwrite(fd, worker->buf, op->size, op->offset) == (ssize_t) op->size;
+        case OP_FSYNC:
+            fd = open_find(worker, op->path);
+            return fd >= 0 && fsync(fd) == 0;
+        case OP_TRUNCATE:
+            fd = open_find(worker, op->path);
+            return fd >= 0 && ftruncate(fd, op->size) == 0;
+        case OP_RELEASE:
+            fd = open_pop(worker, op->path);
+            return fd >= 0 && close(fd) == 0;
+        case OP_MKDIR:
+            return mkdir(path, 0755) == 0;
+        case OP_RMDIR:
+            return rmdir(path) == 0;
+        case OP_UNLINK:
+            return unlink(path) == 0;
+        case OP_RENAME:
+            full_path(path2, sizeof(path2), op->path2);
+            return rename(path, path2) == 0;
+        case OP_MAX:
+            break;
+    }
+    return false;
+}
+
+static void *worker_run(void *ptr) {
+    struct worker *worker = ptr;
+
+    for (size_t idx = 0; idx < worker->count; idx++) {
+        const struct op *op = worker->ops[idx];
+        unsigned long start = now_ns();
+        bool ok = run_op(worker, op);
+        unsigned long elapsed = now_ns() - start;
+
+        if (!ok) {
+            v_printf("%s %s: %s\n", op_names[op->op], op->path, strerror(errno));
+        }
+        if (worker->measure) {
+            samples_add(&worker->samples[op->op], elapsed);
+            if (!ok) ++worker->samples[op->op].errors;
+        }
+    }
+    // The trace may leave files open; don't carry them into the next pass
+    while (worker->open) {
+        close(open_pop(worker, worker->open->path));
+    }
+    return NULL;
+}
+
+static unsigned long run_pass(struct worker *workers, int nthreads, bool measure) {
+    unsigned long start = now_ns();
+
+    for (int idx = 0; idx < nthreads; idx++) {
+        workers[idx].measure = measure;
+        pthread_create(&workers[idx].thread, NULL, worker_run, &workers[idx]);
+    }
+    for (int idx = 0; idx < nthreads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+    }
+    return now_ns() - start;
+}
+
+static unsigned int path_hash(const char *path) {
+    unsigned int hash = 5381;
+    for (; *path; path++) hash = hash * 33 + (unsigned char) *path;
+    return hash;
+}
+
+static void worker_add(struct worker *worker, struct op *op) {
+    if (worker->count == worker->alloc) {
+        worker->alloc = worker->alloc ? worker->alloc * 2 : 1024;
+        worker->ops = realloc(worker->ops, worker->alloc * sizeof(struct op *));
+        if (worker->ops == NULL) {
+            printf("out of memory\n");
+            exit(1);
+        }
+    }
+    worker->ops[worker->count++] = op;
+}
+
+static void mkdirs(const char *path) {
+    char buf[PATH_MAX];
+
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *pnt = buf + strlen(mount) + 1; (pnt = strchr(pnt, '/')) != NULL; pnt++) {
+        *pnt = '\0';
+        mkdir(buf, 0755);
+        *pnt = '/';
+    }
+    mkdir(buf, 0755);
+}
+
+static void parent_dirs(const char *path) {
+    char buf[PATH_MAX];
+    char *slash;
+
+    snprintf(buf, sizeof(buf), "%s", path);
+    slash = strrchr(buf, '/');
+    if (slash && slash > buf + strlen(mount)) {
+        *slash = '\0';
+        mkdirs(buf);
+    }
+}
+
+struct prepared {
+    char *path;
+    bool decided;
+    bool dir;
+    off_t size;
+};
+
+static size_t prepared_find(struct prepared *paths, size_t *npaths, const char *path) {
+    size_t found;
+
+    for (found = 0; found < *npaths; found++) {
+        if (strcmp(paths[found].path, path) == 0) return found;
+    }
+    paths[found].path = (char *) path;
+    paths[found].decided = false;
+    paths[found].dir = false;
+    paths[found].size = -1;
+    ++*npaths;
+    return found;
+}
+
+/* What the trace expects to be there the first time it names a path: a directory to list or
+ * remove, or a file to open without creating it, or to unlink or rename. Files are made at least
+ * as long as the trace reads into them. Paths only ever stat'ed are left alone; misses are part
+ * of the load.
+ */
+static void prepare(struct op *ops, size_t count) {
+    struct prepared *paths = NULL;
+    size_t npaths = 0;
+    char *fill = NULL;
+    size_t fill_len = 0;
+    int made = 0;
+
+    // Paths in order of first mention; a linear search is fine for a one-time setup
+    paths = xmalloc(2 * count * sizeof(struct prepared));
+    for (size_t idx = 0; idx < count; idx++) {
+        struct op *op = &ops[idx];
+        size_t found = prepared_find(paths, &npaths, op->path);
+
+        // A rename's destination is the rename's to make
+        if (op->op == OP_RENAME) {
+            size_t to = prepared_find(paths, &npaths, op->path2);
+            paths[to].decided = true;
+        }
+        // The first operation but a getattr says whether the trace expects the path to be there
+        if (!paths[found].decided && op->op != OP_GETATTR) {
+            bool needed = op->op == OP_READDIR || op->op == OP_RMDIR || op->op == OP_READ || op->op == OP_UNLINK ||
+                op->op == OP_RENAME || (op->op == OP_OPEN && !(op->flags & O_CREAT));
+            paths[found].decided = true;
+            paths[found].dir = op->op == OP_READDIR || op->op == OP_RMDIR;
+            paths[found].size = needed ? 0 : -1;
+        }
+        if (op->op == OP_READ && paths[found].size >= 0 && (off_t)(op->offset + op->size) > paths[found].size) {
+            paths[found].size = op->offset + op->size;
+        }
+    }
+
+    for (size_t idx = 0; idx < npaths; idx++) {
+        char path[PATH_MAX];
+        struct stat st;
+
+        if (paths[idx].size < 0) continue;
+        full_path(path, sizeof(path), paths[idx].path);
+        if (paths[idx].dir) {
+            if (stat(path, &st) == 0) continue;
+            mkdirs(path);
+            ++made;
+        }
+        else {
+            int fd;
+
+            if (stat(path, &st) == 0 && st.st_size >= paths[idx].size) continue;
+            parent_dirs(path);
+            fd = open(path, O_WRONLY | O_CREAT, 0644);
+            if (fd < 0) {
+                printf("prepare: can't create %s: %s\n", path, strerror(errno));
+                continue;
+            }
+            if (paths[idx].size > 0) {
+                if ((size_t) paths[idx].size > fill_len) {
+                    free(fill);
+                    fill = xmalloc(paths[idx].size);
+                    memset(fill, 'p', paths[idx].size);
+                    fill_len = paths[idx].size;
+                }
+                if (pwrite(fd, fill, paths[idx].size, 0) != paths[idx].size) {
+                    printf("prepare: can't write %s: %s\n", path, strerror(errno));
+                }
+            }
+            close(fd);
+            ++made;
+        }
+    }
+    printf("prepare: created %d of %zu paths\n", made, npaths);
+    free(fill);
+    free(paths);
+}
+
+static int cmp_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a;
+    unsigned long y = *(const unsigned long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const unsigned long *sorted, size_t count, double fraction) {
+    size_t idx;
+
+    if (count == 0) return 0;
+    idx = (size_t) (fraction * (count - 1) + 0.5);
+    return sorted[idx] / 1000.0;
+}
+
+struct server_stats {
+    unsigned long requests;
+    int nmethods;
+    char methods[SERVER_METHODS_MAX][16];
+    unsigned long counts[SERVER_METHODS_MAX];
+};
+
+// GET /_stats from mock-dav-server.py, over a plain socket
+static bool server_fetch(const char *server, bool reset, struct server_stats *stats) {
+    char host[256];
+    char *port;
+    char request[512];
+    char response[8192];
+    struct addrinfo hints, *res;
+    size_t len = 0;
+    ssize_t got;
+    char *line;
+    char *saveptr = NULL;
+    int sock;
+
+    memset(stats, 0, sizeof(struct server_stats));
+    snprintf(host, sizeof(host), "%s", server);
+    port = strrchr(host, ':');
+    if (port == NULL) return false;
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return false;
+    sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
+        if (sock >= 0) close(sock);
+        freeaddrinfo(res);
+        return false;
+    }
+    freeaddrinfo(res);
+
+    snprintf(request, sizeof(request), "GET /_stats%s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n", reset ? "?reset=1" : "", host);
+    if (write(sock, request, strlen(request)) < 0) {
+        close(sock);
+        return false;
+    }
+    while (len < sizeof(response) - 1 && (got = read(sock, response + len, sizeof(response) - 1 - len)) > 0) {
+        len += got;
+    }
+    close(sock);
+    response[len] = '\0';
+
+    line = strstr(response, "\r\n\r\n");
+    if (line == NULL || strncmp(response, "HTTP/1.", 7) != 0 || strncmp(response + 9, "200", 3) != 0) return false;
+    for (line = strtok_r(line + 4, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char method[16];
+        unsigned long count;
+
+        if (sscanf(line, "requests %lu", &count) == 1) {
+            stats->requests = count;
+        }
+        else if (sscanf(line, "method %15s %lu", method, &count) == 2 && stats->nmethods < SERVER_METHODS_MAX) {
+            snprintf(stats->methods[stats->nmethods], sizeof(stats->methods[0]), "%s", method);
+            stats->counts[stats->nmethods++] = count;
+        }
+    }
+    return true;
+}
+
+// Prints to stdout, and to the results file if there is one
+static void report(FILE *out, const char *metric, const char *fmt, ...) {
+    va_list ap;
+
+    if (out == NULL) return;
+    fprintf(out, "%s\t", metric);
+    va_start(ap, fmt);
+    vfprintf(out, fmt, ap);
+    va_end(ap);
+    fprintf(out, "\n");
+}
+
+static void print_results(struct worker *workers, int nthreads, unsigned long elapsed, int passes,
+        const struct server_stats *server, const char *trace, FILE *out) {
+    unsigned long total = 0;
+    unsigned long errors = 0;
+    double seconds = elapsed / 1e9;
+    char metric[64];
+
+    if (out) {
+        time_t now = time(NULL);
+        fprintf(out, "# fusedav-replay %s, %d threads, %d passes, %s", trace, nthreads, passes, ctime(&now));
+    }
+    printf("%-9s %10s %8s %10s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "ops/s", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (int op = 0; op < OP_MAX; op++) {
+        struct samples all;
+        unsigned long sum = 0;
+        double mean;
+
+        memset(&all, 0, sizeof(all));
+        for (int idx = 0; idx < nthreads; idx++) {
+            struct samples *samples = &workers[idx].samples[op];
+            for (size_t sample = 0; sample < samples->count; sample++) {
+                samples_add(&all, samples->ns[sample]);
+                sum += samples->ns[sample];
+            }
+            all.errors += samples->errors;
+        }
+        if (all.count == 0) continue;
+        qsort(all.ns, all.count, sizeof(unsigned long), cmp_ulong);
+        mean = sum / 1000.0 / all.count;
+        total += all.count;
+        errors += all.errors;
+
+        printf("%-9s %10zu %8lu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", op_names[op], all.count, all.errors,
+            all.count / seconds, mean, percentile_us(all.ns, all.count, 0.50), percentile_us(all.ns, all.count, 0.90),
+            percentile_us(all.ns, all.count, 0.99), all.ns[all.count - 1] / 1000.0);
+#define OP_METRIC(name, fmt, value) do { \
+            snprintf(metric, sizeof(metric), "%s.%s", op_names[op], name); \
+            report(out, metric, fmt, value); \
+        } while (0)
+        OP_METRIC("count", "%zu", all.count);
+        OP_METRIC("errors", "%lu", all.errors);
+        OP_METRIC("mean_us", "%.1f", mean);
+        OP_METRIC("p50_us", "%.1f", percentile_us(all.ns, all.count, 0.50));
+        OP_METRIC("p90_us", "%.1f", percentile_us(all.ns, all.count, 0.90));
+        OP_METRIC("p99_us", "%.1f", percentile_us(all.ns, all.count, 0.99));
+        OP_METRIC("max_us", "%.1f", all.ns[all.count - 1] / 1000.0);
+#undef OP_METRIC
+        free(all.ns);
+    }
+    printf("%-9s %10lu %8lu %10.0f   in %.2f s\n", "total", total, errors, total / seconds, seconds);
+    report(out, "total.count", "%lu", total);
+    report(out, "total.errors", "%lu", errors);
+    report(out, "total.ops_per_s", "%.1f", total / seconds);
+
+    if (server && total > 0) {
+        printf("server requests: %lu, %.4f per op;", server->requests, (double) server->requests / total);
+        report(out, "server.requests", "%lu", server->requests);
+        report(out, "server.requests_per_op", "%.4f", (double) server->requests / total);
+        for (int idx = 0; idx < server->nmethods; idx++) {
+            printf(" %s %lu", server->methods[idx], server->counts[idx]);
+            snprintf(metric, sizeof(metric), "server.%s_per_op", server->methods[idx]);
+            report(out, metric, "%.4f", (double) server->counts[idx] / total);
+        }
+        printf("\n");
+    }
+}
+
+/* A mix like a PHP site's: mostly getattrs, a fifth of them for files that aren't there (include
+ * paths, autoloaders), directory listings, files opened and read whole, and now and then one
+ * written and the oldest of those removed.
+ */
+static void generate(unsigned long nops, int files, int dirs, unsigned int seed) {
+    unsigned long written = 0;
+    unsigned long created = 0;
+    unsigned long removed = 0;
+
+    printf("# fusedav-replay -g %lu -n %d -D %d -S %u\n", nops, files, dirs, seed);
+    srandom(seed);
+    while (written < nops) {
+        int pick = random() % 100;
+        int file = random() % files;
+        int dir = file % dirs;
+
+        if (pick < 48) {
+            printf("getattr /bench/dir%d/file%d.php\n", dir, file);
+            ++written;
+        }
+        else if (pick < 60) {
+            printf("getattr /bench/dir%d/missing%d.php\n", dir, file);
+            ++written;
+        }
+        else if (pick < 68) {
+            printf("readdir /bench/dir%d\n", dir);
+            ++written;
+        }
+        else if (pick < 95) {
+            printf("getattr /bench/dir%d/file%d.php\n", dir, file);
+            printf("open /bench/dir%d/file%d.php r\n", dir, file);
+            printf("read /bench/dir%d/file%d.php 0 4096\n", dir, file);
+            printf("release /bench/dir%d/file%d.php\n", dir, file);
+            written += 4;
+        }
+        else if (pick < 99) {
+            printf("create /bench/dir%lu/upload%lu.tmp\n", created % dirs, created);
+            printf("write /bench/dir%lu/upload%lu.tmp 0 8192\n", created % dirs, created);
+            printf("release /bench/dir%lu/upload%lu.tmp\n", created % dirs, created);
+            written += 3;
+            ++created;
+        }
+        else if (removed < created) {
+            printf("unlink /bench/dir%lu/upload%lu.tmp\n", removed % dirs, removed);
+            ++written;
+            ++removed;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *trace = NULL;
+    const char *server = NULL;
+    const char *outfile = NULL;
+    struct server_stats server_stats;
+    bool server_ok = false;
+    bool do_prepare = false;
+    int nthreads = 4;
+    int passes = 1;
+    int warmups = 0;
+    unsigned long generate_ops = 0;
+    int files = 20000;
+    int dirs = 200;
+    unsigned int seed = 1;
+    struct worker *workers;
+    struct op *ops;
+    size_t count;
+    unsigned long elapsed = 0;
+    FILE *out = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:f:t:l:W:Ps:o:g:n:D:S:vh")) != -1) {
+        switch (opt) {
+            case 'm':
+                mount = optarg;
+                break;
+            case 'f':
+                trace = optarg;
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'l':
+                passes = atoi(optarg);
+                break;
+            case 'W':
+                warmups = atoi(optarg);
+                break;
+            case 'P':
+                do_prepare = true;
+                break;
+            case 's':
+                server = optarg;
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 'g':
+                generate_ops = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                files = atoi(optarg);
+                break;
+            case 'D':
+                dirs = atoi(optarg);
+                break;
+            case 'S':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+
+    if (generate_ops > 0) {
+        if (files < 1 || dirs < 1) usage();
+        generate(generate_ops, files, dirs, seed);
+        return 0;
+    }
+    if (mount == NULL || trace == NULL || nthreads < 1 || passes < 1 || warmups < 0) usage();
+
+    ops = read_trace(trace, &count);
+    if (count == 0) {
+        printf("nothing to replay\n");
+        return 1;
+    }
+    if (do_prepare) prepare(ops, count);
+
+    workers = calloc(nthreads, sizeof(struct worker));
+    if (workers == NULL) {
+        printf("out of memory\n");
+        return 1;
+    }
+    for (int idx = 0; idx < nthreads; idx++) {
+        workers[idx].id = idx;
+    }
+    for (size_t idx = 0; idx < count; idx++) {
+        worker_add(&workers[path_hash(ops[idx].path) % nthreads], &ops[idx]);
+    }
+
+    for (int pass = 0; pass < warmups; pass++) {
+        v_printf("warm-up pass %d\n", pass + 1);
+        run_pass(workers, nthreads, false);
+    }
+
+    if (server) {
+        server_ok = server_fetch(server, true, &server_stats);
+        if (!server_ok) printf("can't get /_stats from %s; not counting server requests\n", server);
+    }
+    for (int pass = 0; pass < passes; pass++) {
+        v_printf("pass %d\n", pass + 1);
+        elapsed += run_pass(workers, nthreads, true);
+    }
+    if (server_ok) {
+        server_ok = server_fetch(server, false, &server_stats);
+        if (!server_ok) printf("can't get /_stats from %s after the run\n", server);
+    }
+
+    if (outfile) {
+        out = fopen(outfile, "w");
+        if (out == NULL) {
+            printf("can't write %s: %s\n", outfile, strerror(errno));
+        }
+    }
+    print_results(workers, nthreads, elapsed, passes, server_ok ? &server_stats : NULL, trace, out);
+    if (out) fclose(out);
+
+    return 0;
+}
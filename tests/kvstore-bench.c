@@ -0,0 +1,309 @@
+/* Microbenchmark: getattr and readdir throughput of the stat cache on each metadata store engine.
+ *
+ * Builds statcache.c and kvstore.c directly (see tests/Makefile). For each engine, fills a
+ * stat cache with -n files spread over -D directories, reopens it so the memory tier starts
+ * empty, then measures with -t threads:
+ *   getattr: stat_cache_value_get on files picked at random
+ *   readdir: stat_cache_enumerate on directories picked at random
+ * The memory tier holds STAT_CACHE_MEM_MAX_ENTRIES; the default -n is well past that, so most
+ * getattrs go to the store. The share that didn't is printed as mem_hit.
+ *
+ * lmdb is only measured when built with it: make run-kvstorebench LMDB=1
+ *
+ * e.g. kvstore-bench -n 200000 -D 200 -t 4 -i 4
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "statcache.h"
+#include "stats.h"
+
+// Normally provided by stats.c and log.c, which pull in the rest of fusedav
+__thread struct statistics *stats_local = NULL;
+struct statistics *stats_attach(void) {
+    static __thread struct statistics shard;
+    stats_local = &shard;
+    return stats_local;
+}
+__thread unsigned int LOG_DYNAMIC = 6;
+int log_print(unsigned int log_level, unsigned int section, const char *format, ...) {
+    (void)log_level; (void)section; (void)format;
+    return 0;
+}
+
+static bool verbose = false;
+
+static void usage(void) {
+    printf("-n <entries> number of files, 200000 by default\n");
+    printf("-D <dirs> number of directories they are spread over, 200 by default\n");
+    printf("-t <threads> threads measured at once, 4 by default\n");
+    printf("-i <iters> getattrs per file, and readdirs per directory, per measurement; 4 by default\n");
+    printf("-e <engine> only measure this engine, leveldb or lmdb\n");
+    printf("-d <dir> directory for the stores; a new one under /tmp by default\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int entries = 200000;
+static int dirs = 200;
+static int nthreads = 4;
+static int iters = 4;
+
+static void dir_path(char *path, size_t len, int dir) {
+    snprintf(path, len, "/bench/dir%d", dir);
+}
+
+static void entry_path(char *path, size_t len, int idx) {
+    snprintf(path, len, "/bench/dir%d/file%d.php", idx % dirs, idx);
+}
+
+enum pass_e { GETATTR, READDIR };
+
+struct worker {
+    pthread_t thread;
+    stat_cache_t *cache;
+    enum pass_e pass;
+    unsigned int seed;
+    unsigned long ops;
+    unsigned long listed;
+    unsigned long mem_hits;
+    bool failed;
+};
+
+static void count_entry(const char *path_prefix, const char *filename, void *user) {
+    (void)path_prefix; (void)filename;
+    ++*(unsigned long *)user;
+}
+
+static void *worker_run(void *ptr) {
+    struct worker *worker = ptr;
+    char path[PATH_MAX];
+    unsigned long start_hits;
+
+    stats_shard();
+    start_hits = stats_local->statcache_mem_hit;
+    for (unsigned long op = 0; op < worker->ops; op++) {
+        GError *gerr = NULL;
+
+        if (worker->pass == GETATTR) {
+            struct stat_cache_value *value;
+
+            entry_path(path, sizeof(path), rand_r(&worker->seed) % entries);
+            value = stat_cache_value_get(worker->cache, path, true, &gerr);
+            if (value == NULL && gerr == NULL) {
+                printf("getattr: no entry for %s\n", path);
+                worker->failed = true;
+                break;
+            }
+            free(value);
+        }
+        else {
+            dir_path(path, sizeof(path), rand_r(&worker->seed) % dirs);
+            // Forced, as a readdir within the refresh interval would be
+            if (stat_cache_enumerate(worker->cache, path, count_entry, &worker->listed, true) < 0) {
+                printf("readdir: enumerate failed on %s\n", path);
+                worker->failed = true;
+                break;
+            }
+        }
+        if (gerr) {
+            printf("error on %s: %s\n", path, gerr->message);
+            g_clear_error(&gerr);
+            worker->failed = true;
+            break;
+        }
+    }
+    worker->mem_hits = stats_local->statcache_mem_hit - start_hits;
+    return NULL;
+}
+
+static bool run_pass(const char *engine, const char *name, enum pass_e pass, stat_cache_t *cache) {
+    struct worker workers[nthreads];
+    unsigned long total = (unsigned long)(pass == GETATTR ? entries : dirs) * iters;
+    unsigned long ops = 0;
+    unsigned long listed = 0;
+    unsigned long mem_hits = 0;
+    unsigned long elapsed;
+    unsigned long start;
+    bool failed = false;
+
+    start = now_ns();
+    for (int idx = 0; idx < nthreads; idx++) {
+        memset(&workers[idx], 0, sizeof(workers[idx]));
+        workers[idx].cache = cache;
+        workers[idx].pass = pass;
+        workers[idx].seed = idx + 1;
+        workers[idx].ops = total / nthreads + (idx < (int)(total % nthreads) ? 1 : 0);
+        pthread_create(&workers[idx].thread, NULL, worker_run, &workers[idx]);
+    }
+    for (int idx = 0; idx < nthreads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        ops += workers[idx].ops;
+        listed += workers[idx].listed;
+        mem_hits += workers[idx].mem_hits;
+        failed |= workers[idx].failed;
+    }
+    elapsed = now_ns() - start;
+
+    printf("%-8s %-8s %10lu ops  %10.1f ns/op  %12.0f ops/s", engine, name, ops,
+        (double)elapsed * nthreads / ops, (double)ops * 1000000000.0 / elapsed);
+    if (pass == GETATTR) {
+        printf("  mem_hit %5.1f%%\n", 100.0 * mem_hits / ops);
+    }
+    else {
+        printf("  %8.0f entries/op\n", (double)listed / ops);
+    }
+    return !failed;
+}
+
+static bool run_engine(enum kvstore_engine engine, const char *dir) {
+    const char *name = kvstore_engine_name(engine);
+    stat_cache_t *cache;
+    struct stat_cache_supplemental supplemental;
+    struct stat_cache_batch *batch;
+    struct stat_cache_value value;
+    char path[PATH_MAX];
+    GError *gerr = NULL;
+    unsigned long start;
+    bool ok;
+
+    // As with an empty fusedav.conf, but for the engine
+    memset(&supplemental, 0, sizeof(supplemental));
+    supplemental.options.engine = engine;
+    supplemental.options.block_cache_size = 32 * 1024 * 1024;
+    supplemental.options.bloom_bits_per_key = 10;
+
+    stat_cache_open(&cache, &supplemental, (char *)dir, &gerr);
+    if (gerr) {
+        printf("%s: stat_cache_open: %s\n", name, gerr->message);
+        return false;
+    }
+
+    v_printf("%s: populating %d entries in %d directories under %s/%s\n", name, entries, dirs, dir, name);
+    start = now_ns();
+    memset(&value, 0, sizeof(value));
+    value.st.st_mode = S_IFREG | 0644;
+    // A batch per directory, as a PROPFIND of each would write them
+    for (int dirnum = 0; dirnum < dirs; dirnum++) {
+        batch = stat_cache_batch_begin(cache);
+        for (int idx = dirnum; idx < entries; idx += dirs) {
+            entry_path(path, sizeof(path), idx);
+            value.st.st_size = idx;
+            stat_cache_batch_value_set(batch, path, &value, &gerr);
+        }
+        dir_path(path, sizeof(path), dirnum);
+        stat_cache_batch_updated_children(batch, path, time(NULL), &gerr);
+        stat_cache_batch_commit(batch, &gerr);
+        stat_cache_batch_free(batch);
+        if (gerr) {
+            printf("%s: populating: %s\n", name, gerr->message);
+            stat_cache_close(cache, supplemental);
+            return false;
+        }
+    }
+    printf("%-8s %-8s %10d ops  %10.1f ns/op\n", name, "fill", entries, (double)(now_ns() - start) / entries);
+    stat_cache_close(cache, supplemental);
+
+    // Reopen so the getattrs start with an empty memory tier
+    stat_cache_open(&cache, &supplemental, (char *)dir, &gerr);
+    if (gerr) {
+        printf("%s: stat_cache_open: %s\n", name, gerr->message);
+        return false;
+    }
+
+    ok = run_pass(name, "getattr", GETATTR, cache);
+    ok = run_pass(name, "readdir", READDIR, cache) && ok;
+
+    stat_cache_close(cache, supplemental);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    char dirtemplate[] = "/tmp/kvstore-bench-XXXXXX";
+    char *dir = NULL;
+    char *only = NULL;
+    enum kvstore_engine engine;
+    bool ok = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:D:t:i:e:d:vh")) != -1) {
+        switch (opt) {
+            case 'n':
+                entries = atoi(optarg);
+                break;
+            case 'D':
+                dirs = atoi(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'i':
+                iters = atoi(optarg);
+                break;
+            case 'e':
+                only = optarg;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+    if (entries < 1 || dirs < 1 || nthreads < 1 || iters < 1) usage();
+    if (only && !kvstore_engine_parse(only, &engine)) usage();
+
+    if (dir == NULL) {
+        dir = mkdtemp(dirtemplate);
+        if (dir == NULL) {
+            perror("mkdtemp");
+            exit(1);
+        }
+    }
+
+    if (only == NULL || engine == KVSTORE_LEVELDB) {
+        ok = run_engine(KVSTORE_LEVELDB, dir) && ok;
+    }
+#ifdef HAVE_LMDB
+    if (only == NULL || engine == KVSTORE_LMDB) {
+        ok = run_engine(KVSTORE_LMDB, dir) && ok;
+    }
+#else
+    if (only && engine == KVSTORE_LMDB) {
+        printf("built without lmdb; make run-kvstorebench LMDB=1\n");
+        ok = false;
+    }
+#endif
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,476 @@
+#! /usr/bin/env python
+# This file is part of fusedav.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+# A WebDAV server for benchmarking fusedav, holding its tree in memory. It speaks what fusedav
+# asks of the file servers: PROPFIND of depth 0 and 1, including the progressive kind
+# (?changes_since=<time>, answered with what changed and 410s for what went, or 412 if that is
+# from before the server started), GET with If-None-Match and Range, HEAD, PUT, DELETE, MKCOL
+# and MOVE.
+#
+# Each --node is an address to listen on, as a file server node; give a hostname which resolves
+# to all of them as fusedav's uri, e.g. in /etc/hosts
+#   127.0.0.1 davbench
+#   127.0.0.2 davbench
+# (with "multi on" in /etc/host.conf) and fusedav spreads its requests over them.
+#
+# Faults, for every node or, after the address, for one:
+#   --latency MS     added before each response; --jitter MS adds up to that much more at random
+#   --fail RATE      the fraction of requests answered 503
+#   --down           requests are dropped without an answer, as with a node that went away
+# e.g. mock-dav-server.py --node 127.0.0.1:8080 --node 127.0.0.2:8080,latency=300 --latency 2
+#
+# The same settings can be changed while running, at any node:
+#   curl 'http://127.0.0.1:8080/_control?node=127.0.0.2&latency=0&down=1'
+# and the requests served so far, by method and by node, read as text lines, or reset:
+#   curl http://127.0.0.1:8080/_stats
+#   curl 'http://127.0.0.1:8080/_stats?reset=1'
+#
+# --files N --dirs D --size BYTES starts the tree with N files of BYTES bytes spread over D
+# directories, /bench/dir<d>/file<n>.php, as kvstore-bench names them.
+
+import sys
+import time
+import random
+import socket
+import threading
+import argparse
+import email.utils
+
+try:
+    from BaseHTTPServer import HTTPServer, BaseHTTPRequestHandler
+    from SocketServer import ThreadingMixIn
+    from urllib import quote, unquote
+    from urlparse import urlparse, parse_qs
+except ImportError:
+    from http.server import HTTPServer, BaseHTTPRequestHandler
+    from socketserver import ThreadingMixIn
+    from urllib.parse import quote, unquote, urlparse, parse_qs
+
+
+class Entry(object):
+    def __init__(self, is_dir, data=b''):
+        self.is_dir = is_dir
+        self.data = data
+        self.ctime = time.time()
+        self.mtime = self.ctime
+        self.version = 0
+
+    def etag(self):
+        return '"%x-%x-%x"' % (int(self.mtime), len(self.data), self.version)
+
+
+class Tree(object):
+    """Paths are '/'-rooted without a trailing slash; the root is '/'."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.entries = {'/': Entry(True)}
+        self.children = {'/': set()}
+        self.gone = {} # directory -> {name -> when it was deleted or moved away}; for progressive PROPFINDs
+        self.started = time.time()
+
+    @staticmethod
+    def parent(path):
+        head = path.rsplit('/', 1)[0]
+        return head if head else '/'
+
+    @staticmethod
+    def name(path):
+        return path.rsplit('/', 1)[1]
+
+    def touch_parent(self, path):
+        self.entries[self.parent(path)].mtime = time.time()
+
+    def add(self, path, entry):
+        self.entries[path] = entry
+        if entry.is_dir:
+            self.children.setdefault(path, set())
+        self.children[self.parent(path)].add(self.name(path))
+        self.gone.get(self.parent(path), {}).pop(self.name(path), None)
+        self.touch_parent(path)
+
+    def remove(self, path):
+        if self.entries[path].is_dir:
+            for child in list(self.children[path]):
+                self.remove(path.rstrip('/') + '/' + child)
+            del self.children[path]
+        entry = self.entries.pop(path)
+        self.children[self.parent(path)].discard(self.name(path))
+        self.gone.setdefault(self.parent(path), {})[self.name(path)] = time.time()
+        self.touch_parent(path)
+        return entry
+
+    def subtree(self, path):
+        yield path
+        for child in list(self.children.get(path, ())):
+            for sub in self.subtree(path.rstrip('/') + '/' + child):
+                yield sub
+
+    def mkdirs(self, path):
+        if path in self.entries:
+            return
+        self.mkdirs(self.parent(path))
+        self.add(path, Entry(True))
+
+    def populate(self, files, dirs, size):
+        data = b'x' * size
+        for num in range(files):
+            path = '/bench/dir%d/file%d.php' % (num % dirs, num)
+            self.mkdirs(self.parent(path))
+            self.add(path, Entry(False, data))
+
+
+class Faults(object):
+    def __init__(self, latency=0, jitter=0, fail=0.0, down=False):
+        self.latency = latency
+        self.jitter = jitter
+        self.fail = fail
+        self.down = down
+
+    def update(self, settings):
+        for key in ('latency', 'jitter'):
+            if key in settings:
+                setattr(self, key, float(settings[key]))
+        if 'fail' in settings:
+            self.fail = float(settings['fail'])
+        if 'down' in settings:
+            self.down = settings['down'] not in ('0', 'false', '')
+
+
+class Counters(object):
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.reset()
+
+    def reset(self):
+        self.by_method = {}
+        self.by_node = {}
+        self.failed = 0
+        self.dropped = 0
+        self.bytes_out = 0
+        self.bytes_in = 0
+
+    def count(self, node, method):
+        with self.lock:
+            self.by_method[method] = self.by_method.get(method, 0) + 1
+            self.by_node[node] = self.by_node.get(node, 0) + 1
+
+    def report(self):
+        with self.lock:
+            lines = ['requests %d' % sum(self.by_method.values())]
+            lines += ['method %s %d' % item for item in sorted(self.by_method.items())]
+            lines += ['node %s %d' % item for item in sorted(self.by_node.items())]
+            lines += ['failed %d' % self.failed, 'dropped %d' % self.dropped,
+                      'bytes_out %d' % self.bytes_out, 'bytes_in %d' % self.bytes_in]
+        return '\n'.join(lines) + '\n'
+
+
+tree = Tree()
+counters = Counters()
+faults = {} # node address -> Faults
+base_path = ''
+
+
+def http_date(stamp):
+    return email.utils.formatdate(stamp, usegmt=True)
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, format, *args):
+        pass
+
+    def node(self):
+        return self.server.server_address[0]
+
+    def path_of(self, url):
+        path = unquote(urlparse(url).path)
+        if base_path and path.startswith(base_path):
+            path = path[len(base_path):]
+        path = '/' + path.strip('/')
+        return path
+
+    def read_body(self):
+        if self.headers.get('Transfer-Encoding', '').lower() == 'chunked':
+            chunks = []
+            while True:
+                size = int(self.rfile.readline().split(b';')[0].strip(), 16)
+                if size == 0:
+                    self.rfile.readline()
+                    break
+                chunks.append(self.rfile.read(size))
+                self.rfile.readline()
+            body = b''.join(chunks)
+        else:
+            body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        with counters.lock:
+            counters.bytes_in += len(body)
+        return body
+
+    def respond(self, code, body=b'', headers=None, send_body=True):
+        self.send_response(code)
+        for key, value in (headers or {}).items():
+            self.send_header(key, value)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if send_body and body:
+            self.wfile.write(body)
+            with counters.lock:
+                counters.bytes_out += len(body)
+
+    def control(self, url):
+        query = dict((key, values[-1]) for key, values in parse_qs(url.query).items())
+        if url.path == '/_stats':
+            if query.get('reset'):
+                with counters.lock:
+                    counters.reset()
+            self.respond(200, counters.report().encode(), {'Content-Type': 'text/plain'})
+            return
+        nodes = [query.pop('node')] if 'node' in query else list(faults)
+        for node in nodes:
+            if node not in faults:
+                self.respond(404, ('no node %s\n' % node).encode())
+                return
+            faults[node].update(query)
+        self.respond(200, b'ok\n')
+
+    def handle_one(self):
+        url = urlparse(self.path)
+        if url.path.startswith('/_'):
+            self.control(url)
+            return
+        fault = faults[self.node()]
+        counters.count(self.node(), self.command)
+        if fault.latency or fault.jitter:
+            time.sleep((fault.latency + random.random() * fault.jitter) / 1000.0)
+        if fault.down:
+            with counters.lock:
+                counters.dropped += 1
+            self.close_connection = True
+            self.connection.shutdown(socket.SHUT_RDWR)
+            return
+        if fault.fail and random.random() < fault.fail:
+            with counters.lock:
+                counters.failed += 1
+            if self.command in ('PUT', 'PROPFIND'):
+                self.read_body()
+            self.respond(503)
+            return
+        getattr(self, 'dav_' + self.command)(self.path_of(self.path), url)
+
+    # Each method is answered by the one handler, which applies the faults
+    do_GET = do_HEAD = do_PUT = do_DELETE = do_MKCOL = do_MOVE = do_PROPFIND = do_OPTIONS = handle_one
+
+    def dav_OPTIONS(self, path, url):
+        self.respond(200, headers={'DAV': '1, 2', 'Allow': 'OPTIONS, GET, HEAD, PUT, DELETE, MKCOL, MOVE, PROPFIND'})
+
+    def dav_GET(self, path, url, send_body=True):
+        with tree.lock:
+            entry = tree.entries.get(path)
+            if entry is None:
+                self.respond(404, send_body=send_body)
+                return
+            data, etag, mtime = entry.data, entry.etag(), entry.mtime
+        headers = {'ETag': etag, 'Last-Modified': http_date(mtime)}
+        if self.headers.get('If-None-Match') == etag:
+            self.respond(304, headers=headers, send_body=False)
+            return
+        ranges = self.headers.get('Range', '')
+        if ranges.startswith('bytes=') and ',' not in ranges and data:
+            first, last = ranges[6:].split('-')
+            first = int(first)
+            last = min(int(last) if last else len(data) - 1, len(data) - 1)
+            if first < len(data):
+                headers['Content-Range'] = 'bytes %d-%d/%d' % (first, last, len(data))
+                self.respond(206, data[first:last + 1], headers, send_body)
+                return
+        self.respond(200, data, headers, send_body)
+
+    def dav_HEAD(self, path, url):
+        self.dav_GET(path, url, send_body=False)
+
+    def dav_PUT(self, path, url):
+        body = self.read_body()
+        with tree.lock:
+            if tree.parent(path) not in tree.children:
+                code = 409
+            else:
+                entry = tree.entries.get(path)
+                code = 204 if entry else 201
+                if entry is None:
+                    entry = Entry(False)
+                    tree.add(path, entry)
+                entry.data = body
+                entry.mtime = time.time()
+                entry.version += 1
+                etag = entry.etag()
+        self.respond(code, headers={'ETag': etag} if code != 409 else None)
+
+    def dav_DELETE(self, path, url):
+        with tree.lock:
+            if path == '/' or path not in tree.entries:
+                code = 404
+            else:
+                tree.remove(path)
+                code = 204
+        self.respond(code)
+
+    def dav_MKCOL(self, path, url):
+        with tree.lock:
+            if path in tree.entries:
+                code = 405
+            elif tree.parent(path) not in tree.children:
+                code = 409
+            else:
+                tree.add(path, Entry(True))
+                code = 201
+        self.respond(code)
+
+    def dav_MOVE(self, path, url):
+        destination = self.path_of(self.headers.get('Destination', ''))
+        overwrite = self.headers.get('Overwrite', 'T') != 'F'
+        with tree.lock:
+            if path == '/' or path not in tree.entries:
+                code = 404
+            elif destination == path or destination.startswith(path.rstrip('/') + '/'):
+                code = 403
+            elif tree.parent(destination) not in tree.children:
+                code = 409
+            elif destination in tree.entries and not overwrite:
+                code = 412
+            else:
+                code = 204 if destination in tree.entries else 201
+                if code == 204:
+                    tree.remove(destination)
+                moved = [(sub, tree.entries[sub]) for sub in tree.subtree(path)]
+                tree.remove(path)
+                # A rename changes the ctime, so a progressive PROPFIND of the new parent has it
+                moved[0][1].ctime = time.time()
+                for sub, entry in moved:
+                    tree.add(destination + sub[len(path):], entry)
+        self.respond(code)
+
+    def propstat(self, path, entry):
+        href = quote(base_path + (path if path != '/' else '') + ('/' if entry.is_dir else ''))
+        props = ['<D:getlastmodified>%s</D:getlastmodified>' % http_date(entry.mtime),
+                 '<D:creationdate>%s</D:creationdate>' % time.strftime('%Y-%m-%dT%H:%M:%S+0000', time.gmtime(entry.ctime))]
+        if entry.is_dir:
+            props.append('<D:resourcetype><D:collection/></D:resourcetype>')
+        else:
+            props.append('<D:resourcetype/><D:getcontentlength>%d</D:getcontentlength>' % len(entry.data))
+            props.append('<D:getetag>%s</D:getetag>' % entry.etag())
+        return ('<D:response><D:href>%s</D:href><D:propstat><D:prop>%s</D:prop>'
+                '<D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>\n') % (href, ''.join(props))
+
+    def dav_PROPFIND(self, path, url):
+        self.read_body()
+        depth = self.headers.get('Depth', '1')
+        since = parse_qs(url.query).get('changes_since')
+        since = float(since[-1]) if since else None
+        out = ['<?xml version="1.0" encoding="utf-8"?>\n<D:multistatus xmlns:D="DAV:">\n']
+        with tree.lock:
+            entry = tree.entries.get(path)
+            if entry is None:
+                self.respond(404)
+                return
+            # Tombstones only go back to our start
+            if since is not None and since < tree.started:
+                self.respond(412)
+                return
+            out.append(self.propstat(path, entry))
+            if depth != '0' and entry.is_dir:
+                prefix = path.rstrip('/') + '/'
+                for name in tree.children[path]:
+                    child = tree.entries[prefix + name]
+                    if since is None or max(child.mtime, child.ctime) >= since:
+                        out.append(self.propstat(prefix + name, child))
+                if since is not None:
+                    for name, when in tree.gone.get(path, {}).items():
+                        if when >= since:
+                            out.append('<D:response><D:href>%s</D:href><D:status>HTTP/1.1 410 Gone</D:status></D:response>\n'
+                                       % quote(base_path + prefix + name))
+        out.append('</D:multistatus>\n')
+        self.respond(207, ''.join(out).encode('utf-8'), {'Content-Type': 'application/xml; charset="utf-8"'})
+
+
+class Server(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 128
+
+    def handle_error(self, request, client_address):
+        # Mostly fusedav hanging up on a slow or dropped request
+        pass
+
+
+def node_spec(spec, defaults):
+    address, _, options = spec.partition(',')
+    host, _, port = address.partition(':')
+    fault = Faults(defaults.latency, defaults.jitter, defaults.fail, defaults.down)
+    settings = dict(option.partition('=')[::2] for option in options.split(',') if option)
+    if 'down' in settings and not settings['down']:
+        settings['down'] = '1'
+    fault.update(settings)
+    return host, int(port or defaults.port), fault
+
+
+def main():
+    global base_path
+    parser = argparse.ArgumentParser(description='In-memory WebDAV server for benchmarking fusedav')
+    parser.add_argument('--node', action='append', default=[], help='address[:port][,latency=MS][,jitter=MS][,fail=RATE][,down]; repeatable')
+    parser.add_argument('--port', type=int, default=8080, help='for nodes given without one')
+    parser.add_argument('--base', default='', help='path prefix of the uri fusedav mounts, e.g. /files')
+    parser.add_argument('--latency', type=float, default=0, help='ms before each response')
+    parser.add_argument('--jitter', type=float, default=0, help='up to this many more ms, at random')
+    parser.add_argument('--fail', type=float, default=0.0, help='fraction of requests answered 503')
+    parser.add_argument('--down', action='store_true', help='drop every request')
+    parser.add_argument('--files', type=int, default=0)
+    parser.add_argument('--dirs', type=int, default=10)
+    parser.add_argument('--size', type=int, default=4096)
+    parser.add_argument('--seed', type=int, default=None, help='for repeatable faults')
+    args = parser.parse_args()
+
+    random.seed(args.seed)
+    base_path = args.base.rstrip('/')
+    tree.mkdirs('/bench')
+    if args.files:
+        tree.populate(args.files, max(args.dirs, 1), args.size)
+
+    servers = []
+    for spec in args.node or ['127.0.0.1']:
+        host, port, fault = node_spec(spec, args)
+        faults[host] = fault
+        server = Server((host, port), Handler)
+        servers.append(server)
+        thread = threading.Thread(target=server.serve_forever)
+        thread.daemon = True
+        thread.start()
+        sys.stdout.write('node %s:%d latency %gms jitter %gms fail %g%s\n'
+                         % (host, port, fault.latency, fault.jitter, fault.fail, ' down' if fault.down else ''))
+    sys.stdout.write('%d entries under %s\n' % (len(tree.entries), base_path or '/'))
+    sys.stdout.flush()
+    try:
+        while True:
+            time.sleep(3600)
+    except KeyboardInterrupt:
+        for server in servers:
+            server.shutdown()
+
+
+if __name__ == '__main__':
+    main()
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -11,6 +12,8 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #define PATH_MAX 4096
 static const int xl = 0;
@@ -44,6 +47,7 @@ static const int read_end = 3;
 
 static bool verbose = false;
 static bool doing_write = true;
+static bool doing_throughput = false;
 
 struct size_s {
     char name[16];
@@ -60,6 +64,16 @@ struct size_s sizes[] = { {"xl", 1024 * 1024 * 100 + 1, 120},
 
 
 static void usage() {
+    if (doing_throughput) {
+        printf("-d <dir> directory to write and read in, . by default; compare a fusedav mount with local disk\n");
+        printf("-s <size> file size in M, 100 by default\n");
+        printf("-b <size> read/write size in K, 128 by default\n");
+        printf("-i <iters> number of reads of the file, 8 by default\n");
+        printf("-p <pid> also report the CPU time of this process, e.g. fusedav\n");
+        printf("-v for verbose\n");
+        printf("-h for help\n");
+        exit(0);
+    }
     printf("-t <start_time> unix epoch time to start write at (REQUIRED)\n");
     printf("-n <interval> time between write starts, 10 by default\n");
     printf("-i <iters> number of writes, 16 by default\n");
@@ -203,6 +217,118 @@ static int writeread(char *basename, int results[], time_t start_time, unsigned
     return 0;
 }
 
+// User plus system CPU seconds of pid, or of ourselves if pid is 0
+static double cpu_seconds(pid_t pid) {
+    char path[64];
+    unsigned long utime;
+    unsigned long stime;
+    FILE *fp;
+    int ret;
+
+    if (pid == 0) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    }
+
+    sprintf(path, "/proc/%d/stat", pid);
+    fp = fopen(path, "r");
+    if (fp == NULL) return 0;
+    // Fields 14 and 15 are utime and stime in clock ticks; skip past the parenthesized command name
+    ret = fscanf(fp, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(fp);
+    if (ret != 2) return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, double bytes, double elapsed, double cpu_self, double cpu_pid, pid_t pid) {
+    double gb = bytes / (1024.0 * 1024 * 1024);
+    printf("%s: %.1f MB/s; cpu %.3f s/GB", what, bytes / (1024 * 1024) / elapsed, cpu_self / gb);
+    if (pid) printf("; pid %d cpu %.3f s/GB", pid, cpu_pid / gb);
+    printf("\n");
+}
+
+/* Sequential throughput of one large file, and the CPU it costs, to compare fusedav's read and
+ * write paths with local disk. Each pass reopens the file, so fusedav serves it again rather
+ * than the page cache; on local disk we drop the file's pages between passes to match.
+ */
+static int throughput(const char *dir, size_t file_size, size_t block_size, unsigned num_iters, pid_t pid) {
+    char filename[PATH_MAX];
+    char *buf;
+    double start;
+    double cpu_self;
+    double cpu_pid;
+    bool fail = false;
+    int fd;
+
+    buf = malloc(block_size);
+    for (size_t idx = 0; idx < block_size; idx++) {
+        buf[idx] = randomchar();
+    }
+
+    sprintf(filename, "%s/perfanalysis-throughput-%d", dir, getpid());
+
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0) {
+        printf("OPEN ERROR: open failed on %s : %d %s\n", filename, errno, strerror(errno));
+        free(buf);
+        return -1;
+    }
+    start = now_seconds();
+    cpu_self = cpu_seconds(0);
+    cpu_pid = cpu_seconds(pid);
+    for (size_t off = 0; off < file_size && !fail; off += block_size) {
+        if (write(fd, buf, block_size) != (ssize_t)block_size) {
+            printf("WRITE ERROR: %s at %lu : %d %s\n", filename, off, errno, strerror(errno));
+            fail = true;
+        }
+    }
+    // The PUT happens on the close
+    if (close(fd) < 0) fail = true;
+    if (!fail) {
+        report("write", file_size, now_seconds() - start, cpu_seconds(0) - cpu_self, cpu_seconds(pid) - cpu_pid, pid);
+    }
+
+    for (unsigned iter = 0; iter < num_iters && !fail; iter++) {
+        size_t total = 0;
+        ssize_t bytes_read;
+
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            printf("OPEN ERROR: open failed on %s : %d %s\n", filename, errno, strerror(errno));
+            fail = true;
+            break;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        start = now_seconds();
+        cpu_self = cpu_seconds(0);
+        cpu_pid = cpu_seconds(pid);
+        while ((bytes_read = read(fd, buf, block_size)) > 0) {
+            total += bytes_read;
+        }
+        if (bytes_read < 0 || total != file_size) {
+            printf("READ ERROR: read %lu of %lu bytes : %d %s\n", total, file_size, errno, strerror(errno));
+            fail = true;
+        }
+        else {
+            char what[32];
+            sprintf(what, "read %u", iter);
+            report(what, total, now_seconds() - start, cpu_seconds(0) - cpu_self, cpu_seconds(pid) - cpu_pid, pid);
+        }
+        close(fd);
+    }
+
+    unlink(filename);
+    free(buf);
+    return fail ? -1 : 0;
+}
+
 void calculate_latencies(time_t latencyResults[num_sizes][max_iters][collection_points], int num_iters) {
     time_t latency[num_sizes];
 
@@ -233,10 +359,28 @@ int main(int argc, char *argv[]) {
     int results[ResultSize];
     time_t latencyResults[num_sizes][max_iters][collection_points];
     bool fail = false;
+    const char *dir = ".";
+    size_t file_size = 100;
+    size_t block_size = 128;
+    pid_t pid = 0;
+
+    doing_throughput = (strstr(argv[0], "throughput") != NULL);
 
-    while ((opt = getopt (argc, argv, "vhi:t:")) != -1) {
+    while ((opt = getopt (argc, argv, "vhi:t:n:d:s:b:p:")) != -1) {
         switch (opt)
         {
+            case 'd':
+                dir = optarg;
+                break;
+            case 's':
+                file_size = strtol(optarg, NULL, 10);
+                break;
+            case 'b':
+                block_size = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                pid = strtol(optarg, NULL, 10);
+                break;
             case 'v':
                 verbose = true;
                 break;
@@ -257,6 +401,16 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (doing_throughput) {
+        if (block_size == 0 || file_size == 0) usage();
+        if (throughput(dir, file_size * 1024 * 1024, block_size * 1024, num_iters, pid) < 0) {
+            printf("FAIL\n");
+            return 1;
+        }
+        printf("PASS\n");
+        return 0;
+    }
+
     if (start_time == 0) {
         printf("Requires -t <start_time>\n");
         usage();
@@ -0,0 +1,479 @@
+/* Microbenchmark: parsing a large PROPFIND multistatus body.
+ *
+ * Builds props.c directly (see tests/Makefile) and feeds a multistatus body through
+ * two parsers, counting heap allocations and time per DAV:response:
+ *   legacy:  the handlers simple_propfind used to install (a malloc per element,
+ *            a strcmp chain per end tag, a full uri parse and several allocations
+ *            per href, and a callback from inside the parse)
+ *   current: props_parse_multistatus, the parser simple_propfind uses now
+ * Both passes must hand the same results to the callback, or we exit 1.
+ *
+ * The body is generated (-n entries, 50000 by default) unless -f names a recorded
+ * one, e.g. saved with
+ *   curl -X PROPFIND -H 'Depth: 1' ... > body.xml
+ * Hrefs in a recorded body are taken relative to -b <base url>.
+ *
+ * e.g. propfind-parse -n 50000 -i 4
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <expat.h>
+#include <curl/curl.h>
+#include <uriparser/Uri.h>
+
+#include "props.h"
+#include "session.h"
+
+// Normally provided by log.c and session.c, which pull in the rest of fusedav
+__thread unsigned int LOG_DYNAMIC = 6;
+int num_filesystem_server_nodes = 3;
+static const char *base_url = "https://bench.example.com:448/sites/bench/environments/live/files";
+
+int log_print(unsigned int log_level, unsigned int section, const char *format, ...) {
+    (void)log_level; (void)section; (void)format;
+    return 0;
+}
+
+void set_dynamic_logging(void) {}
+void set_saint_mode(void) {}
+
+const char *get_base_url(void) {
+    return base_url;
+}
+
+CURL *session_request_init(const char *path, const char *query_string, bool temporary_handle, bool new_slist) {
+    (void)path; (void)query_string; (void)temporary_handle; (void)new_slist;
+    return NULL;
+}
+
+CURLcode session_perform(CURL *session) {
+    (void)session;
+    return CURLE_FAILED_INIT;
+}
+
+void log_filesystem_nodes(const char *fcn_name, const CURLcode res, const long response_code, const int iter, const char *path) {
+    (void)fcn_name; (void)res; (void)response_code; (void)iter; (void)path;
+}
+
+void aggregate_log_print_server(unsigned int log_level, unsigned int section, const char *name, time_t *previous_time,
+    const char *description1, unsigned long *count1, unsigned long value1,
+    const char *description2, long *count2, long value2) {
+    (void)log_level; (void)section; (void)name; (void)previous_time;
+    (void)description1; (void)count1; (void)value1; (void)description2; (void)count2; (void)value2;
+}
+
+struct curl_slist* enhanced_logging(struct curl_slist *slist, int log_level, int section, const char *format, ...) {
+    (void)log_level; (void)section; (void)format;
+    return slist;
+}
+
+static bool verbose = false;
+
+// Count heap allocations, but only while a pass is being measured
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static __thread bool counting = false;
+static __thread unsigned long mallocs = 0;
+
+void *malloc(size_t size) {
+    if (counting) ++mallocs;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (counting) ++mallocs;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (counting) ++mallocs;
+    return __libc_realloc(ptr, size);
+}
+
+static void usage(void) {
+    printf("-n <entries> number of DAV:response entries to generate, 50000 by default\n");
+    printf("-f <file> parse a recorded multistatus body instead of generating one\n");
+    printf("-b <base url> base url the hrefs are relative to\n");
+    printf("-i <iters> parses per measurement, 4 by default\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Roughly what the file servers send for a Depth: 1 PROPFIND; some names need escaping
+static char *generate_body(int entries, size_t *len) {
+    const char *base_path = strchr(strstr(base_url, "://") + 3, '/');
+    char *body = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&body, &size);
+
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<D:multistatus xmlns:D=\"DAV:\">\n");
+    for (int idx = 0; idx < entries; idx++) {
+        bool dir = (idx % 16 == 0);
+        fprintf(fp, "<D:response><D:href>%s/bench/dir%d/%s%d%s</D:href>",
+            base_path, idx % 64, dir ? "sub" : "file%20", idx, dir ? "/" : ".php");
+        fprintf(fp, "<D:propstat><D:prop>");
+        if (dir) {
+            fprintf(fp, "<D:resourcetype><D:collection/></D:resourcetype>");
+        }
+        else {
+            fprintf(fp, "<D:resourcetype/><D:getcontentlength>%d</D:getcontentlength>", idx * 7);
+        }
+        fprintf(fp, "<D:getlastmodified>Tue, 14 Oct 2025 10:%02d:%02d GMT</D:getlastmodified>", idx % 60, (idx / 60) % 60);
+        fprintf(fp, "<D:creationdate>2025-10-14T09:%02d:00+0000</D:creationdate>", idx % 60);
+        fprintf(fp, "<D:getetag>\"%08x\"</D:getetag>", idx);
+        fprintf(fp, "</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>\n");
+    }
+    fprintf(fp, "</D:multistatus>\n");
+    fclose(fp);
+
+    *len = size;
+    return body;
+}
+
+static char *read_body(const char *file, size_t *len) {
+    FILE *fp = fopen(file, "r");
+    char *body;
+    long size;
+
+    if (fp == NULL) {
+        perror(file);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    body = __libc_malloc(size);
+    if (fread(body, 1, size, fp) != (size_t) size) {
+        perror(file);
+        exit(1);
+    }
+    fclose(fp);
+    *len = size;
+    return body;
+}
+
+// What the callback saw, so the two passes can be compared
+struct results {
+    unsigned long count;
+    unsigned long hash;
+};
+
+static void result_callback(void *userdata, const char *href, struct stat st, unsigned long status_code, GError **gerr) {
+    struct results *results = userdata;
+    unsigned long hash = 5381;
+    (void)gerr;
+
+    for (const char *pnt = href; *pnt; pnt++) {
+        hash = hash * 33 + (unsigned char) *pnt;
+    }
+    hash = hash * 33 + st.st_mode;
+    hash = hash * 33 + st.st_size;
+    hash = hash * 33 + st.st_mtime;
+    hash = hash * 33 + st.st_ctime;
+    hash = hash * 33 + status_code;
+    results->hash += hash;
+    ++results->count;
+    if (results->count <= 3) v_printf("  %s mode %o size %ld status %lu\n", href, st.st_mode, st.st_size, status_code);
+}
+
+/* The parser as it was, less logging. */
+
+struct legacy_state {
+    char path[PATH_MAX];
+    unsigned long status_code;
+    struct stat st;
+    char *current_data;
+    size_t current_data_len;
+    struct results *results;
+};
+
+static char *legacy_relative_path(UriUriA *base_uri, UriUriA *source_uri) {
+    char *path = NULL;
+    char *segment;
+    size_t segment_len = 0;
+    UriPathSegmentA *cur_base = base_uri->pathHead;
+    UriPathSegmentA *cur = source_uri->pathHead;
+
+    while (cur != NULL && cur_base != NULL) {
+        size_t base_segment_len = cur_base->text.afterLast - cur_base->text.first;
+        segment_len = cur->text.afterLast - cur->text.first;
+        if (segment_len != base_segment_len || strncmp(cur->text.first, cur_base->text.first, segment_len) != 0) {
+            break;
+        }
+        cur = cur->next;
+        cur_base = cur_base->next;
+    }
+    if (cur == NULL || cur_base != NULL) {
+        return NULL;
+    }
+    while (cur != NULL) {
+        segment_len = cur->text.afterLast - cur->text.first;
+        segment = malloc(segment_len + 1);
+        strncpy(segment, cur->text.first, segment_len);
+        segment[segment_len] = '\0';
+        if (path == NULL) {
+            path = segment;
+        }
+        else {
+            char *oldpath = path;
+            asprintf(&path, "%s/%s", oldpath, segment);
+            free(segment);
+            free(oldpath);
+        }
+        cur = cur->next;
+    }
+    return path;
+}
+
+static char *legacy_path_beyond_base(const char *source_url) {
+    UriUriA base_uri;
+    UriParserStateA base_state;
+    UriUriA source_uri;
+    UriParserStateA source_state;
+    char *path = NULL;
+    size_t path_len;
+
+    base_state.uri = &base_uri;
+    source_state.uri = &source_uri;
+    if (uriParseUriA(&base_state, base_url) != URI_SUCCESS) {
+        uriFreeUriMembersA(&base_uri);
+        return NULL;
+    }
+    if (uriParseUriA(&source_state, source_url) != URI_SUCCESS) goto finish;
+    if (uriNormalizeSyntaxExA(&base_uri, URI_NORMALIZE_PATH) != URI_SUCCESS) goto finish;
+    if (uriNormalizeSyntaxExA(&source_uri, URI_NORMALIZE_PATH) != URI_SUCCESS) goto finish;
+    path = legacy_relative_path(&base_uri, &source_uri);
+    if (path == NULL) {
+        path = strdup("");
+        goto finish;
+    }
+    path_len = strlen(path);
+    if (path[path_len - 1] == '/') {
+        path[path_len - 1] = '\0';
+    }
+finish:
+    uriFreeUriMembersA(&base_uri);
+    uriFreeUriMembersA(&source_uri);
+    return path;
+}
+
+static void legacy_start(void *userData, const XML_Char *name, const XML_Char **atts) {
+    struct legacy_state *state = userData;
+    (void)name; (void)atts;
+
+    state->current_data = malloc(1);
+    state->current_data[0] = '\0';
+    state->current_data_len = 1;
+}
+
+static void legacy_data(void *userData, const XML_Char *s, int len) {
+    struct legacy_state *state = userData;
+
+    // The old handler wrote a byte before the buffer for text between elements; skip that
+    if (state->current_data == NULL) return;
+    state->current_data = realloc(state->current_data, state->current_data_len + len);
+    strncpy(state->current_data + state->current_data_len - 1, s, len);
+    state->current_data_len += len;
+    state->current_data[state->current_data_len - 1] = '\0';
+}
+
+static void legacy_end(void *userData, const XML_Char *name) {
+    struct legacy_state *state = userData;
+
+    if (strcmp(name, "DAV:status") == 0) {
+        char *token_status = NULL;
+        strtok_r(state->current_data, " ", &token_status);
+        state->status_code = (unsigned long) atol(strtok_r(NULL, " ", &token_status));
+    }
+    else if (strcmp(name, "DAV:href") == 0) {
+        char *relative_path = legacy_path_beyond_base(state->current_data);
+        char *path = NULL;
+        char *unescaped_path;
+        asprintf(&path, "/%s", relative_path);
+        free(relative_path);
+        unescaped_path = curl_easy_unescape(NULL, path, 0, NULL);
+        free(path);
+        strncpy(state->path, unescaped_path, PATH_MAX);
+        state->path[PATH_MAX - 1] = '\0';
+        curl_free(unescaped_path);
+    }
+    else if (strcmp(name, "DAV:collection") == 0) {
+        state->st.st_mode |= S_IFDIR;
+    }
+    else if (strcmp(name, "DAV:getcontentlength") == 0) {
+        state->st.st_size = atol(state->current_data);
+    }
+    else if (strcmp(name, "DAV:getlastmodified") == 0) {
+        state->st.st_mtime = curl_getdate(state->current_data, NULL);
+        state->st.st_atime = state->st.st_mtime;
+    }
+    else if (strcmp(name, "DAV:creationdate") == 0) {
+        struct tm t;
+        memset(&t, 0, sizeof(struct tm));
+        strptime(state->current_data, "%FT%H:%M:%S%z", &t);
+        state->st.st_ctime = mktime(&t);
+    }
+    else if (strcmp(name, "DAV:response") == 0) {
+        if (state->st.st_mode & S_IFDIR) {
+            state->st.st_mode |= 0770;
+            state->st.st_nlink = 3;
+        }
+        else {
+            state->st.st_mode |= S_IFREG | 0660;
+            state->st.st_nlink = 1;
+        }
+        state->st.st_blksize = 4096;
+        if (state->st.st_blocks == 0 && state->st.st_size > 0) {
+            state->st.st_blocks = (state->st.st_size+511)/512;
+        }
+        if (state->st.st_mtime == 0) state->st.st_mtime = time(NULL);
+        if (state->st.st_atime == 0) state->st.st_atime = state->st.st_mtime;
+        if (state->st.st_ctime == 0) state->st.st_ctime = state->st.st_mtime;
+        state->st.st_uid = getuid();
+        state->st.st_gid = getgid();
+        result_callback(state->results, state->path, state->st, state->status_code, NULL);
+        free(state->current_data);
+        memset(state, 0, offsetof(struct legacy_state, results));
+        return;
+    }
+    free(state->current_data);
+    state->current_data = NULL;
+    state->current_data_len = 0;
+}
+
+static int legacy_parse(const char *body, size_t len, struct results *results) {
+    struct legacy_state state;
+    XML_Parser parser = XML_ParserCreateNS(NULL, '\0');
+    int ret = 0;
+
+    memset(&state, 0, sizeof(struct legacy_state));
+    state.results = results;
+    XML_SetUserData(parser, &state);
+    XML_SetElementHandler(parser, legacy_start, legacy_end);
+    XML_SetCharacterDataHandler(parser, legacy_data);
+    if (XML_Parse(parser, body, len, 1) == 0) {
+        printf("legacy parse failed: %s\n", XML_ErrorString(XML_GetErrorCode(parser)));
+        ret = -1;
+    }
+    XML_ParserFree(parser);
+    return ret;
+}
+
+enum pass_e { LEGACY, CURRENT };
+
+static struct results run_pass(const char *name, enum pass_e pass, const char *body, size_t len, int iters) {
+    struct results results;
+    unsigned long start;
+    unsigned long elapsed;
+
+    v_printf("%s:\n", name);
+    mallocs = 0;
+    start = now_ns();
+    for (int iter = 0; iter < iters; iter++) {
+        memset(&results, 0, sizeof(struct results));
+        counting = true;
+        if (pass == LEGACY) {
+            if (legacy_parse(body, len, &results) < 0) exit(1);
+        }
+        else {
+            GError *gerr = NULL;
+            props_parse_multistatus(body, len, result_callback, &results, &gerr);
+            if (gerr) {
+                counting = false;
+                printf("props_parse_multistatus: %s\n", gerr->message);
+                exit(1);
+            }
+        }
+        counting = false;
+    }
+    elapsed = now_ns() - start;
+    if (results.count == 0) {
+        printf("%s: no DAV:response entries in the body\n", name);
+        exit(1);
+    }
+    printf("%-8s %8lu entries  %8.2f mallocs/entry  %8.1f ns/entry  %8.1f MB/s\n", name, results.count,
+        (double)mallocs / iters / results.count, (double)elapsed / iters / results.count,
+        (double)len * iters / elapsed * 1000);
+    return results;
+}
+
+int main(int argc, char *argv[]) {
+    struct results legacy;
+    struct results current;
+    char *file = NULL;
+    char *body;
+    size_t len;
+    int entries = 50000;
+    int iters = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:f:b:i:vh")) != -1) {
+        switch (opt) {
+            case 'n':
+                entries = atoi(optarg);
+                break;
+            case 'f':
+                file = optarg;
+                break;
+            case 'b':
+                base_url = optarg;
+                break;
+            case 'i':
+                iters = atoi(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+
+    if (file) {
+        body = read_body(file, &len);
+    }
+    else {
+        body = generate_body(entries, &len);
+    }
+    v_printf("parsing a %zu byte body, base url %s\n", len, base_url);
+
+    legacy = run_pass("legacy", LEGACY, body, len, iters);
+    current = run_pass("current", CURRENT, body, len, iters);
+
+    if (legacy.count != current.count || legacy.hash != current.hash) {
+        printf("FAIL: results differ: legacy %lu entries (%lx), current %lu entries (%lx)\n",
+            legacy.count, legacy.hash, current.count, current.hash);
+        return 1;
+    }
+
+    free(body);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#! /bin/bash
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script runs a trace against a fusedav mounted from mock-dav-server.py, and writes
+results that bench-compare.py can hold against another build's, e.g.
+   $0 -b src/fusedav -o before.tsv
+   $0 -b src/fusedav -o after.tsv
+   tests/bench-compare.py before.tsv after.tsv
+
+OPTIONS:
+   -h      Show this message
+   -b      fusedav binary; /opt/fusedav/src/fusedav by default
+   -f      Trace to replay; one is made with fusedav-replay -g if not given
+   -o      Results file; replay-results.tsv by default
+   -c      File of extra [fusedav] lines for fusedav.conf, e.g. load_balance=p2c
+   -s      Extra flags for mock-dav-server.py, e.g. "--latency 2 --jitter 5"
+   -r      Extra flags for fusedav-replay; "-t 8 -W 1" by default
+   -p      Port for the mock server; 8080 by default
+   -n      Files the mock server starts with; 20000 by default, in 200 directories
+   -v      Verbose
+EOF
+}
+
+testdir=$(cd $(dirname $0) && pwd)
+fusedav=/opt/fusedav/src/fusedav
+trace=""
+results=replay-results.tsv
+extraconf=""
+serverflags=""
+replayflags="-t 8 -W 1"
+port=8080
+files=20000
+dirs=200
+verbose=0
+while getopts "hb:f:o:c:s:r:p:n:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         f)
+             trace=$OPTARG
+             ;;
+         o)
+             results=$OPTARG
+             ;;
+         c)
+             extraconf=$OPTARG
+             ;;
+         s)
+             serverflags=$OPTARG
+             ;;
+         r)
+             replayflags=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         n)
+             files=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+replay=$testdir/fusedav-replay
+if [ ! -x $replay ]; then
+    make -f $testdir/Makefile testdir=$testdir $replay > /dev/null || exit 1
+fi
+
+workdir=$(mktemp -d /tmp/replay-bench-XXXXXX)
+mountpoint=$workdir/mnt
+mkdir -p $mountpoint $workdir/cache
+
+if [ "$trace" == "" ]; then
+    trace=$workdir/mix.trace
+    $replay -g 200000 -n $files -D $dirs > $trace
+fi
+
+$testdir/mock-dav-server.py --port $port --files $files --dirs $dirs $serverflags > $workdir/server.log 2>&1 &
+serverpid=$!
+
+cleanup()
+{
+    fusermount -u $mountpoint 2> /dev/null
+    kill $serverpid 2> /dev/null
+    wait $serverpid 2> /dev/null
+    if [ $verbose -eq 1 ]; then
+        echo "left $workdir for inspection"
+    else
+        rm -rf $workdir
+    fi
+}
+trap cleanup EXIT
+
+cat > $workdir/fusedav.conf << EOF
+[fusedav]
+cache_path=$workdir/cache
+log_level=3
+EOF
+if [ "$extraconf" != "" ]; then
+    cat $extraconf >> $workdir/fusedav.conf
+fi
+
+sleep 1
+if ! kill -0 $serverpid 2> /dev/null; then
+    echo "FAIL: mock-dav-server.py did not start"
+    cat $workdir/server.log
+    exit 1
+fi
+
+if [ $verbose -eq 1 ]; then
+    echo "$fusedav http://127.0.0.1:$port/ $mountpoint -o conf=$workdir/fusedav.conf"
+    cat $workdir/fusedav.conf
+fi
+$fusedav http://127.0.0.1:$port/ $mountpoint -o conf=$workdir/fusedav.conf
+iters=0
+while ! mountpoint -q $mountpoint; do
+    iters=$((iters + 1))
+    if [ $iters -gt 30 ]; then
+        echo "FAIL: fusedav did not mount $mountpoint"
+        exit 1
+    fi
+    sleep 1
+done
+
+$replay -m $mountpoint -f $trace -P -s 127.0.0.1:$port -o $results $replayflags
+exit $?
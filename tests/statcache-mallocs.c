@@ -0,0 +1,233 @@
+/* Microbenchmark: heap allocations and time per stat cache lookup.
+ *
+ * Builds statcache.c directly (see tests/Makefile) and interposes malloc so
+ * we can count allocations made on the getattr lookup path, including those made
+ * inside leveldb. Three passes over the same entries:
+ *   legacy: the old sequence stat_cache_value_get used per lookup
+ *           (asprintf key, create/destroy readoptions, leveldb_get, frees)
+ *   cold:   stat_cache_value_get right after stat_cache_open (misses the memory tier)
+ *   warm:   stat_cache_value_get again (hits the memory tier)
+ *
+ * e.g. statcache-mallocs -n 20000 -i 4
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <leveldb/c.h>
+
+#include "statcache.h"
+#include "stats.h"
+
+// Normally provided by stats.c and log.c, which pull in the rest of fusedav
+__thread struct statistics *stats_local = NULL;
+struct statistics *stats_attach(void) {
+    static __thread struct statistics shard;
+    stats_local = &shard;
+    return stats_local;
+}
+__thread unsigned int LOG_DYNAMIC = 6;
+int log_print(unsigned int log_level, unsigned int section, const char *format, ...) {
+    (void)log_level; (void)section; (void)format;
+    return 0;
+}
+
+static bool verbose = false;
+
+// Count heap allocations, but only while a pass is being measured
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static __thread bool counting = false;
+static __thread unsigned long mallocs = 0;
+
+void *malloc(size_t size) {
+    if (counting) ++mallocs;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (counting) ++mallocs;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (counting) ++mallocs;
+    return __libc_realloc(ptr, size);
+}
+
+static void usage(void) {
+    printf("-n <entries> number of stat cache entries, 10000 by default\n");
+    printf("-i <iters> passes over the entries per measurement, 4 by default\n");
+    printf("-d <dir> directory for the leveldb; a new one under /tmp by default\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void entry_path(char *path, size_t len, int idx) {
+    snprintf(path, len, "/bench/dir%d/file%d.php", idx % 64, idx);
+}
+
+// What stat_cache_value_get used to do on every call (with today's key format, so it finds the entry).
+static void legacy_get(stat_cache_t *cache, const char *path) {
+    leveldb_readoptions_t *options;
+    char *key = NULL;
+    char *errptr = NULL;
+    char *value;
+    size_t vallen;
+    unsigned depth = 0;
+
+    for (const char *pnt = path; *pnt; pnt++) {
+        if (*pnt == '/') ++depth;
+    }
+    asprintf(&key, "sc1:%04u%s", depth, path);
+    // The store keeps its read options now; make and drop a set as the old code did per call
+    options = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(options, false);
+    value = kvstore_get(cache, key, strlen(key) + 1, &vallen, &errptr);
+    leveldb_readoptions_destroy(options);
+    free(key);
+    free(errptr);
+    free(value);
+}
+
+enum pass_e { LEGACY, CURRENT };
+
+static void run_pass(const char *name, enum pass_e pass, stat_cache_t *cache, int entries, int iters) {
+    char path[PATH_MAX];
+    unsigned long start;
+    unsigned long elapsed;
+    unsigned long ops = (unsigned long)entries * iters;
+
+    mallocs = 0;
+    start = now_ns();
+    for (int iter = 0; iter < iters; iter++) {
+        for (int idx = 0; idx < entries; idx++) {
+            entry_path(path, sizeof(path), idx);
+            counting = true;
+            if (pass == LEGACY) {
+                legacy_get(cache, path);
+            }
+            else {
+                GError *gerr = NULL;
+                struct stat_cache_value *value = stat_cache_value_get(cache, path, false, &gerr);
+                if (gerr) {
+                    counting = false;
+                    printf("stat_cache_value_get error on %s: %s\n", path, gerr->message);
+                    exit(1);
+                }
+                free(value);
+            }
+            counting = false;
+        }
+    }
+    elapsed = now_ns() - start;
+    printf("%-8s %10lu ops  %8.2f mallocs/op  %10.1f ns/op\n", name, ops, (double)mallocs / ops, (double)elapsed / ops);
+}
+
+int main(int argc, char *argv[]) {
+    stat_cache_t *cache;
+    struct stat_cache_supplemental supplemental;
+    struct stat_cache_value value;
+    char dirtemplate[] = "/tmp/statcache-mallocs-XXXXXX";
+    char *dir = NULL;
+    char path[PATH_MAX];
+    GError *gerr = NULL;
+    int entries = 10000;
+    int iters = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:i:d:vh")) != -1) {
+        switch (opt) {
+            case 'n':
+                entries = atoi(optarg);
+                break;
+            case 'i':
+                iters = atoi(optarg);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+
+    if (dir == NULL) {
+        dir = mkdtemp(dirtemplate);
+        if (dir == NULL) {
+            perror("mkdtemp");
+            exit(1);
+        }
+    }
+
+    v_printf("populating %d entries in %s/leveldb\n", entries, dir);
+
+    // leveldb defaults, as with an empty fusedav.conf
+    memset(&supplemental, 0, sizeof(supplemental));
+
+    stat_cache_open(&cache, &supplemental, dir, &gerr);
+    if (gerr) {
+        printf("stat_cache_open: %s\n", gerr->message);
+        exit(1);
+    }
+    memset(&value, 0, sizeof(value));
+    value.st.st_mode = S_IFREG | 0644;
+    for (int idx = 0; idx < entries; idx++) {
+        entry_path(path, sizeof(path), idx);
+        value.st.st_size = idx;
+        stat_cache_value_set(cache, path, &value, &gerr);
+        if (gerr) {
+            printf("stat_cache_value_set: %s\n", gerr->message);
+            exit(1);
+        }
+    }
+    for (int idx = 0; idx < 64; idx++) {
+        snprintf(path, sizeof(path), "/bench/dir%d", idx);
+        stat_cache_updated_children(cache, path, time(NULL), &gerr);
+    }
+    stat_cache_close(cache, supplemental);
+
+    // Reopen so the first current pass starts with an empty memory tier
+    stat_cache_open(&cache, &supplemental, dir, &gerr);
+    if (gerr) {
+        printf("stat_cache_open: %s\n", gerr->message);
+        exit(1);
+    }
+
+    run_pass("legacy", LEGACY, cache, entries, iters);
+    run_pass("cold", CURRENT, cache, entries, 1);
+    run_pass("warm", CURRENT, cache, entries, iters);
+
+    stat_cache_close(cache, supplemental);
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+#! /bin/bash
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script checks that what a writable handle writes survives a refresh of the file from the
+server while the handle is open. It mounts fusedav on mock-dav-server.py, holds a file open for
+writing, changes the file on the server, and has a read-only open fetch the new copy: by a
+ranged fill, by a ranged GET that brings the whole file, and by a plain GET. The handle then
+writes and closes, and the file must read back as the handle left it.
+
+OPTIONS:
+   -h      Show this message
+   -b      fusedav binary; /opt/fusedav/src/fusedav by default
+   -p      Port for the mock server; 8080 by default
+   -v      Verbose
+EOF
+}
+
+testdir=$(cd $(dirname $0) && pwd)
+fusedav=/opt/fusedav/src/fusedav
+port=8080
+verbose=0
+while getopts "hb:p:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+workdir=$(mktemp -d /tmp/writer-refresh-XXXXXX)
+mountpoint=$workdir/mnt
+mkdir -p $mountpoint $workdir/cache
+
+$testdir/mock-dav-server.py --port $port > $workdir/server.log 2>&1 &
+serverpid=$!
+
+cleanup()
+{
+    exec 3>&- 2> /dev/null
+    fusermount -u $mountpoint 2> /dev/null
+    kill $serverpid 2> /dev/null
+    wait $serverpid 2> /dev/null
+    if [ $verbose -eq 1 ]; then
+        echo "left $workdir for inspection"
+    else
+        rm -rf $workdir
+    fi
+}
+trap cleanup EXIT
+
+# Files of 1M and up get ranged GETs
+cat > $workdir/fusedav.conf << EOF
+[fusedav]
+cache_path=$workdir/cache
+log_level=3
+ranged_get_min_size=1
+EOF
+
+sleep 1
+if ! kill -0 $serverpid 2> /dev/null; then
+    echo "FAIL: mock-dav-server.py did not start"
+    cat $workdir/server.log
+    exit 1
+fi
+
+$fusedav http://127.0.0.1:$port/ $mountpoint -o conf=$workdir/fusedav.conf
+iters=0
+while ! mountpoint -q $mountpoint; do
+    iters=$((iters + 1))
+    if [ $iters -gt 30 ]; then
+        echo "FAIL: fusedav did not mount $mountpoint"
+        exit 1
+    fi
+    sleep 1
+done
+
+fail=0
+
+# name, size in bytes
+check()
+{
+    name=$1
+    size=$2
+    file=$mountpoint/$name
+
+    head -c $size /dev/urandom > $workdir/orig
+    head -c $size /dev/urandom > $workdir/other
+    cp $workdir/orig $file
+
+    # Fresh from the PUT on close, so this opens the local copy; nothing is written yet, so the
+    # copy is still eligible for a refresh
+    exec 3<> $file
+
+    curl -s -T $workdir/other http://127.0.0.1:$port/$name > /dev/null
+
+    # Past REFRESH_INTERVAL, so the read-only open goes to the server and gets the new copy
+    sleep 4
+    cat $file > /dev/null
+    # A fill installs just after its last chunk lands
+    sleep 1
+
+    printf WRITTEN >&3
+    exec 3>&-
+
+    cp $workdir/orig $workdir/expected
+    printf WRITTEN | dd of=$workdir/expected conv=notrunc 2> /dev/null
+
+    if cmp -s $workdir/expected $file; then
+        echo "PASS: $name"
+    else
+        echo "FAIL: $name: the writable handle's data was lost"
+        fail=1
+    fi
+}
+
+check ranged-fill $((3 * 1024 * 1024))
+check ranged-whole $((1024 * 1024))
+check full-get 4096
+
+exit $fail